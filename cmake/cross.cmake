@@ -1,5 +1,29 @@
 set(CMAKE_SYSTEM_NAME Linux)
-set(CMAKE_SYSTEM_PROCESSOR aarch64)
+
+# aarch64: 64-bit Raspberry Pi OS, armv7: 32-bit on Pi 2/3/4, armv6: Pi Zero/1
+set(CROSS_TARGET "aarch64" CACHE STRING "Cross compilation target: aarch64, armv7 or armv6")
+set_property(CACHE CROSS_TARGET PROPERTY STRINGS "aarch64" "armv7" "armv6")
+# Toolchain files are re-read for try_compile, which only sees listed variables
+list(APPEND CMAKE_TRY_COMPILE_PLATFORM_VARIABLES CROSS_TARGET)
+
+if (CROSS_TARGET STREQUAL "aarch64")
+    set(CMAKE_SYSTEM_PROCESSOR aarch64)
+    set(triple aarch64-unknown-linux-gnu)
+    set(multiarch aarch64-linux-gnu)
+    set(arch_flags "")
+elseif (CROSS_TARGET STREQUAL "armv7")
+    set(CMAKE_SYSTEM_PROCESSOR armv7l)
+    set(triple armv7-unknown-linux-gnueabihf)
+    set(multiarch arm-linux-gnueabihf)
+    set(arch_flags "-march=armv7-a -mfpu=neon-vfpv4 -mfloat-abi=hard")
+elseif (CROSS_TARGET STREQUAL "armv6")
+    set(CMAKE_SYSTEM_PROCESSOR armv6l)
+    set(triple armv6-unknown-linux-gnueabihf)
+    set(multiarch arm-linux-gnueabihf)
+    set(arch_flags "-march=armv6zk -mfpu=vfp -mfloat-abi=hard")
+else()
+    message(FATAL_ERROR "Unknown CROSS_TARGET ${CROSS_TARGET}, expected aarch64, armv7 or armv6")
+endif()
 
 set(CMAKE_SYSROOT /mnt/rpios)
 
@@ -12,11 +36,12 @@ set(CMAKE_SHARED_LINKER_FLAGS_INIT "-fuse-ld=lld")
 set(CMAKE_AR "/usr/bin/llvm-ar")
 set(CMAKE_RANLIB "/usr/bin/llvm-ranlib")
 
-set(triple aarch64-unknown-linux-gnu)
 set(CMAKE_C_COMPILER_TARGET ${triple})
 set(CMAKE_CXX_COMPILER_TARGET ${triple})
+set(CMAKE_C_FLAGS_INIT "${arch_flags}")
+set(CMAKE_CXX_FLAGS_INIT "${arch_flags}")
 
 set(PKG_CONFIG_EXECUTABLE "/usr/bin/pkg-config")
 set(ENV{PKG_CONFIG_DIR} "")
-set(ENV{PKG_CONFIG_LIBDIR} "${CMAKE_SYSROOT}/usr/lib/pkgconfig:${CMAKE_SYSROOT}/usr/share/pkgconfig:${CMAKE_SYSROOT}/usr/lib/aarch64-linux-gnu/pkgconfig")
+set(ENV{PKG_CONFIG_LIBDIR} "${CMAKE_SYSROOT}/usr/lib/pkgconfig:${CMAKE_SYSROOT}/usr/share/pkgconfig:${CMAKE_SYSROOT}/usr/lib/${multiarch}/pkgconfig")
 set(ENV{PKG_CONFIG_SYSROOT_DIR} ${CMAKE_SYSROOT})
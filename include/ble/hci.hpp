@@ -0,0 +1,64 @@
+#pragma once
+
+#include "receiver.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+namespace ble::hci {
+
+inline constexpr uint8_t command_packet        = 0x01;
+inline constexpr uint8_t event_packet          = 0x04;
+inline constexpr uint8_t command_complete      = 0x0E;
+inline constexpr uint8_t command_status        = 0x0F;
+inline constexpr uint8_t le_meta_event         = 0x3E;
+inline constexpr uint8_t le_advertising_report = 0x02;
+
+inline constexpr uint8_t ad_short_name    = 0x08;
+inline constexpr uint8_t ad_complete_name = 0x09;
+inline constexpr uint8_t ad_manufacturer  = 0xFF;
+
+inline constexpr int malformed_event = -1;
+inline constexpr int other_event     = -2;
+
+/**
+ * @brief Called for each parsed advert, name is empty if the advert carries no local name.
+ * Both point into the parsed buffer and are only valid during the call.
+ */
+using report_callback = void(AdvPacket const& p, std::string_view name);
+
+/**
+ * @brief parse_event Parses an HCI event as read from a raw HCI socket (starting with the
+ * packet type byte) and calls cb for each advert of an LE Advertising Report. Doesn't
+ * allocate.
+ * @return Number of adverts passed to cb, 0 for other events, malformed_event if the event
+ * is truncated or its reports don't match their length fields. Reports preceding a
+ * malformed one have already been passed to cb.
+ */
+int parse_event(uint8_t const* data, size_t size, std::function<report_callback> const& cb);
+
+/**
+ * @brief command_result Reads the status of a command from its Command Complete or Command
+ * Status event, as read from a raw HCI socket
+ * @return The status, 0 on success, other_event for events that don't answer opcode, or
+ * malformed_event
+ */
+int command_result(uint8_t const* data, size_t size, uint16_t opcode);
+
+/**
+ * @brief parse_advertising_data Fills the manufacturer data of p and name from the AD
+ * structures of an advert
+ * @return false if the AD structures are malformed
+ */
+bool parse_advertising_data(
+    uint8_t const* data, size_t size, AdvPacket& p, std::string_view& name
+);
+
+/**
+ * @brief read_address Reads a little-endian bluetooth device address
+ */
+mac_address read_address(uint8_t const* addr);
+
+}  // namespace ble::hci
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "packet.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace ble {
+
+/**
+ * @brief Set of blacklisted MAC addresses, holding at most capacity of them
+ *
+ * Devices with random addresses would otherwise grow it without bound. Once it is full, adding
+ * an address forgets the one added first; a device that is still around gets blacklisted again
+ * by its next advert. Lookups hash the address.
+ *
+ * Not thread-safe.
+ */
+class mac_blacklist {
+public:
+    static constexpr size_t default_capacity = 4096;
+
+    explicit mac_blacklist(size_t capacity = default_capacity): capacity(capacity) {
+        if (capacity == 0) throw std::invalid_argument("The blacklist must hold an address");
+        set.reserve(capacity);
+    }
+
+    /**
+     * @brief insert Adds mac, forgetting the oldest address if the set is full
+     * @return false if mac was already in the set
+     */
+    bool insert(mac_address const& mac) {
+        auto k = key(mac);
+        if (!set.insert(k).second) return false;
+        order.push_back(k);
+        if (order.size() > capacity) {
+            set.erase(order.front());
+            order.pop_front();
+        }
+        return true;
+    }
+
+    bool contains(mac_address const& mac) const { return set.count(key(mac)) != 0; }
+    size_t size() const { return order.size(); }
+
+    /**
+     * @brief formatted The addresses as text, oldest first
+     */
+    std::vector<std::string> formatted() const {
+        std::vector<std::string> r;
+        r.reserve(order.size());
+        for (auto k: order) {
+            mac_address mac;
+            for (size_t i = mac.size(); i-- > 0; k >>= 8u) mac[i] = uint8_t(k);
+            r.push_back(format_mac(mac));
+        }
+        return r;
+    }
+
+private:
+    size_t const capacity;
+    std::unordered_set<uint64_t> set;
+    std::deque<uint64_t> order;  // Oldest first
+
+    static uint64_t key(mac_address const& mac) {
+        uint64_t k = 0;
+        for (auto b: mac) k = (k << 8u) | b;
+        return k;
+    }
+};
+
+}  // namespace ble
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ble {
+
+/**
+ * @brief Bluetooth device address, most significant byte first (in the order it is printed)
+ */
+using mac_address = std::array<uint8_t, 6>;
+
+struct BlePacket {
+    std::string mac;
+    std::string device_name;
+    uint16_t manufacturer_id;
+    std::vector<uint8_t> manufacturer_data;
+    int16_t signal_strength;
+};
+
+/**
+ * @brief Advert with the address and manufacturer data stored inline
+ *
+ * Copying it never allocates, which keeps the receive path allocation-free. The device name
+ * is not part of the packet, it can be looked up with BleListener::device_name().
+ */
+struct AdvPacket {
+    // Extended advertising data is at most 255 bytes, including the AD header
+    static constexpr size_t max_data_size = 255;
+
+    mac_address mac{};
+    uint16_t manufacturer_id = 0;
+    int16_t signal_strength  = 0;
+    uint8_t data_size        = 0;
+    std::array<uint8_t, max_data_size> data{};
+
+    uint8_t const* manufacturer_data() const { return data.data(); }
+    size_t manufacturer_data_size() const { return data_size; }
+
+    /**
+     * @brief set_manufacturer_data Copies at most max_data_size bytes
+     * @return false if the data was truncated
+     */
+    bool set_manufacturer_data(uint8_t const* d, size_t size) {
+        data_size = static_cast<uint8_t>(std::min(size, max_data_size));
+        std::copy(d, d + data_size, data.begin());
+        return size <= max_data_size;
+    }
+};
+
+/**
+ * @brief format_mac Formats the address as AA:BB:CC:DD:EE:FF
+ */
+inline std::string format_mac(mac_address const& mac) {
+    static constexpr char digits[] = "0123456789ABCDEF";
+    std::string s(17, ':');
+    for (size_t i = 0; i < mac.size(); ++i) {
+        s[i * 3]     = digits[mac[i] >> 4];
+        s[i * 3 + 1] = digits[mac[i] & 0x0F];
+    }
+    return s;
+}
+
+/**
+ * @brief parse_mac Parses an address formatted as AA:BB:CC:DD:EE:FF (in either case)
+ * @return false if s is not a valid address
+ */
+inline bool parse_mac(std::string_view s, mac_address& mac) {
+    auto hex = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    };
+    if (s.size() != 17) return false;
+    for (size_t i = 0; i < mac.size(); ++i) {
+        int hi = hex(s[i * 3]);
+        int lo = hex(s[i * 3 + 1]);
+        if (hi < 0 || lo < 0 || (i < 5 && s[i * 3 + 2] != ':')) return false;
+        mac[i] = static_cast<uint8_t>(hi << 4 | lo);
+    }
+    return true;
+}
+
+/**
+ * @brief to_adv_packet Converts a packet, an unparseable MAC is left as 00:00:00:00:00:00
+ */
+inline AdvPacket to_adv_packet(BlePacket const& p) {
+    AdvPacket r;
+    if (!parse_mac(p.mac, r.mac)) r.mac = {};
+    r.manufacturer_id = p.manufacturer_id;
+    r.signal_strength = p.signal_strength;
+    r.set_manufacturer_data(p.manufacturer_data.data(), p.manufacturer_data.size());
+    return r;
+}
+
+inline BlePacket to_ble_packet(AdvPacket const& p, std::string device_name = {}) {
+    BlePacket r;
+    r.mac             = format_mac(p.mac);
+    r.device_name     = std::move(device_name);
+    r.manufacturer_id = p.manufacturer_id;
+    r.manufacturer_data.assign(
+        p.manufacturer_data(), p.manufacturer_data() + p.manufacturer_data_size()
+    );
+    r.signal_strength = p.signal_strength;
+    return r;
+}
+
+std::ostream& operator<<(std::ostream& os, ble::BlePacket const& p);
+std::ostream& operator<<(std::ostream& os, ble::AdvPacket const& p);
+
+}  // namespace ble
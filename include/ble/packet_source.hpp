@@ -0,0 +1,34 @@
+#pragma once
+
+#include "receiver.hpp"
+
+#include <string>
+#include <vector>
+
+namespace ble {
+
+/**
+ * @brief Interface of the backends BleListener receives adverts from
+ *
+ * start() blocks until stop() is called from another thread, the callback is called from
+ * the thread that called start().
+ */
+class PacketSource {
+public:
+    virtual ~PacketSource() = default;
+
+    virtual void start()         = 0;
+    virtual void stop() noexcept = 0;
+
+    virtual void blacklist(mac_address const& mac)         = 0;
+    virtual std::vector<std::string> get_blacklist() const = 0;
+
+    virtual listener_statistics statistics() const                               = 0;
+    virtual std::optional<std::string> device_name(mac_address const& mac) const = 0;
+};
+
+std::unique_ptr<PacketSource> make_packet_source(
+    backend b, std::function<listener_callback> cb, std::string_view nm
+);
+
+}  // namespace ble
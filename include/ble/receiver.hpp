@@ -1,40 +1,57 @@
 #pragma once
 
+#include "packet.hpp"
+
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <functional>
+#include <optional>
 
 namespace ble {
 
-struct BlePacket {
-    std::string mac;
-    std::string device_name;
-    uint16_t manufacturer_id;
-    std::vector<uint8_t> manufacturer_data;
-    int16_t signal_strength;
+using listener_callback = void(AdvPacket const&);
+
+/**
+ * @brief Counters kept by the listener, used to verify the cost of receiving adverts
+ */
+struct listener_statistics {
+    uint64_t adverts    = 0;  // Packets passed to the callback
+    uint64_t dbus_calls = 0;  // Blocking D-Bus method calls made by the listener
+};
+
+/**
+ * @brief Where adverts are received from
+ */
+enum class backend {
+    dbus,  // bluetoothd over D-Bus
+    hci,   // Raw HCI socket, bypassing bluetoothd. Requires CAP_NET_RAW
 };
 
-using listener_callback = void(BlePacket const&);
+class PacketSource;
 
 class BleListener {
 public:
     explicit BleListener(std::function<listener_callback> f,
-                         std::string_view nm = "hci0");
+                         std::string_view nm = "hci0", backend b = backend::dbus);
     ~BleListener();
 
     void start();
     void stop() noexcept;
     void blacklist(std::string const& mac);
+    void blacklist(mac_address const& mac);
     std::vector<std::string> get_blacklist() const;
+    listener_statistics statistics() const;
+
+    /**
+     * @brief device_name Name of the device last seen advertising with the address
+     * @return std::nullopt if the device has not advertised a name
+     */
+    std::optional<std::string> device_name(mac_address const& mac) const;
 
 private:
-    class Impl;
-    const std::unique_ptr<Impl> impl;
+    const std::unique_ptr<PacketSource> impl;
 };
 
-std::ostream& operator<<(std::ostream& os, ble::BlePacket const& p);
-
-
-
 }  // namespace ble
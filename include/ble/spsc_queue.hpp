@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+namespace ble {
+
+/**
+ * @brief What spsc_queue::push does when the queue is full
+ */
+enum class overflow_policy {
+    drop_oldest,  // Discard the oldest queued element to make room
+    drop_newest,  // Discard the element being pushed
+};
+
+/**
+ * @brief Bounded lock-free single-producer/single-consumer queue
+ *
+ * Slots carry a sequence number (as in Vyukov's bounded queue), so the producer can safely
+ * discard the oldest element while the consumer is popping. push() must only be called
+ * from one thread and pop() from one (other) thread.
+ */
+template<class T>
+class spsc_queue {
+public:
+    // Capacities are rounded up to a power of two, at most this one
+    static constexpr size_t max_capacity = size_t(1) << 20u;
+
+    /**
+     * @throws std::invalid_argument if capacity is 0 or larger than max_capacity
+     */
+    explicit spsc_queue(size_t capacity, overflow_policy p = overflow_policy::drop_oldest)
+        : cap(round_up(capacity)), mask(cap - 1), policy(p), slots(new slot[cap]) {
+        for (size_t i = 0; i < cap; ++i) slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    spsc_queue(spsc_queue const&)            = delete;
+    spsc_queue& operator=(spsc_queue const&) = delete;
+
+    /**
+     * @brief push Adds v to the queue, dropping an element according to the overflow policy
+     * if the queue is full
+     * @return true if nothing was dropped
+     */
+    bool push(T v) {
+        if (try_push(v)) return true;
+
+        if (policy == overflow_policy::drop_oldest) {
+            T discarded;
+            if (try_pop(discarded)) dropped_.fetch_add(1, std::memory_order_relaxed);
+            if (try_push(v)) return false;
+        }
+        // Still full, the consumer holds the slot being pushed to
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /**
+     * @brief pop Moves the oldest element to out
+     * @return false if the queue was empty
+     */
+    bool pop(T& out) { return try_pop(out); }
+
+    size_t size() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+    bool empty() const { return size() == 0; }
+    size_t capacity() const { return cap; }
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    const size_t cap;
+    const size_t mask;
+    const overflow_policy policy;
+    const std::unique_ptr<slot[]> slots;
+
+    // Separate cache lines, head is written by the consumer and tail by the producer
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+    alignas(64) std::atomic_uint64_t dropped_ = 0;
+
+    static size_t round_up(size_t n) {
+        if (n == 0) throw std::invalid_argument("spsc_queue capacity must be positive");
+        if (n > max_capacity)
+            throw std::invalid_argument("spsc_queue capacity must be at most "
+                                        + std::to_string(max_capacity));
+        size_t c = 1;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+    bool try_push(T& v) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        slot& s    = slots[pos & mask];
+        if (s.seq.load(std::memory_order_acquire) != pos) return false;  // Full
+        s.value = std::move(v);
+        s.seq.store(pos + 1, std::memory_order_release);
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Called by the consumer, and by the producer when dropping the oldest element
+    bool try_pop(T& out) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            slot& s        = slots[pos & mask];
+            size_t seq     = s.seq.load(std::memory_order_acquire);
+            auto const dif = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+            if (dif == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(s.value);
+                    s.seq.store(pos + cap, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;  // Empty
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+}  // namespace ble
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "mac_table.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ruuvi {
+
+/**
+ * @brief measurement_key Identifies the measurement carried by a Ruuvi payload
+ *
+ * The measurement sequence number for formats that carry one (5, 6 and E1), a hash of the
+ * payload for the others or when the sequence is marked invalid. Two payloads with the same key
+ * from the same tag carry the same measurement.
+ */
+uint64_t measurement_key(uint8_t const* payload, size_t size) noexcept;
+
+/**
+ * @brief Drops repeated adverts of the same measurement before they are decoded
+ *
+ * A tag transmits each measurement several times. The filter remembers the measurement key of
+ * the last advert of every tag, and only the first advert of a measurement is passed on for
+ * decoding; repeats only refresh the signal strength and the time the tag was last seen.
+ *
+ * At most max_tags tags are remembered. When a new tag would exceed it, the least recently seen
+ * quarter of them is forgotten at once, keeping the cost of evicting constant per advert. A
+ * forgotten tag's next advert is decoded even if it repeats the last measurement.
+ *
+ * admit(), find() and expire() must be called from a single thread, the counters can be read
+ * from any.
+ */
+class duplicate_filter {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t default_max_tags = 65536;
+
+    struct tag_state {
+        uint64_t key            = 0;
+        int16_t signal_strength = 0;
+        clock::time_point last_seen{};
+    };
+
+    /**
+     * @throws std::invalid_argument if max_tags is 0
+     */
+    explicit duplicate_filter(size_t max_tags = default_max_tags);
+
+    /**
+     * @brief admit Records an advert
+     * @return true if the advert carries a new measurement and should be decoded
+     */
+    bool admit(ble::AdvPacket const& p, clock::time_point now = clock::now());
+
+    tag_state const* find(ble::mac_address const& mac) const { return tags.find(mac); }
+
+    /** @brief expire Forgets the tags last seen before the time */
+    void expire(clock::time_point before);
+
+    /** @brief Number of adverts that were dropped as repeats */
+    uint64_t suppressed() const { return suppressed_count.load(std::memory_order_relaxed); }
+    /** @brief Number of tags seen */
+    size_t tag_count() const { return tag_count_.load(std::memory_order_relaxed); }
+
+private:
+    size_t const max_tags;
+    mac_table<tag_state> tags;
+    std::vector<ble::mac_address> stale;  // Reused by expire()
+    std::vector<clock::time_point> ages;  // Reused by evict_oldest()
+    std::atomic<uint64_t> suppressed_count = 0;
+    std::atomic<size_t> tag_count_         = 0;
+
+    void evict_oldest();
+};
+
+}  // namespace ruuvi
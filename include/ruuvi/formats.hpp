@@ -0,0 +1,285 @@
+#pragma once
+
+#include "ruuvi.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace ruuvi {
+
+/**
+ * @brief Measurements carried by the Ruuvi data formats
+ */
+enum class field : uint8_t {
+    temperature,           // Celsius
+    humidity,              // Relative humidity 0-100%
+    pressure,              // Pascal
+    acceleration_x,        // G
+    acceleration_y,        // G
+    acceleration_z,        // G
+    battery_voltage,       // Volts
+    tx_power,              // dBm
+    movement_counter,      // Count
+    measurement_sequence,  // Count
+    pm1_0,                 // Particulate matter, ug/m3
+    pm2_5,                 // Particulate matter, ug/m3
+    pm4_0,                 // Particulate matter, ug/m3
+    pm10_0,                // Particulate matter, ug/m3
+    co2,                   // ppm
+    voc_index,             // Sensirion VOC index
+    nox_index,             // Sensirion NOx index
+    luminosity,            // Lux
+};
+inline constexpr size_t field_count = size_t(field::luminosity) + 1;
+
+inline constexpr uint32_t field_bit(field f) { return 1u << uint32_t(f); }
+
+/**
+ * @brief How the raw bits of a field are turned into a value
+ */
+enum class encoding : uint8_t {
+    unsigned_int,
+    signed_int,      // Two's complement over the field width
+    sign_magnitude,  // Format 3 temperature: sign and integer byte, then hundredths byte
+    logarithmic,     // Format 6 luminosity: exp(raw * factor) - 1
+};
+
+/**
+ * @brief Describes one field of a data format
+ *
+ * The raw value is read big-endian from bytes [offset, offset + bytes), shifted right by shift and
+ * masked to width bits. A field split across bytes gets its least significant bit appended from
+ * low_bit_offset. The value is then raw * factor (or raw / factor), plus bias. The field is
+ * invalid if raw equals the sentinel or exceeds max.
+ *
+ * Descriptors are built with the constexpr helpers below, e.g.
+ * signed_field(field::temperature, 1, 2).times(0.005f).invalid_if(0x8000).
+ */
+struct field_descriptor {
+    static constexpr uint8_t no_low_bit = 0xFF;
+
+    field id;
+    uint8_t offset;
+    uint8_t bytes;
+    encoding enc;
+    uint8_t shift          = 0;
+    uint8_t width          = 0;
+    uint8_t low_bit_offset = no_low_bit;
+    uint8_t low_bit        = 0;
+    bool divide            = false;
+    float factor           = 1;
+    float bias             = 0;
+    bool has_sentinel      = false;
+    uint32_t sentinel      = 0;
+    uint32_t max           = std::numeric_limits<uint32_t>::max();
+
+    constexpr field_descriptor(field i, uint8_t o, uint8_t b, encoding e)
+        : id(i), offset(o), bytes(b), enc(e), width(uint8_t(8 * b)) {}
+
+    constexpr field_descriptor bits(uint8_t s, uint8_t w) const {
+        auto r  = *this;
+        r.shift = s;
+        r.width = w;
+        return r;
+    }
+    constexpr field_descriptor low_bit_at(uint8_t o, uint8_t bit) const {
+        auto r           = *this;
+        r.low_bit_offset = o;
+        r.low_bit        = bit;
+        r.width          = uint8_t(width + 1);
+        return r;
+    }
+    constexpr field_descriptor times(float f) const {
+        auto r   = *this;
+        r.factor = f;
+        return r;
+    }
+    constexpr field_descriptor over(float f) const {
+        auto r   = *this;
+        r.factor = f;
+        r.divide = true;
+        return r;
+    }
+    constexpr field_descriptor plus(float b) const {
+        auto r = *this;
+        r.bias = b;
+        return r;
+    }
+    constexpr field_descriptor invalid_if(uint32_t s) const {
+        auto r         = *this;
+        r.has_sentinel = true;
+        r.sentinel     = s;
+        return r;
+    }
+    constexpr field_descriptor at_most(uint32_t m) const {
+        auto r = *this;
+        r.max  = m;
+        return r;
+    }
+    constexpr field_descriptor encoded(encoding e) const {
+        auto r = *this;
+        r.enc  = e;
+        return r;
+    }
+};
+
+constexpr field_descriptor unsigned_field(field id, uint8_t offset, uint8_t bytes) {
+    return {id, offset, bytes, encoding::unsigned_int};
+}
+constexpr field_descriptor signed_field(field id, uint8_t offset, uint8_t bytes) {
+    return {id, offset, bytes, encoding::signed_int};
+}
+
+/*
+ * Format tables. Each format lists its identifier byte, minimum payload size, where the sender
+ * MAC (or its least significant bytes) is repeated, and its fields. Adding a format means adding
+ * a table here and an entry in the jump table in formats.cpp.
+ *
+ * decode_format_5() and convert_data_format_3() read their payloads through these tables. The
+ * exposer only exports format 5, formats 6 and E1 are decoded by decode() alone for now.
+ */
+
+/** @brief Data format 3 (RAWv1) */
+struct format_3 {
+    static constexpr uint8_t id        = 0x03;
+    static constexpr size_t size       = 14;
+    static constexpr size_t mac_offset = 0;
+    static constexpr size_t mac_size   = 0;
+    static constexpr field_descriptor fields[] = {
+        unsigned_field(field::humidity, 1, 1).times(0.5f).at_most(200),
+        unsigned_field(field::temperature, 2, 2).encoded(encoding::sign_magnitude),
+        unsigned_field(field::pressure, 4, 2).plus(50'000),
+        signed_field(field::acceleration_x, 6, 2).times(0.001f),
+        signed_field(field::acceleration_y, 8, 2).times(0.001f),
+        signed_field(field::acceleration_z, 10, 2).times(0.001f),
+        unsigned_field(field::battery_voltage, 12, 2).times(0.001f),
+    };
+};
+
+/** @brief Data format 5 (RAWv2) */
+struct format_5 {
+    static constexpr uint8_t id        = 0x05;
+    static constexpr size_t size       = 24;
+    static constexpr size_t mac_offset = 18;
+    static constexpr size_t mac_size   = 6;
+    static constexpr field_descriptor fields[] = {
+        signed_field(field::temperature, 1, 2).times(0.005f).invalid_if(0x8000),
+        unsigned_field(field::humidity, 3, 2).times(0.0025f).at_most(40'000),
+        unsigned_field(field::pressure, 5, 2).plus(50'000).invalid_if(0xFFFF),
+        signed_field(field::acceleration_x, 7, 2).over(1000).invalid_if(0x8000),
+        signed_field(field::acceleration_y, 9, 2).over(1000).invalid_if(0x8000),
+        signed_field(field::acceleration_z, 11, 2).over(1000).invalid_if(0x8000),
+        unsigned_field(field::battery_voltage, 13, 2)
+            .bits(5, 11)
+            .over(1000)
+            .plus(1.6f)
+            .invalid_if(2047),
+        unsigned_field(field::tx_power, 14, 1).bits(0, 5).times(2).plus(-40).invalid_if(31),
+        unsigned_field(field::movement_counter, 15, 1),
+        unsigned_field(field::measurement_sequence, 16, 2),
+    };
+};
+
+/** @brief Data format 6, the compact Ruuvi Air format */
+struct format_6 {
+    static constexpr uint8_t id        = 0x06;
+    static constexpr size_t size       = 20;
+    static constexpr size_t mac_offset = 17;
+    static constexpr size_t mac_size   = 3;  // Least significant bytes only
+    static constexpr field_descriptor fields[] = {
+        signed_field(field::temperature, 1, 2).times(0.005f).invalid_if(0x8000),
+        unsigned_field(field::humidity, 3, 2).times(0.0025f).at_most(40'000),
+        unsigned_field(field::pressure, 5, 2).plus(50'000).invalid_if(0xFFFF),
+        unsigned_field(field::pm2_5, 7, 2).times(0.1f).invalid_if(0xFFFF),
+        unsigned_field(field::co2, 9, 2).invalid_if(0xFFFF),
+        unsigned_field(field::voc_index, 11, 1).low_bit_at(16, 6).invalid_if(511),
+        unsigned_field(field::nox_index, 12, 1).low_bit_at(16, 7).invalid_if(511),
+        // ln(65536) / 254, luminosity codes span 0..65535 lux logarithmically
+        unsigned_field(field::luminosity, 13, 1)
+            .encoded(encoding::logarithmic)
+            .times(0.043662814523461f)
+            .invalid_if(255),
+        unsigned_field(field::measurement_sequence, 15, 1),
+    };
+};
+
+/** @brief Extended data format E1, the full Ruuvi Air format */
+struct format_e1 {
+    static constexpr uint8_t id        = 0xE1;
+    static constexpr size_t size       = 40;
+    static constexpr size_t mac_offset = 34;
+    static constexpr size_t mac_size   = 6;
+    static constexpr field_descriptor fields[] = {
+        signed_field(field::temperature, 1, 2).times(0.005f).invalid_if(0x8000),
+        unsigned_field(field::humidity, 3, 2).times(0.0025f).at_most(40'000),
+        unsigned_field(field::pressure, 5, 2).plus(50'000).invalid_if(0xFFFF),
+        unsigned_field(field::pm1_0, 7, 2).times(0.1f).invalid_if(0xFFFF),
+        unsigned_field(field::pm2_5, 9, 2).times(0.1f).invalid_if(0xFFFF),
+        unsigned_field(field::pm4_0, 11, 2).times(0.1f).invalid_if(0xFFFF),
+        unsigned_field(field::pm10_0, 13, 2).times(0.1f).invalid_if(0xFFFF),
+        unsigned_field(field::co2, 15, 2).invalid_if(0xFFFF),
+        unsigned_field(field::voc_index, 17, 1).low_bit_at(28, 6).invalid_if(511),
+        unsigned_field(field::nox_index, 18, 1).low_bit_at(28, 7).invalid_if(511),
+        unsigned_field(field::luminosity, 19, 3).times(0.01f).invalid_if(0xFF'FFFF),
+        unsigned_field(field::measurement_sequence, 25, 3).invalid_if(0xFF'FFFF),
+    };
+};
+
+/**
+ * @brief A decoded advert of any supported data format
+ *
+ * Fields the format doesn't carry are NaN and clear in present. Invalid fields are NaN and set in
+ * invalid.
+ */
+struct measurement {
+    static constexpr auto nan = std::numeric_limits<float>::quiet_NaN();
+
+    int data_format   = unknown_format;
+    uint32_t present  = 0;
+    uint32_t invalid  = 0;
+    bool mac_mismatch = false;
+    std::array<float, field_count> values;
+
+    measurement() { reset(); }
+
+    void reset() {
+        data_format  = unknown_format;
+        present      = 0;
+        invalid      = 0;
+        mac_mismatch = false;
+        values.fill(nan);
+    }
+
+    bool has(field f) const { return (present & field_bit(f)) != 0; }
+    bool valid(field f) const { return has(f) && (invalid & field_bit(f)) == 0; }
+    float operator[](field f) const { return values[size_t(f)]; }
+};
+
+inline constexpr int payload_too_short = -3;
+
+/**
+ * @brief decode Decodes a payload of any supported data format, chosen by its first byte
+ * @return The data format, unknown_format, or payload_too_short
+ */
+int decode(uint8_t const* payload, size_t size, measurement& out) noexcept;
+
+/**
+ * @brief decode Decodes an advert and checks that the payload MAC matches the sender
+ * @return The data format, not_ruuvitag, unknown_format or payload_too_short
+ */
+int decode(ble::AdvPacket const& p, measurement& out) noexcept;
+
+/**
+ * @brief decode_as Decodes a payload as data_format whatever its first byte, without the MAC check
+ * @return data_format, unknown_format if it isn't supported, or payload_too_short
+ */
+int decode_as(int data_format, uint8_t const* payload, size_t size, measurement& out) noexcept;
+
+/**
+ * @brief is_decodable Whether decode() supports the data format
+ */
+bool is_decodable(int data_format) noexcept;
+
+}  // namespace ruuvi
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace ruuvi {
+
+/**
+ * @brief Compresses HTTP responses with gzip, reusing one zlib context
+ *
+ * Setting up a deflate stream allocates about 256 KiB of state, which is kept between calls and
+ * only reset. Not thread safe.
+ */
+class gzip_compressor {
+public:
+    /** @param level zlib compression level, 1 (fastest) to 9 (smallest) */
+    explicit gzip_compressor(int level = 1);
+    ~gzip_compressor();
+    gzip_compressor(gzip_compressor const&)            = delete;
+    gzip_compressor& operator=(gzip_compressor const&) = delete;
+
+    /**
+     * @brief compress Replaces out with in compressed as a gzip file, allocates only when out has
+     * to grow
+     */
+    void compress(std::string_view in, std::string& out);
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace ruuvi
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "http_server.hpp"
+#include "ruuvi.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <prometheus/collectable.h>
+
+namespace ruuvi {
+
+/**
+ * @brief Fields of a reading kept in the history, in the order of history_sample::values
+ */
+inline constexpr char const* history_fields[] = {
+    "temperature",
+    "humidity",
+    "pressure",
+    "acceleration_x",
+    "acceleration_y",
+    "acceleration_z",
+    "battery_voltage",
+    "tx_power",
+    "movement_counter",
+    "measurement_sequence",
+    "signal_strength",
+};
+inline constexpr size_t history_field_count = std::size(history_fields);
+
+/**
+ * @brief Most samples in a response of history::serve(), about 700 kB of JSON
+ */
+inline constexpr size_t history_page_samples = 10'000;
+
+/**
+ * @brief A reading as kept in the history
+ */
+struct history_sample {
+    int64_t timestamp_ms = 0;  // Wall clock time the reading was received
+    std::array<float, history_field_count> values{};  // NaN for invalid fields
+};
+
+/**
+ * @brief How much of the history is kept
+ */
+struct history_options {
+    std::chrono::milliseconds retention = std::chrono::hours(24);
+    size_t max_bytes = 32u << 20u;  // Of all tags together, the oldest samples are dropped first
+};
+
+/**
+ * @brief Every reading of each tag over the retention time, compressed in memory
+ *
+ * Samples are compressed as in Gorilla (Facebook's in-memory TSDB): timestamps as delta of
+ * deltas. The fields are kept as the integers of data format 5, e.g. the temperature in steps of
+ * 0.005 C, as the delta from their previous value, and scaled back when queried. Readings decoded
+ * from adverts come back bit for bit, other values are rounded to the resolution of the format.
+ * Samples are appended to 4 KiB blocks per tag which are decoded on their own, and whole blocks
+ * are dropped once they fall out of the retention or the memory limit.
+ *
+ * A sample takes about 7.4 bytes, so 50 tags advertising every 1.285 s take about 24 MiB a day,
+ * within the default limit of 32 MiB.
+ *
+ * add() and expire() must be called from one thread. They share a mutex with queries, which
+ * only hold it to copy the block being filled; full blocks are immutable and decoded outside it.
+ */
+class history: public prometheus::Collectable {
+public:
+    explicit history(history_options opts = {});
+    ~history();
+    history(history const&)            = delete;
+    history& operator=(history const&) = delete;
+
+    /** @brief add Appends the reading to the history of its tag */
+    void add(format_5_reading const& r, int64_t timestamp_ms);
+
+    /** @brief expire Drops the samples older than the retention and forgets tags left empty */
+    void expire(int64_t now_ms);
+
+    /**
+     * @brief query Replaces out with the samples of the tag received at from_ms or later, oldest
+     * first, at most limit of them
+     * @return false if the tag has no history
+     */
+    bool query(ble::mac_address const& mac, int64_t from_ms, std::vector<history_sample>& out,
+               size_t limit = std::numeric_limits<size_t>::max()) const;
+
+    /**
+     * @brief serve Answers GET /history?mac=AA:BB:CC:DD:EE:FF&from=<seconds>&limit=<samples>
+     * with the samples of the tag as JSON
+     * from is in seconds since the epoch, or before now if negative. Without it the history is
+     * sent from its start. A response holds at most limit samples, and history_page_samples
+     * without it. When more follow, the response ends with "next", the from of the next page.
+     * Samples received in the same millisecond as next may be sent in both pages.
+     */
+    void serve(http_request const& req, http_response& r) const;
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace ruuvi
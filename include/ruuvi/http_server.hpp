@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ruuvi {
+
+/**
+ * @brief A GET request received by http_server
+ */
+struct http_request {
+    std::string path;   // Without the query string
+    std::string query;  // After '?', empty if there is none
+    std::vector<std::pair<std::string, std::string>> headers;  // Names in lower case
+
+    /** @brief header Value of the header with the name in lower case, empty if it was not sent */
+    std::string_view header(std::string_view name) const;
+
+    /**
+     * @brief parameter Value of the query string parameter, percent-decoded
+     * Empty if it was not sent, the first one if it was sent several times.
+     */
+    std::string parameter(std::string_view name) const;
+};
+
+/**
+ * @brief accept_quality The q value given to value by a header listing alternatives, such as
+ * Accept or Accept-Encoding, 0 if it is not listed
+ * The most specific entry applies: value itself, then the wildcard of its media type, then the
+ * wildcard matching anything. Parameters other than q are ignored.
+ */
+double accept_quality(std::string_view header, std::string_view value);
+
+/**
+ * @brief The response to a request, sent with a single writev() of the header and the body
+ */
+struct http_response {
+    int status               = 200;
+    std::string content_type = "text/plain; charset=utf-8";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+};
+
+/**
+ * @brief Minimal HTTP/1.1 server for the scrape endpoints
+ *
+ * Serves GET and HEAD requests with a new connection per request. The thread that runs start()
+ * accepts the connections and hands them to a few worker threads, so a client that is slow to
+ * send its request or to read a long response only holds up its own worker. Each worker keeps its
+ * request and response buffers for its next request. Listens on both IPv6 and IPv4 when the
+ * system allows.
+ */
+class http_server {
+public:
+    using handler = void(http_request const&, http_response&);
+
+    static constexpr size_t default_workers = 4;
+
+    /**
+     * @brief http_server Binds the listening socket
+     * @param port The port to listen on, 0 picks a free one
+     * @param workers Number of connections served at once
+     */
+    explicit http_server(uint16_t port, size_t workers = default_workers);
+    ~http_server();
+    http_server(http_server const&)            = delete;
+    http_server& operator=(http_server const&) = delete;
+
+    /**
+     * @brief handle Serves the path with h, must be called before start()
+     * h may be called from several workers at once. Exceptions thrown by h are answered with
+     * status 500.
+     */
+    void handle(std::string path, std::function<handler> h);
+
+    /**
+     * @brief start Serves requests until stop() is called
+     * Returns once every worker has finished, connections still being served are cut short.
+     */
+    void start();
+    void stop() noexcept;
+
+    /** @brief port The port the server listens on */
+    uint16_t port() const noexcept { return port_; }
+
+private:
+    // The buffers of a worker, kept between requests to reuse their capacity
+    struct connection {
+        int fd = -1;
+        std::string buffer;
+        http_request request;
+        http_response response;
+        std::string head;
+    };
+
+    int sock   = -1;
+    int wakeup = -1;  // eventfd used by stop() to interrupt poll(), readable once stopped
+    uint16_t port_;
+    size_t const workers;
+    std::map<std::string, std::function<handler>, std::less<>> handlers;
+
+    std::mutex mtx;
+    std::condition_variable ready;
+    std::deque<int> pending;  // Accepted connections waiting for a worker
+    bool stopping = false;
+
+    void accept_connections();
+    void work();
+    void serve(connection& c);
+    bool read_request(connection& c);
+    void respond(connection& c, bool send_body);
+    void wait_for(int fd, short events, std::chrono::steady_clock::time_point deadline) const;
+};
+
+}  // namespace ruuvi
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <ble/packet.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ruuvi {
+
+/**
+ * @brief Open-addressing hash table keyed by binary MAC address
+ *
+ * Linear probing over a power-of-two array, grown at 3/4 load. Erasing shifts the following
+ * entries back, so there are no tombstones. Pointers to values are invalidated by inserts that
+ * grow the table and by erase.
+ *
+ * Not thread-safe.
+ */
+template<class T> class mac_table {
+public:
+    explicit mac_table(size_t capacity = 16) { rehash(round_up(capacity)); }
+
+    T* find(ble::mac_address const& mac) {
+        auto k = key(mac);
+        for (size_t i = slot(k);; i = next(i)) {
+            auto& s = slots[i];
+            if (!s.used) return nullptr;
+            if (s.key == k) return &s.value;
+        }
+    }
+    T const* find(ble::mac_address const& mac) const {
+        return const_cast<mac_table*>(this)->find(mac);
+    }
+
+    /**
+     * @brief emplace Finds the value of mac, default-constructing it if missing
+     * @return The value and whether it was inserted
+     */
+    std::pair<T*, bool> emplace(ble::mac_address const& mac) {
+        if (4 * (count + 1) > 3 * slots.size()) rehash(2 * slots.size());
+        auto k = key(mac);
+        size_t i = slot(k);
+        for (; slots[i].used; i = next(i)) {
+            if (slots[i].key == k) return {&slots[i].value, false};
+        }
+        slots[i].used  = true;
+        slots[i].key   = k;
+        slots[i].value = T{};
+        ++count;
+        return {&slots[i].value, true};
+    }
+
+    bool erase(ble::mac_address const& mac) {
+        auto k = key(mac);
+        size_t i = slot(k);
+        for (; slots[i].used; i = next(i)) {
+            if (slots[i].key == k) break;
+        }
+        if (!slots[i].used) return false;
+
+        // Move later entries of the probe sequence into the hole
+        for (size_t j = next(i);; j = next(j)) {
+            if (!slots[j].used) break;
+            auto home = slot(slots[j].key);
+            // Keep j if its home lies cyclically in (i, j]
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+            slots[i] = std::move(slots[j]);
+            i        = j;
+        }
+        slots[i].used  = false;
+        slots[i].value = T{};
+        --count;
+        return true;
+    }
+
+    /**
+     * @brief for_each Calls f(mac, value) for every entry, in no particular order
+     */
+    template<class F> void for_each(F&& f) {
+        for (auto& s: slots)
+            if (s.used) f(mac_of(s.key), s.value);
+    }
+    template<class F> void for_each(F&& f) const {
+        for (auto const& s: slots)
+            if (s.used) f(mac_of(s.key), s.value);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() {
+        for (auto& s: slots) s = {};
+        count = 0;
+    }
+
+private:
+    struct entry {
+        uint64_t key = 0;
+        bool used    = false;
+        T value{};
+    };
+
+    std::vector<entry> slots;
+    size_t count = 0;
+    size_t mask  = 0;
+
+    static uint64_t key(ble::mac_address const& mac) {
+        uint64_t k = 0;
+        for (auto b: mac) k = (k << 8u) | b;
+        return k;
+    }
+    static ble::mac_address mac_of(uint64_t k) {
+        ble::mac_address mac;
+        for (size_t i = mac.size(); i-- > 0; k >>= 8u) mac[i] = uint8_t(k);
+        return mac;
+    }
+    static size_t round_up(size_t n) {
+        size_t r = 16;
+        while (r < n) r *= 2;
+        return r;
+    }
+
+    // Fibonacci hashing spreads the vendor prefix and the low bytes over the whole table
+    size_t slot(uint64_t k) const { return size_t((k * 0x9E37'79B9'7F4A'7C15ull) >> 32u) & mask; }
+    size_t next(size_t i) const { return (i + 1) & mask; }
+
+    void rehash(size_t capacity) {
+        std::vector<entry> old(capacity);
+        old.swap(slots);
+        mask  = capacity - 1;
+        count = 0;
+        for (auto& s: old) {
+            if (!s.used) continue;
+            size_t i = slot(s.key);
+            while (slots[i].used) i = next(i);
+            slots[i] = std::move(s);
+            ++count;
+        }
+    }
+};
+
+}  // namespace ruuvi
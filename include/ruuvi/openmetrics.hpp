@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <prometheus/metric_family.h>
+
+namespace ruuvi {
+
+/** @brief Content type of the OpenMetrics text format */
+inline constexpr char const* openmetrics_content_type =
+    "application/openmetrics-text; version=1.0.0; charset=utf-8";
+
+/**
+ * @brief prefers_openmetrics True if the Accept header of a scrape ranks the OpenMetrics text
+ * format above the Prometheus one, which is served otherwise
+ */
+bool prefers_openmetrics(std::string_view accept);
+
+/**
+ * @brief serialize_openmetrics Appends the families to out in the OpenMetrics text format
+ *
+ * Counter families are described without their _total suffix and timestamps are written in
+ * seconds, as the format requires. The "# EOF" line that ends a response is left to the caller,
+ * so that families from several collectors can be appended.
+ */
+void serialize_openmetrics(std::vector<prometheus::MetricFamily> const& families,
+                           std::string& out);
+
+}  // namespace ruuvi
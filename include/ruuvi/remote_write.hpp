@@ -0,0 +1,85 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spool.hpp"
+
+#include <prometheus/collectable.h>
+#include <prometheus/metric_family.h>
+
+namespace ruuvi {
+
+/**
+ * @brief Where and how often remote_writer pushes
+ */
+struct remote_write_options {
+    std::string url;  // http://host[:port]/path, TLS is left to a proxy on the gateway
+    std::chrono::milliseconds interval = std::chrono::seconds(15);  // Between collections
+    size_t max_buffered = 100'000;  // Samples kept while sending fails, the oldest are dropped
+    size_t max_batch    = 2'000;    // Samples per request
+    std::chrono::milliseconds min_backoff = std::chrono::milliseconds(500);
+    std::chrono::milliseconds max_backoff = std::chrono::seconds(30);
+    std::chrono::milliseconds timeout     = std::chrono::seconds(10);  // Of each request
+    // Added to every series, to tell the sites apart without scrape target labels
+    std::vector<std::pair<std::string, std::string>> labels;
+};
+
+/**
+ * @brief encode_write_request Appends the samples of the families to out as a remote write
+ * WriteRequest protobuf message
+ *
+ * Histograms and summaries are split into their series as the text format does. Samples without
+ * a timestamp get timestamp_ms.
+ */
+void encode_write_request(std::vector<prometheus::MetricFamily> const& families,
+                          int64_t timestamp_ms, std::string& out,
+                          std::vector<std::pair<std::string, std::string>> const& labels = {});
+
+/**
+ * @brief Pushes metrics to a Prometheus remote write endpoint
+ *
+ * Collects the sources every interval, buffers their samples and sends them in batches as
+ * snappy-compressed protobuf. A failed request is retried with exponential backoff while new
+ * samples are buffered; when the buffer is full the oldest samples are dropped. Requests
+ * rejected with a 4xx status other than 429 are dropped, as retrying can't help.
+ *
+ * With a spool, the readings in it are pushed in order with the time they were received, and
+ * removed from it once sent. The tag gauges collected from the sources are then left out, the
+ * spool has every reading of them.
+ *
+ * Its own metrics are pushed along with the sources, and can be collected from any thread.
+ */
+class remote_writer: public prometheus::Collectable {
+public:
+    using sources = std::vector<std::shared_ptr<prometheus::Collectable>>;
+
+    /**
+     * @brief remote_writer
+     * @throws std::invalid_argument if the URL is not an http:// URL
+     */
+    remote_writer(remote_write_options opts, sources s, std::shared_ptr<spool> readings = nullptr);
+    ~remote_writer();
+    remote_writer(remote_writer const&)            = delete;
+    remote_writer& operator=(remote_writer const&) = delete;
+
+    /**
+     * @brief start Collects and sends until stop() is called
+     * Samples still buffered then are discarded. stop() waits for a request in progress, at
+     * most the timeout.
+     */
+    void start();
+    void stop() noexcept;
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace ruuvi
@@ -9,8 +9,9 @@
 #include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
-#include <ble/receiver.hpp>
+#include <ble/packet.hpp>
 
 namespace ruuvi {
 
@@ -44,11 +45,128 @@ struct ruuvi_data_format_3 {
     bool contains_errors = true;
 };
 
+/**
+ * @brief Bits of format_5_reading::errors, set for each invalid field
+ */
+enum format_5_error : uint16_t {
+    invalid_size            = 1u << 0,
+    invalid_format          = 1u << 1,
+    invalid_temperature     = 1u << 2,
+    invalid_humidity        = 1u << 3,
+    invalid_pressure        = 1u << 4,
+    invalid_acceleration_x  = 1u << 5,
+    invalid_acceleration_y  = 1u << 6,
+    invalid_acceleration_z  = 1u << 7,
+    invalid_battery_voltage = 1u << 8,
+    invalid_tx_power        = 1u << 9,
+    mac_mismatch            = 1u << 10,  // Payload MAC differs from the sender address
+};
+
+/**
+ * @brief Data format 5 reading without heap-allocated members
+ *
+ * Invalid fields hold the same values as in ruuvi_data_format_5 and have their bit set in
+ * errors. Error messages are only rendered on demand with describe_errors().
+ */
+struct format_5_reading {
+    static constexpr auto nan = std::numeric_limits<float>::quiet_NaN();
+    float temperature         = nan;
+    float humidity            = nan;
+    uint32_t pressure         = -1;
+    std::array<float, 3> acceleration{nan, nan, nan};
+    float battery_voltage         = nan;
+    uint16_t measurement_sequence = -1;
+    int8_t tx_power               = std::numeric_limits<int8_t>::min();
+    uint8_t movement_counter      = -1;
+    int16_t signal_strength       = -32636;
+    ble::mac_address mac{};
+    uint16_t errors     = 0;
+    uint8_t data_size   = 0;  // Kept for describe_errors()
+    uint8_t data_format = 0;
+
+    bool valid(uint16_t bits = 0xFFFF) const { return (errors & bits) == 0; }
+    float acceleration_total() const;
+};
+
+/**
+ * @brief decode_format_5 Decodes a data format 5 advert without allocating
+ * @return true if the reading contains no errors
+ */
+bool decode_format_5(ble::AdvPacket const& p, format_5_reading& out) noexcept;
+
+/**
+ * @brief decode_format_5 Decodes a bare data format 5 payload, without the MAC check
+ * @return true if the reading contains no errors
+ */
+bool decode_format_5(uint8_t const* payload, size_t size, format_5_reading& out) noexcept;
+
+/**
+ * @brief describe_errors Renders the errors of a reading as text, empty if there are none
+ */
+std::string describe_errors(format_5_reading const& r);
+
+/**
+ * @brief Data format 5 readings as structure-of-arrays columns
+ *
+ * Row i of every column belongs to the i:th decoded payload. Invalid fields hold the same values
+ * as in format_5_reading, and errors holds the format_5_error bits of each row.
+ */
+struct format_5_batch {
+    std::vector<float> temperature;
+    std::vector<float> humidity;
+    std::vector<uint32_t> pressure;
+    std::vector<float> acceleration_x;
+    std::vector<float> acceleration_y;
+    std::vector<float> acceleration_z;
+    std::vector<float> battery_voltage;
+    std::vector<uint16_t> measurement_sequence;
+    std::vector<int8_t> tx_power;
+    std::vector<uint8_t> movement_counter;
+    std::vector<uint16_t> errors;
+
+    size_t size() const { return errors.size(); }
+    void resize(size_t n);
+};
+
+/**
+ * @brief Instruction sets decode_format_5_batch can use
+ */
+enum class simd_level { scalar, ssse3, avx2, neon };
+
+/**
+ * @brief simd_supported Checks at runtime whether level can be used on this machine
+ */
+bool simd_supported(simd_level level);
+
+/**
+ * @brief best_simd_level The fastest supported level, detected once
+ */
+simd_level best_simd_level();
+
+/**
+ * @brief decode_format_5_batch Decodes count 24-byte data format 5 payloads into out
+ *
+ * The result matches decode_format_5(payload, 24, ...) bit for bit on every level. Payload MACs
+ * are not checked, as the batch carries no sender addresses. An unsupported level falls back to
+ * the scalar decoder.
+ *
+ * @param payloads First payload, payload i starts at payloads + i * stride
+ * @param stride Distance in bytes between payloads, at least 24
+ */
+void decode_format_5_batch(uint8_t const* payloads, size_t count, size_t stride,
+                           format_5_batch& out, simd_level level = best_simd_level());
+
 std::ostream& operator<<(std::ostream& os, ruuvi_data_format_5 const& data);
 std::ostream& operator<<(std::ostream& os, ruuvi_data_format_3 const& data);
 
 inline constexpr int unknown_format = -1;
 inline constexpr int not_ruuvitag = -2;
+int identify_format(ble::AdvPacket const& p);
+ruuvi_data_format_5 convert_data_format_5(ble::AdvPacket const& p,
+                                          bool throw_on_error = false);
+ruuvi_data_format_3 convert_data_format_3(ble::AdvPacket const& p, bool throw_on_error = false);
+
+// Convert through ble::to_adv_packet
 int identify_format(ble::BlePacket const& p);
 ruuvi_data_format_5 convert_data_format_5(ble::BlePacket const& p,
                                           bool throw_on_error = false);
@@ -2,29 +2,119 @@
 
 #include "ruuvi.hpp"
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <vector>
 
 #include <prometheus/collectable.h>
+#include <prometheus/metric_family.h>
 
 namespace ruuvi {
 
+/**
+ * @brief When the adverts given to RuuviExposer::update(AdvPacket) are decoded
+ */
+enum class decode_mode {
+    on_update,   // Every advert, by the thread calling update()
+    on_collect,  // Only the latest advert of each tag, once per scrape
+};
+
+/**
+ * @brief Which time the samples of a tag are exported with
+ */
+enum class sample_time {
+    scrape,   // None, the scraper stamps them
+    receive,  // The time the measurement was received, the signal strength the latest advert
+};
+
+/**
+ * @brief Bounds the tags RuuviExposer keeps metrics for
+ */
+struct tag_limits {
+    std::chrono::steady_clock::duration ttl{};  // Tags not seen for longer are removed, 0 never
+    size_t max_tags = 0;  // The least recently seen tag makes room for a new one, 0 for no limit
+};
+
+/**
+ * @brief Statistics of the measurements of each tag over fixed, aligned windows
+ *
+ * The minimum, maximum, sum and count of each measured field are exported for the latest closed
+ * window as <gauge>_window_min, _max, _sum and _count, catching spikes between scrapes. A window
+ * closes with the first measurement after it, or with expire() for tags that are not heard from.
+ */
+struct aggregation {
+    std::chrono::steady_clock::duration window{};  // Length of the windows, 0 for none
+    bool last = false;  // Also export the last value of each window as <gauge>_window_last
+};
+
+/**
+ * @brief append_reading Appends the tag gauges of a reading to families, named and labelled as
+ * RuuviExposer exports them and stamped with timestamp_ms
+ * Samples are added to the families of the same name already in families, so readings can be
+ * collected into one set of families. Used to push readings that were received while a remote
+ * write endpoint was down.
+ */
+void append_reading(format_5_reading const& r, int64_t timestamp_ms,
+                    std::vector<prometheus::MetricFamily>& families);
+
 /**
  * @brief The RuuviExposer class
+ *
+ * update(), update_signal() and expire() must be called from one thread (the decoding worker).
+ * They never wait for Collect(), which can run concurrently on any thread.
  */
 class RuuviExposer: public prometheus::Collectable {
 public:
     ~RuuviExposer();
-    RuuviExposer();
+    /**
+     * @brief RuuviExposer
+     * @throws std::invalid_argument for aggregation windows with decode_mode::on_collect, which
+     * doesn't decode every advert
+     */
+    explicit RuuviExposer(decode_mode mode = decode_mode::on_update, tag_limits limits = {},
+                          sample_time time = sample_time::scrape, aggregation windows = {});
 
     /**
      * @brief update Updates prometheus with values from data, with respect to its mac
-     * This is done in thread-safe manner
+     * Wait-free for tags that have been seen before
      * @param data
      */
+    void update(format_5_reading const& data);
     void update(ruuvi_data_format_5 const& data);
 
+    /**
+     * @brief update Updates prometheus with a data format 5 advert, decoded as set by the mode
+     * With decode_mode::on_collect only the payload is copied. ruuvi_received_measurements_total
+     * still counts every advert, ruuvi_errors_total counts the erroneous adverts that were
+     * decoded.
+     */
+    void update(ble::AdvPacket const& p);
+
+    /**
+     * @brief update_signal Only updates the signal strength of the tag, used for repeated adverts
+     * Ignored until the tag has sent a measurement with update()
+     */
+    void update_signal(ble::mac_address const& mac, int16_t signal_strength);
+
+    /**
+     * @brief expire Removes the metrics of the tags not seen within the TTL, and closes the
+     * aggregation windows that have ended
+     * Call periodically from the thread calling update(). Never waits for scrapes, the slots of
+     * removed tags are reused once the scrapes that may still read them have finished.
+     */
+    void expire(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
     virtual std::vector<prometheus::MetricFamily> Collect() const override;
 
+    /**
+     * @brief render Appends the metrics to out in the Prometheus text format
+     * Samples are kept rendered per tag, and only tags with new data since the previous call are
+     * rendered again. Calls are serialized, but never wait for update().
+     */
+    void render(std::string& out) const;
+
 private:
     class Impl;
     std::unique_ptr<Impl> impl;
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+namespace ruuvi {
+
+/**
+ * @brief Single-writer sequence lock holding a value of type T
+ *
+ * store() is wait-free: it never waits for readers. load() copies the value and retries if a
+ * store ran meanwhile, so readers always get a value that was stored as a whole. The value is
+ * kept in atomic words and ordered without standalone fences, which keeps concurrent access
+ * well-defined and visible to TSAN. On x86 the orderings cost nothing.
+ *
+ * Only one thread may store at a time, any number may load.
+ */
+template<class T> class seqlock {
+    static_assert(std::is_trivially_copyable_v<T>, "The value is copied as raw words");
+    static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    seqlock() { store(T{}); }
+
+    void store(T const& value) noexcept {
+        std::array<uint64_t, word_count> words{};
+        std::memcpy(words.data(), &value, sizeof(T));
+
+        // Release on the words keeps the odd sequence ahead of them, a reader that sees any new
+        // word also sees the store in progress
+        auto seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        for (size_t i = 0; i < word_count; ++i) data[i].store(words[i], std::memory_order_release);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    T load() const noexcept {
+        std::array<uint64_t, word_count> words;
+        for (unsigned attempt = 0;; ++attempt) {
+            auto before = sequence.load(std::memory_order_acquire);
+            if ((before & 1u) == 0) {
+                for (size_t i = 0; i < word_count; ++i)
+                    words[i] = data[i].load(std::memory_order_acquire);
+                if (sequence.load(std::memory_order_relaxed) == before) break;
+            }
+            // The writer was preempted in the middle of a store
+            if (attempt >= 64) std::this_thread::yield();
+        }
+        // Trivially copyable, so overwriting a value built with default member initializers is
+        // fine; the cast only silences -Wclass-memaccess for such types
+        T value;
+        std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+        return value;
+    }
+
+    /**
+     * @brief version Changes with every store, for readers caching what they derive from the value
+     */
+    uint32_t version() const noexcept { return sequence.load(std::memory_order_acquire); }
+
+private:
+    std::atomic<uint32_t> sequence = 0;  // Odd while a store is in progress
+    std::array<std::atomic<uint64_t>, word_count> data{};
+};
+
+}  // namespace ruuvi
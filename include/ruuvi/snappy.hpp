@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace ruuvi {
+
+/**
+ * @brief snappy_compress Replaces out with in compressed in the Snappy block format
+ *
+ * The raw format without framing, as used by Prometheus remote write. Compresses less than the
+ * reference implementation, but repeated label sets still shrink several times. Allocates only
+ * when out has to grow.
+ */
+void snappy_compress(std::string_view in, std::string& out);
+
+/**
+ * @brief snappy_uncompress Replaces out with in uncompressed
+ * @return False if in is not valid Snappy data, out is then unspecified
+ */
+bool snappy_uncompress(std::string_view in, std::string& out);
+
+}  // namespace ruuvi
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "formats.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <prometheus/collectable.h>
+
+namespace ruuvi {
+
+/**
+ * @brief Where the spool keeps its segments and how much of the disk it may use
+ */
+struct spool_options {
+    std::string directory;              // Created if missing
+    size_t segment_size = 4u << 20u;    // Bytes per segment file
+    size_t max_size     = 256u << 20u;  // The oldest segments are deleted beyond, at least two
+    // Written readings reach the disk at most this often, one write for all of them
+    std::chrono::milliseconds commit_interval = std::chrono::seconds(10);
+};
+
+/**
+ * @brief A data format 5 advert as stored in the spool
+ */
+struct spooled_reading {
+    int64_t timestamp_ms = 0;  // Wall clock time the advert was received
+    ble::mac_address mac{};
+    int16_t signal_strength = 0;
+    std::array<uint8_t, format_5::size> payload{};
+};
+
+/**
+ * @brief Append-only log of the received readings, kept on disk until they have been sent
+ *
+ * Readings are appended as fixed-size binary records to memory-mapped segment files, which are
+ * written back to the disk in one msync per commit interval instead of one write per reading.
+ * A full segment is closed and the next one started; when the segments exceed the size limit,
+ * the oldest is deleted with its unsent readings. Records carry a checksum, after a crash the
+ * readings of a segment are recovered up to the first record that didn't make it to the disk.
+ *
+ * Readings are read back in the order they were appended, and only removed when acknowledged.
+ * The position of the reader is saved when a segment is deleted and when the spool is closed,
+ * after a crash at most the readings of one segment are read again.
+ *
+ * append() and commit() must be called from one thread, read() and acknowledge() from one
+ * other thread. Appending only waits for the reader when a segment is started.
+ */
+class spool: public prometheus::Collectable {
+public:
+    /**
+     * @brief spool Opens the segments left in the directory and starts a new one
+     * @throws std::runtime_error if the directory or a segment can't be opened
+     */
+    explicit spool(spool_options opts);
+    ~spool();
+    spool(spool const&)            = delete;
+    spool& operator=(spool const&) = delete;
+
+    /**
+     * @brief append Adds a data format 5 advert
+     * @return false if it is not one, or it couldn't be written
+     */
+    bool append(ble::AdvPacket const& p, int64_t timestamp_ms) noexcept;
+
+    /**
+     * @brief commit Writes the appended readings to the disk, if the commit interval has passed
+     * Blocks until the disk has them. Also retries starting a segment after an error.
+     */
+    void commit(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    /**
+     * @brief read Replaces out with at most max of the oldest unacknowledged readings
+     */
+    void read(std::vector<spooled_reading>& out, size_t max);
+
+    /**
+     * @brief acknowledge Removes the n oldest readings, after they have been sent
+     */
+    void acknowledge(size_t n);
+
+    /** @brief Number of readings not acknowledged yet */
+    size_t pending() const;
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace ruuvi
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace ruuvi {
+
+/**
+ * @brief Minimum, maximum, sum, count and last value of N fields over a time window
+ *
+ * Streaming, adding a value is a handful of comparisons. NaN values are skipped, they mark fields
+ * a tag doesn't measure. Trivially copyable, so a closed window can be published through a
+ * seqlock.
+ */
+template<size_t N> struct window_stats {
+    int64_t end = 0;  // When the window ends, in the clock of the caller; 0 for no window
+    std::array<uint32_t, N> count{};
+    std::array<double, N> min{};
+    std::array<double, N> max{};
+    std::array<double, N> sum{};
+    std::array<double, N> last{};
+
+    void add(size_t i, double value) noexcept {
+        if (std::isnan(value)) return;
+        if (count[i]++ == 0) {
+            min[i] = max[i] = value;
+        } else {
+            min[i] = std::min(min[i], value);
+            max[i] = std::max(max[i], value);
+        }
+        sum[i]  += value;
+        last[i] = value;
+    }
+
+    /** @brief reset Starts an empty window, which has no minimum, maximum or last value */
+    void reset(int64_t new_end) noexcept {
+        constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+        end                  = new_end;
+        count.fill(0);
+        min.fill(nan);
+        max.fill(nan);
+        sum.fill(0);
+        last.fill(nan);
+    }
+};
+
+}  // namespace ruuvi
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <prometheus/collectable.h>
+#include <prometheus/metric_family.h>
+
+#include <memory>
+#include <vector>
+
+#include "diskstat_exposer.hpp"
+#include "system_info_exposer.hpp"
+
+namespace sys_info {
+
+/**
+ * @brief Exports the sysinfo_cache_* families of the collectors' snapshot
+ * caches, one family per counter with a collector label for each cache
+ */
+class CacheExposer: public prometheus::Collectable {
+public:
+    CacheExposer(std::shared_ptr<SystemInfoCollector const> sysinfo,
+                 std::shared_ptr<DiskstatExposer const> diskstat);
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    std::shared_ptr<SystemInfoCollector const> const sysinfo;
+    std::shared_ptr<DiskstatExposer const> const diskstat;
+};
+
+}  // namespace sys_info
@@ -2,11 +2,35 @@
 
 #include <prometheus/collectable.h>
 
+#include <chrono>
+#include <memory>
+#include <string>
+
 namespace sys_info {
 class DiskstatExposer: public prometheus::Collectable {
 public:
+    /**
+     * @brief DiskstatExposer Reads diskstat_location under root, the host's
+     * when empty, at most once per max_age
+     */
+    explicit DiskstatExposer(
+        std::string const& root                     = {},
+        std::chrono::steady_clock::duration max_age = std::chrono::seconds(30));
+    ~DiskstatExposer();
+
     std::vector<prometheus::MetricFamily> Collect() const override;
 
+    /**
+     * @brief append_cache_statistics Adds the counters of the snapshot cache
+     * to the sysinfo_cache_* families, see CacheExposer
+     */
+    void append_cache_statistics(
+        std::vector<prometheus::MetricFamily>& families) const;
+
     static constexpr char const* diskstat_location = "/proc/diskstats";
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
 };
 }  // namespace sys_info
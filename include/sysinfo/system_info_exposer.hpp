@@ -2,11 +2,30 @@
 
 #include <prometheus/collectable.h>
 
+#include <chrono>
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace sys_info {
 
+/**
+ * @brief Minimum time between two reads of each source, read on every scrape
+ * when 0
+ *
+ * Scrapes in between are served the previous values.
+ */
+struct refresh_intervals {
+    using duration = std::chrono::steady_clock::duration;
+
+    duration meminfo   = std::chrono::seconds(5);
+    duration stat      = duration::zero();
+    duration netstat   = duration::zero();
+    duration load      = duration::zero();  // sysinfo() and getloadavg()
+    duration thermal   = duration::zero();
+    duration diskstats = std::chrono::seconds(30);  // For DiskstatExposer
+};
+
 class SystemInfoCollector: public prometheus::Collectable {
     struct init {};
 
@@ -17,10 +36,23 @@ public:
     static constexpr char const* thremal_sesnsors_root_location =
         "/sys/class/thermal";
 
-    static std::shared_ptr<SystemInfoCollector> create();
+    /**
+     * @brief create Reads the locations under root, like a copy of the host's
+     * /proc and /sys mounted in a container, or the host's when empty
+     */
+    static std::shared_ptr<SystemInfoCollector>
+    create(std::string root = {}, refresh_intervals intervals = {});
     std::vector<prometheus::MetricFamily> Collect() const override;
 
-    SystemInfoCollector(init);
+    /**
+     * @brief append_cache_statistics Adds the counters of the snapshot cache
+     * to the sysinfo_cache_* families, see CacheExposer
+     */
+    void append_cache_statistics(
+        std::vector<prometheus::MetricFamily>& families) const;
+
+    SystemInfoCollector(init, std::string const& root,
+                        refresh_intervals const& intervals);
     ~SystemInfoCollector();
 
 private:
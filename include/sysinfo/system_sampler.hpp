@@ -0,0 +1,66 @@
+#pragma once
+
+#include <prometheus/collectable.h>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sys_info {
+
+/**
+ * @brief How often SystemSampler samples and over how long its percentiles
+ * are taken
+ */
+struct sampler_options {
+    // In a window, bounds the memory of the ring and the time Collect() holds
+    // it
+    static constexpr size_t max_samples = 100'000;
+
+    double rate = 10;  // Samples per second
+    // Of the percentiles, usually the scrape interval
+    std::chrono::steady_clock::duration window = std::chrono::seconds(15);
+    std::string root;  // As SystemInfoCollector::create()
+};
+
+/**
+ * @brief Samples the CPU and memory use many times per scrape
+ *
+ * Reads /proc/stat and /proc/meminfo at the sampling rate into a ring buffer
+ * of one window. The share of CPU time spent busy and waiting for I/O and the
+ * share of memory used are exported as summaries: their median, 95th
+ * percentile and maximum over the last window, and the count and sum of every
+ * sample. Short bursts that a scrape of cumulative counters averages away
+ * show up in the maximum.
+ *
+ * The thread's own CPU time is exported too. Sampling allocates nothing, and a
+ * sample that takes longer than the period skips the ticks it overran.
+ */
+class SystemSampler: public prometheus::Collectable {
+public:
+    /**
+     * @brief SystemSampler
+     * @throws std::invalid_argument if the rate isn't between 0.1 and 100 or
+     * the window is shorter than a period or holds more than max_samples
+     */
+    explicit SystemSampler(sampler_options const& opts);
+    ~SystemSampler();
+    SystemSampler(SystemSampler const&)            = delete;
+    SystemSampler& operator=(SystemSampler const&) = delete;
+
+    /**
+     * @brief start Samples until stop() is called
+     */
+    void start();
+    void stop() noexcept;
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+}  // namespace sys_info
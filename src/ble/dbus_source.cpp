@@ -0,0 +1,313 @@
+#include "dbus_source.hpp"
+
+#include <spdlog/spdlog.h>
+
+#include <thread>
+
+using namespace ble;
+
+DbusPacketSource::DbusPacketSource(std::function<listener_callback> cb, std::string_view nm)
+    : callback_(std::move(cb)), adapter_name(nm) {
+    if (!callback_) { throw std::logic_error("DbusPacketSource initialized with empty callback"); }
+    create_connection();
+}
+
+DbusPacketSource::~DbusPacketSource() {
+    stop();
+}
+
+void DbusPacketSource::create_connection() {
+    connection                    = sdbus::createConnection();
+    std::string const object_path = "/org/bluez/" + adapter_name;
+
+    manager = sdbus::createProxy(*connection, "org.bluez", object_path);
+
+    objmanager = sdbus::createProxy(*connection, "org.bluez", "/");
+
+    objmanager->uponSignal("InterfacesAdded")
+        .onInterface("org.freedesktop.DBus.ObjectManager")
+        .call([this](
+                  sdbus::ObjectPath const& obj,
+                  std::map<std::string, std::map<std::string, sdbus::Variant>> const& m
+              ) { this->add_cb(obj, m); });
+
+    manager->uponSignal("PropertiesChanged")
+        .onInterface("org.freedesktop.DBus.Properties")
+        .call([this, object_path](
+                  std::string const& interface,
+                  std::map<std::string, sdbus::Variant> const& changed,
+                  std::vector<std::string> const& invalid
+              ) { this->discovery_failed_cb(object_path, interface, changed, invalid); });
+
+    manager->finishRegistration();
+    objmanager->finishRegistration();
+}
+
+void DbusPacketSource::start() {
+    start_discovery();
+    connection->enterEventLoop();
+    if (exited_with_error) throw std::runtime_error("DbusPacketSource exited with error");
+}
+
+void DbusPacketSource::blacklist(mac_address const& mac) {
+    spdlog::debug("Blacklisting {}", format_mac(mac));
+    {
+        std::lock_guard g(blist_mtx);
+        if (!blist.insert(mac)) return;  // Duplicate
+    }
+
+    std::lock_guard g(listeners_mtx);
+    for (auto& [key, val]: listeners) {
+        if (val.mac == mac) {
+            listeners.erase(key);
+            break;
+        }
+    }
+}
+
+std::vector<std::string> DbusPacketSource::get_blacklist() const {
+    std::lock_guard grd(blist_mtx);
+    return blist.formatted();
+}
+
+std::optional<std::string> DbusPacketSource::device_name(mac_address const& mac) const {
+    std::lock_guard g(listeners_mtx);
+    for (auto const& [obj, dev]: listeners) {
+        if (dev.mac == mac) {
+            if (dev.name.empty()) return std::nullopt;
+            return dev.name;
+        }
+    }
+    return std::nullopt;
+}
+
+listener_statistics DbusPacketSource::statistics() const {
+    listener_statistics s;
+    s.adverts    = adverts.load(std::memory_order_relaxed);
+    s.dbus_calls = dbus_calls.load(std::memory_order_relaxed);
+    return s;
+}
+
+void DbusPacketSource::add_cb(
+    sdbus::ObjectPath const& obj,
+    [[maybe_unused]] std::map<std::string, std::map<std::string, sdbus::Variant>> const& interfaces
+) {
+
+    try {
+        {
+            std::lock_guard g(listeners_mtx);
+            if (listeners.find(obj) != listeners.end()) { return; }
+        }
+
+        device dev;
+        dev.proxy = sdbus::createProxy(*connection, "org.bluez", obj);
+
+        // The only full property read for this device, adverts are built from
+        // PropertiesChanged payloads and the values cached here
+        std::map<std::string, sdbus::Variant> properties_;
+        ++dbus_calls;
+        dev.proxy->callMethod("GetAll")
+            .onInterface("org.freedesktop.DBus.Properties")
+            .withArguments("org.bluez.Device1")
+            .storeResultsTo(properties_);
+        auto const& properties = std::as_const(properties_);
+
+        auto end = properties.end();
+        auto mac = properties.find("Address");
+        if (mac == end) {
+            spdlog::warn("Device {} has no address", obj);
+            return;
+        }
+        if (!parse_mac(mac->second.get<std::string>(), dev.mac)) {
+            spdlog::warn("Device {} has an invalid address", obj);
+            return;
+        }
+        {
+            std::lock_guard g(blist_mtx);
+            if (blist.contains(dev.mac)) {
+                // mac blacklisted
+                return;
+            }
+        }
+        auto name = properties.find("Name");
+        if (name != end) { dev.name = name->second.get<std::string>(); }
+        auto rssi = properties.find("RSSI");
+        if (rssi != end) { dev.rssi = rssi->second.get<int16_t>(); }
+
+        spdlog::debug("Added {}", obj);
+
+        AdvPacket packet;
+        packet.mac             = dev.mac;
+        packet.signal_strength = dev.rssi;
+        auto md                = properties.find("ManufacturerData");
+        if (md != end) { read_manufacturer_data(packet, md->second); }
+
+        dev.proxy->uponSignal("PropertiesChanged")
+            .onInterface("org.freedesktop.DBus.Properties")
+            .call([this, obj](
+                      std::string const& interface,
+                      std::map<std::string, sdbus::Variant> const& changed,
+                      std::vector<std::string> const& invalid
+                  ) { this->properties_cb(obj, interface, changed, invalid); });
+
+        dev.proxy->finishRegistration();
+
+        {
+            std::lock_guard g(listeners_mtx);
+            listeners.insert({obj, std::move(dev)});
+        }
+        if (md != end) { emit_packet(packet); }
+    } catch (sdbus::Error const& e) {
+        spdlog::warn("Failed to add device: {} - {}", e.getName(), e.getMessage());
+    }
+}
+
+void DbusPacketSource::rem_cb(
+    sdbus::ObjectPath const& obj, std::vector<std::string> const& interfaces
+) {
+
+    bool found = false;
+    for (auto& i: interfaces) {
+        if (i == "org.bluez.Device1") {
+            found = true;
+            break;
+        }
+    }
+    if (!found) return;
+
+    spdlog::debug("Removed {}", obj);
+    std::lock_guard g(listeners_mtx);
+    auto p = listeners.find(obj);
+    if (p != listeners.end()) { listeners.erase(p); }
+}
+
+void DbusPacketSource::discovery_failed_cb(
+    sdbus::ObjectPath const& /*obj*/, std::string const& interface,
+    std::map<std::string, sdbus::Variant> const& changed,
+    std::vector<std::string> const& /*invalid*/
+) {
+    spdlog::info("Discovery parameters changed");
+
+    if (interface != "org.bluez.Adapter1") return;
+    if (should_discover == false) return;
+
+    auto p = changed.find("Discovering");
+    if (p != changed.end()) {
+        bool new_state = p->second.get<bool>();
+        if (new_state == false) {
+            spdlog::info("Restarting discovery");
+            if (!retry_discovery()) {
+                should_discover   = false;
+                exited_with_error = true;
+                stop();
+            }
+        }
+    }
+}
+
+bool DbusPacketSource::retry_discovery(int times, std::chrono::seconds wait) {
+    for (int i = 0; i < times; ++i) {
+        std::this_thread::sleep_for(wait);
+        try {
+            start_discovery();
+            return true;
+        } catch (sdbus::Error const& e) {
+            spdlog::warn(
+                "Failed to restart discovery, {} remaining: {} - {}", times - i, e.getName(),
+                e.getMessage()
+            );
+        }
+    }
+    return false;
+}
+
+void DbusPacketSource::properties_cb(
+    sdbus::ObjectPath const& obj, std::string const& /*interface*/,
+    std::map<std::string, sdbus::Variant> const& changed,
+    std::vector<std::string> const& /*invalid*/
+) {
+    auto end  = changed.end();
+    auto md   = changed.find("ManufacturerData");
+    auto rssi = changed.find("RSSI");
+    auto name = changed.find("Name");
+    if (md == end && rssi == end && name == end) return;
+
+    AdvPacket packet;
+    {
+        std::lock_guard g(listeners_mtx);
+        auto dev = listeners.find(obj);
+        if (dev == listeners.end()) return;  // Removed or blacklisted
+
+        if (rssi != end) { dev->second.rssi = rssi->second.get<int16_t>(); }
+        if (name != end) { dev->second.name = name->second.get<std::string>(); }
+        if (md == end) return;
+
+        packet.mac             = dev->second.mac;
+        packet.signal_strength = dev->second.rssi;
+    }
+    read_manufacturer_data(packet, md->second);
+
+    // Called without holding listeners_mtx, the callback may blacklist the device
+    emit_packet(packet);
+}
+
+void DbusPacketSource::read_manufacturer_data(AdvPacket& packet, sdbus::Variant const& v) {
+    auto dict = v.get<std::map<uint16_t, sdbus::Variant>>();
+    assert(dict.size() <= 1);
+    if (dict.size() == 1) {
+        for (auto& d: dict) {
+            packet.manufacturer_id = d.first;
+            auto data              = d.second.get<std::vector<uint8_t>>();
+            packet.set_manufacturer_data(data.data(), data.size());
+        }
+    }
+}
+
+void DbusPacketSource::emit_packet(AdvPacket const& packet) {
+    adverts.fetch_add(1, std::memory_order_relaxed);
+    callback_(packet);
+}
+
+void DbusPacketSource::start_discovery() {
+    spdlog::info("Starting bluetooth discovery");
+
+    std::map<std::string, sdbus::Variant> dict;
+    dict["DuplicateData"] = sdbus::Variant(true);
+    dbus_calls += 2;
+    manager->callMethod("SetDiscoveryFilter")
+        .onInterface("org.bluez.Adapter1")
+        .withArguments(dict)
+        .storeResultsTo();
+
+    should_discover = true;
+    manager->callMethod("StartDiscovery").onInterface("org.bluez.Adapter1").storeResultsTo();
+}
+
+void DbusPacketSource::stop_discovery() {
+    spdlog::info("Stopping bluetooth discovery");
+    if (should_discover) {
+        should_discover = false;
+        ++dbus_calls;
+        manager->callMethod("StopDiscovery").onInterface("org.bluez.Adapter1").storeResultsTo();
+    }
+}
+
+void DbusPacketSource::stop() noexcept {
+    try {
+        stop_discovery();
+    } catch (sdbus::Error const& e) {
+        spdlog::warn("Failed to stop discovery: {} - {}", e.getName(), e.getMessage());
+    }
+    connection->leaveEventLoop();
+}
+
+bool DbusPacketSource::is_discovering() const {
+    bool r = false;
+    ++dbus_calls;
+    manager->callMethod("Get")
+        .onInterface("org.freedesktop.DBus.Properties")
+        .withArguments("org.bluez.Adapter1", "Discovering")
+        .storeResultsTo(r);
+
+    return r;
+}
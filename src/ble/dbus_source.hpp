@@ -1,6 +1,7 @@
 #pragma once
 
-#include <ble/receiver.hpp>
+#include <ble/mac_blacklist.hpp>
+#include <ble/packet_source.hpp>
 
 #include <atomic>
 #include <mutex>
@@ -9,20 +10,35 @@
 
 namespace ble {
 
-class BleListener::Impl {
+/**
+ * @brief Receives adverts from bluetoothd over D-Bus
+ */
+class DbusPacketSource: public PacketSource {
 public:
-    Impl(std::function<listener_callback> cb, std::string_view nm);
-    ~Impl();
+    DbusPacketSource(std::function<listener_callback> cb, std::string_view nm);
+    ~DbusPacketSource() override;
 
-    void stop() noexcept;
-    void start();
+    void stop() noexcept override;
+    void start() override;
 
-    void blacklist(std::string const& mac);
-    std::vector<std::string> get_blacklist() const;
+    void blacklist(mac_address const& mac) override;
+    std::vector<std::string> get_blacklist() const override;
 
     bool is_discovering() const;
 
+    listener_statistics statistics() const override;
+    std::optional<std::string> device_name(mac_address const& mac) const override;
+
 private:
+    // Properties cached when a device is added, so that adverts can be built from the
+    // PropertiesChanged payload without calling back into bluetoothd
+    struct device {
+        std::unique_ptr<sdbus::IProxy> proxy;
+        mac_address mac;
+        std::string name;
+        int16_t rssi = 0;
+    };
+
     std::function<listener_callback> callback_;
     std::string adapter_name;
 
@@ -30,17 +46,18 @@ private:
     std::unique_ptr<sdbus::IProxy> manager;
     std::unique_ptr<sdbus::IProxy> objmanager;
 
-    std::map<sdbus::ObjectPath,
-             std::pair<std::unique_ptr<sdbus::IProxy>, std::string>>
-        listeners;
-    std::mutex listeners_mtx;
+    std::map<sdbus::ObjectPath, device> listeners;
+    mutable std::mutex listeners_mtx;
 
-    std::vector<std::string> blist;
+    mac_blacklist blist;
     mutable std::mutex blist_mtx;
 
     std::atomic_bool should_discover   = false;
     std::atomic_bool exited_with_error = false;
 
+    std::atomic_uint64_t adverts            = 0;
+    mutable std::atomic_uint64_t dbus_calls = 0;
+
     void add_cb(
         sdbus::ObjectPath const& obj,
         std::map<std::string, std::map<std::string, sdbus::Variant>> const& m);
@@ -56,7 +73,9 @@ private:
                        std::map<std::string, sdbus::Variant> const& changed,
                        std::vector<std::string> const& invalid);
 
-    void emit_packet(sdbus::ObjectPath const& obj);
+    void emit_packet(AdvPacket const& packet);
+
+    static void read_manufacturer_data(AdvPacket& packet, sdbus::Variant const& v);
 
     void create_connection();
     void start_discovery();
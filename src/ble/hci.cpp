@@ -0,0 +1,91 @@
+#include "hci.hpp"
+
+#include <algorithm>
+
+using namespace ble;
+
+mac_address hci::read_address(uint8_t const* addr) {
+    mac_address mac;
+    for (size_t i = 0; i < mac.size(); ++i) mac[i] = addr[mac.size() - 1 - i];
+    return mac;
+}
+
+bool hci::parse_advertising_data(
+    uint8_t const* data, size_t size, AdvPacket& p, std::string_view& name
+) {
+    size_t i = 0;
+    while (i < size) {
+        size_t len = data[i];
+        if (len == 0) break;  // Early termination, rest is padding
+        if (i + 1 + len > size) return false;
+
+        uint8_t type          = data[i + 1];
+        uint8_t const* field  = data + i + 2;
+        size_t const field_sz = len - 1;
+
+        if (type == ad_manufacturer && field_sz >= 2) {
+            p.manufacturer_id = static_cast<uint16_t>(field[0] | (field[1] << 8));
+            p.set_manufacturer_data(field + 2, field_sz - 2);
+        } else if (type == ad_complete_name || (type == ad_short_name && name.empty())) {
+            name = std::string_view(reinterpret_cast<char const*>(field), field_sz);
+        }
+        i += 1 + len;
+    }
+    return true;
+}
+
+int hci::parse_event(
+    uint8_t const* data, size_t size, std::function<report_callback> const& cb
+) {
+    // packet type, event code, parameter length
+    if (size < 3) return malformed_event;
+    if (data[0] != event_packet || data[1] != le_meta_event) return 0;
+
+    size_t const end = 3 + size_t(data[2]);
+    if (end > size || end < 5) return malformed_event;
+    if (data[3] != le_advertising_report) return 0;
+
+    int const reports = data[4];
+    size_t i          = 5;
+    AdvPacket p;
+    for (int r = 0; r < reports; ++r) {
+        // event type, address type, address, data length
+        if (i + 9 > end) return malformed_event;
+        uint8_t const* addr = data + i + 2;
+        size_t const len    = data[i + 8];
+        i                   += 9;
+        // advertising data, rssi
+        if (i + len + 1 > end) return malformed_event;
+
+        std::string_view name;
+        p.mac             = read_address(addr);
+        p.manufacturer_id = 0;
+        p.data_size       = 0;
+        p.signal_strength = static_cast<int8_t>(data[i + len]);
+        if (!parse_advertising_data(data + i, len, p, name)) return malformed_event;
+        i += len + 1;
+
+        cb(p, name);
+    }
+    return reports;
+}
+
+int hci::command_result(uint8_t const* data, size_t size, uint16_t opcode) {
+    if (size < 3 || data[0] != event_packet) return size < 3 ? malformed_event : other_event;
+    // Command Complete: packets allowed, opcode, status as the first return parameter.
+    // Command Status: status, packets allowed, opcode.
+    size_t opcode_at, status_at;
+    if (data[1] == command_complete) {
+        opcode_at = 4;
+        status_at = 6;
+    } else if (data[1] == command_status) {
+        opcode_at = 5;
+        status_at = 3;
+    } else {
+        return other_event;
+    }
+    size_t const end = 3 + size_t(data[2]);
+    if (end > size || std::max(opcode_at + 2, status_at + 1) > end) return malformed_event;
+    if ((data[opcode_at] | (data[opcode_at + 1] << 8)) != opcode) return other_event;
+    return data[status_at];
+}
@@ -0,0 +1,250 @@
+#include "hci_source.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using namespace ble;
+
+namespace {
+
+// From <bluetooth/hci.h>, not included to avoid depending on libbluetooth headers
+constexpr int btproto_hci                     = 1;
+constexpr int sol_hci                         = 0;
+constexpr int hci_filter_opt                  = 2;
+constexpr uint16_t channel_raw                = 0;
+constexpr uint16_t ogf_le                     = 0x08;
+constexpr uint16_t ocf_le_set_scan_parameters = 0x000B;
+constexpr uint16_t ocf_le_set_scan_enable     = 0x000C;
+constexpr uint8_t command_disallowed          = 0x0C;  // E.g. disabling a scan that isn't running
+constexpr int command_timeout_ms              = 2000;
+
+struct sockaddr_hci {
+    sa_family_t hci_family;
+    unsigned short hci_dev;
+    unsigned short hci_channel;
+};
+
+struct hci_filter {
+    uint32_t type_mask;
+    uint32_t event_mask[2];
+    uint16_t opcode;
+};
+
+std::runtime_error errno_error(std::string const& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+int parse_device_id(std::string_view nm) {
+    constexpr std::string_view prefix = "hci";
+    if (nm.substr(0, prefix.size()) != prefix || nm.size() == prefix.size())
+        throw std::invalid_argument("Invalid HCI device name " + std::string(nm));
+    int id = 0;
+    for (char c: nm.substr(prefix.size())) {
+        if (c < '0' || c > '9')
+            throw std::invalid_argument("Invalid HCI device name " + std::string(nm));
+        id = id * 10 + (c - '0');
+    }
+    return id;
+}
+
+}  // namespace
+
+void unique_fd::reset(int fd) noexcept {
+    if (fd_ >= 0) close(fd_);
+    fd_ = fd;
+}
+
+HciPacketSource::HciPacketSource(std::function<listener_callback> cb, std::string_view nm)
+    : callback_(std::move(cb)), device_id(parse_device_id(nm)) {
+    if (!callback_) { throw std::logic_error("HciPacketSource initialized with empty callback"); }
+    filter_ = [this](AdvPacket const& p, std::string_view name) {
+        if (is_blacklisted(p.mac)) return;
+        if (!name.empty()) update_name(p.mac, name);
+        adverts.fetch_add(1, std::memory_order_relaxed);
+        callback_(p);
+    };
+    open_socket();
+}
+
+HciPacketSource::~HciPacketSource() {
+    stop();
+}
+
+void HciPacketSource::open_socket() {
+    sock.reset(socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, btproto_hci));
+    if (!sock) throw errno_error("Failed to open HCI socket");
+
+    wakeup.reset(eventfd(0, EFD_CLOEXEC));
+    if (!wakeup) throw errno_error("Failed to create eventfd");
+
+    // Adverts, and the answers to the scan commands
+    hci_filter flt{};
+    flt.type_mask = 1u << hci::event_packet;
+    for (uint8_t event: {hci::le_meta_event, hci::command_complete, hci::command_status})
+        flt.event_mask[event >> 5] |= 1u << (event & 31);
+    if (setsockopt(sock.get(), sol_hci, hci_filter_opt, &flt, sizeof(flt)) < 0)
+        throw errno_error("Failed to set HCI filter");
+
+    sockaddr_hci addr{};
+    addr.hci_family  = AF_BLUETOOTH;
+    addr.hci_dev     = static_cast<unsigned short>(device_id);
+    addr.hci_channel = channel_raw;
+    if (bind(sock.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        throw errno_error("Failed to bind HCI socket to hci" + std::to_string(device_id));
+}
+
+// Returns the status the controller answered with. Adverts read meanwhile are dropped.
+uint8_t HciPacketSource::send_command(uint16_t ocf, uint8_t const* params, uint8_t size) {
+    std::array<uint8_t, 4 + 255> buf{};
+    uint16_t opcode = static_cast<uint16_t>((ogf_le << 10) | ocf);
+    buf[0]          = hci::command_packet;
+    buf[1]          = opcode & 0xFF;
+    buf[2]          = opcode >> 8;
+    buf[3]          = size;
+    std::copy(params, params + size, buf.begin() + 4);
+    if (write(sock.get(), buf.data(), 4 + size) < 0)
+        throw errno_error("Failed to send HCI command");
+
+    auto const deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(command_timeout_ms);
+    while (true) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        pollfd p{sock.get(), POLLIN, 0};
+        int n = left.count() > 0 ? poll(&p, 1, int(left.count())) : 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw errno_error("HCI poll failed");
+        }
+        if (n == 0)
+            throw std::runtime_error("No answer to HCI command " + std::to_string(opcode));
+        ssize_t len = read(sock.get(), buf.data(), buf.size());
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw errno_error("HCI read failed");
+        }
+        int status = hci::command_result(buf.data(), size_t(len), opcode);
+        if (status >= 0) return uint8_t(status);
+    }
+}
+
+void HciPacketSource::set_scan(bool enable) {
+    auto check = [](std::string const& what, uint8_t status) {
+        if (status != 0)
+            throw std::runtime_error(what + " failed with HCI status " + std::to_string(status));
+    };
+    const uint8_t disable[] = {0x00, 0x00};
+    if (!enable) {
+        // Disallowed when no scan is running
+        auto status = send_command(ocf_le_set_scan_enable, disable, sizeof(disable));
+        if (status != command_disallowed) check("Disabling the LE scan", status);
+        return;
+    }
+    // The parameters can't be changed while a scan started by e.g. bluetoothd is running
+    send_command(ocf_le_set_scan_enable, disable, sizeof(disable));
+    // Passive scan, 10 ms interval and window, public address, accept all
+    const uint8_t params[] = {0x00, 0x10, 0x00, 0x10, 0x00, 0x00, 0x00};
+    check("Setting the LE scan parameters",
+          send_command(ocf_le_set_scan_parameters, params, sizeof(params)));
+    // Duplicate filtering disabled, every advert is reported
+    const uint8_t enable_params[] = {0x01, 0x00};
+    check("Enabling the LE scan",
+          send_command(ocf_le_set_scan_enable, enable_params, sizeof(enable_params)));
+}
+
+void HciPacketSource::start() {
+    spdlog::info("Starting HCI scan on hci{}", device_id);
+    set_scan(true);
+    try {
+        receive();
+    } catch (...) {
+        stop_scan();
+        throw;
+    }
+    stop_scan();
+}
+
+void HciPacketSource::receive() {
+    std::array<uint8_t, 3 + 255> buf;
+    pollfd fds[2] = {
+        {sock.get(),   POLLIN, 0},
+        {wakeup.get(), POLLIN, 0},
+    };
+    while (true) {
+        int n = poll(fds, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw errno_error("HCI poll failed");
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents & (POLLERR | POLLHUP)) throw std::runtime_error("HCI socket closed");
+
+        ssize_t len = read(sock.get(), buf.data(), buf.size());
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            throw errno_error("HCI read failed");
+        }
+        if (hci::parse_event(buf.data(), size_t(len), filter_) == hci::malformed_event)
+            spdlog::debug("Malformed HCI event of {} bytes", len);
+    }
+}
+
+void HciPacketSource::stop_scan() noexcept {
+    spdlog::info("Stopping HCI scan");
+    try {
+        set_scan(false);
+    } catch (std::exception const& e) { spdlog::warn("Failed to stop HCI scan: {}", e.what()); }
+}
+
+void HciPacketSource::stop() noexcept {
+    // The eventfd stays readable, so a stop() before start() is not lost
+    uint64_t one = 1;
+    if (wakeup && write(wakeup.get(), &one, sizeof(one)) < 0)
+        spdlog::warn("Failed to wake up HCI listener: {}", std::strerror(errno));
+}
+
+void HciPacketSource::blacklist(mac_address const& mac) {
+    spdlog::debug("Blacklisting {}", format_mac(mac));
+    std::lock_guard g(blist_mtx);
+    blist.insert(mac);
+}
+
+std::vector<std::string> HciPacketSource::get_blacklist() const {
+    std::lock_guard g(blist_mtx);
+    return blist.formatted();
+}
+
+bool HciPacketSource::is_blacklisted(mac_address const& mac) const {
+    std::lock_guard g(blist_mtx);
+    return blist.contains(mac);
+}
+
+void HciPacketSource::update_name(mac_address const& mac, std::string_view name) {
+    std::lock_guard g(names_mtx);
+    auto& n = names[mac];
+    if (n != name) n = name;  // Only allocates when the name changes
+}
+
+std::optional<std::string> HciPacketSource::device_name(mac_address const& mac) const {
+    std::lock_guard g(names_mtx);
+    auto it = names.find(mac);
+    if (it == names.end()) return std::nullopt;
+    return it->second;
+}
+
+listener_statistics HciPacketSource::statistics() const {
+    listener_statistics s;
+    s.adverts = adverts.load(std::memory_order_relaxed);
+    return s;
+}
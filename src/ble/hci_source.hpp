@@ -0,0 +1,79 @@
+#pragma once
+
+#include <ble/hci.hpp>
+#include <ble/mac_blacklist.hpp>
+#include <ble/packet_source.hpp>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+namespace ble {
+
+/**
+ * @brief Owns a file descriptor and closes it
+ */
+class unique_fd {
+public:
+    unique_fd() = default;
+    explicit unique_fd(int fd) noexcept: fd_(fd) {}
+    ~unique_fd() { reset(); }
+    unique_fd(unique_fd const&)            = delete;
+    unique_fd& operator=(unique_fd const&) = delete;
+
+    int get() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+    void reset(int fd = -1) noexcept;
+
+private:
+    int fd_ = -1;
+};
+
+/**
+ * @brief Receives adverts from a raw HCI socket, bypassing bluetoothd
+ *
+ * Enables passive LE scanning on the adapter and parses LE Advertising Report events
+ * directly. Requires CAP_NET_RAW.
+ */
+class HciPacketSource: public PacketSource {
+public:
+    HciPacketSource(std::function<listener_callback> cb, std::string_view nm);
+    ~HciPacketSource() override;
+
+    void start() override;
+    void stop() noexcept override;
+
+    void blacklist(mac_address const& mac) override;
+    std::vector<std::string> get_blacklist() const override;
+
+    listener_statistics statistics() const override;
+    std::optional<std::string> device_name(mac_address const& mac) const override;
+
+private:
+    std::function<listener_callback> callback_;
+    std::function<hci::report_callback> filter_;
+    int device_id;
+
+    // Also closed when open_socket() throws in the constructor
+    unique_fd sock;
+    unique_fd wakeup;  // eventfd used by stop() to interrupt poll()
+
+    mac_blacklist blist;
+    mutable std::mutex blist_mtx;
+
+    // Names are only sent in some adverts, the last one seen is kept per device
+    std::map<mac_address, std::string> names;
+    mutable std::mutex names_mtx;
+
+    std::atomic_uint64_t adverts = 0;
+
+    void open_socket();
+    uint8_t send_command(uint16_t ocf, uint8_t const* params, uint8_t size);
+    void set_scan(bool enable);
+    void stop_scan() noexcept;
+    void receive();
+    bool is_blacklisted(mac_address const& mac) const;
+    void update_name(mac_address const& mac, std::string_view name);
+};
+
+}  // namespace ble
@@ -1,33 +1,229 @@
-#include <prometheus/counter.h>
-#include <prometheus/exposer.h>
-#include <prometheus/registry.h>
+#include <prometheus/collectable.h>
+#include <prometheus/metric_family.h>
+#include <prometheus/text_serializer.h>
+#include <ble/receiver.hpp>
+#include <ble/spsc_queue.hpp>
+#include <ruuvi/duplicate_filter.hpp>
+#include <ruuvi/gzip.hpp>
+#include <ruuvi/history.hpp>
+#include <ruuvi/http_server.hpp>
+#include <ruuvi/openmetrics.hpp>
+#include <ruuvi/remote_write.hpp>
 #include <ruuvi/ruuvi.hpp>
 #include <ruuvi/ruuvi_prometheus_exposer.hpp>
+#include <ruuvi/spool.hpp>
+#include <sysinfo/cache_exposer.hpp>
 #include <sysinfo/diskstat_exposer.hpp>
 #include <sysinfo/system_info_exposer.hpp>
+#include <sysinfo/system_sampler.hpp>
 
+#include <array>
 #include <cassert>
 #include <iostream>
 
+#include <condition_variable>
 #include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
 #include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <thread>
 
+#include <time.h>
+
 #include <args.hxx>
 #include <spdlog/sinks/systemd_sink.h>
 #include <spdlog/spdlog.h>
 
+using packet_queue = ble::spsc_queue<ble::AdvPacket>;
+
+/**
+ * @brief Exposes the size of the /metrics responses before and after compression, and the CPU
+ * time spent compressing them, so that the bandwidth saved can be weighed against the CPU
+ */
+class ScrapeStatistics: public prometheus::Collectable {
+public:
+    enum encoding { identity, gzip };
+
+    void count(encoding e, size_t raw, size_t sent, std::chrono::nanoseconds cpu) noexcept {
+        scrapes[e].fetch_add(1, std::memory_order_relaxed);
+        raw_bytes[e].fetch_add(raw, std::memory_order_relaxed);
+        sent_bytes[e].fetch_add(sent, std::memory_order_relaxed);
+        compression_ns.fetch_add(uint64_t(cpu.count()), std::memory_order_relaxed);
+    }
+
+    std::vector<prometheus::MetricFamily> Collect() const override {
+        static constexpr char const* encodings[] = {"identity", "gzip"};
+        std::vector<prometheus::MetricFamily> families;
+        auto add = [&families](
+                       std::string name, std::string help,
+                       std::array<std::atomic<uint64_t>, 2> const& values
+                   ) {
+            auto& f = families.emplace_back();
+            f.name  = std::move(name);
+            f.help  = std::move(help);
+            f.type  = prometheus::MetricType::Counter;
+            for (size_t e = 0; e < values.size(); ++e) {
+                auto& m         = f.metric.emplace_back();
+                m.label         = {{"encoding", encodings[e]}};
+                m.counter.value = double(values[e].load(std::memory_order_relaxed));
+            }
+        };
+        add("ruuvi_scrapes_total", "Number of /metrics responses by content encoding", scrapes);
+        add("ruuvi_scrape_raw_bytes_total", "Size of the /metrics responses before compression",
+            raw_bytes);
+        add("ruuvi_scrape_sent_bytes_total", "Size of the /metrics responses as sent", sent_bytes);
+        auto& f = families.emplace_back();
+        f.name  = "ruuvi_scrape_compression_seconds_total";
+        f.help  = "CPU time spent compressing /metrics responses";
+        f.type  = prometheus::MetricType::Counter;
+        f.metric.emplace_back().counter.value =
+            double(compression_ns.load(std::memory_order_relaxed)) / 1e9;
+        return families;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, 2> scrapes{};
+    std::array<std::atomic<uint64_t>, 2> raw_bytes{};
+    std::array<std::atomic<uint64_t>, 2> sent_bytes{};
+    std::atomic<uint64_t> compression_ns = 0;
+};
+
+/**
+ * @brief Exposes the counters kept by BleListener, the state of the packet queue and the number
+ * of repeated adverts dropped before decoding
+ */
+class ListenerStatistics: public prometheus::Collectable {
+public:
+    ListenerStatistics(ble::BleListener const& l, packet_queue const& q,
+                       ruuvi::duplicate_filter const& d)
+        : listener(l), queue(q), duplicates(d) {}
+
+    std::vector<prometheus::MetricFamily> Collect() const override {
+        auto stats = listener.statistics();
+
+        std::vector<prometheus::MetricFamily> families;
+        auto add = [&families](
+                       std::string name, std::string help, prometheus::MetricType type, double value
+                   ) {
+            auto& f = families.emplace_back();
+            f.name  = std::move(name);
+            f.help  = std::move(help);
+            f.type  = type;
+            auto& m = f.metric.emplace_back();
+            if (type == prometheus::MetricType::Counter)
+                m.counter.value = value;
+            else
+                m.gauge.value = value;
+        };
+        add("ruuvi_ble_adverts_total", "Number of adverts received from the bluetooth adapter",
+            prometheus::MetricType::Counter, stats.adverts);
+        add("ruuvi_ble_dbus_calls_total", "Number of blocking D-Bus calls made by the listener",
+            prometheus::MetricType::Counter, stats.dbus_calls);
+        add("ruuvi_ble_queue_depth", "Number of adverts waiting to be decoded",
+            prometheus::MetricType::Gauge, queue.size());
+        add("ruuvi_ble_queue_capacity", "Maximum number of adverts waiting to be decoded",
+            prometheus::MetricType::Gauge, queue.capacity());
+        add("ruuvi_ble_queue_dropped_total", "Number of adverts dropped due to a full queue",
+            prometheus::MetricType::Counter, queue.dropped());
+        add("ruuvi_duplicate_adverts_total",
+            "Number of repeated adverts of an already received measurement, not decoded",
+            prometheus::MetricType::Counter, duplicates.suppressed());
+        return families;
+    }
+
+private:
+    ble::BleListener const& listener;
+    packet_queue const& queue;
+    ruuvi::duplicate_filter const& duplicates;
+};
+
+struct RuuvitagOptions {
+    uint16_t port;
+    std::string interface;
+    ble::backend backend;
+    size_t queue_size;
+    ble::overflow_policy overflow;
+    bool keep_duplicates;
+    ruuvi::decode_mode decode;
+    ruuvi::tag_limits limits;
+    ruuvi::sample_time sample_time;
+    ruuvi::aggregation windows;
+    ruuvi::remote_write_options push;  // No pushing without a URL
+    bool push_all;                     // Also push the system and listener metrics
+    ruuvi::spool_options spool;        // No spooling without a directory
+    ruuvi::history_options history;    // No history without a retention
+    int gzip_level;                    // 0 never compresses the scrapes
+    std::string sysinfo_root;          // Prefix of /proc and /sys, the host's when empty
+    sys_info::refresh_intervals sysinfo_refresh;
+    sys_info::sampler_options sampling;  // No sampler without a rate
+};
+
+/**
+ * @brief Receives adverts on the listener thread and decodes them on a worker thread
+ *
+ * Packets are handed over through a lock-free queue, so a slow scrape holding the exposer
+ * can't stall bluetooth reception.
+ */
 class Ruuvitag {
 public:
-    Ruuvitag(int port, std::string_view name)
-        : listener(std::bind(&Ruuvitag::ble_callback, this, std::placeholders::_1), name),
-          exposer("[::]:" + std::to_string(port) + "," + std::to_string(port)),
-          rvexposer(std::make_shared<ruuvi::RuuviExposer>()),
-          sysinfo(sys_info::SystemInfoCollector::create()),
-          diskstat(std::make_shared<sys_info::DiskstatExposer>()) {
-        exposer.RegisterCollectable(rvexposer);
-        exposer.RegisterCollectable(sysinfo);
-        exposer.RegisterCollectable(diskstat);
+    explicit Ruuvitag(RuuvitagOptions const& opts)
+        : listener(
+              std::bind(&Ruuvitag::ble_callback, this, std::placeholders::_1), opts.interface,
+              opts.backend
+          ),
+          queue(opts.queue_size, opts.overflow),
+          duplicates(
+              opts.limits.max_tags > 0 ? opts.limits.max_tags
+                                       : ruuvi::duplicate_filter::default_max_tags
+          ),
+          keep_duplicates(opts.keep_duplicates),
+          blestats(std::make_shared<ListenerStatistics>(listener, queue, duplicates)),
+          server(opts.port),
+          rvexposer(
+              std::make_shared<ruuvi::RuuviExposer>(
+                  opts.decode, opts.limits, opts.sample_time, opts.windows
+              )
+          ),
+          tag_ttl(opts.limits.ttl),
+          decode_on_scrape(opts.decode == ruuvi::decode_mode::on_collect),
+          sysinfo(sys_info::SystemInfoCollector::create(opts.sysinfo_root, opts.sysinfo_refresh)),
+          diskstat(std::make_shared<sys_info::DiskstatExposer>(
+              opts.sysinfo_root, opts.sysinfo_refresh.diskstats
+          )),
+          caches(std::make_shared<sys_info::CacheExposer>(sysinfo, diskstat)),
+          scrapestats(std::make_shared<ScrapeStatistics>()),
+          collectables{sysinfo, diskstat, caches, blestats, scrapestats} {
+        if (opts.gzip_level > 0) gzip = std::make_unique<ruuvi::gzip_compressor>(opts.gzip_level);
+        if (!opts.spool.directory.empty()) {
+            readings = std::make_shared<ruuvi::spool>(opts.spool);
+            collectables.push_back(readings);
+        }
+        if (opts.sampling.rate > 0) {
+            sampler = std::make_shared<sys_info::SystemSampler>(opts.sampling);
+            collectables.push_back(sampler);
+        }
+        if (opts.history.retention.count() > 0) {
+            history = std::make_shared<ruuvi::history>(opts.history);
+            collectables.push_back(history);
+            server.handle("/history",
+                          [this](ruuvi::http_request const& q, ruuvi::http_response& r) {
+                              history->serve(q, r);
+                          });
+        }
+        if (!opts.push.url.empty()) {
+            ruuvi::remote_writer::sources pushed{rvexposer};
+            if (opts.push_all)
+                pushed.insert(pushed.end(), collectables.begin(), collectables.end());
+            pusher = std::make_shared<ruuvi::remote_writer>(opts.push, std::move(pushed), readings);
+            collectables.push_back(pusher);
+        }
+        server.handle("/metrics", [this](ruuvi::http_request const& q, ruuvi::http_response& r) {
+            scrape(q, r);
+        });
         spdlog::debug("Collectables registered");
     }
     Ruuvitag(Ruuvitag const&)            = delete;
@@ -35,24 +231,44 @@ public:
 
     void start() {
         spdlog::info("Starting ble listener");
-        listener.start();
+        stopping = false;
+        std::thread worker(&Ruuvitag::work, this);
+        std::thread http(&Ruuvitag::serve, this);
+        std::thread push;
+        if (pusher) push = std::thread(&Ruuvitag::push, this);
+        std::thread sample;
+        if (sampler) sample = std::thread(&sys_info::SystemSampler::start, sampler.get());
+        try {
+            listener.start();
+        } catch (...) {
+            stop_threads(worker, http, push, sample);
+            throw;
+        }
+        stop_threads(worker, http, push, sample);
+        // The server and pusher only stop the listener, their errors are reported once every
+        // thread is joined
+        if (server_error) std::rethrow_exception(server_error);
+        if (push_error) std::rethrow_exception(push_error);
     }
     void stop() {
         spdlog::info("Stopping ble listener");
         listener.stop();
     }
 
-    void ble_callback(ble::BlePacket const& p) {
+    // Called on the listener thread, only hands the packet over to the worker
+    void ble_callback(ble::AdvPacket const& p) {
         // log(p);
-        if (p.manufacturer_id == 0x0499) {
-            auto data = ruuvi::convert_data_format_5(p);
-            //            log(data);
-            rvexposer->update(data);
-            if (data.contains_errors) {
-                spdlog::info("Ruuvitag message errors from ", data.mac, ": ", data.error_msg);
-            }
-        } else {
+        if (p.manufacturer_id != 0x0499) {
             listener.blacklist(p.mac);
+            return;
+        }
+        queue.push(p);
+
+        // Pairs with the fence in work(), either the worker sees the packet or we see it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (worker_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard g(worker_mtx);
+            worker_cv.notify_one();
         }
     }
 
@@ -61,16 +277,205 @@ public:
             spdlog::info("\nBlacklisted macs: ");
             for (auto const& mac: listener.get_blacklist()) { spdlog::info(mac); }
 
+            auto stats = listener.statistics();
+            spdlog::info(
+                "Adverts received: {}, D-Bus calls: {}", stats.adverts, stats.dbus_calls
+            );
+            spdlog::info("Queued adverts: {}, dropped: {}", queue.size(), queue.dropped());
+            spdlog::info("Tags: {}, repeated adverts: {}", duplicates.tag_count(),
+                         duplicates.suppressed());
+
             spdlog::info("");
         } catch (...) {}
     }
 
 private:
     ble::BleListener listener;
-    prometheus::Exposer exposer;
+    packet_queue queue;
+    ruuvi::duplicate_filter duplicates;  // Only touched by the worker, except for the counters
+    bool keep_duplicates;
+    std::shared_ptr<ListenerStatistics> blestats;
+    ruuvi::http_server server;
     std::shared_ptr<ruuvi::RuuviExposer> rvexposer;
+    std::chrono::steady_clock::duration tag_ttl;
+    std::chrono::steady_clock::time_point next_sweep;  // Only touched by the worker
+    bool decode_on_scrape;
     std::shared_ptr<sys_info::SystemInfoCollector> sysinfo;
     std::shared_ptr<sys_info::DiskstatExposer> diskstat;
+    std::shared_ptr<sys_info::CacheExposer> caches;
+    std::shared_ptr<ScrapeStatistics> scrapestats;
+    std::shared_ptr<sys_info::SystemSampler> sampler;  // Only with a sampling rate
+    // Serialized after the tags by the scrapes, and with --push-all also collected by the push
+    // thread, so each one relies on its own synchronisation
+    std::vector<std::shared_ptr<prometheus::Collectable>> collectables;
+    std::shared_ptr<ruuvi::spool> readings;        // Only with a spool directory
+    std::shared_ptr<ruuvi::history> history;       // Only with a retention
+    std::shared_ptr<ruuvi::remote_writer> pusher;  // Only with a remote write URL
+    // Reused by the scrapes, which the server workers take turns at
+    std::mutex scrape_mtx;
+    std::vector<prometheus::MetricFamily> families;
+    std::unique_ptr<ruuvi::gzip_compressor> gzip;  // Only with a compression level
+    std::string uncompressed;                      // Reused by compressed scrapes
+
+    std::mutex worker_mtx;
+    std::condition_variable worker_cv;
+    std::atomic_bool worker_waiting = false;
+    std::atomic_bool stopping       = false;
+    ruuvi::format_5_reading reading;  // Only touched by the worker
+    std::exception_ptr server_error;  // Set by the server thread before it stops the listener
+    std::exception_ptr push_error;    // Set by the push thread before it stops the listener
+
+    void handle_packet(ble::AdvPacket const& p) {
+        // Tags repeat each measurement several times, only the first advert is decoded
+        if (!keep_duplicates && !duplicates.admit(p)) {
+            rvexposer->update_signal(p.mac, p.signal_strength);
+            return;
+        }
+        auto const now_ms = wall_clock_ms();
+        if (readings) readings->append(p, now_ms);
+        if (decode_on_scrape) {
+            // Only the latest payload is kept, errors are not logged
+            rvexposer->update(p);
+            return;
+        }
+        ruuvi::decode_format_5(p, reading);
+        rvexposer->update(reading);
+        if (history) history->add(reading, now_ms);
+        // Error messages are only rendered when they would be logged
+        if (!reading.valid() && spdlog::should_log(spdlog::level::info)) {
+            spdlog::info("Ruuvitag message errors from {}: {}", ble::format_mac(p.mac),
+                         ruuvi::describe_errors(reading));
+        }
+    }
+
+    /*
+     * Removes the tags that have gone silent, closes ended windows, commits the spool and drops
+     * the history past its retention, at most once a second
+     */
+    void sweep() {
+        auto now = std::chrono::steady_clock::now();
+        if (now < next_sweep) return;
+        next_sweep = now + std::chrono::seconds(1);
+        rvexposer->expire(now);
+        if (readings) readings->commit(now);
+        if (history) history->expire(wall_clock_ms());
+        if (tag_ttl.count() > 0) duplicates.expire(now - tag_ttl);
+    }
+
+    static int64_t wall_clock_ms() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    }
+
+    void work() {
+        ble::AdvPacket p;
+        size_t handled = 0;
+        while (true) {
+            if (queue.pop(p)) {
+                handle_packet(p);
+                if (++handled % 256 == 0) sweep();
+                continue;
+            }
+            if (stopping) break;
+            sweep();
+
+            worker_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            {
+                std::unique_lock lk(worker_mtx);
+                // The timeout only guards against a missed notification
+                worker_cv.wait_for(lk, std::chrono::milliseconds(100), [this] {
+                    return stopping || !queue.empty();
+                });
+            }
+            worker_waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    static std::chrono::nanoseconds thread_cpu_time() noexcept {
+        timespec ts{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+    }
+
+    /*
+     * In the Prometheus text format the tags are rendered from their cached text and the other
+     * collectors are serialized. OpenMetrics, when the scraper prefers it, serializes the tags
+     * too. Compressed with gzip when the scraper accepts it.
+     */
+    void scrape(ruuvi::http_request const& q, ruuvi::http_response& r) {
+        std::lock_guard g(scrape_mtx);
+        auto openmetrics = ruuvi::prefers_openmetrics(q.header("accept"));
+        auto compress    = gzip && ruuvi::accept_quality(q.header("accept-encoding"), "gzip") > 0;
+        auto& text       = compress ? uncompressed : r.body;
+        text.clear();
+        families.clear();
+        if (openmetrics) {
+            r.content_type = ruuvi::openmetrics_content_type;
+            families       = rvexposer->Collect();
+        } else {
+            r.content_type = "text/plain; version=0.0.4; charset=utf-8";
+            rvexposer->render(text);
+        }
+        for (auto const& c: collectables) {
+            auto f = c->Collect();
+            std::move(f.begin(), f.end(), std::back_inserter(families));
+        }
+        if (openmetrics) {
+            ruuvi::serialize_openmetrics(families, text);
+            text.append("# EOF\n");
+        } else {
+            text.append(prometheus::TextSerializer().Serialize(families));
+        }
+        r.headers.emplace_back("Vary", "Accept, Accept-Encoding");
+
+        if (!compress) {
+            scrapestats->count(ScrapeStatistics::identity, text.size(), text.size(), {});
+            return;
+        }
+        auto start = thread_cpu_time();
+        gzip->compress(text, r.body);
+        scrapestats->count(
+            ScrapeStatistics::gzip, text.size(), r.body.size(), thread_cpu_time() - start
+        );
+        r.headers.emplace_back("Content-Encoding", "gzip");
+    }
+
+    void serve() {
+        try {
+            server.start();
+        } catch (std::exception const& e) {
+            spdlog::error("Metrics server stopped: {}", e.what());
+            server_error = std::current_exception();
+            listener.stop();
+        }
+    }
+
+    void push() {
+        try {
+            pusher->start();
+        } catch (std::exception const& e) {
+            spdlog::error("Remote write stopped: {}", e.what());
+            push_error = std::current_exception();
+            listener.stop();
+        }
+    }
+
+    void stop_threads(std::thread& worker, std::thread& http, std::thread& push,
+                      std::thread& sample) {
+        {
+            std::lock_guard g(worker_mtx);
+            stopping = true;
+        }
+        worker_cv.notify_one();
+        worker.join();
+        server.stop();
+        http.join();
+        if (pusher) pusher->stop();
+        if (push.joinable()) push.join();
+        if (sampler) sampler->stop();
+        if (sample.joinable()) sample.join();
+    }
 };
 
 namespace {
@@ -112,6 +517,145 @@ int main(int argc, char** argv) {
     args::Flag debug(p, "debug", "Enable debug logs", {"debug"});
     args::Flag trace(p, "trace", "Enable trace logs", {"trace"});
     args::ValueFlag<std::string> interface(p, "interface", "Bluetooth interface to listen on (hci0)", {"interface", 'i'}, "hci0");
+    args::MapFlag<std::string, ble::backend> backend(
+        p, "backend",
+        "Where adverts are received from: dbus (bluetoothd, default) or hci (raw HCI socket, "
+        "requires CAP_NET_RAW)",
+        {"backend"}, {{"dbus", ble::backend::dbus}, {"hci", ble::backend::hci}},
+        ble::backend::dbus
+    );
+    args::ValueFlag<size_t> queue_size(
+        p, "queue-size", "Number of adverts buffered between the listener and decoder (1024)",
+        {"queue-size"}, 1024
+    );
+    args::MapFlag<std::string, ble::overflow_policy> overflow(
+        p, "overflow",
+        "Which advert to drop when the decoder falls behind: drop-oldest (default) or "
+        "drop-newest",
+        {"overflow"},
+        {{"drop-oldest", ble::overflow_policy::drop_oldest},
+         {"drop-newest", ble::overflow_policy::drop_newest}},
+        ble::overflow_policy::drop_oldest
+    );
+    args::Flag keep_duplicates(
+        p, "keep-duplicates",
+        "Decode every advert, including repeats of a measurement that was already received",
+        {"keep-duplicates"}
+    );
+    args::Flag decode_on_scrape(
+        p, "decode-on-scrape",
+        "Keep only the latest advert of each tag and decode it when metrics are scraped, "
+        "saves CPU when tags advertise more often than they are scraped",
+        {"decode-on-scrape"}
+    );
+    args::ValueFlag<unsigned> tag_ttl(
+        p, "seconds",
+        "Remove the metrics of tags that haven't been heard from in this many seconds "
+        "(default 0, never)",
+        {"tag-ttl"}, 0
+    );
+    args::ValueFlag<size_t> max_tags(
+        p, "max-tags",
+        "Number of tags to export metrics for, the least recently heard from makes room for a "
+        "new one (default 0, up to 65536)",
+        {"max-tags"}, 0
+    );
+    args::Flag sample_timestamps(
+        p, "sample-timestamps",
+        "Export the samples of each tag with the time they were received, instead of letting "
+        "the scraper stamp them with the scrape time",
+        {"sample-timestamps"}
+    );
+    args::ValueFlag<unsigned> window(
+        p, "seconds",
+        "Also export the minimum, maximum, sum and count of each measurement over windows of "
+        "this many seconds, catching changes between scrapes (default 0, none)",
+        {"window"}, 0
+    );
+    args::Flag window_last(
+        p, "window-last", "Also export the last measurement of each window", {"window-last"}
+    );
+    args::ValueFlag<std::string> push_url(
+        p, "url",
+        "Push the tag metrics to this Prometheus remote write endpoint, for example "
+        "http://victoria:8428/api/v1/write",
+        {"push-url"}
+    );
+    args::ValueFlag<unsigned> push_interval(
+        p, "seconds", "Seconds between pushes (default 15)", {"push-interval"}, 15
+    );
+    args::ValueFlag<size_t> push_buffer(
+        p, "samples",
+        "Number of samples buffered while the endpoint can't be reached, the oldest are dropped "
+        "(default 100000)",
+        {"push-buffer"}, 100000
+    );
+    args::ValueFlagList<std::string> push_labels(
+        p, "name=value", "Label added to every pushed series, may be repeated", {"push-label"}
+    );
+    args::Flag push_all(
+        p, "push-all", "Also push the system and bluetooth listener metrics", {"push-all"}
+    );
+    args::ValueFlag<std::string> spool_dir(
+        p, "directory",
+        "Keep every received measurement in this directory until it has been pushed, so that "
+        "none are lost while the endpoint can't be reached. Needs --push-url",
+        {"spool-dir"}
+    );
+    args::ValueFlag<size_t> spool_size(
+        p, "MiB", "Disk space the spool may use, the oldest measurements are dropped (default 256)",
+        {"spool-size"}, 256
+    );
+    args::ValueFlag<unsigned> spool_commit(
+        p, "seconds",
+        "Seconds between writes of the spool to the disk, measurements received since the last "
+        "one are lost in a power cut (default 10)",
+        {"spool-commit"}, 10
+    );
+    args::ValueFlag<unsigned> history_hours(
+        p, "hours",
+        "Keep every measurement of the last hours in memory, served as JSON by "
+        "GET /history?mac=AA:BB:CC:DD:EE:FF&from=<seconds since the epoch, or before now if "
+        "negative> in pages of up to 10000 measurements (default 0, no history)",
+        {"history"}, 0
+    );
+    args::ValueFlag<size_t> history_size(
+        p, "MiB",
+        "Memory the history may use, the oldest measurements are dropped. A day of 50 tags takes "
+        "about 24 MiB (default 32)",
+        {"history-size"}, 32
+    );
+    args::ValueFlag<int> gzip_level(
+        p, "level",
+        "gzip level of the /metrics responses for scrapers that accept it, from 1 (fastest) to 9 "
+        "(smallest), 0 never compresses (default 1)",
+        {"gzip-level"}, 1
+    );
+    args::ValueFlag<std::string> sysinfo_root(
+        p, "directory",
+        "Read the system metrics from proc/ and sys/ under this directory instead of /proc and "
+        "/sys, for example where a container mounts those of the host",
+        {"sysinfo-root"}
+    );
+    args::ValueFlagList<std::string> sysinfo_refresh(
+        p, "source=seconds",
+        "Read a source of system metrics at most once in this many seconds, scrapes in between "
+        "get its previous values. Sources are meminfo (default 5), stat, netstat, load, thermal "
+        "(default 0, every scrape) and diskstats (default 30). May be repeated",
+        {"sysinfo-refresh"}
+    );
+    args::ValueFlag<double> sample_rate(
+        p, "per-second",
+        "Also sample the CPU and memory use this many times a second, from 0.1 to 100, and export "
+        "their median, 95th percentile and maximum over --sample-window (default 0, never)",
+        {"sample-rate"}, 0
+    );
+    args::ValueFlag<double> sample_window(
+        p, "seconds",
+        "Seconds over which the sampled percentiles are taken, usually the scrape interval "
+        "(default 15)",
+        {"sample-window"}, 15
+    );
 
     try {
         p.ParseCLI(argc, argv);
@@ -122,18 +666,144 @@ int main(int argc, char** argv) {
         std::cout << e.what() << "\n" << p;
         return EXIT_FAILURE;
     }
+    std::vector<std::pair<std::string, std::string>> labels;
+    for (auto const& l: push_labels.Get()) {
+        auto eq = l.find('=');
+        if (eq == 0 || eq == std::string::npos) {
+            std::cout << "--push-label needs name=value, got " << l << "\n" << p;
+            return EXIT_FAILURE;
+        }
+        labels.emplace_back(l.substr(0, eq), l.substr(eq + 1));
+    }
+    sys_info::refresh_intervals refresh;
+    for (auto const& r: sysinfo_refresh.Get()) {
+        using interval = sys_info::refresh_intervals::duration sys_info::refresh_intervals::*;
+        static std::map<std::string, interval> const sources{
+            {"meminfo",   &sys_info::refresh_intervals::meminfo  },
+            {"stat",      &sys_info::refresh_intervals::stat     },
+            {"netstat",   &sys_info::refresh_intervals::netstat  },
+            {"load",      &sys_info::refresh_intervals::load     },
+            {"thermal",   &sys_info::refresh_intervals::thermal  },
+            {"diskstats", &sys_info::refresh_intervals::diskstats},
+        };
+        auto eq        = r.find('=');
+        auto source    = sources.find(r.substr(0, eq));
+        auto value     = eq == std::string::npos ? "" : r.c_str() + eq + 1;
+        char* end      = nullptr;
+        double seconds = std::strtod(value, &end);
+        if (source == sources.end() || end == value || *end != '\0' || !(seconds >= 0)) {
+            std::cout << "--sysinfo-refresh needs source=seconds, got " << r << "\n" << p;
+            return EXIT_FAILURE;
+        }
+        refresh.*source->second = std::chrono::duration_cast<sys_info::refresh_intervals::duration>(
+            std::chrono::duration<double>(seconds)
+        );
+    }
+    if (queue_size.Get() < 1 || queue_size.Get() > packet_queue::max_capacity) {
+        std::cout << "--queue-size must be between 1 and " << packet_queue::max_capacity << "\n"
+                  << p;
+        return EXIT_FAILURE;
+    }
+    if (push_interval.Get() < 1 || push_interval.Get() > 86400) {
+        std::cout << "--push-interval must be between 1 and 86400 seconds\n" << p;
+        return EXIT_FAILURE;
+    }
+    if (!spool_dir.Get().empty() && push_url.Get().empty()) {
+        std::cout << "--spool-dir needs --push-url, the spool is only emptied by pushing\n" << p;
+        return EXIT_FAILURE;
+    }
+    if (spool_size.Get() > SIZE_MAX >> 20u) {
+        std::cout << "--spool-size must be at most " << (SIZE_MAX >> 20u) << " MiB\n" << p;
+        return EXIT_FAILURE;
+    }
+    if (window.Get() > 0 && decode_on_scrape.Get()) {
+        std::cout << "--window needs every advert decoded, it can't be used with "
+                     "--decode-on-scrape\n"
+                  << p;
+        return EXIT_FAILURE;
+    }
+
+    if (sample_rate.Get() != 0 && !(sample_rate.Get() >= 0.1 && sample_rate.Get() <= 100)) {
+        std::cout << "--sample-rate must be between 0.1 and 100\n" << p;
+        return EXIT_FAILURE;
+    }
+    if (sample_rate.Get() > 0
+        && !(sample_window.Get() * sample_rate.Get() >= 1 && sample_window.Get() <= 3600)) {
+        std::cout << "--sample-window must be between a sampling period and an hour\n" << p;
+        return EXIT_FAILURE;
+    }
+    constexpr auto max_samples = sys_info::sampler_options::max_samples;
+    if (sample_rate.Get() > 0 && sample_window.Get() * sample_rate.Get() > double(max_samples)) {
+        std::cout << "--sample-window at --sample-rate must hold at most " << max_samples
+                  << " samples\n"
+                  << p;
+        return EXIT_FAILURE;
+    }
+    if (gzip_level.Get() < 0 || gzip_level.Get() > 9) {
+        std::cout << "--gzip-level must be between 0 and 9\n" << p;
+        return EXIT_FAILURE;
+    }
+    if (history_hours.Get() > 0 && decode_on_scrape.Get()) {
+        std::cout << "--history needs every advert decoded, it can't be used with "
+                     "--decode-on-scrape\n"
+                  << p;
+        return EXIT_FAILURE;
+    }
+    if (history_size.Get() > SIZE_MAX >> 20u) {
+        std::cout << "--history-size must be at most " << (SIZE_MAX >> 20u) << " MiB\n" << p;
+        return EXIT_FAILURE;
+    }
 
     try {
         config_logger(systemd.Get(), debug.Get(), trace.Get());
 
         spdlog::debug("Starting on port {}", port.Get());
-        Ruuvitag rv(port.Get(), interface.Get());
+        RuuvitagOptions opts;
+        opts.port              = port.Get();
+        opts.interface         = interface.Get();
+        opts.backend           = backend.Get();
+        opts.queue_size        = queue_size.Get();
+        opts.overflow          = overflow.Get();
+        opts.keep_duplicates   = keep_duplicates.Get();
+        opts.decode            = decode_on_scrape.Get() ? ruuvi::decode_mode::on_collect
+                                                        : ruuvi::decode_mode::on_update;
+        opts.limits.ttl        = std::chrono::seconds(tag_ttl.Get());
+        opts.limits.max_tags   = max_tags.Get();
+        opts.sample_time       = sample_timestamps.Get() ? ruuvi::sample_time::receive
+                                                         : ruuvi::sample_time::scrape;
+        opts.windows.window    = std::chrono::seconds(window.Get());
+        opts.windows.last      = window_last.Get();
+        opts.push.url          = push_url.Get();
+        opts.push.interval     = std::chrono::seconds(push_interval.Get());
+        opts.push.max_buffered = push_buffer.Get();
+        opts.push.labels       = std::move(labels);
+        opts.push_all          = push_all.Get();
+
+        opts.spool.directory       = spool_dir.Get();
+        opts.spool.max_size        = spool_size.Get() << 20u;
+        opts.spool.commit_interval = std::chrono::seconds(spool_commit.Get());
+
+        opts.history.retention = std::chrono::hours(history_hours.Get());
+        opts.history.max_bytes = history_size.Get() << 20u;
+
+        opts.gzip_level      = gzip_level.Get();
+        opts.sysinfo_root    = sysinfo_root.Get();
+        opts.sysinfo_refresh = refresh;
+        opts.sampling.rate   = sample_rate.Get();
+        opts.sampling.window = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(sample_window.Get())
+        );
+        opts.sampling.root   = sysinfo_root.Get();
+
+        Ruuvitag rv(opts);
         stop_all.test_and_set();
         debug_print.test_and_set();
 
         std::thread runner([&rv]() {
             try {
                 rv.start();
+                // The listener stopped on its own, without a signal
+                stop_all.clear();
             } catch (std::exception const& e) {
                 // Stop
                 stop_all.clear();
@@ -162,7 +832,7 @@ int main(int argc, char** argv) {
         stopper.join();
         runner.join();
     } catch (std::exception const& e) {
-        spdlog::error("Uncaught exception: ", e.what());
+        spdlog::error("Uncaught exception: {}", e.what());
         stopped_with_error = true;
     } catch (...) {
         spdlog::error("Uncaught exception of unknown type in main()");
@@ -0,0 +1,16 @@
+#include "cache_exposer.hpp"
+
+#include <utility>
+
+using namespace sys_info;
+
+CacheExposer::CacheExposer(std::shared_ptr<SystemInfoCollector const> sysinfo,
+                           std::shared_ptr<DiskstatExposer const> diskstat)
+    : sysinfo(std::move(sysinfo)), diskstat(std::move(diskstat)) {}
+
+std::vector<prometheus::MetricFamily> CacheExposer::Collect() const {
+    std::vector<prometheus::MetricFamily> families;
+    if (sysinfo) sysinfo->append_cache_statistics(families);
+    if (diskstat) diskstat->append_cache_statistics(families);
+    return families;
+}
@@ -1,11 +1,9 @@
 #include "diskstat.hpp"
 
-#include "diskstat_exposer.hpp"
-#include <cassert>
-#include <fstream>
-#include <functional>
+#include "procfs.hpp"
+#include <cerrno>
+#include <cstring>
 #include <spdlog/spdlog.h>
-#include <optional>
 
 #include <prometheus/client_metric.h>
 #include <prometheus/metric_family.h>
@@ -22,44 +20,16 @@ double Diskstat::sector_byte_size() {
     return 512.0;
 }
 
-namespace {
-std::optional<std::ifstream> open_diskstats() {
-    auto check = [&] {
-        std::ifstream ifs(DiskstatExposer::diskstat_location);
-        return ifs.good();
-    };
-    static bool const exists = check();
-    if (exists)
-        return std::ifstream(DiskstatExposer::diskstat_location);
-    else
-        return std::nullopt;
-}
-}  // namespace
-
-std::vector<Diskstat> Diskstat::create() {
-    std::vector<Diskstat> stats;
-    stats.reserve(10);
-
-    auto f = open_diskstats();
-    if (!f.has_value()) {
-        spdlog::warn("Failed to open diskstats file");
-        return {};
+bool Diskstat::read(proc_file& file, std::vector<Diskstat>& stats) {
+    std::string_view text;
+    if (!file.read(text)) {
+        spdlog::warn("Failed to read {}: {}", file.path(),
+                     std::strerror(errno));
+        stats.clear();
+        return false;
     }
-    std::ifstream& ifs = *f;
-
-    std::string line;
-    while (ifs.good() && std::getline(ifs, line).good()) {
-        Diskstat& c = stats.emplace_back();
-
-        ifs >> c.major >> c.minor >> c.devname >> c.ReadCompleted
-            >> c.ReadMerged >> c.ReadSectors >> c.ReadTime >> c.WriteCompleted
-            >> c.WriteMerged >> c.WriteSectors >> c.WriteTime >> c.IOInProgress
-            >> c.IOTime >> c.WeightedIOTime >> c.DiscardCompleted
-            >> c.DiscardMerged >> c.DiscardTime >> c.FlushComplete
-            >> c.FlushTime;
-    }
-
-    return stats;
+    parse_diskstats(text, stats);
+    return true;
 }
 
 }  // namespace sys_info
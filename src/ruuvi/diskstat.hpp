@@ -7,6 +7,8 @@
 
 namespace sys_info {
 
+class proc_file;
+
 struct Diskstat {
     using ul = unsigned long;
     using ui = unsigned int;
@@ -36,7 +38,11 @@ struct Diskstat {
     static double time_to_float(ui time);
     static double sector_byte_size();
 
-    static std::vector<Diskstat> create();
+    /**
+     * @brief read Replaces stats with the lines of file, empty if it can't be
+     * read
+     */
+    static bool read(proc_file& file, std::vector<Diskstat>& stats);
 };
 
 }  // namespace sys_info
@@ -9,6 +9,8 @@
 
 #ifdef ENABLE_SYSINFO_EXPOSER
 #include "diskstat.hpp"
+#include "procfs.hpp"
+#include "snapshot_cache.hpp"
 #endif
 
 namespace sys_info {
@@ -128,18 +130,62 @@ static auto families = create_metric_families();
 
 }  // namespace
 
-std::vector<prometheus::MetricFamily> DiskstatExposer::Collect() const {
-    auto fms   = families;
-    auto stats = Diskstat::create();
-    fms.do_collect(stats);
+class DiskstatExposer::Impl {
+public:
+    Impl(std::string const& root, std::chrono::steady_clock::duration max_age)
+        : file(root + diskstat_location), cache(max_age) {}
 
-    return std::move(fms.family);
-}
+    std::vector<prometheus::MetricFamily> Collect() {
+        auto snapshot = cache.get([this](auto const&) { return refresh(); });
+
+        if (!snapshot) return {};
+        return *snapshot;
+    }
+
+    void append_cache_statistics(std::vector<prometheus::MetricFamily>& families) const {
+        cache.statistics().append("diskstat", families);
+    }
+
+private:
+    using snapshot = std::vector<prometheus::MetricFamily>;
+
+    // Only touched by the refresh of the cache, which runs one at a time
+    proc_file file;
+    std::vector<Diskstat> stats;  // Keeps its capacity between scrapes
+    snapshot_cache<snapshot> cache;
+
+    std::shared_ptr<snapshot const> refresh() {
+        auto fms = families;
+        Diskstat::read(file, stats);
+        fms.do_collect(stats);
+        return std::make_shared<snapshot const>(std::move(fms.family));
+    }
+};
 
 #else
 
-std::vector<pr::MetricFamily> DiskstatExposer::Collect() const { return {}; }
+class DiskstatExposer::Impl {
+public:
+    Impl(std::string const&, std::chrono::steady_clock::duration) {}
+    std::vector<pr::MetricFamily> Collect() { return {}; }
+    void append_cache_statistics(std::vector<pr::MetricFamily>&) const {}
+};
 
 #endif
 
+DiskstatExposer::DiskstatExposer(std::string const& root,
+                                 std::chrono::steady_clock::duration max_age)
+    : impl(std::make_unique<Impl>(root, max_age)) {}
+
+DiskstatExposer::~DiskstatExposer() = default;
+
+std::vector<pr::MetricFamily> DiskstatExposer::Collect() const {
+    return impl->Collect();
+}
+
+void DiskstatExposer::append_cache_statistics(
+    std::vector<pr::MetricFamily>& families) const {
+    impl->append_cache_statistics(families);
+}
+
 }  // namespace sys_info
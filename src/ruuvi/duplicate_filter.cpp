@@ -0,0 +1,108 @@
+#include "duplicate_filter.hpp"
+#include "formats.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace ruuvi;
+
+namespace {
+
+constexpr uint64_t sequence_flag = 1ull << 63u;
+
+template<class Format> constexpr field_descriptor sequence_field() {
+    for (auto const& f: Format::fields)
+        if (f.id == field::measurement_sequence) return f;
+    return Format::fields[0];  // Not reached for the formats below
+}
+
+/*
+ * Sequence number of Format, or false if the payload is short or the sequence is all ones. That
+ * marks it as not available in formats 5 and E1; a real all-ones value is rare enough that
+ * hashing the payload instead costs nothing.
+ */
+template<class Format> bool read_sequence(uint8_t const* data, size_t size, uint64_t& key) {
+    constexpr field_descriptor f = sequence_field<Format>();
+    static_assert(f.id == field::measurement_sequence, "Format has no measurement sequence");
+    constexpr uint32_t all_ones = (1u << (8 * f.bytes)) - 1;
+    if (size < Format::size) return false;
+
+    uint32_t raw = 0;
+    for (size_t i = 0; i < f.bytes; ++i) raw = (raw << 8u) | data[f.offset + i];
+    if (raw == all_ones) return false;
+
+    key = sequence_flag | (uint64_t(Format::id) << 32u) | raw;
+    return true;
+}
+
+// FNV-1a, kept clear of sequence_flag
+uint64_t payload_hash(uint8_t const* data, size_t size) {
+    uint64_t h = 0xCBF2'9CE4'8422'2325ull;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= data[i];
+        h *= 0x0000'0100'0000'01B3ull;
+    }
+    return h & ~sequence_flag;
+}
+
+}  // namespace
+
+uint64_t ruuvi::measurement_key(uint8_t const* payload, size_t size) noexcept {
+    uint64_t key = 0;
+    if (size > 0) {
+        switch (payload[0]) {
+            case format_5::id:
+                if (read_sequence<format_5>(payload, size, key)) return key;
+                break;
+            case format_6::id:
+                if (read_sequence<format_6>(payload, size, key)) return key;
+                break;
+            case format_e1::id:
+                if (read_sequence<format_e1>(payload, size, key)) return key;
+                break;
+            default: break;
+        }
+    }
+    return payload_hash(payload, size);
+}
+
+duplicate_filter::duplicate_filter(size_t max_tags): max_tags(max_tags) {
+    if (max_tags == 0) throw std::invalid_argument("The duplicate filter must hold a tag");
+}
+
+bool duplicate_filter::admit(ble::AdvPacket const& p, clock::time_point now) {
+    auto key = measurement_key(p.manufacturer_data(), p.manufacturer_data_size());
+    if (tags.size() >= max_tags && tags.find(p.mac) == nullptr) evict_oldest();
+    auto [tag, inserted] = tags.emplace(p.mac);
+    tag->signal_strength = p.signal_strength;
+    tag->last_seen       = now;
+
+    if (inserted) {
+        tag_count_.store(tags.size(), std::memory_order_relaxed);
+    } else if (tag->key == key) {
+        suppressed_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    tag->key = key;
+    return true;
+}
+
+void duplicate_filter::expire(clock::time_point before) {
+    stale.clear();
+    tags.for_each([this, before](ble::mac_address const& mac, tag_state const& t) {
+        if (t.last_seen < before) stale.push_back(mac);
+    });
+    for (auto const& mac: stale) tags.erase(mac);
+    tag_count_.store(tags.size(), std::memory_order_relaxed);
+}
+
+void duplicate_filter::evict_oldest() {
+    ages.clear();
+    tags.for_each([this](ble::mac_address const&, tag_state const& t) {
+        ages.push_back(t.last_seen);
+    });
+    auto quarter = ages.begin() + std::ptrdiff_t(ages.size() / 4);
+    std::nth_element(ages.begin(), quarter, ages.end());
+    // Also the tags seen at that very time, so at least one goes
+    expire(*quarter + clock::duration(1));
+}
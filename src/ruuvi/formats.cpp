@@ -0,0 +1,144 @@
+#include "formats.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <utility>
+
+using namespace ruuvi;
+
+namespace {
+
+template<size_t Bytes> inline uint32_t read_be(uint8_t const* p) {
+    static_assert(Bytes >= 1 && Bytes <= 3, "Fields are at most 24 bits wide");
+    if constexpr (Bytes == 1) return p[0];
+    if constexpr (Bytes == 2) return (uint32_t(p[0]) << 8u) | p[1];
+    if constexpr (Bytes == 3) return (uint32_t(p[0]) << 16u) | (uint32_t(p[1]) << 8u) | p[2];
+}
+
+// Decodes Format::fields[I], every descriptor member is a compile time constant
+template<class Format, size_t I> inline void decode_field(uint8_t const* data, measurement& m) {
+    constexpr field_descriptor f = Format::fields[I];
+    constexpr uint32_t mask      = f.width >= 32 ? ~0u : (1u << f.width) - 1;
+    constexpr uint32_t bit       = field_bit(f.id);
+
+    uint32_t raw = read_be<f.bytes>(data + f.offset);
+    if constexpr (f.low_bit_offset != field_descriptor::no_low_bit) {
+        raw = (raw << 1u) | ((data[f.low_bit_offset] >> f.low_bit) & 1u);
+    } else if constexpr (f.shift != 0 || f.width != 8 * f.bytes) {
+        raw = (raw >> f.shift) & mask;
+    }
+
+    bool invalid = false;
+    if constexpr (f.has_sentinel) invalid = invalid || raw == f.sentinel;
+    if constexpr (f.max != std::numeric_limits<uint32_t>::max()) invalid = invalid || raw > f.max;
+
+    float value;
+    if constexpr (f.enc == encoding::sign_magnitude) {
+        // Sign and integer part in the high byte, hundredths in the low byte
+        bool negative  = (raw & 0x8000u) != 0;
+        int integer    = int((raw >> 8u) & 0x7Fu);
+        uint8_t hundth = raw & 0xFFu;
+        invalid        = invalid || hundth > 99;
+        value = float(negative ? -integer : integer) + (negative ? -0.01f : 0.01f) * hundth;
+    } else if constexpr (f.enc == encoding::logarithmic) {
+        value = std::exp(raw * f.factor) - 1;
+    } else {
+        float x;
+        if constexpr (f.enc == encoding::signed_int) {
+            constexpr uint32_t sign = 1u << (f.width - 1);
+            x = static_cast<float>(static_cast<int32_t>((raw ^ sign) - sign));
+        } else {
+            x = static_cast<float>(raw);
+        }
+        if constexpr (f.divide)
+            value = x / f.factor;
+        else if constexpr (f.factor != 1)
+            value = f.factor * x;
+        else
+            value = x;
+        if constexpr (f.bias != 0) value = f.bias + value;
+    }
+
+    m.values[size_t(f.id)] = invalid ? measurement::nan : value;
+    if (invalid) m.invalid |= bit;
+}
+
+template<class Format, size_t... I>
+inline void decode_fields(uint8_t const* data, measurement& m, std::index_sequence<I...>) {
+    (decode_field<Format, I>(data, m), ...);
+}
+
+template<class Format> constexpr uint32_t present_fields() {
+    uint32_t r = 0;
+    for (auto const& f: Format::fields) r |= field_bit(f.id);
+    return r;
+}
+
+// The specialised decoder generated for each format table
+template<class Format>
+int decode_format(uint8_t const* data, size_t size, ble::mac_address const* mac,
+                  measurement& m) noexcept {
+    m.data_format = Format::id;
+    if (size < Format::size) return payload_too_short;
+
+    constexpr size_t count = std::size(Format::fields);
+    m.present              = present_fields<Format>();
+    decode_fields<Format>(data, m, std::make_index_sequence<count>{});
+
+    if constexpr (Format::mac_size > 0) {
+        if (mac != nullptr)
+            m.mac_mismatch = !std::equal(mac->end() - Format::mac_size, mac->end(),
+                                         data + Format::mac_offset);
+    }
+    return Format::id;
+}
+
+using decoder = int (*)(uint8_t const*, size_t, ble::mac_address const*, measurement&) noexcept;
+
+constexpr std::array<decoder, 256> make_decoders() {
+    std::array<decoder, 256> r{};
+    r[format_3::id]  = &decode_format<format_3>;
+    r[format_5::id]  = &decode_format<format_5>;
+    r[format_6::id]  = &decode_format<format_6>;
+    r[format_e1::id] = &decode_format<format_e1>;
+    return r;
+}
+
+// Indexed by the data format byte
+constexpr std::array<decoder, 256> decoders = make_decoders();
+
+int decode_any(uint8_t const* data, size_t size, ble::mac_address const* mac,
+               measurement& out) noexcept {
+    out.reset();
+    if (size == 0) return unknown_format;
+    auto fn = decoders[data[0]];
+    if (fn == nullptr) return unknown_format;
+    return fn(data, size, mac, out);
+}
+
+}  // namespace
+
+int ruuvi::decode(uint8_t const* payload, size_t size, measurement& out) noexcept {
+    return decode_any(payload, size, nullptr, out);
+}
+
+int ruuvi::decode(ble::AdvPacket const& p, measurement& out) noexcept {
+    if (p.manufacturer_id != 0x0499) {
+        out.reset();
+        return not_ruuvitag;
+    }
+    return decode_any(p.manufacturer_data(), p.manufacturer_data_size(), &p.mac, out);
+}
+
+int ruuvi::decode_as(int data_format, uint8_t const* payload, size_t size,
+                     measurement& out) noexcept {
+    out.reset();
+    if (!is_decodable(data_format)) return unknown_format;
+    return decoders[size_t(data_format)](payload, size, nullptr, out);
+}
+
+bool ruuvi::is_decodable(int data_format) noexcept {
+    return data_format >= 0 && data_format < int(decoders.size())
+        && decoders[size_t(data_format)] != nullptr;
+}
@@ -0,0 +1,42 @@
+#include "gzip.hpp"
+
+#include <stdexcept>
+
+#define ZLIB_CONST  // next_in points to const data
+#include <zlib.h>
+
+using namespace ruuvi;
+
+class gzip_compressor::Impl {
+public:
+    explicit Impl(int level) {
+        // 16 added to the window bits asks for the gzip header and trailer instead of zlib's
+        if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            throw std::runtime_error("Failed to set up gzip compression");
+    }
+    ~Impl() { deflateEnd(&stream); }
+
+    void compress(std::string_view in, std::string& out) {
+        if (deflateReset(&stream) != Z_OK) throw std::runtime_error("Failed to reset gzip stream");
+        out.resize(deflateBound(&stream, uLong(in.size())));
+        stream.next_in   = reinterpret_cast<Bytef const*>(in.data());
+        stream.avail_in  = uInt(in.size());
+        stream.next_out  = reinterpret_cast<Bytef*>(out.data());
+        stream.avail_out = uInt(out.size());
+        // The bound leaves room for everything, so one call finishes
+        if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+            throw std::runtime_error("Failed to compress with gzip");
+        out.resize(stream.total_out);
+    }
+
+private:
+    z_stream stream{};
+};
+
+gzip_compressor::gzip_compressor(int level): impl(std::make_unique<Impl>(level)) {}
+
+gzip_compressor::~gzip_compressor() = default;
+
+void gzip_compressor::compress(std::string_view in, std::string& out) {
+    impl->compress(in, out);
+}
@@ -0,0 +1,482 @@
+#include "history.hpp"
+#include "formats.hpp"
+#include "mac_table.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+
+#include <prometheus/metric_family.h>
+
+using namespace ruuvi;
+using namespace prometheus;
+
+namespace {
+
+constexpr size_t block_bytes = 4096;
+constexpr size_t block_words = block_bytes / sizeof(uint64_t);
+// Timestamp and every field escaped to their widest range
+constexpr size_t max_sample_bits = 4 + 64 + history_field_count * (4 + 33);
+static_assert(max_sample_bits < block_bytes * 8);
+
+/*
+ * A block of samples, decoded on its own. The bits are stored most significant first:
+ *   first sample  32 bits per field, the timestamp is first_ms
+ *   others        delta of deltas of the timestamp, then the delta of each field
+ */
+struct block {
+    int64_t first_ms = 0;
+    int64_t last_ms  = 0;
+    uint32_t count   = 0;
+    size_t bits      = 0;
+    std::vector<uint64_t> words;
+};
+
+uint64_t low_bits(uint64_t v, unsigned n) {
+    return n < 64 ? v & ((uint64_t(1) << n) - 1) : v;
+}
+
+void put(block& b, uint64_t v, unsigned n) {
+    v          = low_bits(v, n);
+    auto word  = b.bits / 64;
+    auto avail = unsigned(64 - b.bits % 64);
+    if (n <= avail) {
+        b.words[word] |= v << (avail - n);
+    } else {
+        b.words[word] |= v >> (n - avail);
+        b.words[word + 1] |= v << (64 - (n - avail));
+    }
+    b.bits += n;
+}
+
+class bit_reader {
+public:
+    explicit bit_reader(block const& b): words(b.words.data()) {}
+
+    uint64_t get(unsigned n) {
+        auto word  = pos / 64;
+        auto avail = unsigned(64 - pos % 64);
+        pos += n;
+        if (n <= avail) return low_bits(words[word] >> (avail - n), n);
+        auto rest = n - avail;
+        return low_bits(words[word], avail) << rest | words[word + 1] >> (64 - rest);
+    }
+    bool bit() { return get(1) != 0; }
+    int64_t get_signed(unsigned n) {
+        auto shift = 64 - n;
+        return shift == 0 ? int64_t(get(n)) : int64_t(get(n) << shift) >> shift;
+    }
+
+private:
+    uint64_t const* words;
+    size_t pos = 0;
+};
+
+// A non-zero value in the shortest of the ranges it fits, 0 is the single bit 0
+struct value_range {
+    uint64_t prefix;
+    unsigned prefix_bits;
+    unsigned value_bits;
+};
+constexpr value_range dod_ranges[] = {
+    {0b10, 2, 7}, {0b110, 3, 9}, {0b1110, 4, 12}, {0b1111, 4, 64}};
+constexpr value_range delta_ranges[] = {
+    {0b10, 2, 4}, {0b110, 3, 8}, {0b1110, 4, 16}, {0b1111, 4, 33}};
+
+template<size_t N> void put_value(block& b, int64_t v, value_range const (&ranges)[N]) {
+    if (v == 0) {
+        put(b, 0, 1);
+        return;
+    }
+    for (auto const& r: ranges) {
+        auto limit = r.value_bits < 64 ? int64_t(1) << (r.value_bits - 1) : 0;
+        if (r.value_bits < 64 && (v < -limit || v >= limit)) continue;
+        put(b, r.prefix, r.prefix_bits);
+        put(b, uint64_t(v), r.value_bits);
+        return;
+    }
+}
+
+template<size_t N> int64_t get_value(bit_reader& in, value_range const (&ranges)[N]) {
+    if (!in.bit()) return 0;
+    size_t r = 0;
+    while (r + 1 < N && in.bit()) ++r;
+    return in.get_signed(ranges[r].value_bits);
+}
+
+/*
+ * Fields are kept as the integers data format 5 carries them in, e.g. the temperature in steps of
+ * 0.005 C, and scaled back when queried. The scale is computed as decode_format_5() does, so
+ * decoded readings come back bit for bit. Integer fields are kept as they are.
+ */
+struct field_scale {
+    bool divide  = false;
+    float factor = 1;
+    float bias   = 0;
+};
+
+constexpr field_scale format_5_scale(field id) {
+    for (auto const& f: format_5::fields)
+        if (f.id == id) return {f.divide, f.factor, f.bias};
+    return {};
+}
+
+constexpr field_scale scales[history_field_count] = {
+    format_5_scale(field::temperature),
+    format_5_scale(field::humidity),
+    {},  // Pascal
+    format_5_scale(field::acceleration_x),
+    format_5_scale(field::acceleration_y),
+    format_5_scale(field::acceleration_z),
+    format_5_scale(field::battery_voltage),
+    {},  // dBm
+    {},
+    {},
+    {},
+};
+
+// Kept for invalid fields and values the format can't carry
+constexpr int32_t invalid_raw = std::numeric_limits<int32_t>::min();
+
+int32_t raw_of(float value, field_scale const& s) {
+    auto x = double(value) - double(s.bias);
+    x      = s.divide ? x * double(s.factor) : x / double(s.factor);
+    if (!(std::abs(x) < double(std::numeric_limits<int32_t>::max()))) return invalid_raw;
+    return int32_t(std::lround(x));
+}
+
+float value_of(int32_t raw, field_scale const& s) {
+    if (raw == invalid_raw) return std::numeric_limits<float>::quiet_NaN();
+    auto x = float(raw);
+    auto v = s.divide ? x / s.factor : s.factor != 1 ? s.factor * x : x;
+    return s.bias != 0 ? s.bias + v : v;
+}
+
+using raw_sample = std::array<int32_t, history_field_count>;
+
+// Invalid integer fields hold sentinels, which are kept as invalid like the float fields
+raw_sample raw_sample_of(format_5_reading const& r) {
+    return {raw_of(r.temperature, scales[0]),
+            raw_of(r.humidity, scales[1]),
+            r.valid(invalid_pressure) ? int32_t(r.pressure) : invalid_raw,
+            raw_of(r.acceleration[0], scales[3]),
+            raw_of(r.acceleration[1], scales[4]),
+            raw_of(r.acceleration[2], scales[5]),
+            raw_of(r.battery_voltage, scales[6]),
+            r.valid(invalid_tx_power) ? int32_t(r.tx_power) : invalid_raw,
+            int32_t(r.movement_counter),
+            int32_t(r.measurement_sequence),
+            int32_t(r.signal_strength)};
+}
+
+struct tag_history {
+    std::deque<std::shared_ptr<block const>> full;  // Oldest first
+    block open;                                     // Words allocated with the first sample
+    int64_t delta = 0;                              // Of the last two timestamps in open
+    raw_sample last{};                              // Fields of the last sample in open
+};
+
+void append_sample(tag_history& t, raw_sample const& raw, int64_t ms) {
+    auto& b = t.open;
+    if (b.count == 0) {
+        b.first_ms = ms;
+        t.delta    = 0;
+        for (auto v: raw) put(b, uint32_t(v), 32);
+    } else {
+        auto delta = ms - b.last_ms;
+        put_value(b, delta - t.delta, dod_ranges);
+        t.delta = delta;
+        for (size_t f = 0; f < history_field_count; ++f)
+            put_value(b, int64_t(raw[f]) - t.last[f], delta_ranges);
+    }
+    t.last    = raw;
+    b.last_ms = ms;
+    ++b.count;
+}
+
+// Appends the samples of the block at from_ms or later, until out holds limit samples
+void decode_block(block const& b, int64_t from_ms, size_t limit,
+                  std::vector<history_sample>& out) {
+    bit_reader in(b);
+    raw_sample raw{};
+    history_sample s;
+    s.timestamp_ms = b.first_ms;
+    int64_t delta  = 0;
+    for (uint32_t i = 0; i < b.count; ++i) {
+        if (i == 0) {
+            for (auto& v: raw) v = int32_t(uint32_t(in.get(32)));
+        } else {
+            delta += get_value(in, dod_ranges);
+            s.timestamp_ms += delta;
+            for (auto& v: raw) v = int32_t(v + get_value(in, delta_ranges));
+        }
+        if (s.timestamp_ms < from_ms) continue;
+        if (out.size() >= limit) return;
+        for (size_t f = 0; f < history_field_count; ++f) s.values[f] = value_of(raw[f], scales[f]);
+        out.push_back(s);
+    }
+}
+
+size_t words_used(block const& b) {
+    return (b.bits + 63) / 64;
+}
+
+size_t block_size(block const& b) {
+    return sizeof(block) + b.words.capacity() * sizeof(uint64_t);
+}
+
+void append_float(std::string& out, float value) {
+    if (!std::isfinite(value)) {
+        out.append("null");
+        return;
+    }
+    char buf[32];
+#if __cpp_lib_to_chars >= 201611L
+    auto n = std::to_chars(buf, buf + sizeof(buf), value).ptr - buf;
+#else
+    int n = std::snprintf(buf, sizeof(buf), "%.*g", std::numeric_limits<float>::max_digits10,
+                          double(value));
+#endif
+    out.append(buf, size_t(n));
+}
+
+int64_t wall_clock_ms() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+}  // namespace
+
+class history::Impl {
+public:
+    explicit Impl(history_options o): opts(o) {}
+
+    void add(format_5_reading const& r, int64_t timestamp_ms) {
+        auto raw = raw_sample_of(r);
+        std::lock_guard g(mtx);
+        auto [t, inserted] = tags.emplace(r.mac);
+        if (t->open.words.empty()) {
+            t->open.words.resize(block_words);
+            bytes += block_size(t->open);
+        }
+        append_sample(*t, raw, timestamp_ms);
+        ++samples;
+        if (t->open.bits + max_sample_bits > block_bytes * 8) {
+            seal(*t);
+            while (bytes > opts.max_bytes && drop_oldest()) {}
+        }
+    }
+
+    void expire(int64_t now_ms) {
+        auto cutoff = now_ms - opts.retention.count();
+        std::lock_guard g(mtx);
+        empty.clear();
+        tags.for_each([this, cutoff](ble::mac_address const& mac, tag_history& t) {
+            while (!t.full.empty() && t.full.front()->last_ms < cutoff) drop_front(t);
+            if (t.open.count > 0 && t.open.last_ms < cutoff) {
+                samples -= t.open.count;
+                reset(t.open);
+            }
+            if (t.full.empty() && t.open.count == 0) empty.push_back(mac);
+        });
+        for (auto const& mac: empty) {
+            bytes -= block_size(tags.find(mac)->open);
+            tags.erase(mac);
+        }
+    }
+
+    bool query(ble::mac_address const& mac, int64_t from_ms, size_t limit,
+               std::vector<history_sample>& out) const {
+        out.clear();
+        std::vector<std::shared_ptr<block const>> blocks;
+        block open;
+        {
+            std::lock_guard g(mtx);
+            auto t = tags.find(mac);
+            if (t == nullptr) return false;
+            for (auto const& b: t->full)
+                if (b->last_ms >= from_ms) blocks.push_back(b);
+            if (t->open.count > 0 && t->open.last_ms >= from_ms) {
+                open.first_ms = t->open.first_ms;
+                open.last_ms  = t->open.last_ms;
+                open.count    = t->open.count;
+                open.bits     = t->open.bits;
+                open.words.assign(t->open.words.begin(),
+                                  t->open.words.begin() + ptrdiff_t(words_used(open)));
+            }
+        }
+        for (auto const& b: blocks) {
+            if (out.size() >= limit) return true;
+            decode_block(*b, from_ms, limit, out);
+        }
+        if (open.count > 0) decode_block(open, from_ms, limit, out);
+        return true;
+    }
+
+    std::vector<MetricFamily> Collect() const {
+        size_t tag_count, sample_count, byte_count;
+        {
+            std::lock_guard g(mtx);
+            tag_count    = tags.size();
+            sample_count = samples;
+            byte_count   = bytes;
+        }
+        std::vector<MetricFamily> families;
+        auto add = [&families](char const* name, char const* help, double value) {
+            auto& f = families.emplace_back();
+            f.name  = name;
+            f.help  = help;
+            f.type  = MetricType::Gauge;
+            f.metric.emplace_back().gauge.value = value;
+        };
+        add("ruuvi_history_tags", "Number of tags with readings in the history", double(tag_count));
+        add("ruuvi_history_samples", "Number of readings in the history", double(sample_count));
+        add("ruuvi_history_bytes", "Memory used by the history", double(byte_count));
+        return families;
+    }
+
+private:
+    history_options const opts;
+
+    mutable std::mutex mtx;
+    mac_table<tag_history> tags;
+    size_t samples = 0;
+    size_t bytes   = 0;
+    std::vector<ble::mac_address> empty;  // Reused by expire()
+
+    static void reset(block& b) {
+        std::fill(b.words.begin(), b.words.end(), 0);
+        b.bits  = 0;
+        b.count = 0;
+    }
+
+    // Keeps the open block's words for the next samples
+    void seal(tag_history& t) {
+        auto full = std::make_shared<block>();
+        full->first_ms = t.open.first_ms;
+        full->last_ms  = t.open.last_ms;
+        full->count    = t.open.count;
+        full->bits     = t.open.bits;
+        full->words.assign(t.open.words.begin(),
+                           t.open.words.begin() + ptrdiff_t(words_used(t.open)));
+        bytes += block_size(*full);
+        t.full.push_back(std::move(full));
+        reset(t.open);
+    }
+
+    void drop_front(tag_history& t) {
+        samples -= t.full.front()->count;
+        bytes -= block_size(*t.full.front());
+        t.full.pop_front();
+    }
+
+    // Drops the oldest full block of any tag
+    bool drop_oldest() {
+        tag_history* oldest = nullptr;
+        tags.for_each([&oldest](ble::mac_address const&, tag_history& t) {
+            if (!t.full.empty()
+                && (oldest == nullptr || t.full.front()->first_ms < oldest->full.front()->first_ms))
+                oldest = &t;
+        });
+        if (oldest == nullptr) return false;
+        drop_front(*oldest);
+        return true;
+    }
+};
+
+history::history(history_options opts): impl(std::make_unique<Impl>(opts)) {}
+
+history::~history() = default;
+
+void history::add(format_5_reading const& r, int64_t timestamp_ms) {
+    impl->add(r, timestamp_ms);
+}
+
+void history::expire(int64_t now_ms) {
+    impl->expire(now_ms);
+}
+
+bool history::query(ble::mac_address const& mac, int64_t from_ms,
+                    std::vector<history_sample>& out, size_t limit) const {
+    return impl->query(mac, from_ms, limit, out);
+}
+
+void history::serve(http_request const& req, http_response& r) const {
+    ble::mac_address mac;
+    if (!ble::parse_mac(req.parameter("mac"), mac)) {
+        r.status = 400;
+        r.body   = "Expected mac=AA:BB:CC:DD:EE:FF\n";
+        return;
+    }
+    int64_t from_ms = std::numeric_limits<int64_t>::min();
+    if (auto from = req.parameter("from"); !from.empty()) {
+        char* end      = nullptr;
+        double seconds = std::strtod(from.c_str(), &end);
+        // Beyond that the milliseconds would overflow, and no reading is that far off anyway
+        constexpr double max_seconds = 1e15;
+        if (end != from.c_str() + from.size() || !(std::abs(seconds) <= max_seconds)) {
+            r.status = 400;
+            r.body   = "Expected from=<seconds since the epoch, or before now if negative>\n";
+            return;
+        }
+        from_ms = std::llround(seconds * 1000) + (seconds < 0 ? wall_clock_ms() : 0);
+    }
+    size_t limit = history_page_samples;
+    if (auto l = req.parameter("limit"); !l.empty()) {
+        auto [end, e] = std::from_chars(l.data(), l.data() + l.size(), limit);
+        if (e != std::errc() || end != l.data() + l.size() || limit == 0
+            || limit > history_page_samples) {
+            r.status = 400;
+            r.body   = "Expected limit=<1 to " + std::to_string(history_page_samples) + ">\n";
+            return;
+        }
+    }
+
+    // One more than the page tells whether there is a next one
+    std::vector<history_sample> samples;
+    if (!query(mac, from_ms, samples, limit + 1)) {
+        r.status = 404;
+        r.body   = "No readings from " + ble::format_mac(mac) + "\n";
+        return;
+    }
+    std::optional<int64_t> next_ms;
+    if (samples.size() > limit) {
+        next_ms = samples.back().timestamp_ms;
+        samples.pop_back();
+    }
+    r.content_type = "application/json";
+    auto& out      = r.body;
+    out.clear();
+    out.reserve(samples.size() * 128);
+    out.append("{\"mac\":\"").append(ble::format_mac(mac));
+    out.append("\",\"fields\":[\"timestamp_ms\"");
+    for (auto name: history_fields) out.append(",\"").append(name).append("\"");
+    out.append("],\"samples\":[");
+    char buf[24];
+    for (size_t i = 0; i < samples.size(); ++i) {
+        out.append(i == 0 ? "[" : ",[");
+        out.append(buf, std::to_chars(buf, buf + sizeof(buf), samples[i].timestamp_ms).ptr);
+        for (auto v: samples[i].values) {
+            out.push_back(',');
+            append_float(out, v);
+        }
+        out.push_back(']');
+    }
+    out.append("]");
+    if (next_ms) {
+        // Exact to the millisecond, from is rounded to it
+        int n = std::snprintf(buf, sizeof(buf), "%.3f", double(*next_ms) / 1000);
+        out.append(",\"next\":").append(buf, size_t(n));
+    }
+    out.append("}\n");
+}
+
+std::vector<MetricFamily> history::Collect() const {
+    return impl->Collect();
+}
@@ -0,0 +1,463 @@
+#include "http_server.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using namespace ruuvi;
+
+namespace {
+
+constexpr size_t max_header_size    = 16 * 1024;
+constexpr int timeout_seconds       = 5;   // To receive the whole request
+constexpr int send_timeout_seconds  = 30;  // To send the whole response
+constexpr int accept_backoff_ms     = 100;
+constexpr size_t max_pending        = 64;  // Connections waiting for a worker, more are closed
+
+std::runtime_error errno_error(std::string const& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+char const* reason(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Internal Server Error";
+    }
+}
+
+int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Invalid escapes are kept as they are
+std::string percent_decode(std::string_view s) {
+    std::string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '+') {
+            r.push_back(' ');
+        } else if (s[i] == '%' && i + 2 < s.size() && hex_digit(s[i + 1]) >= 0
+                   && hex_digit(s[i + 2]) >= 0) {
+            r.push_back(char(hex_digit(s[i + 1]) << 4 | hex_digit(s[i + 2])));
+            i += 2;
+        } else {
+            r.push_back(s[i]);
+        }
+    }
+    return r;
+}
+
+std::string_view trim(std::string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+    return s;
+}
+
+int open_listener(uint16_t port) {
+    int one = 1, zero = 0;
+    int fd  = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        // Also accept IPv4 connections, as mapped addresses
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr   = in6addr_any;
+        addr.sin6_port   = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            auto e = errno_error("Failed to bind to port " + std::to_string(port));
+            close(fd);
+            throw e;
+        }
+        return fd;
+    }
+    if (errno != EAFNOSUPPORT) throw errno_error("Failed to open HTTP socket");
+
+    // IPv6 is disabled in the kernel
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw errno_error("Failed to open HTTP socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port        = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        auto e = errno_error("Failed to bind to port " + std::to_string(port));
+        close(fd);
+        throw e;
+    }
+    return fd;
+}
+
+uint16_t bound_port(int fd) {
+    sockaddr_storage addr{};
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+        throw errno_error("Failed to get the HTTP port");
+    if (addr.ss_family == AF_INET6) return ntohs(reinterpret_cast<sockaddr_in6&>(addr).sin6_port);
+    return ntohs(reinterpret_cast<sockaddr_in&>(addr).sin_port);
+}
+
+}  // namespace
+
+std::string_view http_request::header(std::string_view name) const {
+    for (auto const& [n, v]: headers)
+        if (n == name) return v;
+    return {};
+}
+
+std::string http_request::parameter(std::string_view name) const {
+    std::string_view rest(query);
+    while (!rest.empty()) {
+        auto amp   = rest.find('&');
+        auto param = rest.substr(0, amp);
+        rest       = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+        auto eq    = param.find('=');
+        if (percent_decode(param.substr(0, eq)) != name) continue;
+        return eq == std::string_view::npos ? std::string() : percent_decode(param.substr(eq + 1));
+    }
+    return {};
+}
+
+double ruuvi::accept_quality(std::string_view header, std::string_view value) {
+    // Removes the first item of the list, trimmed
+    auto pop = [](std::string_view& list, char sep) {
+        auto end   = list.find(sep);
+        auto item  = list.substr(0, end);
+        list       = end == std::string_view::npos ? std::string_view() : list.substr(end + 1);
+        auto first = item.find_first_not_of(" \t");
+        if (first == std::string_view::npos) return std::string_view();
+        return item.substr(first, item.find_last_not_of(" \t") + 1 - first);
+    };
+    auto equal = [](std::string_view a, std::string_view b) {
+        return a.size() == b.size()
+               && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                      return std::tolower(static_cast<unsigned char>(x))
+                             == std::tolower(static_cast<unsigned char>(y));
+                  });
+    };
+    auto slash = value.find('/');
+    int best   = -1;  // Specificity of the entry found
+    double q   = 0;
+    while (!header.empty()) {
+        auto params = pop(header, ',');
+        auto name   = pop(params, ';');
+        int specificity;
+        if (equal(name, value))
+            specificity = 2;
+        else if (slash != std::string_view::npos && name.size() == slash + 2 && name.back() == '*'
+                 && equal(name.substr(0, slash + 1), value.substr(0, slash + 1)))
+            specificity = 1;
+        else if (name == "*" || name == "*/*")
+            specificity = 0;
+        else
+            continue;
+        if (specificity <= best) continue;
+        best = specificity;
+        q    = 1;
+        while (!params.empty()) {
+            auto param = pop(params, ';');
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                q = std::strtod(std::string(param.substr(2)).c_str(), nullptr);
+        }
+    }
+    return q;
+}
+
+http_server::http_server(uint16_t port, size_t workers): workers(std::max<size_t>(workers, 1)) {
+    sock = open_listener(port);
+    try {
+        if (listen(sock, 16) < 0) throw errno_error("Failed to listen on HTTP socket");
+        port_  = bound_port(sock);
+        wakeup = eventfd(0, EFD_CLOEXEC);
+        if (wakeup < 0) throw errno_error("Failed to create eventfd");
+    } catch (...) {
+        close(sock);
+        throw;
+    }
+}
+
+http_server::~http_server() {
+    close(sock);
+    close(wakeup);
+}
+
+void http_server::handle(std::string path, std::function<handler> h) {
+    handlers[std::move(path)] = std::move(h);
+}
+
+void http_server::start() {
+    spdlog::info("Serving metrics on port {}", port_);
+    {
+        std::lock_guard g(mtx);
+        stopping = false;
+    }
+    std::vector<std::thread> threads;
+    auto join = [this, &threads] {
+        {
+            std::lock_guard g(mtx);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& t: threads) t.join();
+        for (int fd: pending) close(fd);
+        pending.clear();
+    };
+    try {
+        for (size_t i = 0; i < workers; ++i) threads.emplace_back(&http_server::work, this);
+        accept_connections();
+    } catch (...) {
+        // Cuts the connections being served short
+        stop();
+        join();
+        throw;
+    }
+    join();
+}
+
+void http_server::stop() noexcept {
+    // The eventfd stays readable, so a stop() before start() is not lost
+    uint64_t one = 1;
+    if (write(wakeup, &one, sizeof(one)) < 0)
+        spdlog::warn("Failed to wake up HTTP server: {}", std::strerror(errno));
+}
+
+void http_server::accept_connections() {
+    pollfd fds[2] = {
+        {sock,   POLLIN, 0},
+        {wakeup, POLLIN, 0},
+    };
+    bool out_of_descriptors = false;  // Warned once until an accept succeeds
+    while (true) {
+        int n = poll(fds, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw errno_error("HTTP poll failed");
+        }
+        if (fds[1].revents) return;
+
+        int fd = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            int const error = errno;
+            if (error != EMFILE && error != ENFILE) {
+                // The client may have given up already
+                spdlog::debug("HTTP accept failed: {}", std::strerror(error));
+                continue;
+            }
+            // The connection stays pending and the socket readable, retrying at once would spin
+            if (!out_of_descriptors)
+                spdlog::warn("HTTP accept failed: {}, retrying every {} ms",
+                             std::strerror(error), accept_backoff_ms);
+            out_of_descriptors = true;
+            poll(&fds[1], 1, accept_backoff_ms);
+            continue;
+        }
+        out_of_descriptors = false;
+
+        bool queued = false;
+        {
+            std::lock_guard g(mtx);
+            if (pending.size() < max_pending) {
+                pending.push_back(fd);
+                queued = true;
+            }
+        }
+        if (queued) {
+            ready.notify_one();
+        } else {
+            spdlog::debug("HTTP workers busy, closing a connection");
+            close(fd);
+        }
+    }
+}
+
+void http_server::work() {
+    connection c;
+    while (true) {
+        {
+            std::unique_lock lk(mtx);
+            ready.wait(lk, [this] { return stopping || !pending.empty(); });
+            if (stopping) return;
+            c.fd = pending.front();
+            pending.pop_front();
+        }
+        try {
+            serve(c);
+        } catch (std::exception const& e) { spdlog::debug("HTTP request failed: {}", e.what()); }
+        close(c.fd);
+    }
+}
+
+// Throws once the deadline has passed without the events on fd, or when the server stops
+void http_server::wait_for(int fd, short events,
+                           std::chrono::steady_clock::time_point deadline) const {
+    pollfd fds[2] = {
+        {fd,     events, 0},
+        {wakeup, POLLIN, 0},
+    };
+    while (true) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        int n = left.count() > 0 ? poll(fds, 2, int(left.count())) : 0;
+        if (n > 0 && fds[1].revents) throw std::runtime_error("HTTP server stopped");
+        if (n > 0) return;
+        if (n == 0) throw std::runtime_error("HTTP connection timed out");
+        if (errno != EINTR) throw errno_error("HTTP poll failed");
+    }
+}
+
+void http_server::serve(connection& c) {
+    auto& response        = c.response;
+    response.status       = 200;
+    response.content_type = "text/plain; charset=utf-8";
+    response.headers.clear();
+    response.body.clear();
+
+    if (!read_request(c)) return;
+    // Answers to HEAD never have a body, errors included
+    bool const head_only = c.buffer.compare(0, 5, "HEAD ") == 0;
+    if (response.status != 200) return respond(c, !head_only);
+
+    if (!head_only && c.buffer.compare(0, 4, "GET ") != 0) {
+        response.status = 405;
+        response.headers.emplace_back("Allow", "GET, HEAD");
+        return respond(c, true);
+    }
+    auto h = handlers.find(c.request.path);
+    if (h == handlers.end()) {
+        response.status = 404;
+        return respond(c, !head_only);
+    }
+    try {
+        h->second(c.request, response);
+    } catch (std::exception const& e) {
+        spdlog::warn("Failed to serve {}: {}", c.request.path, e.what());
+        response.status = 500;
+        response.headers.clear();
+        response.body.clear();
+    }
+    respond(c, !head_only);
+}
+
+bool http_server::read_request(connection& c) {
+    // The whole request, a client sending a byte at a time gets no more time than one that stalls
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_seconds);
+    auto& buffer        = c.buffer;
+    auto& request       = c.request;
+    buffer.clear();
+    size_t end = std::string::npos;
+    while (end == std::string::npos) {
+        if (buffer.size() >= max_header_size) {
+            c.response.status = 431;
+            return true;
+        }
+        wait_for(c.fd, POLLIN, deadline);
+        auto const old = buffer.size();
+        buffer.resize(max_header_size);
+        ssize_t len = read(c.fd, buffer.data() + old, max_header_size - old);
+        if (len < 0) {
+            buffer.resize(old);
+            if (errno == EINTR) continue;
+            throw errno_error("HTTP read failed");
+        }
+        buffer.resize(old + size_t(len));
+        if (len == 0) return false;  // Closed before the request was complete
+        end = buffer.find("\r\n\r\n", old < 3 ? 0 : old - 3);
+    }
+
+    // Request line: method, target, version
+    std::string_view lines(buffer.data(), end + 2);
+    auto eol        = lines.find("\r\n");
+    auto start_line = lines.substr(0, eol);
+    auto target_at  = start_line.find(' ');
+    auto version_at = start_line.rfind(' ');
+    if (target_at == std::string_view::npos || version_at <= target_at
+        || start_line.substr(version_at + 1, 5) != "HTTP/") {
+        c.response.status = 400;
+        return true;
+    }
+    auto target = start_line.substr(target_at + 1, version_at - target_at - 1);
+    auto query  = target.find('?');
+    request.path.assign(target.substr(0, query));
+    request.query.assign(query == std::string_view::npos ? "" : target.substr(query + 1));
+
+    request.headers.clear();
+    lines.remove_prefix(eol + 2);
+    while (!lines.empty()) {
+        eol        = lines.find("\r\n");
+        auto line  = lines.substr(0, eol);
+        auto colon = line.find(':');
+        lines.remove_prefix(eol + 2);
+        if (colon == std::string_view::npos) continue;
+        auto& [name, value] = request.headers.emplace_back();
+        name.assign(line.substr(0, colon));
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return char(std::tolower(c)); });
+        value.assign(trim(line.substr(colon + 1)));
+    }
+    return true;
+}
+
+void http_server::respond(connection& c, bool send_body) {
+    auto& response = c.response;
+    auto& head     = c.head;
+    if (response.status != 200) {
+        response.content_type = "text/plain; charset=utf-8";
+        if (response.body.empty()) response.body.append(reason(response.status)).append("\n");
+    }
+    head.assign("HTTP/1.1 ").append(std::to_string(response.status)).append(" ");
+    head.append(reason(response.status)).append("\r\n");
+    head.append("Content-Type: ").append(response.content_type).append("\r\n");
+    head.append("Content-Length: ").append(std::to_string(response.body.size())).append("\r\n");
+    head.append("Connection: close\r\n");
+    for (auto const& [name, value]: response.headers)
+        head.append(name).append(": ").append(value).append("\r\n");
+    head.append("\r\n");
+
+    iovec iov[2] = {
+        {head.data(),          head.size()                         },
+        {response.body.data(), send_body ? response.body.size() : 0},
+    };
+    msghdr msg{};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+    // The whole response, a client reading a little at a time can't hold the worker for long
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(send_timeout_seconds);
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        // MSG_NOSIGNAL: a client that hung up must not kill the process with SIGPIPE
+        ssize_t len = sendmsg(c.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) throw errno_error("HTTP write failed");
+            wait_for(c.fd, POLLOUT, deadline);
+            continue;
+        }
+        for (auto& v: iov) {
+            auto n     = std::min(size_t(len), v.iov_len);
+            v.iov_base = static_cast<char*>(v.iov_base) + n;
+            v.iov_len  -= n;
+            len        -= ssize_t(n);
+        }
+    }
+}
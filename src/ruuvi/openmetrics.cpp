@@ -0,0 +1,149 @@
+#include "openmetrics.hpp"
+#include "http_server.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+using namespace ruuvi;
+using namespace prometheus;
+
+namespace {
+
+void append_escaped(std::string& out, std::string const& text, bool quotes) {
+    for (auto c: text) {
+        if (c == '\\')
+            out.append("\\\\");
+        else if (c == '\n')
+            out.append("\\n");
+        else if (c == '"' && quotes)
+            out.append("\\\"");
+        else
+            out.push_back(c);
+    }
+}
+
+void append_double(std::string& out, double value) {
+    if (std::isnan(value)) {
+        out.append("NaN");
+    } else if (std::isinf(value)) {
+        out.append(value < 0 ? "-Inf" : "+Inf");
+    } else {
+        char buf[32];
+#if __cpp_lib_to_chars >= 201611L
+        auto n = std::to_chars(buf, buf + sizeof(buf), value).ptr - buf;
+#else
+        int n = std::snprintf(buf, sizeof(buf), "%.*g",
+                              std::numeric_limits<double>::max_digits10 - 1, value);
+#endif
+        out.append(buf, size_t(n));
+    }
+}
+
+// Seconds with the milliseconds as decimals
+void append_timestamp(std::string& out, int64_t timestamp_ms) {
+    char buf[32];
+    auto seconds = timestamp_ms / 1000;
+    auto millis  = timestamp_ms % 1000;
+    if (millis < 0) {
+        --seconds;
+        millis += 1000;
+    }
+    int n = std::snprintf(buf, sizeof(buf), "%lld.%03d", static_cast<long long>(seconds),
+                          int(millis));
+    out.append(buf, size_t(n));
+}
+
+/*
+ * One sample line, with an extra label after those of the metric such as le or quantile. A
+ * timestamp of 0 is left out, as prometheus-cpp does.
+ */
+void append_sample(std::string& out, std::string_view name, std::string_view suffix,
+                   ClientMetric const& m, char const* extra, double extra_value, double value) {
+    out.append(name).append(suffix);
+    if (!m.label.empty() || extra != nullptr) {
+        char sep = '{';
+        for (auto const& l: m.label) {
+            out.push_back(sep);
+            out.append(l.name).append("=\"");
+            append_escaped(out, l.value, true);
+            out.push_back('"');
+            sep = ',';
+        }
+        if (extra != nullptr) {
+            out.push_back(sep);
+            out.append(extra).append("=\"");
+            append_double(out, extra_value);
+            out.push_back('"');
+        }
+        out.push_back('}');
+    }
+    out.push_back(' ');
+    append_double(out, value);
+    if (m.timestamp_ms != 0) {
+        out.push_back(' ');
+        append_timestamp(out, m.timestamp_ms);
+    }
+    out.push_back('\n');
+}
+
+char const* type_name(MetricType type) {
+    switch (type) {
+    case MetricType::Counter: return "counter";
+    case MetricType::Gauge: return "gauge";
+    case MetricType::Summary: return "summary";
+    case MetricType::Histogram: return "histogram";
+    default: return "unknown";
+    }
+}
+
+}  // namespace
+
+bool ruuvi::prefers_openmetrics(std::string_view accept) {
+    return accept_quality(accept, "application/openmetrics-text")
+           > accept_quality(accept, "text/plain");
+}
+
+void ruuvi::serialize_openmetrics(std::vector<MetricFamily> const& families, std::string& out) {
+    constexpr std::string_view total = "_total";
+    for (auto const& f: families) {
+        std::string_view name = f.name;
+        auto counter          = f.type == MetricType::Counter;
+        if (counter && name.size() > total.size()
+            && name.substr(name.size() - total.size()) == total)
+            name.remove_suffix(total.size());
+
+        out.append("# TYPE ").append(name).append(" ").append(type_name(f.type)).append("\n");
+        if (!f.help.empty()) {
+            out.append("# HELP ").append(name).append(" ");
+            append_escaped(out, f.help, false);
+            out.append("\n");
+        }
+        for (auto const& m: f.metric) {
+            switch (f.type) {
+            case MetricType::Counter:
+                append_sample(out, name, total, m, nullptr, 0, m.counter.value);
+                break;
+            case MetricType::Gauge:
+                append_sample(out, name, "", m, nullptr, 0, m.gauge.value);
+                break;
+            case MetricType::Summary:
+                for (auto const& q: m.summary.quantile)
+                    append_sample(out, name, "", m, "quantile", q.quantile, q.value);
+                append_sample(out, name, "_sum", m, nullptr, 0, m.summary.sample_sum);
+                append_sample(out, name, "_count", m, nullptr, 0, double(m.summary.sample_count));
+                break;
+            case MetricType::Histogram:
+                for (auto const& b: m.histogram.bucket)
+                    append_sample(out, name, "_bucket", m, "le", b.upper_bound,
+                                  double(b.cumulative_count));
+                append_sample(out, name, "_sum", m, nullptr, 0, m.histogram.sample_sum);
+                append_sample(out, name, "_count", m, nullptr, 0,
+                              double(m.histogram.sample_count));
+                break;
+            default: append_sample(out, name, "", m, nullptr, 0, m.untyped.value); break;
+            }
+        }
+    }
+}
@@ -0,0 +1,233 @@
+#include "procfs.hpp"
+
+#include "diskstat.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace sys_info;
+
+namespace {
+
+// Large enough for /proc/meminfo and /proc/stat of a few cores in one read
+constexpr size_t initial_buffer_size = 4096;
+
+// Splits off the first line, without its line break
+std::string_view next_line(std::string_view& text) {
+    auto end  = text.find('\n');
+    auto line = text.substr(0, end);
+    text      = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+    return line;
+}
+
+// Splits off the next word separated by spaces, empty at the end of the line
+std::string_view next_word(std::string_view& line) {
+    auto begin = line.find_first_not_of(' ');
+    if (begin == std::string_view::npos) {
+        line = {};
+        return {};
+    }
+    auto end  = line.find(' ', begin);
+    auto word = line.substr(begin, end - begin);
+    line      = end == std::string_view::npos ? std::string_view() : line.substr(end);
+    return word;
+}
+
+template<class T> bool to_number(std::string_view word, T& value) {
+    auto [end, ec] = std::from_chars(word.data(), word.data() + word.size(), value);
+    return ec == std::errc() && end == word.data() + word.size();
+}
+
+/*
+ * meminfo_keys sorted by name with their index, built at compile time so that each line is
+ * looked up with a binary search
+ */
+struct key_index {
+    std::string_view name;
+    uint8_t index;
+};
+
+constexpr std::array<key_index, meminfo_key_count> sorted_meminfo_keys() {
+    std::array<key_index, meminfo_key_count> keys{};
+    for (size_t i = 0; i < meminfo_key_count; ++i) {
+        key_index k{meminfo_keys[i], uint8_t(i)};
+        size_t j = i;
+        for (; j > 0 && k.name < keys[j - 1].name; --j) keys[j] = keys[j - 1];
+        keys[j] = k;
+    }
+    return keys;
+}
+
+constexpr auto meminfo_index = sorted_meminfo_keys();
+
+int find_meminfo_key(std::string_view name) {
+    auto it = std::lower_bound(meminfo_index.begin(), meminfo_index.end(), name,
+                               [](key_index const& k, std::string_view n) { return k.name < n; });
+    return it != meminfo_index.end() && it->name == name ? it->index : -1;
+}
+
+// Reads the states that follow the name of a cpu line, without splitting it
+// into words first since there are ten numbers on each line of each CPU
+bool parse_cpu_line(std::string_view line, cpu_times& cpu) {
+    auto p         = line.data();
+    auto const end = p + line.size();
+    size_t n       = 0;
+    for (; n < cpu_times::state_count; ++n) {
+        while (p != end && *p == ' ') ++p;
+        if (p == end) break;
+        auto [next, ec] = std::from_chars(p, end, cpu.ticks[n]);
+        if (ec != std::errc() || (next != end && *next != ' ')) return false;
+        p = next;
+    }
+    std::fill(cpu.ticks.begin() + ptrdiff_t(n), cpu.ticks.end(), 0);
+    return n > cpu_times::idle;
+}
+
+}  // namespace
+
+proc_file::proc_file(std::string path): path_(std::move(path)) {}
+
+proc_file::proc_file(proc_file&& other) noexcept
+    : path_(std::move(other.path_)), fd(std::exchange(other.fd, -1)),
+      buffer(std::move(other.buffer)) {}
+
+proc_file::~proc_file() {
+    if (fd >= 0) close(fd);
+}
+
+bool proc_file::read(std::string_view& contents) {
+    if (fd < 0) {
+        fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+    }
+    if (buffer.empty()) buffer.resize(initial_buffer_size);
+    size_t size = 0;
+    while (true) {
+        auto n = pread(fd, buffer.data() + size, buffer.size() - size, off_t(size));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int e = errno;
+            close(fd);
+            fd    = -1;
+            errno = e;
+            return false;
+        }
+        if (n == 0) break;
+        size += size_t(n);
+        // The next scrape reads the whole file at once
+        if (size == buffer.size()) buffer.resize(2 * buffer.size());
+    }
+    contents = std::string_view(buffer.data(), size);
+    return true;
+}
+
+uint32_t sys_info::parse_meminfo(std::string_view text, meminfo_values& values) {
+    constexpr uint32_t all = (uint32_t(1) << meminfo_key_count) - 1;
+    uint32_t found         = 0;
+    while (!text.empty() && found != all) {
+        auto line  = next_line(text);
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+        auto key = find_meminfo_key(line.substr(0, colon));
+        if (key < 0) continue;
+
+        line.remove_prefix(colon + 1);
+        uint64_t value;
+        if (!to_number(next_word(line), value)) continue;
+        auto unit = next_word(line);
+        if (unit == "kB")
+            value *= 1000;
+        else if (unit == "MB")
+            value *= 1'000'000;
+        else if (!unit.empty() && unit != "B")
+            continue;
+        values[size_t(key)] = value;
+        found |= uint32_t(1) << unsigned(key);
+    }
+    return found;
+}
+
+bool sys_info::parse_stat(std::string_view text, cpu_times& total) {
+    auto line = next_line(text);
+    return next_word(line) == "cpu" && parse_cpu_line(line, total);
+}
+
+bool sys_info::parse_stat(std::string_view text, cpu_times& total,
+                          std::vector<core_times>& cores) {
+    cores.clear();
+    if (!parse_stat(text, total)) return false;
+    next_line(text);
+    while (text.substr(0, 3) == "cpu") {
+        auto line  = next_line(text);
+        auto name  = next_word(line);
+        auto& core = cores.emplace_back();
+        if (!to_number(name.substr(3), core.cpu) || !parse_cpu_line(line, core.times)) {
+            cores.pop_back();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sys_info::parse_netstat(std::string_view text, netstat_values& out) {
+    static constexpr std::pair<std::string_view, unsigned long netstat_values::*> counters[] = {
+        {"InOctets",       &netstat_values::in_octets       },
+        {"OutOctets",      &netstat_values::out_octets      },
+        {"InMcastOctets",  &netstat_values::in_mcast_octets },
+        {"OutMcastOctets", &netstat_values::out_mcast_octets},
+    };
+
+    // The line of names is followed by the line of values
+    std::string_view names;
+    while (!text.empty() && names.empty()) {
+        auto line = next_line(text);
+        if (line.substr(0, 6) == "IpExt:") names = line.substr(6);
+    }
+    auto values = next_line(text);
+    if (names.empty() || values.substr(0, 6) != "IpExt:") return false;
+    values.remove_prefix(6);
+
+    uint32_t found = 0;
+    while (!names.empty()) {
+        auto name  = next_word(names);
+        auto value = next_word(values);
+        if (name.empty() || value.empty()) break;
+        for (size_t i = 0; i < std::size(counters); ++i) {
+            if (name != counters[i].first) continue;
+            if (!to_number(value, out.*counters[i].second)) return false;
+            found |= uint32_t(1) << i;
+        }
+    }
+    return found == (uint32_t(1) << std::size(counters)) - 1;
+}
+
+void sys_info::parse_diskstats(std::string_view text, std::vector<Diskstat>& out) {
+    out.clear();
+    while (!text.empty()) {
+        auto line  = next_line(text);
+        auto next  = [&line](auto& value) { return to_number(next_word(line), value); };
+        auto& d    = out.emplace_back();
+        bool valid = next(d.major) && next(d.minor) && !(d.devname = next_word(line)).empty()
+                  && next(d.ReadCompleted) && next(d.ReadMerged) && next(d.ReadSectors)
+                  && next(d.ReadTime) && next(d.WriteCompleted) && next(d.WriteMerged)
+                  && next(d.WriteSectors) && next(d.WriteTime) && next(d.IOInProgress)
+                  && next(d.IOTime) && next(d.WeightedIOTime);
+        if (!valid) {
+            out.pop_back();
+            continue;
+        }
+        // Fields added by later kernels, left at 0 from the first one missing
+        next(d.DiscardCompleted) && next(d.DiscardMerged) && next(d.DiscardSectors)
+            && next(d.DiscardTime) && next(d.FlushComplete) && next(d.FlushTime);
+    }
+}
+
+bool sys_info::parse_integer(std::string_view text, long& value) {
+    while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.remove_suffix(1);
+    return to_number(text, value);
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace sys_info {
+
+struct Diskstat;
+
+/**
+ * @brief A procfs file kept open between scrapes
+ *
+ * read() preads the file from offset 0, which has the kernel generate it again, into a buffer that
+ * keeps its capacity, so that reading allocates nothing once the buffer fits the file. A file that
+ * failed to open or read is opened again on the next call.
+ */
+class proc_file {
+public:
+    explicit proc_file(std::string path);
+    ~proc_file();
+    proc_file(proc_file&& other) noexcept;
+    proc_file(proc_file const&)            = delete;
+    proc_file& operator=(proc_file const&) = delete;
+
+    /**
+     * @brief read Sets contents to the whole file, valid until the next call
+     * @return False if the file can't be opened or read, with errno set
+     */
+    bool read(std::string_view& contents);
+
+    std::string const& path() const noexcept { return path_; }
+
+private:
+    std::string path_;
+    int fd = -1;
+    std::string buffer;
+};
+
+/**
+ * @brief Lines of /proc/meminfo read by parse_meminfo(), in the order of meminfo_values
+ */
+inline constexpr std::string_view meminfo_keys[] = {
+    "MemTotal",
+    "MemFree",
+    "MemAvailable",
+    "Buffers",
+    "Cached",
+    "SwapCached",
+    "Active",
+    "Inactive",
+    "SwapTotal",
+    "SwapFree",
+    "Dirty",
+    "Writeback",
+};
+inline constexpr size_t meminfo_key_count = std::size(meminfo_keys);
+using meminfo_values                      = std::array<uint64_t, meminfo_key_count>;
+
+/**
+ * @brief parse_meminfo Sets values[i] to the value of the line meminfo_keys[i], in bytes
+ * Stops once every key has been found.
+ * @return A mask with bit i set if meminfo_keys[i] was found with a known unit
+ */
+uint32_t parse_meminfo(std::string_view text, meminfo_values& values);
+
+/**
+ * @brief Time spent in each state since boot, in USER_HZ ticks, in the order of /proc/stat
+ */
+struct cpu_times {
+    enum state { user, nice, system, idle, iowait, irq, softirq, steal, guest, guest_nice };
+    static constexpr size_t state_count = guest_nice + 1;
+
+    std::array<unsigned long long, state_count> ticks{};
+};
+
+/**
+ * @brief parse_stat Reads the first line of /proc/stat, the sum over all CPUs
+ * States missing from older kernels are left at 0.
+ * @return False if the line is missing or has fewer than the first four states
+ */
+bool parse_stat(std::string_view text, cpu_times& total);
+
+/**
+ * @brief The times of one CPU, from a cpuN line of /proc/stat
+ */
+struct core_times {
+    unsigned cpu;  // N, with gaps where CPUs are offline
+    cpu_times times;
+};
+
+/**
+ * @brief parse_stat Also reads the cpuN lines that follow the first line into cores, in one pass
+ * Stops at the first line after them, before the long intr line. The capacity of cores is kept.
+ * @return False as the first overload, or if a cpuN line has fewer than the first four states
+ */
+bool parse_stat(std::string_view text, cpu_times& total, std::vector<core_times>& cores);
+
+/**
+ * @brief Counters of the IpExt lines of /proc/net/netstat
+ */
+struct netstat_values {
+    unsigned long in_octets;
+    unsigned long out_octets;
+    unsigned long in_mcast_octets;
+    unsigned long out_mcast_octets;
+};
+
+/**
+ * @brief parse_netstat Finds the counters by their names in the IpExt header line
+ * @return False if the IpExt lines or one of the counters are missing
+ */
+bool parse_netstat(std::string_view text, netstat_values& out);
+
+/**
+ * @brief parse_diskstats Replaces out with a Diskstat per line of /proc/diskstats
+ * The discard and flush fields of kernels before 4.18 and 5.5 are left at 0, and lines with fewer
+ * than the eleven fields of older kernels are skipped. The capacity of out is kept.
+ */
+void parse_diskstats(std::string_view text, std::vector<Diskstat>& out);
+
+/**
+ * @brief parse_integer Reads a sysfs attribute holding a single number, like a thermal zone's temp
+ */
+bool parse_integer(std::string_view text, long& value);
+
+}  // namespace sys_info
@@ -0,0 +1,606 @@
+#include "remote_write.hpp"
+#include "ruuvi_prometheus_exposer.hpp"
+#include "snappy.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <spdlog/spdlog.h>
+
+using namespace ruuvi;
+using namespace prometheus;
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+using label = std::pair<std::string, std::string>;
+
+/*
+ * Protocol buffers encoding of the remote write messages:
+ *   WriteRequest { repeated TimeSeries timeseries = 1; }
+ *   TimeSeries   { repeated Label labels = 1; repeated Sample samples = 2; }
+ *   Label        { string name = 1; string value = 2; }
+ *   Sample       { double value = 1; int64 timestamp = 2; }
+ */
+enum wire_type : uint8_t { varint = 0, fixed64 = 1, length_delimited = 2 };
+
+void append_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7u;
+    }
+    out.push_back(char(v));
+}
+
+size_t varint_size(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7u;
+        ++n;
+    }
+    return n;
+}
+
+void append_key(std::string& out, unsigned field, wire_type type) {
+    out.push_back(char(field << 3u | type));
+}
+
+void append_string(std::string& out, unsigned field, std::string_view s) {
+    append_key(out, field, length_delimited);
+    append_varint(out, s.size());
+    out.append(s);
+}
+
+// A sample waiting to be sent, its labels already encoded as the fields of a TimeSeries
+struct pending_sample {
+    std::string labels;
+    double value;
+    int64_t timestamp_ms;
+};
+
+void append_timeseries(std::string& out, pending_sample const& s) {
+    size_t sample_size = 1 + 8 + 1 + varint_size(uint64_t(s.timestamp_ms));
+    append_key(out, 1, length_delimited);
+    append_varint(out, s.labels.size() + 1 + varint_size(sample_size) + sample_size);
+    out.append(s.labels);
+    append_key(out, 2, length_delimited);
+    append_varint(out, sample_size);
+    append_key(out, 1, fixed64);
+    uint64_t bits;
+    std::memcpy(&bits, &s.value, sizeof(bits));
+    for (unsigned i = 0; i < 8; ++i) out.push_back(char(bits >> (8 * i)));
+    append_key(out, 2, varint);
+    append_varint(out, uint64_t(s.timestamp_ms));
+}
+
+// Bucket bounds and quantiles as label values, the way the text format writes them
+std::string format_double(double v) {
+    if (std::isinf(v)) return v < 0 ? "-Inf" : "+Inf";
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%.*g", std::numeric_limits<double>::max_digits10 - 1,
+                          v);
+    return std::string(buf, size_t(n));
+}
+
+/*
+ * Splits families into samples, with the labels of each series sorted by name as remote write
+ * requires
+ */
+class sample_writer {
+public:
+    sample_writer(std::vector<label> const& l, std::deque<pending_sample>& o)
+        : external(l), out(o) {}
+
+    void add(MetricFamily const& f, int64_t now_ms) {
+        for (auto const& m: f.metric) {
+            auto ts = m.timestamp_ms != 0 ? m.timestamp_ms : now_ms;
+            switch (f.type) {
+            case MetricType::Counter: add(f.name, m, nullptr, m.counter.value, ts); break;
+            case MetricType::Gauge: add(f.name, m, nullptr, m.gauge.value, ts); break;
+            case MetricType::Summary:
+                for (auto const& q: m.summary.quantile) {
+                    label l{"quantile", format_double(q.quantile)};
+                    add(f.name, m, &l, q.value, ts);
+                }
+                add(f.name + "_sum", m, nullptr, m.summary.sample_sum, ts);
+                add(f.name + "_count", m, nullptr, double(m.summary.sample_count), ts);
+                break;
+            case MetricType::Histogram:
+                for (auto const& b: m.histogram.bucket) {
+                    label l{"le", format_double(b.upper_bound)};
+                    add(f.name + "_bucket", m, &l, double(b.cumulative_count), ts);
+                }
+                add(f.name + "_sum", m, nullptr, m.histogram.sample_sum, ts);
+                add(f.name + "_count", m, nullptr, double(m.histogram.sample_count), ts);
+                break;
+            default: add(f.name, m, nullptr, m.untyped.value, ts); break;
+            }
+        }
+    }
+
+private:
+    std::vector<label> const& external;
+    std::deque<pending_sample>& out;
+    std::vector<std::pair<std::string_view, std::string_view>> sorted;
+
+    void add(std::string const& name, ClientMetric const& m, label const* extra, double value,
+             int64_t ts) {
+        sorted.clear();
+        sorted.emplace_back("__name__", name);
+        for (auto const& l: m.label) sorted.emplace_back(l.name, l.value);
+        if (extra != nullptr) sorted.emplace_back(extra->first, extra->second);
+        for (auto const& l: external) {
+            // The labels of the metric take precedence
+            bool taken = std::any_of(sorted.begin(), sorted.end(),
+                                     [&l](auto const& s) { return s.first == l.first; });
+            if (!taken) sorted.emplace_back(l.first, l.second);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        auto& s = out.emplace_back();
+        for (auto const& [n, v]: sorted) {
+            append_key(s.labels, 1, length_delimited);
+            append_varint(s.labels, 1 + varint_size(n.size()) + n.size() + 1
+                                        + varint_size(v.size()) + v.size());
+            append_string(s.labels, 1, n);
+            append_string(s.labels, 2, v);
+        }
+        s.value        = value;
+        s.timestamp_ms = ts;
+    }
+};
+
+int64_t wall_clock_ms() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+std::runtime_error errno_error(std::string const& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+struct http_url {
+    std::string host;  // Without the brackets of an IPv6 address
+    std::string port = "80";
+    std::string path = "/";
+};
+
+http_url parse_url(std::string const& full) {
+    constexpr std::string_view scheme = "http://";
+    std::string_view url(full);
+    if (url.substr(0, scheme.size()) != scheme)
+        throw std::invalid_argument("Only http:// remote write URLs are supported: " + full);
+    url.remove_prefix(scheme.size());
+    http_url r;
+    auto slash = url.find('/');
+    if (slash != std::string_view::npos) {
+        r.path = std::string(url.substr(slash));
+        url    = url.substr(0, slash);
+    }
+    auto colon = url.rfind(':');
+    if (colon != std::string_view::npos && url.find(']', colon) == std::string_view::npos) {
+        r.port = std::string(url.substr(colon + 1));
+        url    = url.substr(0, colon);
+    }
+    if (url.size() >= 2 && url.front() == '[' && url.back() == ']')
+        url = url.substr(1, url.size() - 2);
+    r.host = std::string(url);
+    if (r.host.empty() || r.port.empty())
+        throw std::invalid_argument("Invalid remote write URL: " + full);
+    return r;
+}
+
+// host[:port] as the Host header wants it, the default port left out (RFC 7230, section 5.4)
+std::string host_header(http_url const& url) {
+    auto host = url.host.find(':') == std::string::npos ? url.host : "[" + url.host + "]";
+    return url.port == "80" ? host : host + ":" + url.port;
+}
+
+// Upper bounds of the buckets, observations are counted under a mutex as prometheus-cpp does
+class histogram {
+public:
+    explicit histogram(std::vector<double> b): bounds(std::move(b)), counts(bounds.size() + 1) {}
+
+    void observe(double v) {
+        auto bucket = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+        std::lock_guard g(mtx);
+        ++counts[size_t(bucket)];
+        sum += v;
+    }
+
+    void collect(ClientMetric::Histogram& h) const {
+        std::lock_guard g(mtx);
+        uint64_t total = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            total += counts[i];
+            auto bound = i < bounds.size() ? bounds[i] : std::numeric_limits<double>::infinity();
+            h.bucket.push_back({total, bound});
+        }
+        h.sample_count = total;
+        h.sample_sum   = sum;
+    }
+
+private:
+    std::vector<double> const bounds;
+    mutable std::mutex mtx;
+    std::vector<uint64_t> counts;
+    double sum = 0;
+};
+
+enum result { success, failure, rejected };
+constexpr char const* results[] = {"success", "failure", "rejected"};
+enum drop_reason { overflow, refused };
+constexpr char const* drop_reasons[] = {"overflow", "rejected"};
+
+}  // namespace
+
+void ruuvi::encode_write_request(std::vector<MetricFamily> const& families, int64_t timestamp_ms,
+                                 std::string& out, std::vector<label> const& labels) {
+    std::deque<pending_sample> samples;
+    sample_writer writer(labels, samples);
+    for (auto const& f: families) writer.add(f, timestamp_ms);
+    for (auto const& s: samples) append_timeseries(out, s);
+}
+
+class remote_writer::Impl {
+public:
+    Impl(remote_write_options o, sources s, std::shared_ptr<spool> r)
+        : opts(std::move(o)),
+          url(parse_url(opts.url)),
+          host(host_header(url)),
+          inputs(std::move(s)),
+          spooled(std::move(r)) {
+        // A zero interval would collect and encode in a busy loop
+        if (opts.interval.count() <= 0)
+            throw std::invalid_argument("The remote write interval must be positive");
+        // The families of a reading, and how many readings fit in a batch
+        append_reading(format_5_reading{}, 0, reading_families);
+        size_t samples = 0;
+        for (auto const& f: reading_families) {
+            reading_names.push_back(f.name);
+            samples += f.metric.size();
+        }
+        readings_per_batch = std::max<size_t>(1, opts.max_batch / samples);
+    }
+
+    void start() {
+        auto next_collect = clock::now();
+        auto retry_at     = clock::time_point{};
+        clock::duration backoff{};
+        std::unique_lock lk(mtx);
+        while (!stopping) {
+            lk.unlock();
+            auto now = clock::now();
+            if (now >= next_collect) {
+                collect_samples();
+                next_collect = std::max(next_collect + opts.interval, now);
+            }
+            while ((!buffer.empty() || spool_pending()) && now >= retry_at && !stopping.load()) {
+                if (!buffer.empty() ? send_batch() : send_spooled()) {
+                    backoff = {};
+                } else {
+                    backoff  = backoff == clock::duration{}
+                                   ? clock::duration(opts.min_backoff)
+                                   : std::min<clock::duration>(backoff * 2, opts.max_backoff);
+                    retry_at = clock::now() + backoff;
+                }
+                now = clock::now();
+                // Collecting is not held up by a long backlog
+                if (now >= next_collect) break;
+            }
+            lk.lock();
+            auto wake = buffer.empty() && !spool_pending() ? next_collect
+                                                           : std::min(next_collect, retry_at);
+            cv.wait_until(lk, wake, [this] { return stopping.load(); });
+        }
+    }
+
+    void stop() noexcept {
+        {
+            std::lock_guard g(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+    }
+
+    std::vector<MetricFamily> Collect() const {
+        std::vector<MetricFamily> families;
+        auto add = [&families](char const* name, char const* help, MetricType type) -> auto& {
+            auto& f = families.emplace_back();
+            f.name  = name;
+            f.help  = help;
+            f.type  = type;
+            return f;
+        };
+        auto& requests = add("ruuvi_remote_write_requests_total",
+                             "Number of remote write requests by result", MetricType::Counter);
+        for (size_t r = 0; r < std::size(results); ++r) {
+            auto& m = requests.metric.emplace_back();
+            m.label.push_back({"result", results[r]});
+            m.counter.value = double(request_count[r].load(std::memory_order_relaxed));
+        }
+        add("ruuvi_remote_write_samples_total", "Number of samples sent", MetricType::Counter)
+            .metric.emplace_back()
+            .counter.value = double(sent.load(std::memory_order_relaxed));
+        auto& dropped = add("ruuvi_remote_write_dropped_samples_total",
+                            "Number of samples dropped without being sent", MetricType::Counter);
+        for (size_t r = 0; r < std::size(drop_reasons); ++r) {
+            auto& m = dropped.metric.emplace_back();
+            m.label.push_back({"reason", drop_reasons[r]});
+            m.counter.value = double(drop_count[r].load(std::memory_order_relaxed));
+        }
+        add("ruuvi_remote_write_buffered_samples", "Number of samples waiting to be sent",
+            MetricType::Gauge)
+            .metric.emplace_back()
+            .gauge.value = double(buffered.load(std::memory_order_relaxed));
+        batch_sizes.collect(add("ruuvi_remote_write_batch_samples",
+                                "Number of samples in the requests sent", MetricType::Histogram)
+                                .metric.emplace_back()
+                                .histogram);
+        durations.collect(add("ruuvi_remote_write_request_duration_seconds",
+                              "Duration of remote write requests, including failed ones",
+                              MetricType::Histogram)
+                              .metric.emplace_back()
+                              .histogram);
+        return families;
+    }
+
+private:
+    remote_write_options const opts;
+    http_url const url;
+    std::string const host;  // Of the Host header
+    sources const inputs;
+    std::shared_ptr<spool> const spooled;
+    std::vector<std::string> reading_names;  // Left out of the sources with a spool
+    size_t readings_per_batch = 1;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::atomic_bool stopping = false;
+
+    // Only used by the thread running start(), reused between requests
+    std::deque<pending_sample> buffer;
+    std::string request;
+    std::string compressed;
+    std::string head;
+    std::array<char, 256> response;
+    std::vector<spooled_reading> readings;
+    std::vector<MetricFamily> reading_families;
+    std::deque<pending_sample> replay;  // Of the readings, until they are sent
+
+    std::array<std::atomic<uint64_t>, std::size(results)> request_count{};
+    std::array<std::atomic<uint64_t>, std::size(drop_reasons)> drop_count{};
+    std::atomic<uint64_t> sent   = 0;
+    std::atomic<size_t> buffered = 0;
+    histogram batch_sizes{{10, 100, 500, 1000, 2000, 5000, 10000}};
+    histogram durations{{0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}};
+
+    void collect_samples() {
+        auto now = wall_clock_ms();
+        sample_writer writer(opts.labels, buffer);
+        for (auto const& source: inputs) {
+            // A source that fails, like sysinfo on an unreadable file, doesn't hold up the others
+            try {
+                for (auto const& f: source->Collect())
+                    if (!spooled || !is_reading_family(f.name)) writer.add(f, now);
+            } catch (std::exception const& e) {
+                spdlog::warn("Failed to collect the metrics to push: {}", e.what());
+            }
+        }
+        for (auto const& f: Collect()) writer.add(f, now);
+
+        if (buffer.size() > opts.max_buffered) {
+            auto excess = buffer.size() - opts.max_buffered;
+            buffer.erase(buffer.begin(), buffer.begin() + std::ptrdiff_t(excess));
+            drop_count[overflow].fetch_add(excess, std::memory_order_relaxed);
+        }
+        buffered.store(buffer.size(), std::memory_order_relaxed);
+    }
+
+    bool is_reading_family(std::string const& name) const {
+        return std::find(reading_names.begin(), reading_names.end(), name) != reading_names.end();
+    }
+
+    bool spool_pending() const { return spooled && (!replay.empty() || spooled->pending() > 0); }
+
+    // Sends the oldest samples, false if they should be retried
+    bool send_batch() {
+        auto n = std::min(opts.max_batch, buffer.size());
+        if (!send(buffer, n)) return false;
+        buffer.erase(buffer.begin(), buffer.begin() + std::ptrdiff_t(n));
+        buffered.store(buffer.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // Sends the oldest spooled readings, which stay in the spool until they have been sent
+    bool send_spooled() {
+        if (replay.empty()) {
+            try {
+                spooled->read(readings, readings_per_batch);
+            } catch (std::exception const& e) {
+                spdlog::warn("Failed to read spooled readings: {}", e.what());
+                return false;
+            }
+            reading_families.clear();
+            ble::AdvPacket p;
+            format_5_reading r;
+            for (auto const& s: readings) {
+                p.mac             = s.mac;
+                p.signal_strength = s.signal_strength;
+                p.set_manufacturer_data(s.payload.data(), s.payload.size());
+                decode_format_5(p, r);
+                append_reading(r, s.timestamp_ms, reading_families);
+            }
+            sample_writer writer(opts.labels, replay);
+            for (auto const& f: reading_families) writer.add(f, 0);
+        }
+        if (!send(replay, replay.size())) return false;
+        spooled->acknowledge(readings.size());
+        replay.clear();
+        return true;
+    }
+
+    // Sends the n first samples and counts them as sent or dropped, false if they should be
+    // retried
+    bool send(std::deque<pending_sample> const& samples, size_t n) {
+        request.clear();
+        for (size_t i = 0; i < n; ++i) append_timeseries(request, samples[i]);
+        snappy_compress(request, compressed);
+
+        auto begin = clock::now();
+        int status = 0;
+        try {
+            status = post(compressed);
+        } catch (std::exception const& e) {
+            spdlog::warn("Remote write to {} failed: {}", opts.url, e.what());
+        }
+        durations.observe(std::chrono::duration<double>(clock::now() - begin).count());
+
+        bool retry = status == 0 || status == 429 || status >= 500;
+        if (retry) {
+            if (status != 0) spdlog::warn("Remote write to {} answered {}", opts.url, status);
+            request_count[failure].fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (status >= 200 && status < 300) {
+            request_count[success].fetch_add(1, std::memory_order_relaxed);
+            sent.fetch_add(n, std::memory_order_relaxed);
+            batch_sizes.observe(double(n));
+        } else {
+            spdlog::warn("Remote write to {} rejected {} samples with {}", opts.url, n, status);
+            request_count[rejected].fetch_add(1, std::memory_order_relaxed);
+            drop_count[refused].fetch_add(n, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // The status of the response, throws if there is none
+    int post(std::string const& body) {
+        int fd = connect_to_url();
+        head.clear();
+        head.append("POST ").append(url.path).append(" HTTP/1.1\r\nHost: ").append(host);
+        head.append("\r\nUser-Agent: ruuvi-exposer\r\nContent-Type: application/x-protobuf");
+        head.append("\r\nContent-Encoding: snappy\r\nX-Prometheus-Remote-Write-Version: 0.1.0");
+        head.append("\r\nContent-Length: ").append(std::to_string(body.size()));
+        head.append("\r\nConnection: close\r\n\r\n");
+
+        try {
+            iovec iov[2] = {{head.data(), head.size()},
+                            {const_cast<char*>(body.data()), body.size()}};
+            msghdr msg{};
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = 2;
+            while (msg.msg_iovlen > 0) {
+                auto len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+                if (len < 0 && errno == EINTR) continue;
+                if (len < 0) throw errno_error("Failed to send the request");
+                // Skips what was written, partly written buffers are continued
+                while (msg.msg_iovlen > 0 && size_t(len) >= msg.msg_iov->iov_len) {
+                    len -= ssize_t(msg.msg_iov->iov_len);
+                    ++msg.msg_iov;
+                    --msg.msg_iovlen;
+                }
+                if (msg.msg_iovlen > 0) {
+                    msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + len;
+                    msg.msg_iov->iov_len -= size_t(len);
+                }
+            }
+
+            // Only the status line is needed, the rest is left unread
+            size_t size = 0;
+            while (size < response.size()) {
+                auto len = read(fd, response.data() + size, response.size() - size);
+                if (len < 0 && errno == EINTR) continue;
+                if (len < 0) throw errno_error("Failed to read the response");
+                if (len == 0) break;
+                size += size_t(len);
+                if (std::string_view(response.data(), size).find("\r\n") != std::string_view::npos)
+                    break;
+            }
+            close(fd);
+            fd = -1;
+
+            // HTTP/1.1 204 No Content
+            std::string_view line(response.data(), size);
+            auto space = line.find(' ');
+            int status = 0;
+            if (line.substr(0, 5) != "HTTP/" || space == std::string_view::npos
+                || std::from_chars(line.data() + space + 1, line.data() + size, status).ec
+                       != std::errc{})
+                throw std::runtime_error("Invalid response");
+            return status;
+        } catch (...) {
+            if (fd >= 0) close(fd);
+            throw;
+        }
+    }
+
+    int connect_to_url() {
+        addrinfo hints{};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addrs   = nullptr;
+        if (int e = getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &addrs); e != 0)
+            throw std::runtime_error("Failed to resolve " + url.host + ": " + gai_strerror(e));
+
+        auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(opts.timeout);
+        timeval tv{};
+        tv.tv_sec  = time_t(timeout.count() / 1'000'000);
+        tv.tv_usec = suseconds_t(timeout.count() % 1'000'000);
+        int fd     = -1;
+        int error  = 0;
+        for (auto a = addrs; a != nullptr && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd < 0) continue;
+            // Also bounds connect()
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            if (connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                error = errno;
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd < 0) {
+            errno = error;
+            throw errno_error("Failed to connect to " + url.host + ":" + url.port);
+        }
+        return fd;
+    }
+};
+
+remote_writer::remote_writer(remote_write_options opts, sources s, std::shared_ptr<spool> readings)
+    : impl(std::make_unique<Impl>(std::move(opts), std::move(s), std::move(readings))) {}
+
+remote_writer::~remote_writer() = default;
+
+void remote_writer::start() {
+    impl->start();
+}
+
+void remote_writer::stop() noexcept {
+    impl->stop();
+}
+
+std::vector<MetricFamily> remote_writer::Collect() const {
+    return impl->Collect();
+}
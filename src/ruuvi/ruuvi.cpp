@@ -1,5 +1,7 @@
 #include "ruuvi.hpp"
+#include "formats.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <future>
@@ -8,184 +10,184 @@
 using namespace ble;
 using namespace ruuvi;
 
-namespace {
-
-template<typename I>
-std::string n2hexstr(I w, size_t hex_len = sizeof(I) << 1) {
-    static constexpr char digits[] = "0123456789ABCDEF";
-    std::string rc(hex_len, '0');
-    for (size_t i = 0, j = (hex_len - 1) * 4; i < hex_len; ++i, j -= 4)
-        rc[i] = digits[(w >> j) & 0x0f];
-    return rc;
-}
-
-}  // namespace
 // ------------------------------------------------------------------------------------
 
 float ruuvi_data_format_5::acceleration_total() const {
     return std::hypot(acceleration[0], acceleration[1], acceleration[2]);
 }
 
-int ruuvi::identify_format(BlePacket const& p) {
+float format_5_reading::acceleration_total() const {
+    return std::hypot(acceleration[0], acceleration[1], acceleration[2]);
+}
+
+int ruuvi::identify_format(AdvPacket const& p) {
     if (p.manufacturer_id != 0x0499) return not_ruuvitag;
-    if (p.manufacturer_data[0] == 0x03) return 3;
-    if (p.manufacturer_data[0] == 0x04) return 4;
-    if (p.manufacturer_data[0] == 0x05) return 5;
-    if (p.manufacturer_data[0] == 0x08) return 8;
-    return unknown_format;
+    if (p.manufacturer_data_size() == 0) return unknown_format;
+    switch (auto id = p.manufacturer_data()[0]) {
+        case 0x03:
+        case 0x04:
+        case 0x05:
+        case 0x06:
+        case 0x08:
+        case 0xE1: return id;
+        default: return unknown_format;
+    }
 }
 
-ruuvi_data_format_5 ruuvi::convert_data_format_5(BlePacket const& p,
-                                                 bool throw_on_error) {
-    ruuvi_data_format_5 result;
-    auto& data = p.manufacturer_data;
+int ruuvi::identify_format(BlePacket const& p) {
+    return identify_format(to_adv_packet(p));
+}
 
-    auto _throw = [throw_on_error, &result](std::string const& s) {
-        if (throw_on_error)
-            throw std::runtime_error("Data format 5 converison failed: " + s);
-        if (!result.error_msg.empty()) result.error_msg += " - ";
-        result.error_msg       += s;
-        result.contains_errors = true;
-    };
+ruuvi_data_format_5 ruuvi::convert_data_format_5(BlePacket const& p, bool throw_on_error) {
+    return convert_data_format_5(to_adv_packet(p), throw_on_error);
+}
 
-    if (p.manufacturer_data.size() != 24) {
-        _throw("Expected data size 24, got "
-               + std::to_string(p.manufacturer_data.size()));
-    }
-    if (data[0] != 0x05)
-        _throw("Expected data format 5, got " + std::to_string(data[0]));
-
-    // Read values
-    uint16_t temperature    = (static_cast<uint16_t>(data[1]) << 8u) | data[2];
-    uint16_t humidity       = (static_cast<uint16_t>(data[3]) << 8u) | data[4];
-    uint16_t pressure       = (static_cast<uint16_t>(data[5]) << 8u) | data[6];
-    uint16_t acceleration_x = (static_cast<uint16_t>(data[7] << 8u) | data[8]);
-    uint16_t acceleration_y = (static_cast<uint16_t>(data[9] << 8u) | data[10]);
-    uint16_t acceleration_z =
-        (static_cast<uint16_t>(data[11] << 8u) | data[12]);
-    uint16_t battery_voltage = (static_cast<uint16_t>(data[13]) << 3u)
-                             | ((data[14] & 0b1110'0000u) >> 5u);
-    int8_t tx_power          = data[14] & 0b0001'1111u;
-    uint8_t movement_counter = data[15];
-    uint16_t measurement_sequence =
-        (static_cast<uint16_t>(data[16]) << 8u) | data[17];
-
-    std::string packet_mac;
-    packet_mac.reserve(18);
-    for (size_t i = 18; i < 24; ++i) {
-        packet_mac += (n2hexstr(data[i], 2));
-        packet_mac.push_back(':');
-    }
-    packet_mac.pop_back();
+ruuvi_data_format_3 ruuvi::convert_data_format_3(BlePacket const& p, bool throw_on_error) {
+    return convert_data_format_3(to_adv_packet(p), throw_on_error);
+}
 
-    result.contains_errors = false;
+namespace {
 
-    // Error checking
-    // Convert values and populate result
-    if (temperature == 0x8000)
-        _throw("Temperature 0x8000 invalid");
+// Copies a field decoded from the format table, or sets its error bit and keeps the default
+template<class T>
+inline void take(measurement const& m, field f, uint16_t error, T& out, uint16_t& errors) {
+    if (m.valid(f))
+        out = static_cast<T>(m[f]);
     else
-        result.temperature = 0.005f * static_cast<int16_t>(temperature);
+        errors |= error;
+}
 
-    if (humidity == 0xFFFF)
-        _throw("Humidity 0xFFFF invalid");
-    else if (humidity > 40'000)
-        _throw("Humidity > 40 000 (100%) invalid");
-    else
-        result.humidity = 0.0025f * humidity;
+}  // namespace
 
-    if (pressure == 0xFFFF)
-        _throw("Pressure 0xFFFF invalid");
-    else
-        result.pressure = uint32_t(pressure) + 50'000;
+bool ruuvi::decode_format_5(uint8_t const* data, size_t size,
+                            format_5_reading& result) noexcept {
+    result             = format_5_reading{};
+    result.data_size   = static_cast<uint8_t>(std::min<size_t>(size, 255));
+    result.data_format = size > 0 ? data[0] : 0;
 
-    if (acceleration_x == 0x8000)
-        _throw("X-acceleration 0x8000 invalid");
-    else
-        result.acceleration[0] = static_cast<int16_t>(acceleration_x) / 1000.0f;
-    if (acceleration_y == 0x8000)
-        _throw("Y-acceleration 0x8000 invalid");
-    else
-        result.acceleration[1] = static_cast<int16_t>(acceleration_y) / 1000.0f;
-    if (acceleration_z == 0x8000)
-        _throw("Z-acceleration 0x8000 invalid");
-    else
-        result.acceleration[2] = static_cast<int16_t>(acceleration_z) / 1000.0f;
+    if (size != format_5::size) {
+        result.errors |= invalid_size;
+        // Fields past the end can't be read
+        if (size < format_5::size) return false;
+    }
+    if (data[0] != format_5::id) result.errors |= invalid_format;
+
+    measurement m;
+    decode_as(format_5::id, data, size, m);
+    auto& e = result.errors;
+    take(m, field::temperature, invalid_temperature, result.temperature, e);
+    take(m, field::humidity, invalid_humidity, result.humidity, e);
+    take(m, field::pressure, invalid_pressure, result.pressure, e);
+    take(m, field::acceleration_x, invalid_acceleration_x, result.acceleration[0], e);
+    take(m, field::acceleration_y, invalid_acceleration_y, result.acceleration[1], e);
+    take(m, field::acceleration_z, invalid_acceleration_z, result.acceleration[2], e);
+    take(m, field::battery_voltage, invalid_battery_voltage, result.battery_voltage, e);
+    take(m, field::tx_power, invalid_tx_power, result.tx_power, e);
+    // Have no invalid value
+    result.movement_counter     = static_cast<uint8_t>(m[field::movement_counter]);
+    result.measurement_sequence = static_cast<uint16_t>(m[field::measurement_sequence]);
+
+    return result.errors == 0;
+}
 
-    if (battery_voltage == 2047)
-        _throw("Battery voltage 2047 invalid");
-    else
-        result.battery_voltage = 1.6f + battery_voltage / 1000.0f;
+bool ruuvi::decode_format_5(AdvPacket const& p, format_5_reading& result) noexcept {
+    auto data = p.manufacturer_data();
+    decode_format_5(data, p.manufacturer_data_size(), result);
+    result.mac             = p.mac;
+    result.signal_strength = p.signal_strength;
 
-    //    if (measurement_sequence == 65535)
-    //        _throw("Measurement sequence number 65535 invalid");
-    //    else
-    result.measurement_sequence = measurement_sequence;
+    if (p.manufacturer_data_size() >= 24 && !std::equal(p.mac.begin(), p.mac.end(), data + 18))
+        result.errors |= mac_mismatch;
 
-    if (tx_power == 31)
-        _throw("Tx power 31 invalid");
-    else
-        result.tx_power = -40 + tx_power * 2;
+    return result.errors == 0;
+}
 
-    //    if (movement_counter == 255)
-    //        _throw("Movement counter 255 invalid");
-    //    else
-    result.movement_counter = movement_counter;
+std::string ruuvi::describe_errors(format_5_reading const& r) {
+    std::string msg;
+    auto add = [&msg, &r](uint16_t bit, std::string const& s) {
+        if ((r.errors & bit) == 0) return;
+        if (!msg.empty()) msg += " - ";
+        msg += s;
+    };
+    add(invalid_size, "Expected data size 24, got " + std::to_string(r.data_size));
+    add(invalid_format, "Expected data format 5, got " + std::to_string(r.data_format));
+    add(invalid_temperature, "Temperature 0x8000 invalid");
+    add(invalid_humidity, "Humidity 0xFFFF or > 40 000 (100%) invalid");
+    add(invalid_pressure, "Pressure 0xFFFF invalid");
+    add(invalid_acceleration_x, "X-acceleration 0x8000 invalid");
+    add(invalid_acceleration_y, "Y-acceleration 0x8000 invalid");
+    add(invalid_acceleration_z, "Z-acceleration 0x8000 invalid");
+    add(invalid_battery_voltage, "Battery voltage 2047 invalid");
+    add(invalid_tx_power, "Tx power 31 invalid");
+    add(mac_mismatch, "Receiver and packet MAC addresses differ");
+    return msg;
+}
 
-    if (p.mac != packet_mac) {
-        _throw("Receiver and packet MAC addresses differ");
-        result.mac = "";
-    } else
-        result.mac = std::move(packet_mac);
+ruuvi_data_format_5 ruuvi::convert_data_format_5(AdvPacket const& p,
+                                                 bool throw_on_error) {
+    format_5_reading r;
+    decode_format_5(p, r);
 
-    result.signal_strength = p.signal_strength;
+    ruuvi_data_format_5 result;
+    result.contains_errors = !r.valid();
+    if (result.contains_errors) {
+        result.error_msg = describe_errors(r);
+        if (throw_on_error)
+            throw std::runtime_error("Data format 5 converison failed: " + result.error_msg);
+    }
+
+    result.temperature          = r.temperature;
+    result.humidity             = r.humidity;
+    result.pressure             = r.pressure;
+    result.acceleration         = r.acceleration;
+    result.battery_voltage      = r.battery_voltage;
+    result.measurement_sequence = r.measurement_sequence;
+    result.tx_power             = r.tx_power;
+    result.movement_counter     = r.movement_counter;
+    result.signal_strength      = r.signal_strength;
+    result.mac                  = r.valid(mac_mismatch) ? format_mac(r.mac) : "";
 
     return result;
 }
 
-ruuvi_data_format_3 ruuvi::convert_data_format_3(BlePacket const& p,
+ruuvi_data_format_3 ruuvi::convert_data_format_3(AdvPacket const& p,
                                                  bool throw_on_error) {
     ruuvi_data_format_3 result;
-    auto& data = p.manufacturer_data;
+    auto data = p.manufacturer_data();
 
     auto _throw = [throw_on_error, &result](std::string const& s) {
         if (throw_on_error)
-            throw std::runtime_error("Data format 5 converison failed: " + s);
+            throw std::runtime_error("Data format 3 converison failed: " + s);
         if (!result.error_msg.empty()) result.error_msg += " - ";
         result.error_msg       += s;
         result.contains_errors = true;
     };
 
-    uint8_t humidity      = data[1];
-    int8_t temperature    = ((data[2] & 0x80) == 0 ? 1 : -1) * (data[2] & 0x7F);
-    uint8_t temp_fraction = data[3];
-    uint16_t pressure     = (uint16_t(data[4]) << 8) | data[5];
-    uint16_t accel_x      = (uint16_t(data[6]) << 8) | data[7];
-    uint16_t accel_y      = (uint16_t(data[8]) << 8) | data[9];
-    uint16_t accel_z      = (uint16_t(data[10]) << 8) | data[11];
-    uint16_t voltage      = (uint16_t(data[12]) << 8) | data[13];
+    if (p.manufacturer_data_size() < format_3::size) {
+        _throw("Expected data size 14, got " + std::to_string(p.manufacturer_data_size()));
+        return result;
+    }
 
+    measurement m;
+    decode_as(format_3::id, data, p.manufacturer_data_size(), m);
     result.contains_errors = false;
 
-    if (humidity > 200) {
+    if (m.valid(field::humidity))
+        result.humidity = m[field::humidity];
+    else
         _throw("Humidity > 200 is invalid");
-    } else {
-        result.humidity = humidity * 0.5;
-    }
-    if (temp_fraction > 99) {
+    if (m.valid(field::temperature))
+        result.temperature = m[field::temperature];
+    else
         _throw("Temperature fraction > 99 is invalid");
-    } else {
-        result.temperature =
-            temperature + ((data[2] & 0x80) ? -0.01f : 0.01f) * temp_fraction;
-    }
-    result.pressure        = uint32_t(pressure) + 50'000;
-    result.acceleration[0] = static_cast<int16_t>(accel_x) * 0.001f;
-    result.acceleration[1] = static_cast<int16_t>(accel_y) * 0.001f;
-    result.acceleration[2] = static_cast<int16_t>(accel_z) * 0.001f;
-    result.battery_voltage = voltage * 0.001f;
+    result.pressure        = static_cast<uint32_t>(m[field::pressure]);
+    result.acceleration[0] = m[field::acceleration_x];
+    result.acceleration[1] = m[field::acceleration_y];
+    result.acceleration[2] = m[field::acceleration_z];
+    result.battery_voltage = m[field::battery_voltage];
 
     result.signal_strength = p.signal_strength;
-    result.mac             = p.mac;
+    result.mac             = format_mac(p.mac);
 
     return result;
 }
@@ -248,3 +250,21 @@ std::ostream& ble::operator<<(std::ostream& os, BlePacket const& p) {
     os << "\n";
     return os;
 }
+
+std::ostream& ble::operator<<(std::ostream& os, AdvPacket const& p) {
+    os << "Ble packet MAC: " << format_mac(p.mac);
+    os << "\nSignal strength: " << p.signal_strength;
+    os << "\nManufacturer id: " << p.manufacturer_id;
+    os << "\nManufacturer data: \n";
+
+    auto fmt = os.flags();
+    os << std::showbase << std::hex << std::setfill('0') << std::setw(2)
+       << std::right;
+    for (size_t i = 0; i < p.manufacturer_data_size(); ++i) {
+        os << +p.manufacturer_data()[i] << ' ';
+    }
+    os.flags(fmt);
+
+    os << "\n";
+    return os;
+}
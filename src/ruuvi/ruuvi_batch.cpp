@@ -0,0 +1,442 @@
+#include "ruuvi.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RUUVI_SIMD_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+// 32-bit NEON lacks vector division, which the accelerations need to stay bit-exact
+#define RUUVI_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace ruuvi;
+
+namespace {
+
+constexpr float nan_value = std::numeric_limits<float>::quiet_NaN();
+
+// Payloads per SIMD block, one 16-bit lane each
+constexpr size_t block_size = 8;
+
+/*
+ * Every SIMD path first shuffles bytes 0..15 of each payload into eight little-endian 16-bit
+ * lanes, then transposes the eight rows of a block so that each vector holds one field:
+ *
+ *   lane 0..6: temperature, humidity, pressure, acceleration x/y/z, battery voltage + tx power
+ *   lane 7:    data format (high byte), movement counter (low byte)
+ *
+ * The measurement sequence (bytes 16..17) is copied with scalar code.
+ */
+enum lane : int {
+    lane_temperature,
+    lane_humidity,
+    lane_pressure,
+    lane_acceleration_x,
+    lane_acceleration_y,
+    lane_acceleration_z,
+    lane_power,
+    lane_format_movement,
+};
+
+void decode_scalar(uint8_t const* payloads, size_t begin, size_t count, size_t stride,
+                   format_5_batch& out) {
+    format_5_reading r;
+    for (size_t i = begin; i < count; ++i) {
+        decode_format_5(payloads + i * stride, 24, r);
+        out.temperature[i]          = r.temperature;
+        out.humidity[i]             = r.humidity;
+        out.pressure[i]             = r.pressure;
+        out.acceleration_x[i]       = r.acceleration[0];
+        out.acceleration_y[i]       = r.acceleration[1];
+        out.acceleration_z[i]       = r.acceleration[2];
+        out.battery_voltage[i]      = r.battery_voltage;
+        out.measurement_sequence[i] = r.measurement_sequence;
+        out.tx_power[i]             = r.tx_power;
+        out.movement_counter[i]     = r.movement_counter;
+        out.errors[i]               = r.errors;
+    }
+}
+
+void copy_sequence(uint8_t const* block, size_t stride, uint16_t* out) {
+    for (size_t j = 0; j < block_size; ++j) {
+        auto p = block + j * stride;
+        out[j] = (static_cast<uint16_t>(p[16]) << 8u) | p[17];
+    }
+}
+
+#ifdef RUUVI_SIMD_X86
+
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+// Shared by both paths, inlined so that the AVX2 path doesn't mix in legacy SSE encodings
+#define SHARED_SSSE3 TARGET_SSSE3 __attribute__((always_inline)) inline
+
+struct block_ssse3 {
+    __m128i field[8];
+    __m128i invalid[8];  // All ones where the lane's field is invalid
+    __m128i tx;
+    __m128i errors;
+};
+
+SHARED_SSSE3 void load_block(uint8_t const* block, size_t stride, block_ssse3& b) {
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 4, 3, 6, 5, 8, 7, 10, 9, 12, 11, 14, 13, 15, 0);
+
+    __m128i r[block_size];
+    for (size_t j = 0; j < block_size; ++j) {
+        auto row = _mm_loadu_si128(reinterpret_cast<__m128i const*>(block + j * stride));
+        r[j]     = _mm_shuffle_epi8(row, shuffle);
+    }
+
+    // 8x8 transpose of 16-bit lanes
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    __m128i* f = b.field;
+    f[0]       = _mm_unpacklo_epi64(b0, b4);
+    f[1]       = _mm_unpackhi_epi64(b0, b4);
+    f[2]       = _mm_unpacklo_epi64(b1, b5);
+    f[3]       = _mm_unpackhi_epi64(b1, b5);
+    f[4]       = _mm_unpacklo_epi64(b2, b6);
+    f[5]       = _mm_unpackhi_epi64(b2, b6);
+    f[6]       = _mm_unpacklo_epi64(b3, b7);
+    f[7]       = _mm_unpackhi_epi64(b3, b7);
+
+    // Same checks as decode_format_5
+    auto eq = [](__m128i v, int x) { return _mm_cmpeq_epi16(v, _mm_set1_epi16(short(x))); };
+    __m128i* inv = b.invalid;
+
+    __m128i battery = _mm_srli_epi16(f[lane_power], 5);
+    __m128i tx      = _mm_and_si128(f[lane_power], _mm_set1_epi16(0x1F));
+
+    inv[0] = eq(f[lane_temperature], 0x8000);
+    // humidity > 40000, saturating subtraction is zero otherwise
+    inv[1] = _mm_xor_si128(eq(_mm_subs_epu16(f[lane_humidity], _mm_set1_epi16(short(40'000))), 0),
+                           _mm_set1_epi16(-1));
+    inv[2] = eq(f[lane_pressure], 0xFFFF);
+    inv[3] = eq(f[lane_acceleration_x], 0x8000);
+    inv[4] = eq(f[lane_acceleration_y], 0x8000);
+    inv[5] = eq(f[lane_acceleration_z], 0x8000);
+    inv[6] = eq(battery, 2047);
+    inv[7] = eq(tx, 31);
+
+    __m128i bad_format = _mm_andnot_si128(eq(_mm_srli_epi16(f[lane_format_movement], 8), 0x05),
+                                          _mm_set1_epi16(invalid_format));
+
+    const uint16_t bits[8] = {invalid_temperature,    invalid_humidity,
+                              invalid_pressure,       invalid_acceleration_x,
+                              invalid_acceleration_y, invalid_acceleration_z,
+                              invalid_battery_voltage, invalid_tx_power};
+    b.errors = bad_format;
+    for (int k = 0; k < 8; ++k)
+        b.errors = _mm_or_si128(b.errors, _mm_and_si128(inv[k], _mm_set1_epi16(short(bits[k]))));
+
+    // Battery voltage replaces the packed field
+    f[lane_power] = battery;
+    b.tx          = tx;
+}
+
+// Stores the fields narrower than 32 bits: tx power, movement counter and errors
+SHARED_SSSE3 void store_small(block_ssse3 const& b, size_t i, format_5_batch& out) {
+    __m128i tx = _mm_sub_epi16(_mm_slli_epi16(b.tx, 1), _mm_set1_epi16(40));
+    tx         = _mm_or_si128(_mm_and_si128(b.invalid[7], _mm_set1_epi16(INT8_MIN)),
+                              _mm_andnot_si128(b.invalid[7], tx));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out.tx_power.data() + i), _mm_packs_epi16(tx, tx));
+
+    __m128i movement = _mm_and_si128(b.field[lane_format_movement], _mm_set1_epi16(0xFF));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out.movement_counter.data() + i),
+                     _mm_packus_epi16(movement, movement));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out.errors.data() + i), b.errors);
+}
+
+// Widen lanes 0..3 or 4..7 to 32 bits
+template<bool High> TARGET_SSSE3 __m128i sext(__m128i v) {
+    return _mm_srai_epi32(High ? _mm_unpackhi_epi16(v, v) : _mm_unpacklo_epi16(v, v), 16);
+}
+template<bool High> TARGET_SSSE3 __m128i zext(__m128i v) {
+    auto zero = _mm_setzero_si128();
+    return High ? _mm_unpackhi_epi16(v, zero) : _mm_unpacklo_epi16(v, zero);
+}
+
+TARGET_SSSE3 __m128 select_nan(__m128i invalid, __m128 v) {
+    auto m = _mm_castsi128_ps(invalid);
+    return _mm_or_ps(_mm_and_ps(m, _mm_set1_ps(nan_value)), _mm_andnot_ps(m, v));
+}
+
+// Converts and stores four lanes of the 32-bit fields, starting at row at
+template<bool High> TARGET_SSSE3 void store_half(block_ssse3 const& b, size_t at,
+                                                  format_5_batch& out) {
+    auto t = _mm_mul_ps(_mm_set1_ps(0.005f),
+                        _mm_cvtepi32_ps(sext<High>(b.field[lane_temperature])));
+    _mm_storeu_ps(out.temperature.data() + at, select_nan(sext<High>(b.invalid[0]), t));
+
+    auto hu = _mm_mul_ps(_mm_set1_ps(0.0025f), _mm_cvtepi32_ps(zext<High>(b.field[lane_humidity])));
+    _mm_storeu_ps(out.humidity.data() + at, select_nan(sext<High>(b.invalid[1]), hu));
+
+    auto p = _mm_add_epi32(zext<High>(b.field[lane_pressure]), _mm_set1_epi32(50'000));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out.pressure.data() + at),
+                     _mm_or_si128(p, sext<High>(b.invalid[2])));
+
+    float* acceleration[3] = {out.acceleration_x.data(), out.acceleration_y.data(),
+                              out.acceleration_z.data()};
+    for (int k = 0; k < 3; ++k) {
+        auto a = _mm_div_ps(_mm_cvtepi32_ps(sext<High>(b.field[lane_acceleration_x + k])),
+                            _mm_set1_ps(1000.0f));
+        _mm_storeu_ps(acceleration[k] + at, select_nan(sext<High>(b.invalid[3 + k]), a));
+    }
+
+    auto v = _mm_add_ps(_mm_set1_ps(1.6f),
+                        _mm_div_ps(_mm_cvtepi32_ps(zext<High>(b.field[lane_power])),
+                                   _mm_set1_ps(1000.0f)));
+    _mm_storeu_ps(out.battery_voltage.data() + at, select_nan(sext<High>(b.invalid[6]), v));
+}
+
+TARGET_SSSE3 void decode_ssse3(uint8_t const* payloads, size_t count, size_t stride,
+                               format_5_batch& out) {
+    size_t i = 0;
+    block_ssse3 b;
+    for (; i + block_size <= count; i += block_size) {
+        auto block = payloads + i * stride;
+        load_block(block, stride, b);
+        store_half<false>(b, i, out);
+        store_half<true>(b, i + 4, out);
+        store_small(b, i, out);
+        copy_sequence(block, stride, out.measurement_sequence.data() + i);
+    }
+    decode_scalar(payloads, i, count, stride, out);
+}
+
+TARGET_AVX2 __m256i sext8(__m128i v) { return _mm256_cvtepi16_epi32(v); }
+TARGET_AVX2 __m256i zext8(__m128i v) { return _mm256_cvtepu16_epi32(v); }
+
+TARGET_AVX2 __m256 select_nan(__m256i invalid, __m256 v) {
+    return _mm256_blendv_ps(v, _mm256_set1_ps(nan_value), _mm256_castsi256_ps(invalid));
+}
+
+TARGET_AVX2 void decode_avx2(uint8_t const* payloads, size_t count, size_t stride,
+                             format_5_batch& out) {
+    size_t i = 0;
+    block_ssse3 b;
+    for (; i + block_size <= count; i += block_size) {
+        auto block = payloads + i * stride;
+        load_block(block, stride, b);
+
+        auto t = _mm256_mul_ps(_mm256_set1_ps(0.005f),
+                               _mm256_cvtepi32_ps(sext8(b.field[lane_temperature])));
+        _mm256_storeu_ps(out.temperature.data() + i, select_nan(sext8(b.invalid[0]), t));
+
+        auto hu = _mm256_mul_ps(_mm256_set1_ps(0.0025f),
+                                _mm256_cvtepi32_ps(zext8(b.field[lane_humidity])));
+        _mm256_storeu_ps(out.humidity.data() + i, select_nan(sext8(b.invalid[1]), hu));
+
+        auto p = _mm256_add_epi32(zext8(b.field[lane_pressure]), _mm256_set1_epi32(50'000));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out.pressure.data() + i),
+                            _mm256_or_si256(p, sext8(b.invalid[2])));
+
+        float* acceleration[3] = {out.acceleration_x.data(), out.acceleration_y.data(),
+                                  out.acceleration_z.data()};
+        for (int k = 0; k < 3; ++k) {
+            auto a = _mm256_div_ps(_mm256_cvtepi32_ps(sext8(b.field[lane_acceleration_x + k])),
+                                   _mm256_set1_ps(1000.0f));
+            _mm256_storeu_ps(acceleration[k] + i, select_nan(sext8(b.invalid[3 + k]), a));
+        }
+
+        auto v = _mm256_add_ps(_mm256_set1_ps(1.6f),
+                               _mm256_div_ps(_mm256_cvtepi32_ps(zext8(b.field[lane_power])),
+                                             _mm256_set1_ps(1000.0f)));
+        _mm256_storeu_ps(out.battery_voltage.data() + i, select_nan(sext8(b.invalid[6]), v));
+
+        store_small(b, i, out);
+        copy_sequence(block, stride, out.measurement_sequence.data() + i);
+    }
+    decode_scalar(payloads, i, count, stride, out);
+}
+
+#endif  // RUUVI_SIMD_X86
+
+#ifdef RUUVI_SIMD_NEON
+
+void decode_neon(uint8_t const* payloads, size_t count, size_t stride, format_5_batch& out) {
+    static const uint8_t shuffle_bytes[16] = {2, 1, 4, 3, 6, 5, 8, 7, 10, 9, 12, 11, 14, 13, 15, 0};
+    const uint8x16_t shuffle = vld1q_u8(shuffle_bytes);
+
+    size_t i = 0;
+    for (; i + block_size <= count; i += block_size) {
+        auto block = payloads + i * stride;
+
+        uint16x8_t r[block_size];
+        for (size_t j = 0; j < block_size; ++j)
+            r[j] = vreinterpretq_u16_u8(vqtbl1q_u8(vld1q_u8(block + j * stride), shuffle));
+
+        // 8x8 transpose of 16-bit lanes
+        uint16x8x2_t t01 = vtrnq_u16(r[0], r[1]);
+        uint16x8x2_t t23 = vtrnq_u16(r[2], r[3]);
+        uint16x8x2_t t45 = vtrnq_u16(r[4], r[5]);
+        uint16x8x2_t t67 = vtrnq_u16(r[6], r[7]);
+
+        auto trn32 = [](uint16x8_t a, uint16x8_t b) {
+            return vtrnq_u32(vreinterpretq_u32_u16(a), vreinterpretq_u32_u16(b));
+        };
+        uint32x4x2_t u02 = trn32(t01.val[0], t23.val[0]);
+        uint32x4x2_t u13 = trn32(t01.val[1], t23.val[1]);
+        uint32x4x2_t u46 = trn32(t45.val[0], t67.val[0]);
+        uint32x4x2_t u57 = trn32(t45.val[1], t67.val[1]);
+
+        auto lo = [](uint32x4_t a, uint32x4_t b) {
+            return vreinterpretq_u16_u32(vcombine_u32(vget_low_u32(a), vget_low_u32(b)));
+        };
+        auto hi = [](uint32x4_t a, uint32x4_t b) {
+            return vreinterpretq_u16_u32(vcombine_u32(vget_high_u32(a), vget_high_u32(b)));
+        };
+        uint16x8_t f[8];
+        f[0] = lo(u02.val[0], u46.val[0]);
+        f[1] = lo(u13.val[0], u57.val[0]);
+        f[2] = lo(u02.val[1], u46.val[1]);
+        f[3] = lo(u13.val[1], u57.val[1]);
+        f[4] = hi(u02.val[0], u46.val[0]);
+        f[5] = hi(u13.val[0], u57.val[0]);
+        f[6] = hi(u02.val[1], u46.val[1]);
+        f[7] = hi(u13.val[1], u57.val[1]);
+
+        // Same checks as decode_format_5
+        uint16x8_t battery = vshrq_n_u16(f[lane_power], 5);
+        uint16x8_t tx      = vandq_u16(f[lane_power], vdupq_n_u16(0x1F));
+
+        uint16x8_t inv[8];
+        inv[0] = vceqq_u16(f[lane_temperature], vdupq_n_u16(0x8000));
+        inv[1] = vcgtq_u16(f[lane_humidity], vdupq_n_u16(40'000));
+        inv[2] = vceqq_u16(f[lane_pressure], vdupq_n_u16(0xFFFF));
+        inv[3] = vceqq_u16(f[lane_acceleration_x], vdupq_n_u16(0x8000));
+        inv[4] = vceqq_u16(f[lane_acceleration_y], vdupq_n_u16(0x8000));
+        inv[5] = vceqq_u16(f[lane_acceleration_z], vdupq_n_u16(0x8000));
+        inv[6] = vceqq_u16(battery, vdupq_n_u16(2047));
+        inv[7] = vceqq_u16(tx, vdupq_n_u16(31));
+
+        const uint16_t bits[8] = {invalid_temperature,    invalid_humidity,
+                                  invalid_pressure,       invalid_acceleration_x,
+                                  invalid_acceleration_y, invalid_acceleration_z,
+                                  invalid_battery_voltage, invalid_tx_power};
+        uint16x8_t errors = vbicq_u16(vdupq_n_u16(invalid_format),
+                                      vceqq_u16(vshrq_n_u16(f[lane_format_movement], 8),
+                                                vdupq_n_u16(0x05)));
+        for (int k = 0; k < 8; ++k)
+            errors = vorrq_u16(errors, vandq_u16(inv[k], vdupq_n_u16(bits[k])));
+        vst1q_u16(out.errors.data() + i, errors);
+
+        for (size_t h = 0; h < 2; ++h) {
+            auto half = [h](uint16x8_t v) { return h == 0 ? vget_low_u16(v) : vget_high_u16(v); };
+            auto sext = [&half](uint16x8_t v) {
+                return vmovl_s16(vreinterpret_s16_u16(half(v)));
+            };
+            auto zext = [&half](uint16x8_t v) { return vmovl_u16(half(v)); };
+            auto mask = [&sext](uint16x8_t v) { return vreinterpretq_u32_s32(sext(v)); };
+            auto nan  = vdupq_n_f32(nan_value);
+            auto at   = i + h * 4;
+
+            auto t = vmulq_f32(vdupq_n_f32(0.005f), vcvtq_f32_s32(sext(f[lane_temperature])));
+            vst1q_f32(out.temperature.data() + at, vbslq_f32(mask(inv[0]), nan, t));
+
+            auto hu = vmulq_f32(vdupq_n_f32(0.0025f), vcvtq_f32_u32(zext(f[lane_humidity])));
+            vst1q_f32(out.humidity.data() + at, vbslq_f32(mask(inv[1]), nan, hu));
+
+            auto p = vaddq_u32(zext(f[lane_pressure]), vdupq_n_u32(50'000));
+            vst1q_u32(out.pressure.data() + at, vorrq_u32(p, mask(inv[2])));
+
+            float* acceleration[3] = {out.acceleration_x.data(), out.acceleration_y.data(),
+                                      out.acceleration_z.data()};
+            for (int k = 0; k < 3; ++k) {
+                auto a = vdivq_f32(vcvtq_f32_s32(sext(f[lane_acceleration_x + k])),
+                                   vdupq_n_f32(1000.0f));
+                vst1q_f32(acceleration[k] + at, vbslq_f32(mask(inv[3 + k]), nan, a));
+            }
+
+            auto v = vaddq_f32(vdupq_n_f32(1.6f),
+                               vdivq_f32(vcvtq_f32_u32(zext(battery)), vdupq_n_f32(1000.0f)));
+            vst1q_f32(out.battery_voltage.data() + at, vbslq_f32(mask(inv[6]), nan, v));
+        }
+
+        int16x8_t power = vsubq_s16(vshlq_n_s16(vreinterpretq_s16_u16(tx), 1), vdupq_n_s16(40));
+        power           = vbslq_s16(inv[7], vdupq_n_s16(INT8_MIN), power);
+        vst1_s8(out.tx_power.data() + i, vmovn_s16(power));
+        // Narrowing keeps the low byte, the movement counter
+        vst1_u8(out.movement_counter.data() + i, vmovn_u16(f[lane_format_movement]));
+
+        copy_sequence(block, stride, out.measurement_sequence.data() + i);
+    }
+    decode_scalar(payloads, i, count, stride, out);
+}
+
+#endif  // RUUVI_SIMD_NEON
+
+}  // namespace
+
+void format_5_batch::resize(size_t n) {
+    temperature.resize(n);
+    humidity.resize(n);
+    pressure.resize(n);
+    acceleration_x.resize(n);
+    acceleration_y.resize(n);
+    acceleration_z.resize(n);
+    battery_voltage.resize(n);
+    measurement_sequence.resize(n);
+    tx_power.resize(n);
+    movement_counter.resize(n);
+    errors.resize(n);
+}
+
+bool ruuvi::simd_supported(simd_level level) {
+    switch (level) {
+        case simd_level::scalar: return true;
+#ifdef RUUVI_SIMD_X86
+        case simd_level::ssse3: __builtin_cpu_init(); return __builtin_cpu_supports("ssse3");
+        case simd_level::avx2: __builtin_cpu_init(); return __builtin_cpu_supports("avx2");
+#endif
+#ifdef RUUVI_SIMD_NEON
+        case simd_level::neon: return true;
+#endif
+        default: return false;
+    }
+}
+
+simd_level ruuvi::best_simd_level() {
+    static const simd_level best = [] {
+        for (auto l: {simd_level::avx2, simd_level::ssse3, simd_level::neon})
+            if (simd_supported(l)) return l;
+        return simd_level::scalar;
+    }();
+    return best;
+}
+
+void ruuvi::decode_format_5_batch(uint8_t const* payloads, size_t count, size_t stride,
+                                  format_5_batch& out, simd_level level) {
+    out.resize(count);
+    if (!simd_supported(level)) level = simd_level::scalar;
+
+    switch (level) {
+#ifdef RUUVI_SIMD_X86
+        case simd_level::avx2: decode_avx2(payloads, count, stride, out); break;
+        case simd_level::ssse3: decode_ssse3(payloads, count, stride, out); break;
+#endif
+#ifdef RUUVI_SIMD_NEON
+        case simd_level::neon: decode_neon(payloads, count, stride, out); break;
+#endif
+        default: decode_scalar(payloads, 0, count, stride, out); break;
+    }
+}
@@ -1,180 +1,960 @@
 #include "ruuvi_prometheus_exposer.hpp"
+#include "formats.hpp"
+#include "mac_table.hpp"
+#include "seqlock.hpp"
+#include "window_stats.hpp"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
-#include <cerrno>
-#include <cstring>
-#include <future>
-#include <map>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
-#include <thread>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <prometheus/collectable.h>
-#include <prometheus/counter.h>
-#include <prometheus/exposer.h>
-#include <prometheus/family.h>
-#include <prometheus/gauge.h>
-#include <prometheus/registry.h>
+#include <prometheus/metric_family.h>
+
+#include <time.h>
 
 using namespace ruuvi;
 using namespace prometheus;
 
 namespace {
 
-class MetricCollector {
-public:
-    MetricCollector(Family<Gauge>& m,
-                    std::function<double(ruuvi_data_format_5 const&)> const& c,
-                    std::map<std::string, std::string> const& l = {})
-        : metric(&m), collector(c), labels(l) {}
+using clock = std::chrono::steady_clock;
+
+struct GaugeDescriptor {
+    char const* name;
+    char const* help;
+    char const* axis;  // Value of the axis label, or nullptr
+    bool windowed;     // Aggregated over windows, for measured values
+    double (*value)(format_5_reading const&);
+};
+
+// Gauges sharing a name are exported as one family
+constexpr GaugeDescriptor gauges[] = {
+    {"ruuvi_temperature_celsius", "Ruuvitag temperature in Celsius", nullptr, true,
+     [](format_5_reading const& r) -> double { return r.temperature; }},
+    {"ruuvi_relative_humidity_ratio", "Ruuvitag relative humidity 0-100%", nullptr, true,
+     [](format_5_reading const& r) -> double { return r.humidity; }},
+    {"ruuvi_pressure_pascals", "Ruuvitag pressure in Pascal", nullptr, true,
+     [](format_5_reading const& r) -> double { return r.pressure; }},
+    {"ruuvi_acceleration_gs", "Ruuvitag acceleration in Gs", "x", true,
+     [](format_5_reading const& r) -> double { return r.acceleration[0]; }},
+    {"ruuvi_acceleration_gs", "Ruuvitag acceleration in Gs", "y", true,
+     [](format_5_reading const& r) -> double { return r.acceleration[1]; }},
+    {"ruuvi_acceleration_gs", "Ruuvitag acceleration in Gs", "z", true,
+     [](format_5_reading const& r) -> double { return r.acceleration[2]; }},
+    {"ruuvi_battery_volts", "Ruuvitag battery voltage", nullptr, true,
+     [](format_5_reading const& r) -> double { return r.battery_voltage; }},
+    {"ruuvi_movement_count", "Ruuvitag movement counter", nullptr, false,
+     [](format_5_reading const& r) -> double { return r.movement_counter; }},
+    {"ruuvi_tx_power_dbm", "Ruuvitag transmit power", nullptr, false,
+     [](format_5_reading const& r) -> double { return r.tx_power; }},
+    {"ruuvi_measurement_count", "Ruuvitag packet measurement sequence number[0-65335]", nullptr,
+     false,
+     [](format_5_reading const& r) -> double { return r.measurement_sequence; }},
+    {"ruuvi_rssi_dbm", "Ruuvitag received signal strength rssi", nullptr, false,
+     [](format_5_reading const& r) -> double { return r.signal_strength; }},
+    {"ruuvi_accelerayion_gs_total", "Total acceleration of ruuvitag, hypot(x, y, z)", nullptr,
+     true,
+     [](format_5_reading const& r) -> double { return r.acceleration_total(); }},
+    // Set when scraped, from the monotonic time kept with the values
+    {"ruuvi_last_seen_timestamp_seconds",
+     "Time the tag was last heard from, in seconds since the epoch", nullptr, false,
+     [](format_5_reading const&) -> double { return 0; }},
+};
+constexpr size_t gauge_count = std::size(gauges);
+
+constexpr size_t gauge_index(std::string_view name) {
+    size_t i = 0;
+    while (i < gauge_count && gauges[i].name != name) ++i;
+    return i;
+}
+constexpr size_t rssi_gauge      = gauge_index("ruuvi_rssi_dbm");
+constexpr size_t last_seen_gauge = gauge_index("ruuvi_last_seen_timestamp_seconds");
+static_assert(rssi_gauge < gauge_count && last_seen_gauge < gauge_count);
+
+// Updates only need millisecond resolution, the coarse clock reads faster. It counts from the
+// same point as steady_clock on Linux.
+clock::time_point coarse_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return clock::time_point(std::chrono::seconds(ts.tv_sec)
+                             + std::chrono::nanoseconds(ts.tv_nsec));
+}
 
-    void update(ruuvi_data_format_5 const& d) {
-        auto tmp = labels;
-        tmp.insert({"mac", d.mac});
-        metric->Add(tmp).Set(collector(d));
+// Monotonic times are kept in nanoseconds, and converted to wall clock time when scraped
+int64_t monotonic_ns(clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+// Added to a monotonic time, gives nanoseconds since the epoch
+int64_t wall_clock_offset() {
+    auto wall = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count()
+         - monotonic_ns(clock::now());
+}
+
+struct FamilyDescriptor {
+    char const* name = nullptr;
+    char const* help = nullptr;
+    MetricType type  = MetricType::Untyped;
+};
+
+// The gauge families in order, followed by the error and measurement counters
+constexpr size_t gauge_family_count() {
+    size_t n = 0;
+    for (size_t g = 0; g < gauge_count; ++g)
+        if (g == 0 || std::string_view(gauges[g].name) != gauges[g - 1].name) ++n;
+    return n;
+}
+constexpr size_t errors_family       = gauge_family_count();
+constexpr size_t measurements_family = errors_family + 1;
+constexpr size_t family_count        = errors_family + 2;
+
+constexpr std::array<size_t, gauge_count> make_gauge_families() {
+    std::array<size_t, gauge_count> r{};
+    for (size_t g = 1; g < gauge_count; ++g)
+        r[g] = r[g - 1] + (std::string_view(gauges[g].name) != gauges[g - 1].name ? 1 : 0);
+    return r;
+}
+constexpr auto gauge_family = make_gauge_families();  // Family of each gauge
+
+constexpr std::array<FamilyDescriptor, family_count> make_family_table() {
+    std::array<FamilyDescriptor, family_count> r{};
+    for (size_t g = 0; g < gauge_count; ++g)
+        r[gauge_family[g]] = {gauges[g].name, gauges[g].help, MetricType::Gauge};
+    r[errors_family]       = {"ruuvi_errors_total", "Number of errors", MetricType::Counter};
+    r[measurements_family] = {"ruuvi_received_measurements_total",
+                              "Total count of received measurements", MetricType::Counter};
+    return r;
+}
+constexpr auto family_table = make_family_table();
+
+// The windowed gauges are the fields of the aggregation windows
+constexpr size_t window_field_count() {
+    size_t n = 0;
+    for (size_t g = 0; g < gauge_count; ++g) n += gauges[g].windowed ? 1 : 0;
+    return n;
+}
+constexpr size_t window_fields = window_field_count();
+using WindowStats              = window_stats<window_fields>;
+
+constexpr std::array<size_t, window_fields> make_windowed_gauges() {
+    std::array<size_t, window_fields> r{};
+    for (size_t g = 0, k = 0; g < gauge_count; ++g)
+        if (gauges[g].windowed) r[k++] = g;
+    return r;
+}
+constexpr auto windowed_gauge = make_windowed_gauges();  // Gauge of each field
+
+// Windowed gauge families in order, each is exported as one family per statistic
+constexpr std::array<size_t, window_fields> make_window_families() {
+    std::array<size_t, window_fields> r{};
+    for (size_t k = 1; k < window_fields; ++k)
+        r[k] = r[k - 1]
+             + (gauge_family[windowed_gauge[k]] != gauge_family[windowed_gauge[k - 1]] ? 1 : 0);
+    return r;
+}
+constexpr auto window_family         = make_window_families();  // Of each field
+constexpr size_t window_family_count = window_family[window_fields - 1] + 1;
+
+enum window_stat { stat_min, stat_max, stat_sum, stat_count, stat_last };
+constexpr char const* window_stat_suffix[] = {"_window_min", "_window_max", "_window_sum",
+                                              "_window_count", "_window_last"};
+constexpr char const* window_stat_help[]   = {
+    ", minimum over the window", ", maximum over the window", ", sum over the window",
+    ", number of measurements in the window", ", last measurement in the window"};
+
+double stat_value(WindowStats const& w, size_t k, size_t stat) {
+    switch (stat) {
+    case stat_min: return w.min[k];
+    case stat_max: return w.max[k];
+    case stat_sum: return w.sum[k];
+    case stat_count: return double(w.count[k]);
+    default: return w.last[k];
     }
+}
 
-private:
-    Family<Gauge>* metric;
-    const std::function<double(ruuvi_data_format_5 const&)> collector;
-    const std::map<std::string, std::string> labels;
+// Named at runtime after the gauge family and the statistic
+struct WindowFamily {
+    std::string name;
+    std::string help;
+
+    FamilyDescriptor descriptor() const { return {name.c_str(), help.c_str(), MetricType::Gauge}; }
+};
+
+// Not per tag
+constexpr FamilyDescriptor live_tags_family{"ruuvi_tags", "Number of tags with exported metrics",
+                                            MetricType::Gauge};
+constexpr FamilyDescriptor evictions_family{"ruuvi_tag_evictions_total",
+                                            "Number of tags whose metrics were removed",
+                                            MetricType::Counter};
+
+enum eviction { expired, capacity };
+constexpr char const* eviction_reasons[] = {"expired", "capacity"};
+
+/*
+ * Text exposition format, written the way prometheus-cpp's TextSerializer writes it
+ */
+void append_header(std::string& out, FamilyDescriptor const& f) {
+    out.append("# HELP ").append(f.name).append(" ").append(f.help).append("\n");
+    out.append("# TYPE ").append(f.name);
+    out.append(f.type == MetricType::Counter ? " counter\n" : " gauge\n");
+}
+
+// Without the line break, which may follow a timestamp
+void append_value(std::string& out, double value) {
+    if (std::isnan(value)) {
+        out.append("Nan");
+    } else if (std::isinf(value)) {
+        out.append(value < 0 ? "-Inf" : "+Inf");
+    } else {
+        char buf[32];
+#if __cpp_lib_to_chars >= 201611L
+        auto n = std::to_chars(buf, buf + sizeof(buf), value).ptr - buf;
+#else
+        // Older standard libraries only convert integers
+        int n = std::snprintf(buf, sizeof(buf), "%.*g",
+                              std::numeric_limits<double>::max_digits10 - 1, value);
+#endif
+        out.append(buf, size_t(n));
+    }
+}
+
+// A timestamp of 0 is left out, as prometheus-cpp does
+void append_sample(std::string& out, char const* name, char const* axis, std::string const& mac,
+                   double value, int64_t timestamp_ms = 0) {
+    out.append(name).append("{");
+    if (axis != nullptr) out.append("axis=\"").append(axis).append("\",");
+    out.append("mac=\"").append(mac).append("\"} ");
+    append_value(out, value);
+    if (timestamp_ms != 0) {
+        char buf[24];
+        out.append(" ").append(buf, std::to_chars(buf, buf + sizeof(buf), timestamp_ms).ptr);
+    }
+    out.append("\n");
+}
+
+// The latest gauge values of a tag, replaced as a whole
+struct TagValues {
+    ble::mac_address mac;
+    bool known_mac;  // False for readings whose MAC doesn't match the sender
+    std::array<double, gauge_count> values;
+    int64_t received;   // Monotonic time of the measurement
+    int64_t last_seen;  // Monotonic time of the latest advert, repeats included
+};
+
+TagValues values_of(format_5_reading const& r, ble::mac_address const* mac, int64_t received) {
+    TagValues v;
+    v.mac       = mac != nullptr ? *mac : ble::mac_address{};
+    v.known_mac = mac != nullptr;
+    for (size_t i = 0; i < gauge_count; ++i) v.values[i] = gauges[i].value(r);
+    v.received  = received;
+    v.last_seen = received;
+    return v;
+}
+
+// The latest advert of a tag, kept instead of its values with decode_mode::on_collect
+struct TagPayload {
+    uint64_t measurement;  // Counts the adverts of the tag, 0 until the first one
+    int64_t received;      // Monotonic times, as in TagValues
+    int64_t last_seen;
+    int16_t signal_strength;
+    uint8_t size;  // Of the whole payload, only the format 5 bytes are kept
+    std::array<uint8_t, format_5::size> data;
+};
+
+struct TagSlot {
+    seqlock<TagValues> values;
+    seqlock<TagPayload> payload;
+    seqlock<WindowStats> window;  // The latest closed window, its end is 0 until one has closed
+    std::atomic<uint64_t> measurements = 0;
+    std::atomic<uint64_t> errors       = 0;
+    // With decode_mode::on_collect, the last measurement whose errors were counted
+    std::atomic<uint64_t> errors_counted = 0;
+    std::atomic_bool live                = false;  // Cleared when the tag is removed
+    std::atomic<uint32_t> generation     = 0;      // Incremented when given to another tag
+};
+
+// What the writer keeps about the tag in a slot, linked from the most to least recently seen
+struct SlotOwner {
+    ble::mac_address mac;
+    bool known_mac;
+    clock::time_point last_seen;
+    WindowStats window;  // Still open
+    uint32_t newer;
+    uint32_t older;
+};
+
+// The samples of a tag in the text format, one string per family
+struct RenderedTag {
+    bool rendered         = false;
+    uint32_t generation   = 0;  // Of the slot, the MAC is formatted again when it changes
+    uint32_t version      = 0;  // Of the seqlock the values were read from
+    uint64_t measurements = 0;
+    uint64_t errors       = 0;
+    std::string mac;
+    std::array<std::string, family_count> lines;
+    uint32_t window_version = 0;
+    std::vector<std::string> window_lines;  // Indexed like the window families
 };
 
 }  // namespace
 
+/*
+ * Every tag gets a slot, written only by the thread calling update(). Slots live in chunks that
+ * are never moved or freed while the exposer exists, and a slot is published to Collect() by
+ * incrementing slot_count. Collect() copies the values of each slot through its seqlock, so it
+ * never holds anything that update() waits for.
+ *
+ * The writer keeps the tags in least recently seen order, and removes them from the tail when they
+ * expire or make room for a new one. A removed slot is hidden from new scrapes at once, but only
+ * reused after two epochs: a scrape registers in the current epoch, and the writer reuses the
+ * slots retired before an epoch change once no scrape of the old epoch is left.
+ *
+ * With decode_mode::on_collect the slot holds the latest payload instead, and Collect() decodes
+ * it. A tag advertising every second is then decoded once per scrape instead of ten times.
+ *
+ * Aggregation windows are aligned to multiples of their length on the monotonic clock. The writer
+ * keeps the open window of each tag with its owner, and publishes it through the seqlock of the
+ * slot when it closes. Scrapes only read closed windows, so they never reset anything the writer
+ * uses.
+ */
 class RuuviExposer::Impl {
 public:
-    Impl(): registry(std::make_shared<Registry>()) {
-        std::lock_guard grd(mtx);
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_temperature_celsius")
-                                  .Help("Ruuvitag temperature in Celsius")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::temperature});
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_relative_humidity_ratio")
-                                  .Help("Ruuvitag relative humidity 0-100%")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::humidity});
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_pressure_pascals")
-                                  .Help("Ruuvitag pressure in Pascal")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::pressure});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_acceleration_gs")
-                 .Help("Ruuvitag acceleration in Gs")
-                 .Register(*registry),
-             [](ruuvi_data_format_5 const& p) { return p.acceleration[0]; },
-             {{"axis", "x"}}});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_acceleration_gs")
-                 .Help("Ruuvitag acceleration in Gs")
-                 .Register(*registry),
-             [](ruuvi_data_format_5 const& p) { return p.acceleration[1]; },
-             {{"axis", "y"}}});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_acceleration_gs")
-                 .Help("Ruuvitag acceleration in Gs")
-                 .Register(*registry),
-             [](ruuvi_data_format_5 const& p) { return p.acceleration[2]; },
-             {{"axis", "z"}}});
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_battery_volts")
-                                  .Help("Ruuvitag battery voltage")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::battery_voltage});
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_movement_count")
-                                  .Help("Ruuvitag movement counter")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::movement_counter});
-
-        collectors.push_back({BuildGauge()
-                                  .Name("ruuvi_tx_power_dbm")
-                                  .Help("Ruuvitag transmit power")
-                                  .Register(*registry),
-                              &ruuvi_data_format_5::tx_power});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_measurement_count")
-                 .Help("Ruuvitag packet measurement sequence number[0-65335]")
-                 .Register(*registry),
-             &ruuvi_data_format_5::measurement_sequence});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_rssi_dbm")
-                 .Help("Ruuvitag received signal strength rssi")
-                 .Register(*registry),
-             &ruuvi_data_format_5::signal_strength});
-
-        collectors.push_back(
-            {BuildGauge()
-                 .Name("ruuvi_accelerayion_gs_total")
-                 .Help("Total acceleration of ruuvitag, hypot(x, y, z)")
-                 .Register(*registry),
-             &ruuvi_data_format_5::acceleration_total});
-
-        errors_counter = &BuildCounter()
-                              .Name("ruuvi_errors_total")
-                              .Help("Number of errors")
-                              .Register(*registry);
-
-        measurements_total = &BuildCounter()
-                                  .Name("ruuvi_received_measurements_total")
-                                  .Help("Total count of received measurements")
-                                  .Register(*registry);
-    }
-
-    void update_data(ruuvi_data_format_5 const& new_data) {
-        std::lock_guard grd(mtx);
-        for (auto& c : collectors) { c.update(new_data); }
-        measurements_total
-            ->Add({
-                {"mac", new_data.mac}
-        })
-            .Increment();
-        auto& e = errors_counter->Add({
-            {"mac", new_data.mac}
-        });
-        if (new_data.contains_errors) e.Increment();
-    }
-
-    std::vector<MetricFamily> Collect() {
-        std::lock_guard grd(mtx);
-        return registry->Collect();
+    Impl(decode_mode m, tag_limits l, sample_time t, aggregation a)
+        : mode(m), time(t), ttl(l.ttl),
+          max_live(l.max_tags == 0 || l.max_tags > max_slots ? max_slots : l.max_tags),
+          window_length(std::chrono::duration_cast<std::chrono::nanoseconds>(a.window).count()),
+          window_stats_count(window_length <= 0 ? 0 : a.last ? 5 : 4) {
+        if (window_stats_count > 0 && mode == decode_mode::on_collect)
+            throw std::invalid_argument("Aggregation windows need every advert decoded on update");
+        for (size_t k = 0; k < window_fields; ++k) {
+            if (k > 0 && window_family[k] == window_family[k - 1]) continue;
+            auto const& f = family_table[gauge_family[windowed_gauge[k]]];
+            for (size_t stat = 0; stat < window_stats_count; ++stat) {
+                window_families.push_back({std::string(f.name) + window_stat_suffix[stat],
+                                           std::string(f.help) + window_stat_help[stat]});
+            }
+        }
+    }
+    Impl(Impl const&)            = delete;
+    Impl& operator=(Impl const&) = delete;
+    ~Impl() {
+        for (auto& c: chunks) delete c.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief update_data Stores the values of the tag
+     * @param mac The sender, or nullptr if it is not known
+     */
+    void update_data(format_5_reading const& new_data, ble::mac_address const* mac,
+                     bool contains_errors, clock::time_point now = coarse_now()) {
+        auto i = slot_of(mac, now);
+        if (i == no_slot) return;
+
+        auto& s = slot(i);
+        auto v  = values_of(new_data, mac, monotonic_ns(now));
+        s.values.store(v);
+        if (window_stats_count > 0) aggregate(i, v);
+        s.measurements.fetch_add(1, std::memory_order_relaxed);
+        if (contains_errors) s.errors.fetch_add(1, std::memory_order_relaxed);
+        publish(s);
+    }
+
+    void update_advert(ble::AdvPacket const& p) {
+        auto data = p.manufacturer_data();
+        auto size = p.manufacturer_data_size();
+        auto now  = coarse_now();
+
+        if (mode == decode_mode::on_update) {
+            decode_format_5(p, reading);
+            update_data(reading, reading.valid(mac_mismatch) ? &p.mac : nullptr, !reading.valid(),
+                        now);
+            return;
+        }
+
+        // Picking the slot only needs the MAC check of the decoder
+        bool known = size < format_5::size
+                  || std::equal(p.mac.begin(), p.mac.end(), data + format_5::mac_offset);
+        auto i     = slot_of(known ? &p.mac : nullptr, now);
+        if (i == no_slot) return;
+        auto slot = &this->slot(i);
+
+        TagPayload payload;
+        payload.measurement     = slot->measurements.load(std::memory_order_relaxed) + 1;
+        payload.received        = monotonic_ns(now);
+        payload.last_seen       = payload.received;
+        payload.signal_strength = p.signal_strength;
+        payload.size            = uint8_t(size);
+        payload.data.fill(0);
+        std::copy(data, data + std::min(size, payload.data.size()), payload.data.begin());
+        slot->payload.store(payload);
+        slot->measurements.store(payload.measurement, std::memory_order_relaxed);
+        publish(*slot);
+    }
+
+    void update_signal(ble::mac_address const& mac, int16_t signal_strength) {
+        // Only tags that have sent a measurement have a slot
+        auto index = tags.find(mac);
+        if (index == nullptr) return;
+        auto now = coarse_now();
+        touch(*index, now);
+        auto& s = slot(*index);
+        // Loads never retry, this is the only writer
+        if (mode == decode_mode::on_collect) {
+            auto p            = s.payload.load();
+            p.signal_strength = signal_strength;
+            p.last_seen       = monotonic_ns(now);
+            s.payload.store(p);
+        } else {
+            auto v               = s.values.load();
+            v.values[rssi_gauge] = signal_strength;
+            v.last_seen          = monotonic_ns(now);
+            s.values.store(v);
+        }
+    }
+
+    void expire(clock::time_point now) {
+        if (ttl.count() > 0) {
+            while (oldest != no_slot && now - owners[oldest].last_seen > ttl)
+                evict(oldest, eviction::expired);
+        }
+        // Tags that are not heard from would keep their windows open
+        auto t = monotonic_ns(now);
+        if (window_stats_count > 0 && t >= windows_end) {
+            for (auto i = newest; i != no_slot; i = owners[i].older)
+                if (t >= owners[i].window.end) close_window(i, t);
+            windows_end = window_end(t);
+        }
+        reclaim();
+    }
+
+    std::vector<MetricFamily> Collect() const {
+        read_guard guard(*this);
+        auto const count  = slot_count.load(std::memory_order_acquire);
+        auto const offset = stable_offset();
+
+        std::vector<TagValues> values;
+        std::vector<TagSlot const*> slots;
+        std::vector<WindowStats> windows;
+        values.reserve(count);
+        slots.reserve(count);
+        if (window_stats_count > 0) windows.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            TagValues v;
+            auto& s = slot(i);
+            if (!s.live.load(std::memory_order_acquire) || !snapshot(s, v, offset)) continue;
+            values.push_back(v);
+            slots.push_back(&slot(i));
+            if (window_stats_count > 0) windows.push_back(s.window.load());
+        }
+
+        std::vector<std::string> macs(values.size());
+        for (size_t i = 0; i < values.size(); ++i)
+            if (values[i].known_mac) macs[i] = ble::format_mac(values[i].mac);
+
+        std::vector<MetricFamily> families(family_count);
+        for (size_t f = 0; f < family_count; ++f) {
+            families[f].name = family_table[f].name;
+            families[f].help = family_table[f].help;
+            families[f].type = family_table[f].type;
+        }
+        for (size_t g = 0; g < gauge_count; ++g) {
+            auto& f = families[gauge_family[g]];
+            for (size_t i = 0; i < values.size(); ++i) {
+                auto& m = f.metric.emplace_back();
+                if (gauges[g].axis != nullptr) m.label.push_back({"axis", gauges[g].axis});
+                m.label.push_back({"mac", macs[i]});
+                m.gauge.value  = values[i].values[g];
+                m.timestamp_ms = timestamp_ms(values[i], g, offset);
+            }
+        }
+        for (size_t i = 0; i < slots.size(); ++i) {
+            auto& e = families[errors_family].metric.emplace_back();
+            e.label.push_back({"mac", macs[i]});
+            e.counter.value = double(slots[i]->errors.load(std::memory_order_relaxed));
+            auto& m = families[measurements_family].metric.emplace_back();
+            m.label.push_back({"mac", macs[i]});
+            m.counter.value = double(slots[i]->measurements.load(std::memory_order_relaxed));
+        }
+
+        auto const first_window = families.size();
+        for (auto const& wf: window_families) {
+            auto& f = families.emplace_back();
+            f.name  = wf.name;
+            f.help  = wf.help;
+            f.type  = MetricType::Gauge;
+        }
+        for (size_t k = 0; k < window_fields; ++k) {
+            auto const& g = gauges[windowed_gauge[k]];
+            for (size_t stat = 0; stat < window_stats_count; ++stat) {
+                auto& f = families[first_window + window_family[k] * window_stats_count + stat];
+                for (size_t i = 0; i < windows.size(); ++i) {
+                    if (windows[i].end == 0) continue;  // None has closed yet
+                    auto& m = f.metric.emplace_back();
+                    if (g.axis != nullptr) m.label.push_back({"axis", g.axis});
+                    m.label.push_back({"mac", macs[i]});
+                    m.gauge.value  = stat_value(windows[i], k, stat);
+                    m.timestamp_ms = window_timestamp_ms(windows[i], offset);
+                }
+            }
+        }
+
+        auto& live = families.emplace_back();
+        live.name  = live_tags_family.name;
+        live.help  = live_tags_family.help;
+        live.type  = live_tags_family.type;
+        live.metric.emplace_back().gauge.value = double(live_tags.load(std::memory_order_relaxed));
+        auto& evicted = families.emplace_back();
+        evicted.name  = evictions_family.name;
+        evicted.help  = evictions_family.help;
+        evicted.type  = evictions_family.type;
+        for (size_t r = 0; r < evictions.size(); ++r) {
+            auto& m = evicted.metric.emplace_back();
+            m.label.push_back({"reason", eviction_reasons[r]});
+            m.counter.value = double(evictions[r].load(std::memory_order_relaxed));
+        }
+        return families;
+    }
+
+    void render(std::string& out) const {
+        std::lock_guard grd(render_mtx);  // Only shared between scrapes
+        read_guard guard(*this);
+        auto const count  = slot_count.load(std::memory_order_acquire);
+        auto const offset = stable_offset();
+        if (rendered.size() < count) rendered.resize(count);
+        for (size_t i = 0; i < count; ++i) refresh(slot(i), rendered[i], offset);
+
+        for (size_t f = 0; f < family_count; ++f) {
+            bool header = false;
+            for (size_t i = 0; i < count; ++i) {
+                auto const& lines = rendered[i].lines[f];
+                if (lines.empty()) continue;
+                if (!header) append_header(out, family_table[f]);
+                header = true;
+                out.append(lines);
+            }
+        }
+        for (size_t f = 0; f < window_families.size(); ++f) {
+            bool header = false;
+            for (size_t i = 0; i < count; ++i) {
+                auto const& lines = rendered[i].window_lines;
+                if (f >= lines.size() || lines[f].empty()) continue;
+                if (!header) append_header(out, window_families[f].descriptor());
+                header = true;
+                out.append(lines[f]);
+            }
+        }
+
+        append_header(out, live_tags_family);
+        out.append(live_tags_family.name).append(" ");
+        append_value(out, double(live_tags.load(std::memory_order_relaxed)));
+        out.append("\n");
+        append_header(out, evictions_family);
+        for (size_t r = 0; r < evictions.size(); ++r) {
+            out.append(evictions_family.name).append("{reason=\"");
+            out.append(eviction_reasons[r]).append("\"} ");
+            append_value(out, double(evictions[r].load(std::memory_order_relaxed)));
+            out.append("\n");
+        }
     }
 
 private:
-    const std::shared_ptr<Registry> registry;
+    static constexpr size_t chunk_size = 64;
+    static constexpr size_t max_chunks = 1024;
+    static constexpr size_t max_slots  = chunk_size * max_chunks;
+    static constexpr uint32_t no_slot  = ~0u;
+    using Chunk                        = std::array<TagSlot, chunk_size>;
+
+    const decode_mode mode;
+    const sample_time time;
+    const clock::duration ttl;
+    const size_t max_live;
+    const int64_t window_length;      // In nanoseconds
+    const size_t window_stats_count;  // Exported per field, 0 without windows
+    std::vector<WindowFamily> window_families;
+    format_5_reading reading;  // Only used by the writer
+
+    std::array<std::atomic<Chunk*>, max_chunks> chunks{};
+    std::atomic<size_t> slot_count = 0;
+
+    // Only used by render(), indexed like the slots
+    mutable std::mutex render_mtx;
+    mutable std::vector<RenderedTag> rendered;
+
+    // Reading the two clocks differs by a few microseconds each time, only a step of the wall
+    // clock replaces the offset. Text rendered earlier then agrees with Collect().
+    mutable std::atomic<int64_t> offset_ns = wall_clock_offset();
+
+    std::atomic<size_t> live_tags = 0;
+    std::array<std::atomic<uint64_t>, std::size(eviction_reasons)> evictions{};
+
+    // Scrapes in progress by the parity of the epoch they started in
+    std::atomic<uint64_t> epoch = 0;
+    mutable std::array<std::atomic<uint32_t>, 2> readers{};
+
+    // Only used by the writer
+    mac_table<uint32_t> tags;
+    uint32_t unknown_slot = no_slot;  // Readings whose MAC doesn't match the sender
+    std::vector<SlotOwner> owners;    // Indexed like the slots
+    uint32_t newest     = no_slot;
+    uint32_t oldest     = no_slot;
+    int64_t windows_end = 0;  // Of the windows expire() closes next
+    std::vector<uint32_t> retired;     // Removed since the last epoch change
+    std::vector<uint32_t> grace;       // Removed before it, may still be read by scrapes
+    std::vector<uint32_t> free_slots;  // Not read by any scrape
+
+    // Keeps the slots read by a scrape from being reused until it has finished
+    class read_guard {
+    public:
+        explicit read_guard(Impl const& i): impl(i) {
+            while (true) {
+                auto e = impl.epoch.load();
+                parity = e & 1u;
+                impl.readers[parity].fetch_add(1);
+                // Otherwise the writer may have missed the registration
+                if (impl.epoch.load() == e) break;
+                impl.readers[parity].fetch_sub(1, std::memory_order_release);
+            }
+        }
+        ~read_guard() { impl.readers[parity].fetch_sub(1, std::memory_order_release); }
+        read_guard(read_guard const&)            = delete;
+        read_guard& operator=(read_guard const&) = delete;
+
+    private:
+        Impl const& impl;
+        size_t parity;
+    };
+
+    int64_t stable_offset() const {
+        auto current = wall_clock_offset();
+        auto kept    = offset_ns.load(std::memory_order_relaxed);
+        if (std::abs(current - kept) < 1'000'000) return kept;
+        offset_ns.store(current, std::memory_order_relaxed);
+        return current;
+    }
+
+    TagSlot& slot(size_t i) const {
+        return (*chunks[i / chunk_size].load(std::memory_order_relaxed))[i % chunk_size];
+    }
+
+    // The current values of the slot, false if it has none yet
+    bool snapshot(TagSlot& s, TagValues& out, int64_t offset) const {
+        if (mode == decode_mode::on_collect) {
+            if (!decode(s, out)) return false;
+        } else {
+            out = s.values.load();
+        }
+        out.values[last_seen_gauge] = double(out.last_seen + offset) / 1e9;
+        return true;
+    }
+
+    // Of the sample of gauge g in milliseconds since the epoch, or 0 to leave it out
+    int64_t timestamp_ms(TagValues const& v, size_t g, int64_t offset) const {
+        if (time == sample_time::scrape || g == last_seen_gauge) return 0;
+        // The signal strength is also updated by repeated adverts
+        return ((g == rssi_gauge ? v.last_seen : v.received) + offset) / 1'000'000;
+    }
+
+    // Window statistics are stamped with the end of the window
+    int64_t window_timestamp_ms(WindowStats const& w, int64_t offset) const {
+        return time == sample_time::scrape ? 0 : (w.end + offset) / 1'000'000;
+    }
+
+    // Re-renders the samples of the slot if its values or counters changed
+    void refresh(TagSlot& s, RenderedTag& r, int64_t offset) const {
+        if (!s.live.load(std::memory_order_acquire)) {
+            if (r.rendered) {
+                for (auto& l: r.lines) l.clear();
+                for (auto& l: r.window_lines) l.clear();
+            }
+            r.rendered = false;
+            return;
+        }
+        auto generation   = s.generation.load(std::memory_order_relaxed);
+        auto version      = mode == decode_mode::on_update ? s.values.version()
+                                                           : s.payload.version();
+        auto measurements = s.measurements.load(std::memory_order_relaxed);
+        bool same_tag     = r.rendered && r.generation == generation;
+        if (!same_tag || r.version != version || r.measurements != measurements
+            || r.errors != s.errors.load(std::memory_order_relaxed)) {
+            if (!render_values(s, r, offset, measurements, !same_tag)) return;
+            r.generation   = generation;
+            r.version      = version;
+            r.measurements = measurements;
+        }
+        if (window_stats_count > 0 && (!same_tag || r.window_version != s.window.version()))
+            refresh_window(s, r, offset);
+    }
+
+    // False if the slot has no values yet
+    bool render_values(TagSlot& s, RenderedTag& r, int64_t offset, uint64_t measurements,
+                       bool new_tag) const {
+        TagValues v;
+        if (!snapshot(s, v, offset)) return false;
+        auto errors = s.errors.load(std::memory_order_relaxed);  // Counted by decode()
+
+        if (new_tag) r.mac = v.known_mac ? ble::format_mac(v.mac) : "";
+        for (auto& l: r.lines) l.clear();
+        for (size_t g = 0; g < gauge_count; ++g) {
+            append_sample(r.lines[gauge_family[g]], gauges[g].name, gauges[g].axis, r.mac,
+                          v.values[g], timestamp_ms(v, g, offset));
+        }
+        append_sample(r.lines[errors_family], family_table[errors_family].name, nullptr, r.mac,
+                      double(errors));
+        append_sample(r.lines[measurements_family], family_table[measurements_family].name,
+                      nullptr, r.mac, double(measurements));
+
+        r.rendered = true;
+        r.errors   = errors;
+        return true;
+    }
+
+    void refresh_window(TagSlot& s, RenderedTag& r, int64_t offset) const {
+        auto version = s.window.version();
+        auto w       = s.window.load();
+        r.window_lines.resize(window_families.size());
+        for (auto& l: r.window_lines) l.clear();
+        if (w.end != 0) {
+            auto timestamp = window_timestamp_ms(w, offset);
+            for (size_t k = 0; k < window_fields; ++k) {
+                for (size_t stat = 0; stat < window_stats_count; ++stat) {
+                    auto f = window_family[k] * window_stats_count + stat;
+                    append_sample(r.window_lines[f], window_families[f].name.c_str(),
+                                  gauges[windowed_gauge[k]].axis, r.mac, stat_value(w, k, stat),
+                                  timestamp);
+                }
+            }
+        }
+        r.window_version = version;
+    }
+
+    // Values of the latest payload of the slot, false if there is none. Errors are counted once.
+    bool decode(TagSlot& s, TagValues& out) const {
+        auto p = s.payload.load();
+        if (p.measurement == 0) return false;
+
+        format_5_reading r;
+        decode_format_5(p.data.data(), p.size, r);
+        r.signal_strength = p.signal_strength;
+
+        auto counted = s.errors_counted.load(std::memory_order_relaxed);
+        if (!r.valid()) {
+            // Concurrent scrapes may decode the same payload
+            while (counted < p.measurement
+                   && !s.errors_counted.compare_exchange_weak(counted, p.measurement))
+                ;
+            if (counted < p.measurement) s.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        auto v        = s.values.load();  // The MAC of the slot
+        out           = values_of(r, v.known_mac ? &v.mac : nullptr, p.received);
+        out.last_seen = p.last_seen;
+        return true;
+    }
 
-    std::vector<MetricCollector> collectors;
-    Family<Counter>* errors_counter;
-    Family<Counter>* measurements_total;
-    std::mutex mtx;
+    // The slot of the tag, created on first use and published once it holds a measurement;
+    // no_slot if the slots have run out
+    uint32_t slot_of(ble::mac_address const* mac, clock::time_point now) {
+        uint32_t const* index = nullptr;
+        if (mac != nullptr)
+            index = tags.find(*mac);
+        else if (unknown_slot != no_slot)
+            index = &unknown_slot;
+        if (index != nullptr) {
+            touch(*index, now);
+            return *index;
+        }
+
+        reclaim();
+        auto n = slot_count.load(std::memory_order_relaxed);
+        if (free_slots.empty() && n == max_slots) return no_slot;
+        if (live_tags.load(std::memory_order_relaxed) == max_live)
+            evict(oldest, eviction::capacity);
+
+        uint32_t i = uint32_t(n);
+        if (!free_slots.empty()) {
+            i = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            if (n % chunk_size == 0)
+                chunks[n / chunk_size].store(new Chunk(), std::memory_order_relaxed);
+            owners.emplace_back();
+        }
+
+        // No scrape reads the slot until it is published
+        auto& s = slot(i);
+        TagValues v;
+        v.mac       = mac != nullptr ? *mac : ble::mac_address{};
+        v.known_mac = mac != nullptr;
+        v.values.fill(0);
+        v.received  = 0;
+        v.last_seen = 0;
+        s.values.store(v);
+        s.payload.store(TagPayload{});
+        s.window.store(WindowStats{});
+        s.measurements.store(0, std::memory_order_relaxed);
+        s.errors.store(0, std::memory_order_relaxed);
+        s.errors_counted.store(0, std::memory_order_relaxed);
+        s.generation.store(s.generation.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+        if (i == n) slot_count.store(n + 1, std::memory_order_release);
+
+        owners[i] = {v.mac, v.known_mac, now, WindowStats{}, no_slot, no_slot};
+        if (window_stats_count > 0) owners[i].window.reset(window_end(monotonic_ns(now)));
+        link(i);
+        if (mac != nullptr)
+            *tags.emplace(*mac).first = i;
+        else
+            unknown_slot = i;
+        live_tags.store(live_tags.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return i;
+    }
+
+    // The end of the window containing the monotonic time t
+    int64_t window_end(int64_t t) const { return (t / window_length + 1) * window_length; }
+
+    // Adds the values to the open window of the slot, after closing it if it has ended
+    void aggregate(uint32_t i, TagValues const& v) {
+        auto& w = owners[i].window;
+        if (v.received >= w.end) close_window(i, v.received);
+        for (size_t k = 0; k < window_fields; ++k) w.add(k, v.values[windowed_gauge[k]]);
+    }
+
+    // Publishes the open window of the slot to scrapes, and opens the one containing t
+    void close_window(uint32_t i, int64_t t) {
+        slot(i).window.store(owners[i].window);
+        owners[i].window.reset(window_end(t));
+    }
+
+    void publish(TagSlot& s) {
+        // Only the writer sets it
+        if (!s.live.load(std::memory_order_relaxed)) s.live.store(true, std::memory_order_release);
+    }
+
+    void evict(uint32_t i, eviction reason) {
+        auto const& o = owners[i];
+        unlink(i);
+        if (o.known_mac)
+            tags.erase(o.mac);
+        else
+            unknown_slot = no_slot;
+        slot(i).live.store(false, std::memory_order_relaxed);
+        retired.push_back(i);
+        live_tags.store(live_tags.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        evictions[reason].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Moves the retired slots on as the scrapes that may read them finish, never waits for them
+    void reclaim() {
+        auto e = epoch.load(std::memory_order_relaxed);
+        // The scrapes of the previous epoch share a counter with the next one
+        if (grace.empty() && !retired.empty() && readers[(e + 1) & 1u].load() == 0) {
+            grace.swap(retired);
+            epoch.store(++e);
+        }
+        if (!grace.empty() && readers[(e - 1) & 1u].load() == 0) {
+            free_slots.insert(free_slots.end(), grace.begin(), grace.end());
+            grace.clear();
+        }
+    }
+
+    void link(uint32_t i) {
+        owners[i].newer = no_slot;
+        owners[i].older = newest;
+        (newest != no_slot ? owners[newest].newer : oldest) = i;
+        newest = i;
+    }
+
+    void unlink(uint32_t i) {
+        auto const& o = owners[i];
+        (o.newer != no_slot ? owners[o.newer].older : newest) = o.older;
+        (o.older != no_slot ? owners[o.older].newer : oldest) = o.newer;
+    }
+
+    void touch(uint32_t i, clock::time_point now) {
+        owners[i].last_seen = now;
+        if (i == newest) return;
+        unlink(i);
+        link(i);
+    }
 };
 
-RuuviExposer::RuuviExposer(): impl(std::make_unique<Impl>()) {}
+void ruuvi::append_reading(format_5_reading const& r, int64_t timestamp_ms,
+                          std::vector<MetricFamily>& families) {
+    auto const mac = r.valid(mac_mismatch) ? ble::format_mac(r.mac) : std::string();
+    for (size_t g = 0; g < gauge_count; ++g) {
+        auto f = std::find_if(families.begin(), families.end(),
+                              [g](MetricFamily const& f) { return f.name == gauges[g].name; });
+        if (f == families.end()) {
+            f       = families.emplace(families.end());
+            f->name = gauges[g].name;
+            f->help = gauges[g].help;
+            f->type = MetricType::Gauge;
+        }
+        auto& m = f->metric.emplace_back();
+        if (gauges[g].axis != nullptr) m.label.push_back({"axis", gauges[g].axis});
+        m.label.push_back({"mac", mac});
+        m.gauge.value  = g == last_seen_gauge ? double(timestamp_ms) / 1000 : gauges[g].value(r);
+        m.timestamp_ms = timestamp_ms;
+    }
+}
+
+RuuviExposer::RuuviExposer(decode_mode mode, tag_limits limits, sample_time time,
+                           aggregation windows)
+    : impl(std::make_unique<Impl>(mode, limits, time, windows)) {}
 
 RuuviExposer::~RuuviExposer() = default;
 
+void RuuviExposer::update(format_5_reading const& data) {
+    impl->update_data(data, data.valid(mac_mismatch) ? &data.mac : nullptr, !data.valid());
+}
+
 void RuuviExposer::update(ruuvi_data_format_5 const& data) {
-    impl->update_data(data);
+    format_5_reading r;
+    r.temperature          = data.temperature;
+    r.humidity             = data.humidity;
+    r.pressure             = data.pressure;
+    r.acceleration         = data.acceleration;
+    r.battery_voltage      = data.battery_voltage;
+    r.measurement_sequence = data.measurement_sequence;
+    r.tx_power             = data.tx_power;
+    r.movement_counter     = data.movement_counter;
+    r.signal_strength      = data.signal_strength;
+
+    ble::mac_address mac;
+    bool known = ble::parse_mac(data.mac, mac);
+    impl->update_data(r, known ? &mac : nullptr, data.contains_errors);
+}
+
+void RuuviExposer::update(ble::AdvPacket const& p) {
+    impl->update_advert(p);
+}
+
+void RuuviExposer::update_signal(ble::mac_address const& mac, int16_t signal_strength) {
+    impl->update_signal(mac, signal_strength);
+}
+
+void RuuviExposer::expire(std::chrono::steady_clock::time_point now) {
+    impl->expire(now);
 }
 
 std::vector<MetricFamily> RuuviExposer::Collect() const {
     return impl->Collect();
 }
+
+void RuuviExposer::render(std::string& out) const {
+    impl->render(out);
+}
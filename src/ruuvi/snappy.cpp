@@ -0,0 +1,161 @@
+#include "snappy.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+using namespace ruuvi;
+
+namespace {
+
+// Copies can reach back this far, the input is compressed in blocks of this size
+constexpr size_t block_size = 1u << 16u;
+constexpr size_t hash_bits  = 14;
+
+enum tag : uint8_t { literal = 0, copy_1 = 1, copy_2 = 2, copy_4 = 3 };
+
+uint32_t load32(char const* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t hash(uint32_t bytes) {
+    return (bytes * 0x1e35a7bdu) >> (32 - hash_bits);
+}
+
+void append_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(char(v | 0x80));
+        v >>= 7u;
+    }
+    out.push_back(char(v));
+}
+
+void append_literal(std::string& out, char const* p, size_t size) {
+    if (size == 0) return;
+    auto n = size - 1;
+    if (n < 60) {
+        out.push_back(char(literal | n << 2u));
+    } else {
+        // The length follows in 1 to 4 bytes
+        int bytes = n < (1u << 8u) ? 1 : n < (1u << 16u) ? 2 : n < (1u << 24u) ? 3 : 4;
+        out.push_back(char(literal | (59 + bytes) << 2u));
+        for (int i = 0; i < bytes; ++i) out.push_back(char(n >> (8 * i)));
+    }
+    out.append(p, size);
+}
+
+void append_copy(std::string& out, size_t offset, size_t length) {
+    // Longest copies first, never leaving fewer than 4 bytes for the short form
+    while (length >= 68) {
+        out.push_back(char(copy_2 | 63u << 2u));
+        out.push_back(char(offset));
+        out.push_back(char(offset >> 8u));
+        length -= 64;
+    }
+    if (length > 64) {
+        out.push_back(char(copy_2 | 59u << 2u));
+        out.push_back(char(offset));
+        out.push_back(char(offset >> 8u));
+        length -= 60;
+    }
+    if (length < 12 && offset < 2048) {
+        out.push_back(char(copy_1 | (length - 4) << 2u | (offset >> 8u) << 5u));
+        out.push_back(char(offset));
+    } else {
+        out.push_back(char(copy_2 | (length - 1) << 2u));
+        out.push_back(char(offset));
+        out.push_back(char(offset >> 8u));
+    }
+}
+
+void compress_block(char const* in, size_t size, std::string& out,
+                    std::array<uint16_t, 1u << hash_bits>& table) {
+    size_t literal_start = 0;
+    if (size >= 4) {
+        table.fill(0);
+        size_t pos = 0;
+        while (pos + 4 <= size) {
+            auto bytes   = load32(in + pos);
+            auto& entry  = table[hash(bytes)];
+            size_t match = entry;
+            entry        = uint16_t(pos);
+            if (match >= pos || load32(in + match) != bytes) {
+                // Skips faster through data that doesn't compress
+                pos += 1 + ((pos - literal_start) >> 5u);
+                continue;
+            }
+            size_t length = 4;
+            while (pos + length < size && in[match + length] == in[pos + length]) ++length;
+            append_literal(out, in + literal_start, pos - literal_start);
+            append_copy(out, pos - match, length);
+            pos += length;
+            literal_start = pos;
+        }
+    }
+    append_literal(out, in + literal_start, size - literal_start);
+}
+
+}  // namespace
+
+void ruuvi::snappy_compress(std::string_view in, std::string& out) {
+    std::array<uint16_t, 1u << hash_bits> table;
+    out.clear();
+    append_varint(out, in.size());
+    for (size_t block = 0; block < in.size(); block += block_size) {
+        compress_block(in.data() + block, std::min(block_size, in.size() - block), out, table);
+    }
+}
+
+bool ruuvi::snappy_uncompress(std::string_view in, std::string& out) {
+    uint64_t size = 0;
+    size_t pos    = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (pos == in.size() || shift > 63) return false;
+        auto b = uint8_t(in[pos++]);
+        size |= uint64_t(b & 0x7fu) << shift;
+        if ((b & 0x80u) == 0) break;
+    }
+    out.clear();
+    if (size > in.size() * 64) return false;  // More than copies could possibly produce
+    out.reserve(size);
+
+    while (pos < in.size()) {
+        auto t = uint8_t(in[pos++]);
+        if ((t & 3u) == literal) {
+            size_t length = t >> 2u;
+            if (length >= 60) {
+                size_t bytes = length - 59;
+                if (in.size() - pos < bytes) return false;
+                length = 0;
+                for (size_t i = 0; i < bytes; ++i) length |= size_t(uint8_t(in[pos + i])) << 8 * i;
+                pos += bytes;
+            }
+            ++length;
+            if (in.size() - pos < length || size - out.size() < length) return false;
+            out.append(in.data() + pos, length);
+            pos += length;
+            continue;
+        }
+
+        size_t length, offset;
+        size_t bytes = (t & 3u) == copy_1 ? 1 : (t & 3u) == copy_2 ? 2 : 4;
+        if (in.size() - pos < bytes) return false;
+        if ((t & 3u) == copy_1) {
+            length = 4 + ((t >> 2u) & 7u);
+            offset = size_t(t >> 5u) << 8u | uint8_t(in[pos]);
+        } else {
+            length = 1 + (t >> 2u);
+            offset = 0;
+            for (size_t i = 0; i < bytes; ++i) offset |= size_t(uint8_t(in[pos + i])) << 8 * i;
+        }
+        pos += bytes;
+        if (offset == 0 || offset > out.size() || size - out.size() < length) return false;
+        // May overlap what it appends, byte by byte repeats the pattern
+        auto from = out.size() - offset;
+        for (size_t i = 0; i < length; ++i) out.push_back(out[from + i]);
+    }
+    return out.size() == size;
+}
@@ -0,0 +1,29 @@
+#include "snapshot_cache.hpp"
+
+#include <algorithm>
+
+using namespace sys_info;
+
+void cache_statistics::append(char const* collector,
+                              std::vector<prometheus::MetricFamily>& families) const {
+    auto add = [collector, &families](char const* name, char const* help, double value) {
+        auto f = std::find_if(families.begin(), families.end(),
+                              [name](auto const& family) { return family.name == name; });
+        if (f == families.end()) {
+            f       = families.emplace(families.end());
+            f->name = name;
+            f->help = help;
+            f->type = prometheus::MetricType::Counter;
+        }
+        auto& m = f->metric.emplace_back();
+        m.label.push_back({"collector", collector});
+        m.counter.value = value;
+    };
+    add("sysinfo_cache_hits_total",
+        "Number of scrapes served a snapshot read by an earlier or concurrent scrape",
+        double(hits.load(std::memory_order_relaxed)));
+    add("sysinfo_cache_refreshes_total", "Number of times the snapshot was read again",
+        double(refreshes.load(std::memory_order_relaxed)));
+    add("sysinfo_cache_refresh_seconds_total", "Time spent reading the snapshot again",
+        double(refresh_ns.load(std::memory_order_relaxed)) / 1e9);
+}
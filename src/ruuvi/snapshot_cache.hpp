@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <prometheus/metric_family.h>
+
+namespace sys_info {
+
+/**
+ * @brief Counters of a snapshot_cache, exported with the metrics of its collector
+ */
+struct cache_statistics {
+    std::atomic<uint64_t> hits       = 0;  // Scrapes served a snapshot they didn't read
+    std::atomic<uint64_t> refreshes  = 0;
+    std::atomic<uint64_t> refresh_ns = 0;
+
+    /**
+     * @brief append Adds the counters to the sysinfo_cache_* families, labelled with the
+     * collector, creating the families not in families yet
+     */
+    void append(char const* collector, std::vector<prometheus::MetricFamily>& families) const;
+};
+
+/**
+ * @brief A snapshot shared by the scrapes of a collector, refreshed once it's older than max_age
+ *
+ * Only one scrape refreshes it at a time. Scrapes that find a refresh in flight wait for it and
+ * return its snapshot instead of reading the files again.
+ */
+template<class T> class snapshot_cache {
+public:
+    using clock    = std::chrono::steady_clock;
+    using snapshot = std::shared_ptr<T const>;
+
+    explicit snapshot_cache(clock::duration max_age): max_age(max_age) {}
+
+    /**
+     * @brief get Returns the snapshot, replaced first by refresh(previous snapshot) if it's stale
+     * @return Null only if there's no snapshot yet and refreshing it threw
+     */
+    template<class F> snapshot get(F&& refresh) {
+        std::unique_lock l(mtx);
+        if (current && clock::now() - refreshed_at < max_age) {
+            stats.hits.fetch_add(1, std::memory_order_relaxed);
+            return current;
+        }
+        if (refreshing) {
+            auto const started = generation;
+            done.wait(l, [this, started] { return generation != started; });
+            stats.hits.fetch_add(1, std::memory_order_relaxed);
+            return current;
+        }
+
+        refreshing         = true;
+        auto const start   = clock::now();
+        snapshot const old = current;
+        l.unlock();
+        snapshot next;
+        try {
+            next = refresh(old);
+        } catch (...) {
+            finish(l, nullptr, start);
+            throw;
+        }
+        finish(l, std::move(next), start);
+        return current;
+    }
+
+    cache_statistics const& statistics() const noexcept { return stats; }
+
+private:
+    clock::duration const max_age;
+    std::mutex mtx;
+    std::condition_variable done;
+    snapshot current;
+    clock::time_point refreshed_at;  // When the files of current started to be read
+    bool refreshing     = false;
+    uint64_t generation = 0;  // Incremented by each refresh, for the scrapes waiting on it
+    cache_statistics stats;
+
+    void finish(std::unique_lock<std::mutex>& l, snapshot next, clock::time_point start) {
+        auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start);
+        l.lock();
+        if (next) {
+            current      = std::move(next);
+            refreshed_at = start;
+        }
+        refreshing = false;
+        ++generation;
+        stats.refreshes.fetch_add(1, std::memory_order_relaxed);
+        stats.refresh_ns.fetch_add(uint64_t(ns.count()), std::memory_order_relaxed);
+        done.notify_all();
+    }
+};
+
+}  // namespace sys_info
@@ -0,0 +1,528 @@
+#include "spool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string_view>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <prometheus/metric_family.h>
+#include <spdlog/spdlog.h>
+
+using namespace ruuvi;
+using namespace prometheus;
+
+namespace {
+
+using clock = std::chrono::steady_clock;
+
+/*
+ * Records are stored in host byte order, the spool is only read back on the same machine:
+ *   int64 timestamp_ms, mac[6], int16 signal_strength, payload[24], uint32 checksum
+ * The checksum is never 0, so the zeros past the last record of a segment are not one.
+ */
+constexpr size_t mac_offset      = 8;
+constexpr size_t signal_offset   = mac_offset + 6;
+constexpr size_t payload_offset  = signal_offset + 2;
+constexpr size_t checksum_offset = payload_offset + format_5::size;
+constexpr size_t record_size     = checksum_offset + 4;
+
+// Segments are named by their sequence number, in hex so that they sort by name
+constexpr std::string_view segment_prefix = "spool-";
+constexpr std::string_view segment_suffix = ".seg";
+constexpr char const* cursor_name         = "cursor";
+
+uint32_t checksum(uint8_t const* p, size_t size) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) h = (h ^ p[i]) * 16777619u;
+    return h != 0 ? h : 1;
+}
+
+void encode_record(spooled_reading const& r, uint8_t* out) {
+    std::memcpy(out, &r.timestamp_ms, sizeof(r.timestamp_ms));
+    std::memcpy(out + mac_offset, r.mac.data(), r.mac.size());
+    std::memcpy(out + signal_offset, &r.signal_strength, sizeof(r.signal_strength));
+    std::memcpy(out + payload_offset, r.payload.data(), r.payload.size());
+    auto sum = checksum(out, checksum_offset);
+    std::memcpy(out + checksum_offset, &sum, sizeof(sum));
+}
+
+void decode_record(uint8_t const* in, spooled_reading& r) {
+    std::memcpy(&r.timestamp_ms, in, sizeof(r.timestamp_ms));
+    std::memcpy(r.mac.data(), in + mac_offset, r.mac.size());
+    std::memcpy(&r.signal_strength, in + signal_offset, sizeof(r.signal_strength));
+    std::memcpy(r.payload.data(), in + payload_offset, r.payload.size());
+}
+
+bool valid(uint8_t const* record) {
+    uint32_t sum;
+    std::memcpy(&sum, record + checksum_offset, sizeof(sum));
+    return sum == checksum(record, checksum_offset);
+}
+
+std::runtime_error errno_error(std::string const& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// Reads size bytes unless the file ends first, returns the number read
+size_t read_at(int fd, uint8_t* out, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        auto len = pread(fd, out + done, size - done, offset + off_t(done));
+        if (len < 0 && errno == EINTR) continue;
+        if (len < 0) throw errno_error("Failed to read the spool");
+        if (len == 0) break;
+        done += size_t(len);
+    }
+    return done;
+}
+
+struct segment {
+    uint64_t seq;
+    int fd;
+    size_t records;  // Of the active segment, see active_records
+    bool active;     // Still appended to
+};
+
+// Of the oldest unacknowledged reading
+struct position {
+    uint64_t seq = 0;
+    size_t index = 0;
+};
+
+// Readings of one segment returned by the last read(), until they are acknowledged
+struct span {
+    uint64_t seq;
+    size_t index;
+    size_t count;
+};
+
+enum drop_reason { over_size, write_error };
+constexpr char const* drop_reasons[] = {"capacity", "error"};
+
+}  // namespace
+
+class spool::Impl {
+public:
+    explicit Impl(spool_options o)
+        : opts(std::move(o)),
+          capacity(opts.segment_size / record_size),
+          max_segments(std::max<size_t>(2, opts.max_size / std::max<size_t>(opts.segment_size, 1))),
+          page_size(size_t(sysconf(_SC_PAGESIZE))) {
+        if (capacity == 0)
+            throw std::invalid_argument("Spool segments must have room for at least one reading");
+        if (mkdir(opts.directory.c_str(), 0755) < 0 && errno != EEXIST)
+            throw errno_error("Failed to create " + opts.directory);
+        recover();
+        start_segment();
+    }
+
+    ~Impl() {
+        seal();
+        std::lock_guard g(mtx);
+        if (!segments.empty() && segments.back().records == 0) {
+            remove(segments.back());
+            segments.pop_back();
+        }
+        save_cursor();
+        for (auto const& s: segments) close(s.fd);
+    }
+
+    bool append(ble::AdvPacket const& p, int64_t timestamp_ms) noexcept {
+        if (p.manufacturer_data_size() != format_5::size || p.manufacturer_data()[0] != 0x05)
+            return false;
+        auto n = active_records.load(std::memory_order_relaxed);
+        if (map != nullptr && n == capacity) {
+            seal();
+            try {
+                start_segment();
+            } catch (std::exception const& e) {
+                spdlog::warn("Spooling stopped: {}", e.what());
+            }
+            n = 0;
+        }
+        if (map == nullptr) {
+            drop_count[write_error].fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        spooled_reading r;
+        r.timestamp_ms    = timestamp_ms;
+        r.mac             = p.mac;
+        r.signal_strength = p.signal_strength;
+        std::copy_n(p.manufacturer_data(), r.payload.size(), r.payload.begin());
+        encode_record(r, map + n * record_size);
+        active_records.store(n + 1, std::memory_order_release);
+        appended.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void commit(clock::time_point now) {
+        if (now < next_commit) return;
+        next_commit = now + opts.commit_interval;
+        if (map == nullptr) {
+            try {
+                start_segment();
+                spdlog::info("Spooling resumed");
+            } catch (std::exception const& e) {
+                spdlog::warn("Spooling still stopped: {}", e.what());
+            }
+            return;
+        }
+        sync(active_records.load(std::memory_order_relaxed));
+    }
+
+    void read(std::vector<spooled_reading>& out, size_t max) {
+        out.clear();
+        std::lock_guard g(mtx);
+        in_flight.clear();
+        auto it      = current();
+        size_t index = cursor.index;
+        while (it != segments.end() && out.size() < max) {
+            auto limit = records(*it);
+            auto n     = std::min(limit - index, max - out.size());
+            scratch.resize(n * record_size);
+            auto bytes =
+                read_at(it->fd, scratch.data(), scratch.size(), off_t(index * record_size));
+            for (size_t i = 0; i + record_size <= bytes; i += record_size)
+                decode_record(scratch.data() + i, out.emplace_back());
+            if (bytes >= record_size) in_flight.push_back({it->seq, index, bytes / record_size});
+            index += n;
+            if (index < limit || it->active) break;
+            ++it;
+            index = 0;
+        }
+    }
+
+    void acknowledge(size_t n) {
+        std::lock_guard g(mtx);
+        // The readings sent from segments dropped in the meantime are already past the cursor
+        for (auto const& s: in_flight) {
+            if (n == 0 || find(s.seq) != segments.end()) break;
+            n -= std::min(n, s.count);
+        }
+        in_flight.clear();
+        bool removed = false;
+        for (auto it = current(); it != segments.end();) {
+            auto k = std::min(n, records(*it) - cursor.index);
+            cursor.index += k;
+            n -= k;
+            if (cursor.index < records(*it) || it->active) break;
+            // Fully sent
+            remove(*it);
+            cursor  = {it->seq + 1, 0};
+            it      = segments.erase(it);
+            removed = true;
+        }
+        // Saved only when a segment goes, after a crash its successor is read from the start
+        if (removed) save_cursor();
+    }
+
+    size_t pending() const {
+        std::lock_guard g(mtx);
+        size_t n = 0;
+        for (auto const& s: segments) {
+            if (s.seq < cursor.seq) continue;
+            n += records(s) - (s.seq == cursor.seq ? cursor.index : 0);
+        }
+        return n;
+    }
+
+    std::vector<MetricFamily> Collect() const {
+        size_t segment_count;
+        {
+            std::lock_guard g(mtx);
+            segment_count = segments.size();
+        }
+        auto waiting = pending();
+
+        std::vector<MetricFamily> families;
+        auto add = [&families](char const* name, char const* help, MetricType type) -> auto& {
+            auto& f = families.emplace_back();
+            f.name  = name;
+            f.help  = help;
+            f.type  = type;
+            return f;
+        };
+        add("ruuvi_spool_readings_total", "Number of readings written to the spool",
+            MetricType::Counter)
+            .metric.emplace_back()
+            .counter.value = double(appended.load(std::memory_order_relaxed));
+        auto& dropped = add("ruuvi_spool_dropped_readings_total",
+                            "Number of readings dropped from the spool before being sent",
+                            MetricType::Counter);
+        for (size_t r = 0; r < std::size(drop_reasons); ++r) {
+            auto& m = dropped.metric.emplace_back();
+            m.label.push_back({"reason", drop_reasons[r]});
+            m.counter.value = double(drop_count[r].load(std::memory_order_relaxed));
+        }
+        add("ruuvi_spool_pending_readings", "Number of spooled readings waiting to be sent",
+            MetricType::Gauge)
+            .metric.emplace_back()
+            .gauge.value = double(waiting);
+        add("ruuvi_spool_segments", "Number of spool segment files", MetricType::Gauge)
+            .metric.emplace_back()
+            .gauge.value = double(segment_count);
+        add("ruuvi_spool_commits_total", "Number of times the spool was written to the disk",
+            MetricType::Counter)
+            .metric.emplace_back()
+            .counter.value = double(commits.load(std::memory_order_relaxed));
+        return families;
+    }
+
+private:
+    spool_options const opts;
+    size_t const capacity;  // Readings per segment
+    size_t const max_segments;
+    size_t const page_size;
+
+    // The segments in order, the last one active unless starting it failed
+    mutable std::mutex mtx;
+    std::deque<segment> segments;
+    position cursor;
+    uint64_t next_seq = 0;
+    std::vector<uint8_t> scratch;  // Only used by the reader
+    std::vector<span> in_flight;   // Of the last read(), in order
+
+    // Only used by the writer
+    uint8_t* map = nullptr;  // Of the active segment
+    size_t synced = 0;       // Readings of the active segment on the disk
+    clock::time_point next_commit{};
+
+    std::atomic<size_t> active_records = 0;  // Released after a record is written
+    std::atomic<uint64_t> appended     = 0;
+    std::atomic<uint64_t> commits      = 0;
+    std::array<std::atomic<uint64_t>, std::size(drop_reasons)> drop_count{};
+
+    std::string path(uint64_t seq) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%.*s%016llx%.*s", int(segment_prefix.size()),
+                      segment_prefix.data(), static_cast<unsigned long long>(seq),
+                      int(segment_suffix.size()), segment_suffix.data());
+        return opts.directory + "/" + name;
+    }
+
+    size_t records(segment const& s) const {
+        return s.active ? active_records.load(std::memory_order_acquire) : s.records;
+    }
+
+    std::deque<segment>::iterator find(uint64_t seq) {
+        return std::find_if(segments.begin(), segments.end(),
+                            [seq](segment const& s) { return s.seq == seq; });
+    }
+
+    // The segment of the cursor, moved past the segments that have been deleted
+    std::deque<segment>::iterator current() {
+        auto it = std::find_if(segments.begin(), segments.end(),
+                               [this](segment const& s) { return s.seq >= cursor.seq; });
+        if (it != segments.end() && it->seq != cursor.seq) cursor = {it->seq, 0};
+        return it;
+    }
+
+    void remove(segment const& s) {
+        close(s.fd);
+        if (unlink(path(s.seq).c_str()) < 0)
+            spdlog::warn("Failed to remove spool segment {}: {}", s.seq, std::strerror(errno));
+    }
+
+    // Opens the segments of an earlier run, the readings after the cursor are sent again
+    void recover() {
+        auto dir = opendir(opts.directory.c_str());
+        if (dir == nullptr) throw errno_error("Failed to open " + opts.directory);
+        std::vector<uint64_t> found;
+        while (auto e = readdir(dir)) {
+            std::string_view name(e->d_name);
+            if (name.size() <= segment_prefix.size() + segment_suffix.size()
+                || name.substr(0, segment_prefix.size()) != segment_prefix
+                || name.substr(name.size() - segment_suffix.size()) != segment_suffix)
+                continue;
+            name.remove_prefix(segment_prefix.size());
+            name.remove_suffix(segment_suffix.size());
+            uint64_t seq;
+            auto [end, ec] = std::from_chars(name.data(), name.data() + name.size(), seq, 16);
+            if (ec == std::errc{} && end == name.data() + name.size()) found.push_back(seq);
+        }
+        closedir(dir);
+        std::sort(found.begin(), found.end());
+
+        for (auto seq: found) {
+            next_seq = seq + 1;
+            int fd   = open(path(seq).c_str(), O_RDWR | O_CLOEXEC);
+            if (fd < 0) throw errno_error("Failed to open " + path(seq));
+            segment s{seq, fd, 0, false};
+            try {
+                s.records = count_records(fd);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            if (s.records == 0)
+                remove(s);
+            else
+                segments.push_back(s);
+        }
+        load_cursor();
+        // Leaves room for the segment started next
+        while (segments.size() >= max_segments) drop_oldest();
+        if (auto n = pending(); n > 0)
+            spdlog::info("Spool has {} readings to send in {} segments", n, segments.size());
+    }
+
+    // The records up to the first one that didn't make it to the disk
+    size_t count_records(int fd) {
+        constexpr size_t chunk_records = (1u << 16u) / record_size;
+        std::vector<uint8_t> chunk(chunk_records * record_size);
+        size_t n = 0;
+        while (true) {
+            auto bytes = read_at(fd, chunk.data(), chunk.size(), off_t(n * record_size));
+            for (size_t i = 0; i + record_size <= bytes; i += record_size, ++n)
+                if (!valid(chunk.data() + i)) return n;
+            if (bytes < chunk.size()) return n;
+        }
+    }
+
+    void load_cursor() {
+        auto file = opts.directory + "/" + cursor_name;
+        uint8_t buf[20];
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        bool ok = false;
+        try {
+            ok = read_at(fd, buf, sizeof(buf), 0) == sizeof(buf);
+        } catch (std::exception const& e) {
+            spdlog::warn("{}", e.what());
+        }
+        close(fd);
+        uint32_t sum;
+        std::memcpy(&sum, buf + 16, sizeof(sum));
+        if (!ok || sum != checksum(buf, 16)) {
+            spdlog::warn("Ignoring invalid spool cursor {}", file);
+            return;
+        }
+        std::memcpy(&cursor.seq, buf, sizeof(cursor.seq));
+        std::memcpy(&cursor.index, buf + 8, sizeof(uint64_t));
+        auto it = current();
+        if (it != segments.end() && cursor.index > it->records) cursor.index = it->records;
+    }
+
+    // Not synced, a lost cursor only means sending readings again
+    void save_cursor() {
+        auto file = opts.directory + "/" + cursor_name;
+        auto tmp  = file + ".tmp";
+        uint8_t buf[20];
+        uint64_t index = cursor.index;
+        std::memcpy(buf, &cursor.seq, sizeof(cursor.seq));
+        std::memcpy(buf + 8, &index, sizeof(index));
+        auto sum = checksum(buf, 16);
+        std::memcpy(buf + 16, &sum, sizeof(sum));
+
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write(fd, buf, sizeof(buf)) == ssize_t(sizeof(buf));
+        if (fd >= 0) ok = close(fd) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), file.c_str()) < 0)
+            spdlog::warn("Failed to save the spool cursor: {}", std::strerror(errno));
+    }
+
+    // Called with the mutex held, when the segments exceed the size limit
+    void drop_oldest() {
+        auto const& s = segments.front();
+        if (s.seq >= cursor.seq) {
+            auto unread = s.records - (s.seq == cursor.seq ? cursor.index : 0);
+            // Those being sent are not lost, acknowledge() skips them
+            for (auto const& f: in_flight)
+                if (f.seq == s.seq) unread -= std::min(unread, f.count);
+            drop_count[over_size].fetch_add(unread, std::memory_order_relaxed);
+        }
+        remove(s);
+        segments.pop_front();
+    }
+
+    void start_segment() {
+        auto seq   = next_seq;
+        auto file  = path(seq);
+        auto bytes = capacity * record_size;
+        int fd     = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw errno_error("Failed to create " + file);
+        // Reserved up front, writing to a mapped hole on a full disk would raise SIGBUS
+        void* m = MAP_FAILED;
+        if (int e = posix_fallocate(fd, 0, off_t(bytes)); e != 0)
+            errno = e;
+        else
+            m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED) {
+            auto e = errno_error("Failed to allocate " + file);
+            close(fd);
+            unlink(file.c_str());
+            throw e;
+        }
+
+        map    = static_cast<uint8_t*>(m);
+        synced = 0;
+        std::lock_guard g(mtx);
+        next_seq = seq + 1;
+        active_records.store(0, std::memory_order_relaxed);
+        segments.push_back({seq, fd, 0, true});
+        while (segments.size() > max_segments) drop_oldest();
+    }
+
+    // Writes the pages holding the readings not on the disk yet
+    void sync(size_t n) {
+        if (n == synced) return;
+        auto begin = synced * record_size / page_size * page_size;
+        if (msync(map + begin, n * record_size - begin, MS_SYNC) < 0)
+            spdlog::warn("Failed to write the spool: {}", std::strerror(errno));
+        synced = n;
+        commits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void seal() noexcept {
+        if (map == nullptr) return;
+        auto n = active_records.load(std::memory_order_relaxed);
+        sync(n);
+        munmap(map, capacity * record_size);
+        map = nullptr;
+        std::lock_guard g(mtx);
+        segments.back().records = n;
+        segments.back().active  = false;
+    }
+};
+
+spool::spool(spool_options opts): impl(std::make_unique<Impl>(std::move(opts))) {}
+
+spool::~spool() = default;
+
+bool spool::append(ble::AdvPacket const& p, int64_t timestamp_ms) noexcept {
+    return impl->append(p, timestamp_ms);
+}
+
+void spool::commit(std::chrono::steady_clock::time_point now) {
+    impl->commit(now);
+}
+
+void spool::read(std::vector<spooled_reading>& out, size_t max) {
+    impl->read(out, max);
+}
+
+void spool::acknowledge(size_t n) {
+    impl->acknowledge(n);
+}
+
+size_t spool::pending() const {
+    return impl->pending();
+}
+
+std::vector<MetricFamily> spool::Collect() const {
+    return impl->Collect();
+}
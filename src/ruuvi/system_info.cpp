@@ -13,63 +13,12 @@ namespace sys_info {
 
 std::atomic_llong system_info::errors_count = 0;
 
-bool system_info::test_file(std::string const& name) {
-    try {
-        std::ifstream ifs(name);
-        return ifs.good();
-    } catch (std::exception const& e) {
-        spdlog::info(e.what());
-        return false;
-    }
-}
-
-std::optional<std::ifstream> system_info::open_stat_file() {
-    static bool const has_file = test_file(SystemInfoCollector::stat_location);
-    if (!has_file) {
-        error("File check for ", SystemInfoCollector::stat_location,
-              " Failed previously");
-        return std::nullopt;
-    }
-    return open_file(SystemInfoCollector::stat_location);
-}
-
-std::optional<std::ifstream> system_info::open_meminfo_file() {
-    static bool const has_file =
-        test_file(SystemInfoCollector::meminfo_location);
-    if (!has_file) {
-        error("File check for ", SystemInfoCollector::meminfo_location,
-              " Failed previously");
-        return std::nullopt;
-    }
-    return open_file(SystemInfoCollector::meminfo_location);
-}
-
-std::optional<std::ifstream> system_info::open_netstat_file() {
-    static bool const has_file =
-        test_file(SystemInfoCollector::netstat_location);
-    if (!has_file) {
-        error("File check for ", SystemInfoCollector::netstat_location,
-              " Failed previously");
-        return std::nullopt;
-    }
-    return open_file(SystemInfoCollector::netstat_location);
-}
-
-std::optional<std::ifstream> system_info::open_file(std::string const& name) {
-    std::optional<std::ifstream> opt(std::nullopt);
-
-    try {
-        opt.emplace(std::ifstream(name));
-        if (!opt.has_value() || !opt->good()) {
-            error("Failed to open ", name);
-            opt.reset();
-        }
-    } catch (std::exception& e) {
-        error("Exception while opening ", name, ": ", e.what());
-    }
-
-    return opt;
-}
+proc_files::proc_files(std::string const& root)
+    : meminfo(root + SystemInfoCollector::meminfo_location),
+      stat(root + SystemInfoCollector::stat_location),
+      netstat(root + SystemInfoCollector::netstat_location),
+      thermal_root(root
+                   + SystemInfoCollector::thremal_sesnsors_root_location) {}
 
 double system_info::get_clock_hz() {
     static double const v = []() {
@@ -89,23 +38,22 @@ int system_info::get_sectorsize() {
     return 512;
 }
 
-double system_info::get_unit(std::string const& u) {
-    if (u == "kB") return 1000;
-    if (u == "B" || u == "") return 1;
-    if (u == "MB") return 1'000'000;
-    error("Unknown unit in meminfo file: ", u);
-    return 1;
-}
-
-std::unique_ptr<system_info const> system_info::create() {
-    std::unique_ptr<system_info> info(new system_info{});
+std::unique_ptr<system_info const>
+system_info::create(proc_files& files, system_info const* previous,
+                    unsigned sources) {
+    std::unique_ptr<system_info> info(previous ? new system_info(*previous)
+                                               : new system_info{});
+    info->has_errors = false;
+    info->errors.clear();
     try {
-        info->read_meminfo();
-        info->read_stat();
-        info->get_sysinfo();
-        info->get_loadavg();
-        info->read_netstat();
-        info->read_thermal_sensors();
+        if (sources & meminfo_source) info->read_meminfo(files.meminfo);
+        if (sources & stat_source) info->read_stat(files.stat);
+        if (sources & load_source) {
+            info->get_sysinfo();
+            info->get_loadavg();
+        }
+        if (sources & netstat_source) info->read_netstat(files.netstat);
+        if (sources & thermal_source) info->read_thermal_sensors(files);
     } catch (std::exception const& e) {
         info->error("Exception in system_info::create(): ", e.what());
     } catch (...) { info->error("Unknown exception in system_info::create()"); }
@@ -113,128 +61,78 @@ std::unique_ptr<system_info const> system_info::create() {
     return info;
 }
 
-void system_info::read_meminfo() {
-    auto file = open_meminfo_file();
-    if (file.has_value()) {
-
-        auto lines = parse_lines(*file);
-        file->close();
-
-        std::string_view to_find;
-        typename decltype(lines)::iterator it;
-        auto predicate = [&to_find](meminfo_line const& v) {
-            return v.name == to_find;
-        };
-
-#define MEMINFO_READ(value_name)                                               \
-    to_find = #value_name;                                                     \
-    it      = std::find_if(lines.begin(), lines.end(), predicate);             \
-    if (it != lines.end()) {                                                   \
-        value_name = (*it).value;                                              \
-        lines.erase(it);                                                       \
-    } else {                                                                   \
-        error("Value named ", #value_name, " not found in ",                   \
-              SystemInfoCollector::meminfo_location);                          \
+void system_info::read_meminfo(proc_file& file) {
+    // Members set from the values of meminfo_keys
+    static constexpr ul system_info::*fields[] = {
+        &system_info::MemTotal,
+        &system_info::MemFree,
+        &system_info::MemAvailable,
+        &system_info::Buffers,
+        &system_info::Cached,
+        &system_info::SwapCached,
+        &system_info::Active,
+        &system_info::Inactive,
+        &system_info::SwapTotal,
+        &system_info::SwapFree,
+        &system_info::Dirty,
+        &system_info::Writeback,
+    };
+    static_assert(std::size(fields) == meminfo_key_count);
+
+    std::string_view text;
+    if (!file.read(text)) {
+        error("Error while reading ", file.path(), ": ", std::strerror(errno));
+        return;
     }
-
-        MEMINFO_READ(MemTotal);
-        MEMINFO_READ(MemFree);
-        MEMINFO_READ(MemAvailable);
-        MEMINFO_READ(Buffers);
-        MEMINFO_READ(Cached);
-        MEMINFO_READ(SwapCached);
-        MEMINFO_READ(Active);
-        MEMINFO_READ(Inactive);
-        //    MEMINFO_READ(HighTotal);
-        //    MEMINFO_READ(HighFree);
-        //    MEMINFO_READ(LowTotal);
-        //    MEMINFO_READ(LowFree);
-        MEMINFO_READ(SwapTotal);
-        MEMINFO_READ(SwapFree);
-        MEMINFO_READ(Dirty);
-        MEMINFO_READ(Writeback);
-
-#undef MEMINFO_READ
-    } else {
-        error("Error while reading ", SystemInfoCollector::meminfo_location);
+    meminfo_values values{};
+    auto found = parse_meminfo(text, values);
+    for (size_t i = 0; i < meminfo_key_count; ++i) {
+        if (found & (1u << i)) {
+            this->*fields[i] = values[i];
+        } else {
+            error("Value named ", meminfo_keys[i], " not found in ",
+                  file.path());
+        }
     }
 }
 
-void system_info::read_stat() {
-    auto file            = open_stat_file();
+void system_info::read_stat(proc_file& file) {
     double const user_hz = get_clock_hz();
-
-    if (file.has_value() && file->good() && user_hz > 0) {
-        std::string id;
-        long user       = 0;
-        long nice       = 0;
-        long system     = 0;
-        long idle       = 0;
-        long iowait     = 0;
-        long irq        = 0;
-        long softirq    = 0;
-        long steal      = 0;
-        long guest      = 0;
-        long guest_nice = 0;
-        *file >> id >> user >> nice >> system >> idle >> iowait >> irq
-            >> softirq >> steal >> guest >> guest_nice;
-        if (!file->good() || id != "cpu")
-            error("Error while parsing ", SystemInfoCollector::stat_location);
-        UserTime   = (user + nice) * user_hz;
-        SystemTime = system * user_hz;
-        IrqTime    = (irq + softirq) * user_hz;
-        VmTime     = (steal + guest + guest_nice) * user_hz;
-    } else {
-        error("Error while reading ", SystemInfoCollector::stat_location);
+    std::string_view text;
+    if (!file.read(text) || user_hz <= 0) {
+        error("Error while reading ", file.path());
+        return;
     }
-}
-
-void system_info::read_netstat() {
-    auto file = open_netstat_file();
-    if (file.has_value() && file->good()) {
-
-        std::vector<std::string> lines;
-        lines.reserve(20);
-        std::string l;
-        while (std::getline(*file, l)) lines.push_back(l);
-
-        auto pred = [](std::string const& s) {
-            if (s.find("IpExt") != s.npos) { return true; }
-            return false;
-        };
-
-        auto it = std::find_if(lines.begin(), lines.end(), pred);
-        if (it == lines.end()) {
-            error("Couldn't  find IpExt in ",
-                  SystemInfoCollector::netstat_location);
-            return;
-        }
-        // Find next IpExt row after labels
-        it = std::find_if(it + 1, lines.end(), pred);
-        if (it != lines.end()) {
-            std::string id;
-            unsigned long u;  // unused
-            unsigned long in_octets  = 0;
-            unsigned long out_octets = 0;
-            unsigned long in_mcast   = 0;
-            unsigned long out_mcast  = 0;
-
-            std::stringstream ss(*it);
-            ss >> id >> u >> u >> u >> u >> u >> u >> in_octets >> out_octets
-                >> in_mcast >> out_mcast;
-
-            InOctets  = in_octets + in_mcast;
-            OutOctets = out_octets + out_mcast;
-
-            if (!ss.good() || id != "IpExt:") {
-                error("Error while reading IpExt values");
-            }
-
-        } else {
-            error("Couldn't find second IpExt row in ",
-                  SystemInfoCollector::netstat_location);
-        }
+    // CoreTimes keeps the capacity of the previous snapshot's
+    cpu_times cpu;
+    if (!parse_stat(text, cpu, CoreTimes)) {
+        error("Error while parsing ", file.path());
+        return;
+    }
+    auto ticks = [&cpu](auto... states) {
+        return double((cpu.ticks[states] + ...));
+    };
+    UserTime   = ticks(cpu_times::user, cpu_times::nice) * user_hz;
+    SystemTime = ticks(cpu_times::system) * user_hz;
+    IrqTime    = ticks(cpu_times::irq, cpu_times::softirq) * user_hz;
+    VmTime = ticks(cpu_times::steal, cpu_times::guest, cpu_times::guest_nice)
+           * user_hz;
+    SecondsPerTick = user_hz;
+}
+
+void system_info::read_netstat(proc_file& file) {
+    std::string_view text;
+    if (!file.read(text)) {
+        error("Error while reading ", file.path(), ": ", std::strerror(errno));
+        return;
     }
+    netstat_values v;
+    if (!parse_netstat(text, v)) {
+        error("Error while reading IpExt values from ", file.path());
+        return;
+    }
+    InOctets  = v.in_octets + v.in_mcast_octets;
+    OutOctets = v.out_octets + v.out_mcast_octets;
 }
 
 void system_info::get_sysinfo() {
@@ -255,72 +153,48 @@ void system_info::get_loadavg() {
     }
 }
 
-std::list<system_info::meminfo_line>
-system_info::parse_lines(std::istream& is) {
-    std::list<meminfo_line> lines;
-
-    std::string line;
-    while (std::getline(is, line)) {
-        meminfo_line m;
-        std::stringstream ss(line);
-        std::string multiplier;
-
-        ss >> m.name >> m.value >> multiplier;
-        // Remove trailing ':'
-        m.name.pop_back();
-
-        m.value *= get_unit(multiplier);
-        lines.push_back(std::move(m));
-    }
-
-    return lines;
-}
-
-std::vector<thermal_sensor> const& system_info::find_sensors() {
-    static std::vector<thermal_sensor> sensors = [this]() {
-        std::vector<thermal_sensor> sensors;
-
-        std::filesystem::path path =
-            SystemInfoCollector::thremal_sesnsors_root_location;
-        for (auto const& entry : std::filesystem::directory_iterator(path)) {
-            if (!entry.is_directory()) continue;
-            std::string dirname = entry.path().filename().string();
-            if (dirname.find("thermal_zone") != dirname.npos) {
-                auto& sensor            = sensors.emplace_back();
-                sensor.temperature_path = entry.path() / "temp";
-
-                std::ifstream type(entry.path() / "type");
-                if (type.good()) {
-                    type >> sensor.type;
-                } else {
-                    error("Failed to read thermal type file ",
-                          entry.path() / "type");
-                }
+std::vector<thermal_sensor>& system_info::find_sensors(proc_files& files) {
+    if (files.thermal_sensors) return *files.thermal_sensors;
+
+    std::vector<thermal_sensor> sensors;
+    for (auto const& entry :
+         std::filesystem::directory_iterator(files.thermal_root)) {
+        if (!entry.is_directory()) continue;
+        std::string dirname = entry.path().filename().string();
+        if (dirname.find("thermal_zone") != dirname.npos) {
+            proc_file temp((entry.path() / "temp").string());
+            auto& sensor = sensors.emplace_back(
+                thermal_sensor{std::move(temp), std::string()});
+
+            std::ifstream type(entry.path() / "type");
+            if (type.good()) {
+                type >> sensor.type;
+            } else {
+                error("Failed to read thermal type file ",
+                      entry.path() / "type");
             }
         }
-        spdlog::info("Found {} sensors", sensors.size());
-        for (auto& s : sensors) spdlog::debug(s.type);
-        return sensors;
-    }();
-
-    return sensors;
+    }
+    spdlog::info("Found {} sensors", sensors.size());
+    for (auto& s : sensors) spdlog::debug(s.type);
+    return files.thermal_sensors.emplace(std::move(sensors));
 }
 
-void sys_info::system_info::read_thermal_sensors() {
-    std::vector<thermal_sensor> const& sensors = find_sensors();
+void sys_info::system_info::read_thermal_sensors(proc_files& files) {
+    std::vector<thermal_sensor>& sensors = find_sensors(files);
+    SensorTemps.clear();
     SensorTemps.reserve(sensors.size());
-    for (auto const& sensor : sensors) {
+    for (auto& sensor : sensors) {
         thermal_info info{};
         info.type = sensor.type;
 
-        std::ifstream temperature_file(sensor.temperature_path);
-        if (temperature_file.good()) {
-            long value;
-            temperature_file >> value;
+        std::string_view text;
+        long value;
+        if (sensor.temperature.read(text) && parse_integer(text, value)) {
             info.value_celsius = value * thermal_sensor::step_size;
         } else {
-            error("Failed to open temperature file ", sensor.temperature_path,
-                  " for ", info.type);
+            error("Failed to read temperature file ",
+                  sensor.temperature.path(), " for ", info.type);
         }
         SensorTemps.push_back(info);
     }
@@ -2,13 +2,14 @@
 
 #include <atomic>
 #include <filesystem>
-#include <list>
-#include <spdlog/spdlog.h>
 #include <optional>
+#include <spdlog/spdlog.h>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "diskstat.hpp"
+#include "procfs.hpp"
 
 namespace sys_info {
 
@@ -19,10 +20,41 @@ struct thermal_info {
 
 struct thermal_sensor {
     static constexpr double step_size = 1.0 / 1000;
-    std::filesystem::path temperature_path;
+    proc_file temperature;
     std::string type;
 };
 
+/**
+ * @brief The procfs and sysfs files read on every scrape, kept open between
+ * scrapes
+ */
+struct proc_files {
+    proc_file meminfo;
+    proc_file stat;
+    proc_file netstat;
+    std::filesystem::path thermal_root;
+    // Found on the first scrape
+    std::optional<std::vector<thermal_sensor>> thermal_sensors;
+
+    /**
+     * @brief proc_files Opens the files under root, the host's /proc and /sys
+     * when empty
+     */
+    explicit proc_files(std::string const& root = {});
+};
+
+/**
+ * @brief The sources of system_info, as bits of a mask
+ */
+enum system_info_source : unsigned {
+    meminfo_source = 1u << 0,
+    stat_source    = 1u << 1,
+    netstat_source = 1u << 2,
+    load_source    = 1u << 3,  // sysinfo() and getloadavg()
+    thermal_source = 1u << 4,
+    all_sources    = (1u << 5) - 1,
+};
+
 struct system_info {
     using ul = unsigned long;
     // From /proc/meminfo
@@ -55,6 +87,8 @@ struct system_info {
     double SystemTime;
     double IrqTime;
     double VmTime;
+    std::vector<core_times> CoreTimes;  // Of each online CPU
+    double SecondsPerTick;              // Of the ticks of CoreTimes
 
     // From /proc/net/netstat
     ul InOctets;
@@ -71,35 +105,27 @@ struct system_info {
     static std::atomic_llong errors_count;
     double get_errors_count() const { return errors_count; }
 
-    static std::unique_ptr<system_info const> create();
+    /**
+     * @brief create Reads sources, and copies the other values from previous
+     */
+    static std::unique_ptr<system_info const>
+    create(proc_files& files, system_info const* previous = nullptr,
+           unsigned sources = all_sources);
 
 private:
-    bool test_file(std::string const& name);
-    std::optional<std::ifstream> open_file(std::string const& name);
-    std::optional<std::ifstream> open_stat_file();
-    std::optional<std::ifstream> open_meminfo_file();
-    std::optional<std::ifstream> open_netstat_file();
+    std::vector<thermal_sensor>& find_sensors(proc_files& files);
 
-    std::vector<thermal_sensor> const& find_sensors();
-
-    double get_unit(std::string const& u);
     double get_clock_hz();
     int get_sectorsize();
 
     system_info() = default;
 
-    void read_meminfo();
-    void read_stat();
-    void read_netstat();
+    void read_meminfo(proc_file& file);
+    void read_stat(proc_file& file);
+    void read_netstat(proc_file& file);
     void get_sysinfo();
     void get_loadavg();
-    void read_thermal_sensors();
-
-    struct meminfo_line {
-        std::string name;
-        unsigned long value;
-    };
-    std::list<meminfo_line> parse_lines(std::istream& is);
+    void read_thermal_sensors(proc_files& files);
 
     template<class... As> void error(As&&... as) {
         // Increment only first time
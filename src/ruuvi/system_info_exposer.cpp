@@ -1,5 +1,7 @@
 #include "system_info_exposer.hpp"
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstring>
@@ -8,19 +10,22 @@
 #include <iostream>
 #include <list>
 #include <map>
+#include <mutex>
 
 #include <prometheus/family.h>
 #include <prometheus/gauge.h>
 
 #include "raw_gauge.hpp"
+#include "snapshot_cache.hpp"
 #include "system_info.hpp"
 #include <spdlog/spdlog.h>
 
 using namespace sys_info;
 using namespace prometheus;
 
-std::shared_ptr<sys_info::SystemInfoCollector> SystemInfoCollector::create() {
-    return std::make_shared<SystemInfoCollector>(init());
+std::shared_ptr<sys_info::SystemInfoCollector>
+SystemInfoCollector::create(std::string root, refresh_intervals intervals) {
+    return std::make_shared<SystemInfoCollector>(init(), root, intervals);
 }
 
 #ifdef ENABLE_SYSINFO_EXPOSER
@@ -37,20 +42,109 @@ template<class F> auto to_double_single(F&& f) {
 
 class SystemInfoCollector::Impl {
 public:
-    Impl() { create_gauges(); }
+    Impl(std::string const& root, refresh_intervals const& intervals)
+        : files(root),
+          intervals{intervals.meminfo, intervals.stat, intervals.netstat,
+                    intervals.load, intervals.thermal},
+          cache(*std::min_element(this->intervals.begin(),
+                                  this->intervals.end())) {
+        create_gauges();
+        cores_family.name = "sysinfo_cpu_seconds_total";
+        cores_family.help = "Time each CPU spent in each mode since boot, "
+                            "guest and guest_nice also counted in user and "
+                            "nice";
+        cores_family.type = MetricType::Counter;
+    }
 
     std::vector<MetricFamily> Collect() const {
-        auto info = system_info::create();
+        auto info = cache.get([this](auto const& previous) {
+            return refresh(previous.get());
+        });
 
         std::vector<MetricFamily> metrics;
-        metrics.reserve(gauges.size());
+        metrics.reserve(gauges.size() + 1);
 
-        for (auto& g : gauges) { metrics.push_back(g.Collect(*info)); }
+        if (info) {
+            for (auto& g : gauges) { metrics.push_back(g.Collect(*info)); }
+            metrics.push_back(collect_cores(*info));
+        }
         return metrics;
     }
 
+    void append_cache_statistics(std::vector<MetricFamily>& families) const {
+        cache.statistics().append("sysinfo", families);
+    }
+
 private:
+    using clock = std::chrono::steady_clock;
+    static constexpr size_t source_count = 5;
+
     std::vector<raw_gauge<system_info const&>> gauges;
+    // Only touched by the refresh of the cache, which runs one at a time
+    mutable proc_files files;
+    // Of each bit of system_info_source
+    std::array<clock::duration, source_count> const intervals;
+    mutable std::array<clock::time_point, source_count> last_read{};
+    mutable snapshot_cache<system_info> cache;
+
+    // The series of sysinfo_cpu_seconds_total, of each CPU and mode, kept
+    // between scrapes since copying them is cheaper than labelling new ones
+    mutable std::mutex cores_mtx;
+    mutable MetricFamily cores_family;
+    mutable std::vector<unsigned> core_ids;  // Of cores_family, in order
+
+    std::shared_ptr<system_info const>
+    refresh(system_info const* previous) const {
+        static_assert(all_sources == (1u << source_count) - 1);
+        auto const now = clock::now();
+        unsigned due   = 0;
+        for (size_t i = 0; i < source_count; ++i) {
+            if (previous && now - last_read[i] < intervals[i]) continue;
+            due |= 1u << i;
+            last_read[i] = now;
+        }
+        return system_info::create(files, previous, due);
+    }
+
+    MetricFamily collect_cores(system_info const& info) const {
+        static constexpr char const* modes[] = {
+            "user", "nice",    "system", "idle",  "iowait",
+            "irq",  "softirq", "steal",  "guest", "guest_nice",
+        };
+        static_assert(std::size(modes) == cpu_times::state_count);
+        constexpr size_t n = std::size(modes);
+
+        std::lock_guard g(cores_mtx);
+        auto& series = cores_family.metric;
+        // Labelled again only when CPUs go online or offline
+        if (!std::equal(core_ids.begin(), core_ids.end(),
+                        info.CoreTimes.begin(), info.CoreTimes.end(),
+                        [](unsigned id, core_times const& core) {
+                            return id == core.cpu;
+                        })) {
+            core_ids.clear();
+            series.clear();
+            series.reserve(info.CoreTimes.size() * n);
+            for (auto& core : info.CoreTimes) {
+                core_ids.push_back(core.cpu);
+                auto const cpu = std::to_string(core.cpu);
+                for (auto mode : modes) {
+                    auto& m = series.emplace_back();
+                    m.label.reserve(2);
+                    m.label.push_back({"cpu", cpu});
+                    m.label.push_back({"mode", mode});
+                }
+            }
+        }
+        for (size_t i = 0; i < info.CoreTimes.size(); ++i) {
+            auto const& ticks = info.CoreTimes[i].times.ticks;
+            for (size_t s = 0; s < n; ++s) {
+                series[i * n + s].counter.value =
+                    double(ticks[s]) * info.SecondsPerTick;
+            }
+        }
+        return cores_family;
+    }
 
     void create_gauges() {
         // ------ memstat --------
@@ -190,6 +284,7 @@ private:
                              .Help("Time spent in virtual machines since boot")
                              .Type(MetricType::Gauge)
                              .Callback(to_double_single(&system_info::VmTime)));
+
         gauges.push_back(
             BuildRawGauge()
                 .Name("sysinfo_errors_count")
@@ -236,16 +331,24 @@ private:
 
 class SystemInfoCollector::Impl {
 public:
+    Impl(std::string const&, refresh_intervals const&) {}
     std::vector<MetricFamily> Collect() const { return {}; }
+    void append_cache_statistics(std::vector<MetricFamily>&) const {}
 };
 
 #endif
 
-SystemInfoCollector::SystemInfoCollector(init)
-    : impl(std::make_unique<Impl>()) {}
+SystemInfoCollector::SystemInfoCollector(init, std::string const& root,
+                                         refresh_intervals const& intervals)
+    : impl(std::make_unique<Impl>(root, intervals)) {}
 
 SystemInfoCollector::~SystemInfoCollector() = default;
 
 std::vector<MetricFamily> SystemInfoCollector::Collect() const {
     return impl->Collect();
 }
+
+void SystemInfoCollector::append_cache_statistics(
+    std::vector<MetricFamily>& families) const {
+    impl->append_cache_statistics(families);
+}
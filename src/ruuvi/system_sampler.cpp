@@ -0,0 +1,282 @@
+#include "system_sampler.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include <prometheus/metric_family.h>
+
+#ifdef ENABLE_SYSINFO_EXPOSER
+#include "procfs.hpp"
+#include "system_info_exposer.hpp"
+#include <spdlog/spdlog.h>
+#include <time.h>
+#endif
+
+using namespace sys_info;
+using namespace prometheus;
+
+#ifdef ENABLE_SYSINFO_EXPOSER
+
+namespace {
+
+using steady = std::chrono::steady_clock;
+
+struct sample {
+    steady::time_point time;
+    // Shares of the time since the previous sample, and of MemTotal
+    std::array<float, 3> values;  // Of each summary, NaN when unknown
+};
+
+struct summary_info {
+    char const* name;
+    char const* help;
+};
+
+constexpr summary_info summaries[] = {
+    {"sysinfo_sampled_cpu_busy_ratio",
+     "Share of CPU time spent neither idle nor waiting for I/O between two "
+     "samples"},
+    {"sysinfo_sampled_cpu_iowait_ratio",
+     "Share of CPU time spent waiting for I/O between two samples"},
+    {"sysinfo_sampled_memory_used_ratio",
+     "Share of memory not available for starting new applications"},
+};
+
+constexpr double quantiles[] = {0.5, 0.95, 1};
+
+// Nearest-rank percentile of values, which are reordered
+double percentile(std::vector<float>& values, double q) {
+    if (values.empty()) return std::nan("");
+    auto rank = size_t(std::ceil(q * double(values.size())));
+    auto nth  = values.begin() + ptrdiff_t(std::max<size_t>(rank, 1) - 1);
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+uint64_t thread_cpu_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1'000'000'000u + uint64_t(ts.tv_nsec);
+}
+
+}  // namespace
+
+class SystemSampler::Impl {
+public:
+    explicit Impl(sampler_options const& opts)
+        : window(opts.window),
+          stat(opts.root + SystemInfoCollector::stat_location),
+          meminfo(opts.root + SystemInfoCollector::meminfo_location) {
+        if (!(opts.rate >= 0.1 && opts.rate <= 100))
+            throw std::invalid_argument(
+                "The sampling rate must be between 0.1 and 100 per second");
+        period = std::chrono::duration_cast<steady::duration>(
+            std::chrono::duration<double>(1 / opts.rate));
+        auto const samples =
+            std::chrono::duration<double>(window).count() * opts.rate;
+        if (window < period || samples > double(sampler_options::max_samples))
+            throw std::invalid_argument(
+                "The sampling window must hold between one and "
+                + std::to_string(sampler_options::max_samples) + " samples");
+        ring.resize(size_t(std::ceil(samples)) + 1);
+    }
+
+    void start() {
+        auto next = steady::now();
+        std::unique_lock l(mtx);
+        while (!stopping) {
+            l.unlock();
+            take_sample();
+            cpu_ns.store(thread_cpu_ns(), std::memory_order_relaxed);
+
+            // Skips the ticks a slow sample overran instead of catching up
+            auto const now = steady::now();
+            next += period;
+            if (next < now) {
+                auto const behind = (now - next) / period + 1;
+                missed.fetch_add(uint64_t(behind), std::memory_order_relaxed);
+                next += behind * period;
+            }
+            l.lock();
+            wake.wait_until(l, next, [this] { return stopping; });
+        }
+    }
+
+    void stop() noexcept {
+        {
+            std::lock_guard g(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+    }
+
+    std::vector<MetricFamily> Collect() const {
+        constexpr size_t n = std::size(summaries);
+        std::array<std::vector<float>, n> values;
+        for (auto& v : values) v.reserve(ring.size());
+        std::array<uint64_t, n> counts;
+        std::array<double, n> sums;
+        {
+            std::lock_guard g(mtx);
+            auto const since = steady::now() - window;
+            // From the newest sample back
+            for (size_t i = 1; i <= used; ++i) {
+                auto const& s = ring[(head + ring.size() - i) % ring.size()];
+                if (s.time < since) break;
+                for (size_t k = 0; k < n; ++k) {
+                    if (std::isnan(s.values[k])) continue;
+                    values[k].push_back(s.values[k]);
+                }
+            }
+            counts = sample_counts;
+            sums   = sample_sums;
+        }
+
+        std::vector<MetricFamily> families;
+        families.reserve(n + 4);
+        for (size_t k = 0; k < n; ++k) {
+            auto& f = families.emplace_back();
+            f.name  = summaries[k].name;
+            f.help  = summaries[k].help;
+            f.type  = MetricType::Summary;
+            auto& m = f.metric.emplace_back();
+            m.summary.sample_count = counts[k];
+            m.summary.sample_sum   = sums[k];
+            for (auto q : quantiles)
+                m.summary.quantile.push_back({q, percentile(values[k], q)});
+        }
+
+        auto add = [&families](char const* name, char const* help,
+                               double value) {
+            auto& f = families.emplace_back();
+            f.name  = name;
+            f.help  = help;
+            f.type  = MetricType::Counter;
+            f.metric.emplace_back().counter.value = value;
+        };
+        add("sysinfo_sampler_samples_total", "Number of samples taken",
+            double(samples.load(std::memory_order_relaxed)));
+        add("sysinfo_sampler_missed_total",
+            "Number of samples skipped because sampling fell behind",
+            double(missed.load(std::memory_order_relaxed)));
+        add("sysinfo_sampler_errors_total",
+            "Number of samples that couldn't be read",
+            double(errors.load(std::memory_order_relaxed)));
+        add("sysinfo_sampler_cpu_seconds_total",
+            "CPU time used by the sampler thread",
+            double(cpu_ns.load(std::memory_order_relaxed)) / 1e9);
+        return families;
+    }
+
+private:
+    steady::duration const window;
+    steady::duration period;
+
+    // Only touched by the sampler thread
+    proc_file stat;
+    proc_file meminfo;
+    cpu_times previous;
+    bool has_previous = false;
+
+    mutable std::mutex mtx;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::vector<sample> ring;
+    size_t head = 0;  // Where the next sample goes
+    size_t used = 0;
+    std::array<uint64_t, std::size(summaries)> sample_counts{};
+    std::array<double, std::size(summaries)> sample_sums{};
+
+    std::atomic<uint64_t> samples = 0;
+    std::atomic<uint64_t> missed  = 0;
+    std::atomic<uint64_t> errors  = 0;
+    std::atomic<uint64_t> cpu_ns  = 0;
+
+    void take_sample() {
+        std::string_view text;
+        cpu_times cpu;
+        if (!stat.read(text) || !parse_stat(text, cpu)) {
+            if (errors.fetch_add(1, std::memory_order_relaxed) == 0)
+                spdlog::warn("Sampler failed to read {}", stat.path());
+            return;
+        }
+        auto const now = steady::now();
+
+        constexpr uint32_t mem_keys = (1u << 0) | (1u << 2);
+        static_assert(meminfo_keys[0] == "MemTotal");
+        static_assert(meminfo_keys[2] == "MemAvailable");
+        meminfo_values mem{};
+        float memory = std::nanf("");
+        if (meminfo.read(text)
+            && (parse_meminfo(text, mem) & mem_keys) == mem_keys && mem[0] > 0)
+            memory = float(1 - double(mem[2]) / double(mem[0]));
+
+        // guest and guest_nice are already counted in user and nice
+        using state = cpu_times::state;
+        auto delta  = [this, &cpu](state s) {
+            return double(cpu.ticks[s] - previous.ticks[s]);
+        };
+        double total = 0;
+        for (int s = state::user; s <= state::steal; ++s)
+            total += delta(state(s));
+        bool const first = !has_previous;
+        previous         = cpu;
+        has_previous     = true;
+        // No tick elapsed since the previous sample, or the counters went back
+        if (first || !(total > 0)) return;
+
+        auto const idle   = delta(state::idle);
+        auto const iowait = delta(state::iowait);
+        sample const s{
+            now,
+            {float((total - idle - iowait) / total), float(iowait / total),
+             memory}
+        };
+
+        std::lock_guard g(mtx);
+        ring[head] = s;
+        head       = (head + 1) % ring.size();
+        used       = std::min(used + 1, ring.size());
+        for (size_t k = 0; k < std::size(summaries); ++k) {
+            if (std::isnan(s.values[k])) continue;
+            ++sample_counts[k];
+            sample_sums[k] += s.values[k];
+        }
+        samples.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+#else
+
+class SystemSampler::Impl {
+public:
+    explicit Impl(sampler_options const&) {}
+    void start() {}
+    void stop() noexcept {}
+    std::vector<MetricFamily> Collect() const { return {}; }
+};
+
+#endif
+
+SystemSampler::SystemSampler(sampler_options const& opts)
+    : impl(std::make_unique<Impl>(opts)) {}
+
+SystemSampler::~SystemSampler() = default;
+
+void SystemSampler::start() {
+    impl->start();
+}
+
+void SystemSampler::stop() noexcept {
+    impl->stop();
+}
+
+std::vector<MetricFamily> SystemSampler::Collect() const {
+    return impl->Collect();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+#include <benchmark/benchmark.h>
+
+namespace bench {
+
+/**
+ * @brief allocations Number of calls to the global operator new since the start of the
+ * program, counted by the replacements in alloc_counter.cpp
+ */
+uint64_t allocations();
+
+/**
+ * @brief Reports the allocations made while in scope as a per-iteration counter
+ *
+ * Setting other counters allocates, so end the scope before e.g. State::SetItemsProcessed.
+ */
+class allocation_counter {
+public:
+    explicit allocation_counter(benchmark::State& s, char const* n = "allocs/iter")
+        : state(s), name(n), start(allocations()) {}
+    ~allocation_counter() {
+        // Read before the counter map allocates its node
+        auto const n         = double(allocations() - start);
+        state.counters[name] = benchmark::Counter(n, benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State& state;
+    char const* const name;
+    uint64_t const start;
+};
+
+}  // namespace bench
@@ -0,0 +1,509 @@
+#include "alloc_counter.hpp"
+#include "ruuvi_corpus.hpp"
+#include "ruuvi_vectors.hpp"
+
+#include <benchmark/benchmark.h>
+#include <ble/hci.hpp>
+#include <ble/spsc_queue.hpp>
+#include <prometheus/metric_family.h>
+#include <prometheus/text_serializer.h>
+#include <ruuvi/formats.hpp>
+#include <ruuvi/gzip.hpp>
+#include <ruuvi/history.hpp>
+#include <ruuvi/openmetrics.hpp>
+#include <ruuvi/ruuvi.hpp>
+#include <ruuvi/ruuvi_prometheus_exposer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using vectors::to_raw_data;
+
+// LE Advertising Report from CB:B8:33:4C:88:4F carrying a data format 5 payload
+std::vector<uint8_t> ruuvi_event() {
+    return to_raw_data("043E2B0201"
+                       "00014F884C33B8CB1F"
+                       "020106"
+                       "1BFF99040512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F"
+                       "C4");
+}
+
+ble::AdvPacket ruuvi_packet(char const* payload) {
+    return ble::to_adv_packet(
+        ble::BlePacket{vectors::mac, "", vectors::ruuvi_id, to_raw_data(payload), -60});
+}
+
+ble::AdvPacket default_packet5() {
+    return ruuvi_packet(vectors::format_5);
+}
+
+ble::AdvPacket invalid_packet5() {
+    return ruuvi_packet(vectors::format_5_invalid);
+}
+
+}  // namespace
+
+// Steady state of the receive path: parse an HCI event and hand the packet to the worker
+static void BM_HciToQueue(benchmark::State& state) {
+    auto const ev = ruuvi_event();
+    ble::spsc_queue<ble::AdvPacket> queue(64);
+    std::function<ble::hci::report_callback> cb = [&queue](ble::AdvPacket const& p,
+                                                           std::string_view) { queue.push(p); };
+    ble::AdvPacket out;
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            ble::hci::parse_event(ev.data(), ev.size(), cb);
+            queue.pop(out);
+            benchmark::DoNotOptimize(out);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HciToQueue);
+
+static void BM_AdvPacketQueue(benchmark::State& state) {
+    auto packet = default_packet5();
+    ble::spsc_queue<ble::AdvPacket> queue(64);
+    ble::AdvPacket out;
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            queue.push(packet);
+            queue.pop(out);
+            benchmark::DoNotOptimize(out);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AdvPacketQueue);
+
+// The previous packet type, for comparison
+static void BM_BlePacketQueue(benchmark::State& state) {
+    ble::BlePacket packet{vectors::mac, "", vectors::ruuvi_id, to_raw_data(vectors::format_5),
+                          -60};
+    ble::spsc_queue<ble::BlePacket> queue(64);
+    ble::BlePacket out;
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            queue.push(packet);
+            queue.pop(out);
+            benchmark::DoNotOptimize(out);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_BlePacketQueue);
+
+// Legacy conversion, renders error messages for every packet
+static void BM_ConvertDataFormat5(benchmark::State& state) {
+    auto const packet = state.range(0) ? invalid_packet5() : default_packet5();
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) { benchmark::DoNotOptimize(ruuvi::convert_data_format_5(packet)); }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ConvertDataFormat5)->ArgName("invalid")->Arg(0)->Arg(1);
+
+static void BM_DecodeFormat5(benchmark::State& state) {
+    auto const packet = state.range(0) ? invalid_packet5() : default_packet5();
+    ruuvi::format_5_reading reading;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            ruuvi::decode_format_5(packet, reading);
+            benchmark::DoNotOptimize(reading);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeFormat5)->ArgName("invalid")->Arg(0)->Arg(1);
+
+// Table-generated decoders, BM_DecodeFormat5 adds the copy into a format_5_reading
+static void BM_DecodeTable(benchmark::State& state) {
+    ble::AdvPacket packet;
+    switch (state.range(0)) {
+        case 3: packet = ruuvi_packet(vectors::format_3); break;
+        case 5: packet = default_packet5(); break;
+        case 6: packet = ruuvi_packet(vectors::format_6); break;
+        default: packet = ruuvi_packet(vectors::format_e1); break;
+    }
+    ruuvi::measurement m;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            ruuvi::decode(packet, m);
+            benchmark::DoNotOptimize(m);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeTable)->ArgName("format")->Arg(3)->Arg(5)->Arg(6)->Arg(0xE1);
+
+// Decodes 1024 payloads per iteration, one at a time or as a batch
+static constexpr size_t batch_size = 1024;
+
+static std::vector<uint8_t> batch_payloads() {
+    std::vector<uint8_t> r;
+    for (size_t i = 0; i < batch_size; ++i) {
+        auto p = i % 8 == 0 ? invalid_packet5() : default_packet5();
+        r.insert(r.end(), p.manufacturer_data(), p.manufacturer_data() + 24);
+    }
+    return r;
+}
+
+static void BM_DecodeFormat5Loop(benchmark::State& state) {
+    auto const payloads = batch_payloads();
+    ruuvi::format_5_reading reading;
+    for (auto _: state) {
+        for (size_t i = 0; i < batch_size; ++i) {
+            ruuvi::decode_format_5(payloads.data() + i * 24, 24, reading);
+            benchmark::DoNotOptimize(reading);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_DecodeFormat5Loop);
+
+static void BM_DecodeFormat5Batch(benchmark::State& state) {
+    auto const level = ruuvi::simd_level(state.range(0));
+    if (!ruuvi::simd_supported(level)) {
+        state.SkipWithError("Unsupported on this machine");
+        return;
+    }
+    auto const payloads = batch_payloads();
+    ruuvi::format_5_batch batch;
+    batch.resize(batch_size);
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            ruuvi::decode_format_5_batch(payloads.data(), batch_size, 24, batch, level);
+            benchmark::DoNotOptimize(batch.errors.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_DecodeFormat5Batch)
+    ->ArgName("simd")
+    ->Arg(int(ruuvi::simd_level::scalar))
+    ->Arg(int(ruuvi::simd_level::ssse3))
+    ->Arg(int(ruuvi::simd_level::avx2))
+    ->Arg(int(ruuvi::simd_level::neon));
+
+/*
+ * Mixed traffic: vectors, random valid and invalid packets, other manufacturers and truncated
+ * payloads, see ruuvi_corpus.hpp. Each iteration handles one packet, so time and allocations
+ * are per packet.
+ */
+static constexpr size_t corpus_size = 4096;  // Power of two, indexed with a mask
+
+static void BM_IdentifyFormat(benchmark::State& state) {
+    auto const corpus = bench::make_corpus(corpus_size);
+    size_t i          = 0;
+    {
+        bench::allocation_counter allocs(state, "allocs/packet");
+        for (auto _: state) {
+            benchmark::DoNotOptimize(ruuvi::identify_format(corpus[i++ & (corpus_size - 1)]));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_IdentifyFormat);
+
+// What the exposer did before the allocation-free decoders
+static void BM_ConvertCorpus(benchmark::State& state) {
+    auto const corpus = bench::make_corpus(corpus_size);
+    size_t i          = 0;
+    {
+        bench::allocation_counter allocs(state, "allocs/packet");
+        for (auto _: state) {
+            auto const& p = corpus[i++ & (corpus_size - 1)];
+            switch (ruuvi::identify_format(p)) {
+                case 5: benchmark::DoNotOptimize(ruuvi::convert_data_format_5(p)); break;
+                case 3: benchmark::DoNotOptimize(ruuvi::convert_data_format_3(p)); break;
+                default: break;
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ConvertCorpus);
+
+static void BM_DecodeCorpus(benchmark::State& state) {
+    auto const corpus = bench::make_corpus(corpus_size);
+    size_t i          = 0;
+    ruuvi::measurement m;
+    {
+        bench::allocation_counter allocs(state, "allocs/packet");
+        for (auto _: state) {
+            ruuvi::decode(corpus[i++ & (corpus_size - 1)], m);
+            benchmark::DoNotOptimize(m);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DecodeCorpus);
+
+// Publishing decoded readings, cycling through state.range(0) tags with their own metrics, and
+// aggregating them over windows of state.range(1) seconds
+static void BM_ExposerUpdate(benchmark::State& state) {
+    auto const tags = size_t(state.range(0));
+    auto packet     = default_packet5();
+    std::vector<ruuvi::format_5_reading> readings(tags);
+    for (size_t i = 0; i < tags; ++i) {
+        packet.mac[4] = uint8_t(i >> 8u);
+        packet.mac[5] = uint8_t(i);
+        std::copy(packet.mac.begin(), packet.mac.end(), packet.data.begin() + 18);
+        ruuvi::decode_format_5(packet, readings[i]);
+    }
+
+    ruuvi::aggregation windows{std::chrono::seconds(state.range(1)), true};
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode::on_update, {}, ruuvi::sample_time::scrape,
+                                windows);
+    for (auto const& r: readings) exposer.update(r);  // Every tag has been seen before
+    size_t i = 0;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            exposer.update(readings[i]);
+            if (++i == tags) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ExposerUpdate)
+    ->ArgNames({"tags", "window_s"})
+    ->ArgsProduct({{1, 50, 1000}, {0, 1}});
+
+/*
+ * The worker's cost per advert from 50 tags, decoding every advert or only storing it, and the
+ * scrape that decodes the stored adverts. A tag advertising every second and scraped every 10 s
+ * costs 10 adverts plus a tenth of a scrape.
+ */
+static std::vector<ble::AdvPacket> tag_adverts(size_t tags) {
+    std::vector<ble::AdvPacket> r(tags, default_packet5());
+    for (size_t i = 0; i < tags; ++i) {
+        r[i].mac[5]   = uint8_t(i);
+        r[i].data[23] = uint8_t(i);
+    }
+    return r;
+}
+
+static void BM_ExposerAdvert(benchmark::State& state) {
+    auto const adverts = tag_adverts(50);
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode(state.range(0)));
+    for (auto const& p: adverts) exposer.update(p);
+    size_t i = 0;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            exposer.update(adverts[i]);
+            if (++i == adverts.size()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ExposerAdvert)
+    ->ArgName("mode")
+    ->Arg(int(ruuvi::decode_mode::on_update))
+    ->Arg(int(ruuvi::decode_mode::on_collect));
+
+static void BM_ExposerCollect(benchmark::State& state) {
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode(state.range(0)));
+    for (auto const& p: tag_adverts(50)) exposer.update(p);
+    for (auto _: state) benchmark::DoNotOptimize(exposer.Collect());
+}
+BENCHMARK(BM_ExposerCollect)
+    ->ArgName("mode")
+    ->Arg(int(ruuvi::decode_mode::on_update))
+    ->Arg(int(ruuvi::decode_mode::on_collect));
+
+/*
+ * A scrape of state.range(0) tags in the text format: serializing the families of Collect(), or
+ * concatenating the text rendered per tag with state.range(1) percent of the tags updated since
+ * the previous scrape. The response buffer is reused, as the HTTP server does.
+ */
+static std::vector<ruuvi::format_5_reading> tag_readings(size_t tags) {
+    auto packet = default_packet5();
+    std::vector<ruuvi::format_5_reading> r(tags);
+    for (size_t i = 0; i < tags; ++i) {
+        packet.mac[4] = uint8_t(i >> 8u);
+        packet.mac[5] = uint8_t(i);
+        std::copy(packet.mac.begin(), packet.mac.end(), packet.data.begin() + 18);
+        ruuvi::decode_format_5(packet, r[i]);
+    }
+    return r;
+}
+
+static void BM_ExposerScrapeCollect(benchmark::State& state) {
+    ruuvi::RuuviExposer exposer;
+    for (auto const& r: tag_readings(size_t(state.range(0)))) exposer.update(r);
+    prometheus::TextSerializer serializer;
+    size_t bytes = 0;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            auto text = serializer.Serialize(exposer.Collect());
+            bytes     = text.size();
+        }
+    }
+    state.counters["bytes"] = double(bytes);
+}
+BENCHMARK(BM_ExposerScrapeCollect)->ArgName("tags")->Arg(50)->Arg(5000);
+
+static void BM_ExposerScrapeRender(benchmark::State& state) {
+    auto const tags    = size_t(state.range(0));
+    auto const changed = tags * size_t(state.range(1)) / 100;
+    auto readings      = tag_readings(tags);
+    ruuvi::RuuviExposer exposer;
+    for (auto const& r: readings) exposer.update(r);
+    std::string text;
+    exposer.render(text);
+    size_t next = 0;
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            state.PauseTiming();
+            for (size_t i = 0; i < changed; ++i) {
+                auto& r = readings[next];
+                ++r.measurement_sequence;
+                exposer.update(r);
+                if (++next == tags) next = 0;
+            }
+            text.clear();
+            state.ResumeTiming();
+            exposer.render(text);
+        }
+    }
+    state.counters["bytes"] = double(text.size());
+}
+BENCHMARK(BM_ExposerScrapeRender)
+    ->ArgNames({"tags", "changed%"})
+    ->ArgsProduct({{50, 5000}, {0, 10, 100}});
+
+// The rendered scrape of state.range(0) tags serialized again as OpenMetrics
+static void BM_ExposerScrapeOpenMetrics(benchmark::State& state) {
+    ruuvi::RuuviExposer exposer;
+    for (auto const& r: tag_readings(size_t(state.range(0)))) exposer.update(r);
+    std::string text;
+    for (auto _: state) {
+        text.clear();
+        ruuvi::serialize_openmetrics(exposer.Collect(), text);
+    }
+    state.counters["bytes"] = double(text.size());
+}
+BENCHMARK(BM_ExposerScrapeOpenMetrics)->ArgName("tags")->Arg(50)->Arg(5000);
+
+// Compressing the scrape of state.range(0) tags at gzip level state.range(1)
+static void BM_ScrapeGzip(benchmark::State& state) {
+    ruuvi::RuuviExposer exposer;
+    for (auto const& r: tag_readings(size_t(state.range(0)))) exposer.update(r);
+    std::string text, compressed;
+    exposer.render(text);
+    ruuvi::gzip_compressor gzip(int(state.range(1)));
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) gzip.compress(text, compressed);
+    }
+    state.SetBytesProcessed(state.iterations() * int64_t(text.size()));
+    state.counters["raw_bytes"]  = double(text.size());
+    state.counters["sent_bytes"] = double(compressed.size());
+}
+BENCHMARK(BM_ScrapeGzip)->ArgNames({"tags", "level"})->ArgsProduct({{50, 5000}, {1, 6, 9}});
+
+/*
+ * The history of tags drifting as real ones do, one advert every 1.285 s with some jitter and
+ * noise in the last digits of the fields. Adding reports the memory per sample, querying decodes
+ * 24 h of one tag and with state.range(0) renders the first page of it as the JSON of
+ * GET /history.
+ */
+class drifting_fleet {
+public:
+    explicit drifting_fleet(size_t tags): readings(tag_readings(tags)), times(tags, 0) {
+        for (size_t i = 0; i < tags; ++i) times[i] = int64_t(i) * 1285 / int64_t(tags);
+    }
+
+    // The next advert of tag i, and the time it was received
+    ruuvi::format_5_reading const& next(size_t i, int64_t& timestamp_ms) {
+        auto step = [this](int lo, int hi) { return std::uniform_int_distribution(lo, hi)(rng); };
+        auto& r   = readings[i];
+        times[i] += 1285 + step(-30, 30);
+        r.temperature += 0.005f * float(step(-1, 1));
+        r.humidity += 0.0025f * float(step(-2, 2));
+        r.pressure += uint32_t(step(-1, 1));
+        for (auto& a: r.acceleration) a += 0.004f * float(step(-1, 1));
+        r.battery_voltage = 2.9f + 0.001f * float(step(0, 5));
+        ++r.measurement_sequence;
+        r.signal_strength = int16_t(step(-90, -60));
+        timestamp_ms      = times[i];
+        return r;
+    }
+
+private:
+    std::mt19937 rng{1};
+    std::vector<ruuvi::format_5_reading> readings;
+    std::vector<int64_t> times;
+};
+
+static double history_gauge(ruuvi::history const& h, char const* name) {
+    for (auto const& f: h.Collect())
+        if (f.name == name) return f.metric.at(0).gauge.value;
+    return 0;
+}
+
+static void BM_HistoryAdd(benchmark::State& state) {
+    auto const tags = size_t(state.range(0));
+    drifting_fleet fleet(tags);
+    ruuvi::history h;
+    size_t i = 0;
+    int64_t timestamp_ms;
+    for (auto _: state) {
+        auto const& r = fleet.next(i, timestamp_ms);
+        h.add(r, timestamp_ms);
+        if (++i == tags) i = 0;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["bytes_per_sample"] =
+        history_gauge(h, "ruuvi_history_bytes") / history_gauge(h, "ruuvi_history_samples");
+}
+BENCHMARK(BM_HistoryAdd)->ArgName("tags")->Arg(50);
+
+static void BM_HistoryQuery(benchmark::State& state) {
+    constexpr size_t day = 24 * 3600 * 1000 / 1285;
+    drifting_fleet fleet(1);
+    ruuvi::history h;
+    int64_t timestamp_ms;
+    ruuvi::format_5_reading last;
+    for (size_t i = 0; i < day; ++i) {
+        last = fleet.next(0, timestamp_ms);
+        h.add(last, timestamp_ms);
+    }
+
+    std::vector<ruuvi::history_sample> samples;
+    ruuvi::http_request req;
+    req.query = "mac=" + ble::format_mac(last.mac);
+    ruuvi::http_response resp;
+    for (auto _: state) {
+        if (state.range(0) == 0) {
+            h.query(last.mac, 0, samples);
+        } else {
+            h.serve(req, resp);
+        }
+    }
+    auto const served = state.range(0) == 0 ? day : ruuvi::history_page_samples;
+    state.SetItemsProcessed(state.iterations() * int64_t(served));
+    if (state.range(0) != 0) state.counters["bytes"] = double(resp.body.size());
+}
+BENCHMARK(BM_HistoryQuery)->ArgName("json")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,284 @@
+#include "alloc_counter.hpp"
+#include "diskstat.hpp"
+#include "procfs.hpp"
+
+#include <benchmark/benchmark.h>
+#include <prometheus/metric_family.h>
+#include <sysinfo/diskstat_exposer.hpp>
+#include <sysinfo/system_info_exposer.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Snapshots of /proc and /sys in test/fixtures
+constexpr char const* machines[] = {"rpi3", "rpi4", "rpizero", "x86-server"};
+
+std::string fixture(benchmark::State& state, char const* name = "") {
+    return std::string(SYSINFO_FIXTURES) + "/" + machines[state.range(0)] + "/" + name;
+}
+
+void each_machine(benchmark::internal::Benchmark* b) {
+    b->ArgName("machine");
+    for (size_t i = 0; i < std::size(machines); ++i) b->Arg(int64_t(i));
+}
+
+// read=0 parses a copy in memory, read=1 also reads the file again as on a scrape
+void each_machine_and_read(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"machine", "read"});
+    for (size_t i = 0; i < std::size(machines); ++i)
+        b->Args({int64_t(i), 0})->Args({int64_t(i), 1});
+}
+
+template<class Parse> void parse_fixture(benchmark::State& state, char const* name, Parse parse) {
+    sys_info::proc_file file(fixture(state, name));
+    std::string_view text;
+    if (!file.read(text)) {
+        state.SkipWithError("Can't read the fixture");
+        return;
+    }
+    std::string const copy(text);
+    bool const read = state.range(1) != 0;
+    state.SetLabel(machines[state.range(0)]);
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            if (read && !file.read(text)) state.SkipWithError("Can't read the fixture");
+            parse(read ? text : std::string_view(copy));
+        }
+    }
+    state.SetBytesProcessed(int64_t(state.iterations() * copy.size()));
+}
+
+// The parsers that system_info and Diskstat used before proc_file, kept as is for comparison
+
+struct legacy_meminfo_line {
+    std::string name;
+    unsigned long value;
+};
+
+double legacy_unit(std::string const& u) {
+    if (u == "kB") return 1000;
+    if (u == "MB") return 1'000'000;
+    return 1;
+}
+
+unsigned long legacy_meminfo(std::string const& path) {
+    std::ifstream file(path);
+    std::list<legacy_meminfo_line> lines;
+    std::string line;
+    while (std::getline(file, line)) {
+        legacy_meminfo_line m;
+        std::stringstream ss(line);
+        std::string multiplier;
+        ss >> m.name >> m.value >> multiplier;
+        m.name.pop_back();
+        m.value *= legacy_unit(multiplier);
+        lines.push_back(std::move(m));
+    }
+
+    unsigned long sum = 0;
+    for (auto name: {"MemTotal", "MemFree", "MemAvailable", "Buffers", "Cached", "SwapCached",
+                     "Active", "Inactive", "SwapTotal", "SwapFree", "Dirty", "Writeback"}) {
+        auto it = std::find_if(lines.begin(), lines.end(),
+                               [name](legacy_meminfo_line const& l) { return l.name == name; });
+        if (it != lines.end()) {
+            sum += it->value;
+            lines.erase(it);
+        }
+    }
+    return sum;
+}
+
+long legacy_stat(std::string const& path) {
+    std::ifstream file(path);
+    std::string id;
+    long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0,
+         guest = 0, guest_nice = 0;
+    file >> id >> user >> nice >> system >> idle >> iowait >> irq >> softirq >> steal >> guest
+        >> guest_nice;
+    return user + nice + system + irq + softirq + steal + guest + guest_nice;
+}
+
+unsigned long legacy_netstat(std::string const& path) {
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    lines.reserve(20);
+    std::string l;
+    while (std::getline(file, l)) lines.push_back(l);
+
+    auto pred = [](std::string const& s) { return s.find("IpExt") != s.npos; };
+    auto it   = std::find_if(lines.begin(), lines.end(), pred);
+    if (it == lines.end()) return 0;
+    it = std::find_if(it + 1, lines.end(), pred);
+    if (it == lines.end()) return 0;
+
+    std::string id;
+    unsigned long u, in_octets = 0, out_octets = 0, in_mcast = 0, out_mcast = 0;
+    std::stringstream ss(*it);
+    ss >> id >> u >> u >> u >> u >> u >> u >> in_octets >> out_octets >> in_mcast >> out_mcast;
+    return in_octets + out_octets + in_mcast + out_mcast;
+}
+
+std::vector<sys_info::Diskstat> legacy_diskstats(std::string const& path) {
+    std::vector<sys_info::Diskstat> stats;
+    stats.reserve(10);
+    std::ifstream ifs(path);
+    std::string line;
+    while (ifs.good() && std::getline(ifs, line).good()) {
+        auto& c = stats.emplace_back();
+        ifs >> c.major >> c.minor >> c.devname >> c.ReadCompleted >> c.ReadMerged >> c.ReadSectors
+            >> c.ReadTime >> c.WriteCompleted >> c.WriteMerged >> c.WriteSectors >> c.WriteTime
+            >> c.IOInProgress >> c.IOTime >> c.WeightedIOTime >> c.DiscardCompleted
+            >> c.DiscardMerged >> c.DiscardTime >> c.FlushComplete >> c.FlushTime;
+    }
+    return stats;
+}
+
+template<class F> void legacy_fixture(benchmark::State& state, char const* name, F f) {
+    auto const path = fixture(state, name);
+    state.SetLabel(machines[state.range(0)]);
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) benchmark::DoNotOptimize(f(path));
+    }
+}
+
+}  // namespace
+
+// ------ Each source, parsed as on every scrape --------
+
+static void BM_Meminfo(benchmark::State& state) {
+    sys_info::meminfo_values values;
+    parse_fixture(state, "proc/meminfo", [&values](std::string_view text) {
+        benchmark::DoNotOptimize(sys_info::parse_meminfo(text, values));
+    });
+}
+BENCHMARK(BM_Meminfo)->Apply(each_machine_and_read);
+
+static void BM_Stat(benchmark::State& state) {
+    sys_info::cpu_times cpu;
+    parse_fixture(state, "proc/stat", [&cpu](std::string_view text) {
+        benchmark::DoNotOptimize(sys_info::parse_stat(text, cpu));
+    });
+}
+BENCHMARK(BM_Stat)->Apply(each_machine_and_read);
+
+static void BM_StatCores(benchmark::State& state) {
+    sys_info::cpu_times cpu;
+    std::vector<sys_info::core_times> cores;
+    parse_fixture(state, "proc/stat", [&cpu, &cores](std::string_view text) {
+        benchmark::DoNotOptimize(sys_info::parse_stat(text, cpu, cores));
+    });
+}
+BENCHMARK(BM_StatCores)->Apply(each_machine_and_read);
+
+static void BM_Netstat(benchmark::State& state) {
+    sys_info::netstat_values values;
+    parse_fixture(state, "proc/net/netstat", [&values](std::string_view text) {
+        benchmark::DoNotOptimize(sys_info::parse_netstat(text, values));
+    });
+}
+BENCHMARK(BM_Netstat)->Apply(each_machine_and_read);
+
+static void BM_Diskstats(benchmark::State& state) {
+    std::vector<sys_info::Diskstat> disks;
+    parse_fixture(state, "proc/diskstats", [&disks](std::string_view text) {
+        sys_info::parse_diskstats(text, disks);
+        benchmark::DoNotOptimize(disks.data());
+    });
+}
+BENCHMARK(BM_Diskstats)->Apply(each_machine_and_read);
+
+static void BM_Thermal(benchmark::State& state) {
+    std::vector<sys_info::proc_file> zones;
+    auto const root = fixture(state, "sys/class/thermal");
+    for (auto const& entry: std::filesystem::directory_iterator(root))
+        zones.emplace_back((entry.path() / "temp").string());
+    state.SetLabel(machines[state.range(0)]);
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) {
+            for (auto& zone: zones) {
+                std::string_view text;
+                long value;
+                if (!zone.read(text) || !sys_info::parse_integer(text, value))
+                    state.SkipWithError("Can't read the fixture");
+                benchmark::DoNotOptimize(value);
+            }
+        }
+    }
+}
+BENCHMARK(BM_Thermal)->Apply(each_machine);
+
+// ------ Whole collectors, as scraped --------
+
+// cached=0 reads every source on every scrape, cached=1 uses the default refresh intervals
+void each_machine_and_cached(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"machine", "cached"});
+    for (size_t i = 0; i < std::size(machines); ++i)
+        b->Args({int64_t(i), 0})->Args({int64_t(i), 1});
+}
+
+sys_info::refresh_intervals intervals(benchmark::State& state) {
+    if (state.range(1) != 0) return {};
+    sys_info::refresh_intervals every_scrape;
+    every_scrape.meminfo = every_scrape.diskstats = {};
+    return every_scrape;
+}
+
+static void BM_SystemInfoCollect(benchmark::State& state) {
+    auto collector = sys_info::SystemInfoCollector::create(fixture(state), intervals(state));
+    collector->Collect();  // Finds the thermal zones
+    state.SetLabel(machines[state.range(0)]);
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) benchmark::DoNotOptimize(collector->Collect());
+    }
+}
+BENCHMARK(BM_SystemInfoCollect)->Apply(each_machine_and_cached);
+
+static void BM_DiskstatCollect(benchmark::State& state) {
+    sys_info::DiskstatExposer exposer(fixture(state), intervals(state).diskstats);
+    state.SetLabel(machines[state.range(0)]);
+
+    {
+        bench::allocation_counter allocs(state);
+        for (auto _: state) benchmark::DoNotOptimize(exposer.Collect());
+    }
+}
+BENCHMARK(BM_DiskstatCollect)->Apply(each_machine_and_cached);
+
+// ------ The previous parsers, for comparison --------
+
+static void BM_LegacyMeminfo(benchmark::State& state) {
+    legacy_fixture(state, "proc/meminfo", legacy_meminfo);
+}
+BENCHMARK(BM_LegacyMeminfo)->Apply(each_machine);
+
+static void BM_LegacyStat(benchmark::State& state) {
+    legacy_fixture(state, "proc/stat", legacy_stat);
+}
+BENCHMARK(BM_LegacyStat)->Apply(each_machine);
+
+static void BM_LegacyNetstat(benchmark::State& state) {
+    legacy_fixture(state, "proc/net/netstat", legacy_netstat);
+}
+BENCHMARK(BM_LegacyNetstat)->Apply(each_machine);
+
+static void BM_LegacyDiskstats(benchmark::State& state) {
+    legacy_fixture(state, "proc/diskstats", legacy_diskstats);
+}
+BENCHMARK(BM_LegacyDiskstats)->Apply(each_machine);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,139 @@
+#include "ruuvi_corpus.hpp"
+
+#include "ruuvi_vectors.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <random>
+
+namespace {
+
+using rng = std::mt19937;
+
+constexpr size_t fleet_size = 50;
+
+struct generator {
+    rng r;
+    std::vector<ble::mac_address> fleet;
+
+    uint8_t byte() { return uint8_t(std::uniform_int_distribution<int>(0, 255)(r)); }
+    uint16_t u16(uint16_t lo, uint16_t hi) {
+        return uint16_t(std::uniform_int_distribution<int>(lo, hi)(r));
+    }
+    int16_t i16(int16_t lo, int16_t hi) {
+        return int16_t(std::uniform_int_distribution<int>(lo, hi)(r));
+    }
+
+    ble::AdvPacket packet(ble::mac_address const& mac, std::vector<uint8_t> const& data) {
+        ble::AdvPacket p;
+        p.mac             = mac;
+        p.manufacturer_id = vectors::ruuvi_id;
+        p.signal_strength = i16(-100, -30);
+        p.set_manufacturer_data(data.data(), data.size());
+        return p;
+    }
+
+    static void put16(std::vector<uint8_t>& d, size_t at, uint16_t v) {
+        d[at]     = v >> 8u;
+        d[at + 1] = v & 0xFFu;
+    }
+
+    std::vector<uint8_t> format_5(ble::mac_address const& mac) {
+        std::vector<uint8_t> d(24);
+        d[0] = 0x05;
+        put16(d, 1, uint16_t(i16(-8000, 8000)));  // -40..40 C
+        put16(d, 3, u16(0, 40'000));
+        put16(d, 5, u16(40'000, 60'000));
+        for (size_t at: {7, 9, 11}) put16(d, at, uint16_t(i16(-2000, 2000)));
+        put16(d, 13, uint16_t((u16(1000, 1500) << 5u) | u16(0, 15)));
+        d[15] = byte();
+        put16(d, 16, u16(0, 65534));
+        std::copy(mac.begin(), mac.end(), d.begin() + 18);
+        return d;
+    }
+
+    std::vector<uint8_t> invalid_5(ble::mac_address const& mac) {
+        auto d = format_5(mac);
+        switch (u16(0, 5)) {
+            case 0: put16(d, 1, 0x8000); break;
+            case 1: put16(d, 3, 0xFFFF); break;
+            case 2: put16(d, 5, 0xFFFF); break;
+            case 3: put16(d, 7 + 2 * u16(0, 2), 0x8000); break;
+            case 4: d[13] = 0xFF, d[14] |= 0xE0; break;
+            default: d[18] ^= 0xFF; break;  // MAC mismatch
+        }
+        return d;
+    }
+
+    std::vector<uint8_t> format_3() {
+        std::vector<uint8_t> d(14);
+        d[0] = 0x03;
+        d[1] = uint8_t(u16(0, 200));
+        d[2] = uint8_t(u16(0, 40) | (u16(0, 1) << 7u));
+        d[3] = uint8_t(u16(0, 99));
+        put16(d, 4, u16(40'000, 60'000));
+        for (size_t at: {6, 8, 10}) put16(d, at, uint16_t(i16(-2000, 2000)));
+        put16(d, 12, u16(2000, 3300));
+        return d;
+    }
+};
+
+}  // namespace
+
+std::vector<ble::AdvPacket> bench::make_corpus(size_t size, uint32_t seed, corpus_mix mix) {
+    generator g{rng(seed), {}};
+    for (size_t i = 0; i < fleet_size; ++i) {
+        ble::mac_address m;
+        for (auto& b: m) b = g.byte();
+        g.fleet.push_back(m);
+    }
+
+    // The fixed payloads carry the MAC of the vectors, format 5 checks it
+    ble::mac_address vector_mac;
+    ble::parse_mac(vectors::mac, vector_mac);
+    const char* fixed[] = {vectors::format_5, vectors::format_5_max, vectors::format_5_invalid,
+                           vectors::format_3, vectors::unknown_format, vectors::format_6,
+                           vectors::format_e1};
+
+    std::discrete_distribution<int> kind({double(mix.vectors), double(mix.format_5),
+                                          double(mix.invalid_5), double(mix.format_3),
+                                          double(mix.foreign), double(mix.unknown),
+                                          double(mix.truncated)});
+
+    std::vector<ble::AdvPacket> r;
+    r.reserve(size);
+    while (r.size() < size) {
+        auto const& mac = g.fleet[g.u16(0, fleet_size - 1)];
+        switch (kind(g.r)) {
+            case 0: {
+                auto payload = fixed[g.u16(0, std::size(fixed) - 1)];
+                r.push_back(g.packet(vector_mac, vectors::to_raw_data(payload)));
+                break;
+            }
+            case 1: r.push_back(g.packet(mac, g.format_5(mac))); break;
+            case 2: r.push_back(g.packet(mac, g.invalid_5(mac))); break;
+            case 3: r.push_back(g.packet(mac, g.format_3())); break;
+            case 4: {
+                std::vector<uint8_t> d(g.u16(1, 26));
+                for (auto& b: d) b = g.byte();
+                auto p            = g.packet(mac, d);
+                p.manufacturer_id = g.u16(0, 0x0498);
+                r.push_back(p);
+                break;
+            }
+            case 5: {
+                auto d = g.format_5(mac);
+                d[0]   = uint8_t(g.u16(0x10, 0xDF));
+                r.push_back(g.packet(mac, d));
+                break;
+            }
+            default: {
+                auto d = g.u16(0, 1) ? g.format_5(mac) : g.format_3();
+                d.resize(g.u16(1, uint16_t(d.size() - 1)));
+                r.push_back(g.packet(mac, d));
+                break;
+            }
+        }
+    }
+    return r;
+}
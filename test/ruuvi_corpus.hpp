@@ -0,0 +1,31 @@
+#pragma once
+
+#include <ble/packet.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+
+/**
+ * @brief Relative weights of the packet kinds in a corpus
+ */
+struct corpus_mix {
+    unsigned vectors   = 10;  // The fixed payloads from ruuvi_vectors.hpp
+    unsigned format_5  = 50;  // Random, valid data format 5
+    unsigned invalid_5 = 10;  // Data format 5 with random fields at their invalid sentinels
+    unsigned format_3  = 10;  // Random, valid data format 3
+    unsigned foreign   = 10;  // Other manufacturers
+    unsigned unknown   = 5;   // Ruuvi manufacturer id, unknown data format
+    unsigned truncated = 5;   // Ruuvi payloads cut short
+};
+
+/**
+ * @brief make_corpus Builds a reproducible corpus of adverts from tags of a small fleet
+ * @param size Number of packets
+ * @param seed Seed of the random generator, equal seeds give equal corpora
+ */
+std::vector<ble::AdvPacket> make_corpus(size_t size, uint32_t seed = 1, corpus_mix mix = {});
+
+}  // namespace bench
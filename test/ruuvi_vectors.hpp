@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Manufacturer data payloads shared by the decoding tests and the benchmark corpus. All of them
+ * are sent from vectors::mac with manufacturer id 0x0499.
+ */
+namespace vectors {
+
+inline constexpr char mac[]              = "CB:B8:33:4C:88:4F";
+inline constexpr uint16_t ruuvi_id       = 0x0499;
+inline constexpr char format_5[]         = "0512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F";
+inline constexpr char format_5_max[]     = "057FFF9C40FFFE7FFF7FFF7FFFFFDEFEFFFECBB8334C884F";
+inline constexpr char format_5_invalid[] = "058000FFFFFFFF800080008000FFFFFFFFFFFFFFFFFFFFFF";
+inline constexpr char format_3[]         = "03291A1ECE1EFC18F94202CA0B53";
+inline constexpr char unknown_format[]   = "09291A1ECE1EFC18F94202CA0B53";
+inline constexpr char format_6[]         = "06170C5668C79E007000C90501D9FFCD004C884F";
+inline constexpr char format_e1[]        =
+    "E1170C5668C79E0065007004BD11CA00C90A0213E0ACFFFFFFDECDEE00FFFFFFFFFFCBB8334C884F";
+
+inline std::vector<uint8_t> to_raw_data(std::string const& s) {
+    std::vector<uint8_t> r;
+    for (size_t i = 0; i + 1 < s.size(); i += 2) {
+        r.push_back(uint8_t(std::stoi(s.substr(i, 2), nullptr, 16)));
+    }
+    return r;
+}
+
+}  // namespace vectors
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include <dirent.h>
+#include <unistd.h>
+
+namespace tests {
+
+/**
+ * @brief A directory under /tmp removed with the files in it, like the segments of a spool
+ */
+class temp_dir {
+public:
+    temp_dir() {
+        char name[] = "/tmp/ruuvi-spool-XXXXXX";
+        if (mkdtemp(name) == nullptr) throw std::runtime_error("Failed to create a directory");
+        path = name;
+    }
+    ~temp_dir() {
+        if (auto dir = opendir(path.c_str())) {
+            while (auto e = readdir(dir))
+                if (e->d_name[0] != '.') unlink((path + "/" + e->d_name).c_str());
+            closedir(dir);
+        }
+        rmdir(path.c_str());
+    }
+    temp_dir(temp_dir const&)            = delete;
+    temp_dir& operator=(temp_dir const&) = delete;
+
+    std::string path;
+
+    /** @brief Number of spool segment files in the directory */
+    size_t segments() const {
+        size_t n = 0;
+        if (auto dir = opendir(path.c_str())) {
+            while (auto e = readdir(dir)) n += std::string(e->d_name).rfind("spool-", 0) == 0;
+            closedir(dir);
+        }
+        return n;
+    }
+};
+
+}  // namespace tests
@@ -0,0 +1,193 @@
+#include "ruuvi_vectors.hpp"
+
+#include <gtest/gtest.h>
+#include <map>
+#include <random>
+#include <ruuvi/duplicate_filter.hpp>
+#include <ruuvi/mac_table.hpp>
+
+using vectors::to_raw_data;
+
+namespace {
+
+ble::AdvPacket make_packet(ble::mac_address const& mac, std::vector<uint8_t> const& payload,
+                           int16_t rssi = -60) {
+    ble::AdvPacket p;
+    p.mac             = mac;
+    p.manufacturer_id = vectors::ruuvi_id;
+    p.signal_strength = rssi;
+    p.set_manufacturer_data(payload.data(), payload.size());
+    return p;
+}
+
+ble::mac_address test_mac() {
+    ble::mac_address mac;
+    ble::parse_mac(vectors::mac, mac);
+    return mac;
+}
+
+uint64_t key(std::vector<uint8_t> const& payload) {
+    return ruuvi::measurement_key(payload.data(), payload.size());
+}
+
+void set_sequence(std::vector<uint8_t>& format_5, uint16_t seq) {
+    format_5[16] = seq >> 8u;
+    format_5[17] = seq & 0xFFu;
+}
+
+}  // namespace
+
+TEST(MacTableTest, MatchesMap) {
+    // Few distinct addresses, so probe chains collide and erase has to move entries
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> pick(0, 199);
+    std::uniform_int_distribution<int> op(0, 2);
+
+    ruuvi::mac_table<int> table;
+    std::map<ble::mac_address, int> expected;
+    for (int i = 0; i < 20'000; ++i) {
+        ble::mac_address mac{0xCB, 0xB8, 0x33, 0, 0, uint8_t(pick(rng))};
+        mac[4] = uint8_t(mac[5] % 3);
+        switch (op(rng)) {
+            case 0: {
+                auto [v, inserted] = table.emplace(mac);
+                EXPECT_EQ(inserted, expected.count(mac) == 0);
+                *v = expected[mac] = i;
+                break;
+            }
+            case 1: EXPECT_EQ(table.erase(mac), expected.erase(mac) == 1); break;
+            default: {
+                auto v = table.find(mac);
+                auto e = expected.find(mac);
+                ASSERT_EQ(v != nullptr, e != expected.end());
+                if (v != nullptr) {
+                    EXPECT_EQ(*v, e->second);
+                }
+            }
+        }
+        ASSERT_EQ(table.size(), expected.size());
+    }
+
+    size_t visited = 0;
+    table.for_each([&](ble::mac_address const& mac, int v) {
+        ++visited;
+        EXPECT_EQ(expected.at(mac), v);
+    });
+    EXPECT_EQ(visited, expected.size());
+}
+
+TEST(DuplicateFilterTest, MeasurementKey) {
+    auto a = to_raw_data(vectors::format_5);
+    auto b = a;
+    b[1] ^= 0x01;  // Same sequence, other temperature
+    EXPECT_EQ(key(a), key(b));
+    set_sequence(b, 0x1234);
+    EXPECT_NE(key(a), key(b));
+
+    // Invalid sequence numbers fall back to hashing the payload
+    set_sequence(a, 0xFFFF);
+    set_sequence(b, 0xFFFF);
+    EXPECT_NE(key(a), key(b));
+
+    // Format 3 has no sequence number
+    auto c = to_raw_data(vectors::format_3);
+    auto d = c;
+    EXPECT_EQ(key(c), key(d));
+    d[1] ^= 0x01;
+    EXPECT_NE(key(c), key(d));
+
+    // The same sequence number in other formats is another measurement
+    auto e = to_raw_data(vectors::format_6);
+    auto f = to_raw_data(vectors::format_e1);
+    e[15] = 0x42;
+    f[25] = 0;
+    f[26] = 0;
+    f[27] = 0x42;
+    EXPECT_NE(key(e), key(f));
+    e[2] ^= 0x01;
+    f[2] ^= 0x01;
+    EXPECT_EQ(key(e) & 0xFFFF'FFFF, 0x42u);
+    EXPECT_EQ(key(f) & 0xFFFF'FFFF, 0x42u);
+
+    EXPECT_NO_THROW(ruuvi::measurement_key(nullptr, 0));
+}
+
+TEST(DuplicateFilterTest, SuppressesRepeats) {
+    using namespace std::chrono_literals;
+    ruuvi::duplicate_filter filter;
+    auto const mac = test_mac();
+    auto payload   = to_raw_data(vectors::format_5);
+    auto t0        = ruuvi::duplicate_filter::clock::time_point{} + 1h;
+
+    EXPECT_TRUE(filter.admit(make_packet(mac, payload, -60), t0));
+    EXPECT_FALSE(filter.admit(make_packet(mac, payload, -70), t0 + 1s));
+    EXPECT_FALSE(filter.admit(make_packet(mac, payload, -80), t0 + 2s));
+    EXPECT_EQ(filter.suppressed(), 2u);
+
+    // Repeats still refresh the signal strength and the time the tag was seen
+    auto tag = filter.find(mac);
+    ASSERT_NE(tag, nullptr);
+    EXPECT_EQ(tag->signal_strength, -80);
+    EXPECT_EQ(tag->last_seen, t0 + 2s);
+
+    set_sequence(payload, 0x0100);
+    EXPECT_TRUE(filter.admit(make_packet(mac, payload), t0 + 3s));
+
+    // Other tags are tracked separately
+    auto other = mac;
+    other[5] ^= 0xFF;
+    EXPECT_TRUE(filter.admit(make_packet(other, payload), t0 + 3s));
+    EXPECT_FALSE(filter.admit(make_packet(other, payload), t0 + 3s));
+    EXPECT_EQ(filter.suppressed(), 3u);
+    EXPECT_EQ(filter.tag_count(), 2u);
+    EXPECT_EQ(filter.find(ble::mac_address{}), nullptr);
+}
+
+TEST(DuplicateFilterTest, Expires) {
+    using namespace std::chrono_literals;
+    ruuvi::duplicate_filter filter;
+    auto const mac = test_mac();
+    auto other     = mac;
+    other[5]       ^= 0xFF;
+    auto payload   = to_raw_data(vectors::format_5);
+    auto t0        = ruuvi::duplicate_filter::clock::time_point{} + 1h;
+
+    filter.admit(make_packet(mac, payload), t0);
+    filter.admit(make_packet(other, payload), t0 + 2s);
+    filter.expire(t0 + 1s);
+    EXPECT_EQ(filter.find(mac), nullptr);
+    EXPECT_NE(filter.find(other), nullptr);
+    EXPECT_EQ(filter.tag_count(), 1u);
+
+    // A forgotten tag's next advert is decoded even if it repeats the last measurement
+    EXPECT_TRUE(filter.admit(make_packet(mac, payload), t0 + 3s));
+}
+
+TEST(DuplicateFilterTest, ForgetsTheLeastRecentlySeen) {
+    using namespace std::chrono_literals;
+    ruuvi::duplicate_filter filter(8);
+    auto payload = to_raw_data(vectors::format_5);
+    auto t0      = ruuvi::duplicate_filter::clock::time_point{} + 1h;
+    auto mac     = [](uint8_t i) { return ble::mac_address{0xCB, 0xB8, 0x33, 0x4C, 0x88, i}; };
+
+    for (uint8_t i = 0; i < 8; ++i) filter.admit(make_packet(mac(i), payload), t0 + i * 1s);
+    // Tag 0 is heard again, tag 1 becomes the least recently seen
+    EXPECT_FALSE(filter.admit(make_packet(mac(0), payload), t0 + 10s));
+    EXPECT_EQ(filter.tag_count(), 8u);
+
+    EXPECT_TRUE(filter.admit(make_packet(mac(8), payload), t0 + 11s));
+    EXPECT_LE(filter.tag_count(), 8u);
+    EXPECT_EQ(filter.find(mac(1)), nullptr);
+    EXPECT_EQ(filter.find(mac(2)), nullptr);
+    EXPECT_NE(filter.find(mac(0)), nullptr);
+    EXPECT_NE(filter.find(mac(7)), nullptr);
+    EXPECT_NE(filter.find(mac(8)), nullptr);
+
+    for (uint8_t i = 9; i < 200; ++i) {
+        filter.admit(make_packet(mac(i), payload), t0 + i * 1s);
+        ASSERT_LE(filter.tag_count(), 8u);
+    }
+    EXPECT_NE(filter.find(mac(199)), nullptr);
+
+    EXPECT_THROW(ruuvi::duplicate_filter(0), std::invalid_argument);
+}
@@ -0,0 +1,128 @@
+#include "ruuvi_vectors.hpp"
+
+#include <gtest/gtest.h>
+#include <ble/hci.hpp>
+
+using vectors::to_raw_data;
+
+namespace {
+
+// Flags, manufacturer specific data with a data format 5 payload
+const std::string ruuvi_ad = std::string("020106") + "1BFF9904" + vectors::format_5;
+
+// LE meta event with a single advertising report from CB:B8:33:4C:88:4F, rssi -60
+std::vector<uint8_t> ruuvi_event() {
+    auto ad     = to_raw_data(ruuvi_ad);
+    auto report = to_raw_data("0001" "4F884C33B8CB");
+    report.push_back(uint8_t(ad.size()));
+    report.insert(report.end(), ad.begin(), ad.end());
+    report.push_back(uint8_t(-60));
+
+    std::vector<uint8_t> ev = {0x04, 0x3E, uint8_t(2 + report.size()), 0x02, 0x01};
+    ev.insert(ev.end(), report.begin(), report.end());
+    return ev;
+}
+
+std::vector<ble::BlePacket> parse(std::vector<uint8_t> const& ev, int& ret) {
+    std::vector<ble::BlePacket> packets;
+    ret = ble::hci::parse_event(
+        ev.data(), ev.size(),
+        [&packets](ble::AdvPacket const& p, std::string_view name) {
+            packets.push_back(ble::to_ble_packet(p, std::string(name)));
+        }
+    );
+    return packets;
+}
+
+}  // namespace
+
+TEST(HciParseTest, ParsesAdvertisingReport) {
+    int ret      = 0;
+    auto packets = parse(ruuvi_event(), ret);
+    ASSERT_EQ(ret, 1);
+    ASSERT_EQ(packets.size(), 1u);
+
+    auto& p = packets[0];
+    EXPECT_EQ(p.mac, "CB:B8:33:4C:88:4F");
+    EXPECT_EQ(p.manufacturer_id, 0x0499);
+    EXPECT_EQ(p.signal_strength, -60);
+    EXPECT_EQ(p.manufacturer_data, to_raw_data("0512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F"));
+    EXPECT_TRUE(p.device_name.empty());
+}
+
+TEST(HciParseTest, ParsesMultipleReportsAndNames) {
+    auto name   = to_raw_data("0709527575766931");  // Complete local name "Ruuvi1"
+    auto report = to_raw_data("0000" "010203040506");
+    report.push_back(uint8_t(name.size()));
+    report.insert(report.end(), name.begin(), name.end());
+    report.push_back(uint8_t(-80));
+
+    auto ev = ruuvi_event();
+    ev[4]   = 2;
+    ev.insert(ev.end(), report.begin(), report.end());
+    ev[2] = uint8_t(ev.size() - 3);
+
+    int ret      = 0;
+    auto packets = parse(ev, ret);
+    ASSERT_EQ(ret, 2);
+    ASSERT_EQ(packets.size(), 2u);
+    EXPECT_EQ(packets[1].mac, "06:05:04:03:02:01");
+    EXPECT_EQ(packets[1].device_name, "Ruuvi1");
+    EXPECT_EQ(packets[1].signal_strength, -80);
+    EXPECT_TRUE(packets[1].manufacturer_data.empty());
+}
+
+TEST(HciParseTest, IgnoresOtherEvents) {
+    int ret = -5;
+    // Command complete
+    auto packets = parse(to_raw_data("040E0401050C00"), ret);
+    EXPECT_EQ(ret, 0);
+    EXPECT_TRUE(packets.empty());
+
+    // LE connection complete
+    packets = parse(to_raw_data("043E0301000000"), ret);
+    EXPECT_EQ(ret, 0);
+    EXPECT_TRUE(packets.empty());
+}
+
+TEST(HciParseTest, RejectsTruncatedEvents) {
+    auto ev = ruuvi_event();
+    for (size_t len = 0; len < ev.size(); ++len) {
+        auto cut = std::vector<uint8_t>(ev.begin(), ev.begin() + len);
+        int ret      = 0;
+        auto packets = parse(cut, ret);
+        EXPECT_TRUE(packets.empty()) << "Truncated to " << len;
+        EXPECT_EQ(ret, ble::hci::malformed_event) << "Truncated to " << len;
+    }
+
+    // Advertising data length past the end of the event
+    ev[5 + 8] = 200;
+    int ret   = 0;
+    EXPECT_TRUE(parse(ev, ret).empty());
+    EXPECT_EQ(ret, ble::hci::malformed_event);
+
+    // AD structure longer than the advertising data
+    ev            = ruuvi_event();
+    ev[5 + 9 + 3] = 0x30;
+    EXPECT_TRUE(parse(ev, ret).empty());
+    EXPECT_EQ(ret, ble::hci::malformed_event);
+}
+
+TEST(HciParseTest, ReadsCommandResults) {
+    auto result = [](std::string const& hex, uint16_t opcode) {
+        auto ev = to_raw_data(hex);
+        return ble::hci::command_result(ev.data(), ev.size(), opcode);
+    };
+    // LE Set Scan Enable (0x200C) completed, and refused as Command Disallowed
+    EXPECT_EQ(result("040E04010C2000", 0x200C), 0);
+    EXPECT_EQ(result("040E04010C200C", 0x200C), 0x0C);
+    // LE Set Scan Parameters (0x200B) refused with a Command Status event
+    EXPECT_EQ(result("040F040C010B20", 0x200B), 0x0C);
+
+    EXPECT_EQ(result("040E04010C2000", 0x200B), ble::hci::other_event);
+    EXPECT_EQ(result("040F040C010B20", 0x200C), ble::hci::other_event);
+    EXPECT_EQ(result("043E0301000000", 0x200C), ble::hci::other_event);
+    EXPECT_EQ(result("040E03010C20", 0x200C), ble::hci::malformed_event);
+    EXPECT_EQ(result("040E04010C20", 0x200C), ble::hci::malformed_event);
+    EXPECT_EQ(result("040E", 0x200C), ble::hci::malformed_event);
+}
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <prometheus/metric_family.h>
+#include <random>
+#include <ruuvi/history.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr ble::mac_address tag_mac{0xCB, 0xB8, 0x33, 0x4C, 0x88, 0x4F};
+
+uint32_t bits_of(float f) {
+    uint32_t v;
+    std::memcpy(&v, &f, sizeof(v));
+    return v;
+}
+
+// A tag drifting slowly in steps of the format 5 resolution, with the noise and gaps of real
+// reception
+struct drifting_tag {
+    std::mt19937 rng{3};
+    ruuvi::format_5_reading r;
+    int64_t time_ms = 1'700'000'000'000;
+
+    int temperature = 4300;  // 21.5 C
+    int humidity    = 18'100;
+    int pressure    = 50'325;
+    std::array<int, 3> acceleration{4, -12, 1020};
+    uint8_t movement_counter      = 0;
+    uint16_t measurement_sequence = 0;
+
+    ruuvi::format_5_reading const& next() {
+        auto step = [this](int lo, int hi) { return std::uniform_int_distribution(lo, hi)(rng); };
+        time_ms += 1285 + step(-30, 30) + (step(0, 99) == 0 ? step(1000, 100'000) : 0);
+        temperature += step(-1, 1);
+        humidity += step(-2, 2);
+        pressure += step(-1, 1);
+        for (auto& a: acceleration) a += 4 * step(-1, 1);
+        movement_counter += step(0, 50) == 0;
+        ++measurement_sequence;
+
+        uint8_t payload[24] = {0x05};
+        auto be16           = [&payload](size_t offset, int v) {
+            payload[offset]     = uint8_t(v >> 8);
+            payload[offset + 1] = uint8_t(v);
+        };
+        be16(1, temperature);
+        be16(3, humidity);
+        be16(5, pressure);
+        for (size_t i = 0; i < 3; ++i) be16(7 + 2 * i, acceleration[i]);
+        be16(13, 1351 << 5 | 22);  // 2.951 V, 4 dBm
+        payload[15] = movement_counter;
+        be16(16, measurement_sequence);
+        std::copy(tag_mac.begin(), tag_mac.end(), payload + 18);
+        ruuvi::decode_format_5(payload, sizeof(payload), r);
+        r.mac             = tag_mac;
+        r.signal_strength = int16_t(step(-90, -60));
+        return r;
+    }
+};
+
+double value_of(std::vector<prometheus::MetricFamily> const& families, std::string const& name) {
+    for (auto const& f: families)
+        if (f.name == name) return f.metric.at(0).gauge.value;
+    return std::nan("");
+}
+
+}  // namespace
+
+TEST(HistoryTest, RoundTrips) {
+    ruuvi::history h;
+    drifting_tag tag;
+    std::vector<ruuvi::history_sample> added;
+    for (int i = 0; i < 5000; ++i) {
+        auto const& r = tag.next();
+        if (i % 700 == 0) {
+            // Invalid fields, and the wall clock stepping back
+            auto invalid        = r;
+            invalid.temperature = ruuvi::format_5_reading::nan;
+            invalid.errors      = ruuvi::invalid_temperature | ruuvi::invalid_pressure;
+            tag.time_ms -= 5000;
+            h.add(invalid, tag.time_ms);
+        } else {
+            h.add(r, tag.time_ms);
+        }
+        added.push_back({tag.time_ms, {}});
+    }
+
+    std::vector<ruuvi::history_sample> out;
+    ASSERT_TRUE(h.query(tag_mac, std::numeric_limits<int64_t>::min(), out));
+    ASSERT_EQ(out.size(), added.size());
+    for (size_t i = 0; i < out.size(); ++i) ASSERT_EQ(out[i].timestamp_ms, added[i].timestamp_ms);
+    EXPECT_TRUE(std::isnan(out[0].values[0]));
+    EXPECT_TRUE(std::isnan(out[0].values[2]));
+    EXPECT_EQ(bits_of(out.back().values[0]), bits_of(tag.r.temperature));
+    EXPECT_EQ(out.back().values[2], float(tag.r.pressure));
+    EXPECT_EQ(bits_of(out.back().values[5]), bits_of(tag.r.acceleration[2]));
+    EXPECT_EQ(out.back().values[9], float(tag.r.measurement_sequence));
+    EXPECT_EQ(out.back().values[10], float(tag.r.signal_strength));
+
+    // Samples from the middle on, across blocks
+    auto from = added[3210].timestamp_ms;
+    ASSERT_TRUE(h.query(tag_mac, from, out));
+    ASSERT_FALSE(out.empty());
+    EXPECT_EQ(out.front().timestamp_ms, from);
+    for (auto const& s: out) EXPECT_GE(s.timestamp_ms, from);
+
+    auto families = h.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_history_tags"), 1);
+    EXPECT_EQ(value_of(families, "ruuvi_history_samples"), 5000);
+    // Far less than the 48 bytes of a sample stored as is
+    EXPECT_LT(value_of(families, "ruuvi_history_bytes"), 5000 * 9);
+
+    EXPECT_FALSE(h.query(ble::mac_address{}, 0, out));
+    EXPECT_TRUE(out.empty());
+}
+
+TEST(HistoryTest, RoundsToTheFormatResolution) {
+    ruuvi::history h;
+    ruuvi::format_5_reading r;
+    r.mac             = tag_mac;
+    r.temperature     = 21.5037f;
+    r.humidity        = 1e30f;
+    r.battery_voltage = 2.9512f;
+    h.add(r, 1'700'000'000'000);
+
+    std::vector<ruuvi::history_sample> out;
+    ASSERT_TRUE(h.query(tag_mac, 0, out));
+    ASSERT_EQ(out.size(), 1u);
+    EXPECT_FLOAT_EQ(out[0].values[0], 21.505f);
+    EXPECT_TRUE(std::isnan(out[0].values[1]));
+    EXPECT_FLOAT_EQ(out[0].values[6], 2.951f);
+}
+
+TEST(HistoryTest, DropsOldSamples) {
+    ruuvi::history_options opts;
+    opts.retention = std::chrono::hours(1);
+    opts.max_bytes = 64 * 1024;
+    ruuvi::history h(opts);
+    drifting_tag tag;
+    for (int i = 0; i < 20'000; ++i) {
+        auto const& r = tag.next();
+        h.add(r, tag.time_ms);
+    }
+
+    auto families = h.Collect();
+    EXPECT_LE(value_of(families, "ruuvi_history_bytes"), opts.max_bytes);
+    std::vector<ruuvi::history_sample> out;
+    ASSERT_TRUE(h.query(tag_mac, std::numeric_limits<int64_t>::min(), out));
+    EXPECT_EQ(double(out.size()), value_of(families, "ruuvi_history_samples"));
+    EXPECT_LT(out.size(), 20'000u);
+    EXPECT_EQ(out.back().timestamp_ms, tag.time_ms);
+
+    h.expire(tag.time_ms + 30 * 60 * 1000);
+    ASSERT_TRUE(h.query(tag_mac, std::numeric_limits<int64_t>::min(), out));
+    EXPECT_GE(out.front().timestamp_ms, tag.time_ms - 30 * 60 * 1000 - 4 * 3600 * 1000);
+    h.expire(tag.time_ms + 2 * 3600 * 1000);
+    EXPECT_FALSE(h.query(tag_mac, std::numeric_limits<int64_t>::min(), out));
+    EXPECT_EQ(value_of(h.Collect(), "ruuvi_history_tags"), 0);
+}
+
+TEST(HistoryTest, ServesJson) {
+    ruuvi::history h;
+    ruuvi::format_5_reading r;
+    r.mac         = tag_mac;
+    r.temperature = 21.5f;
+    r.pressure    = 100'325;
+    h.add(r, 1'700'000'000'000);
+    r.temperature = 21.505f;
+    h.add(r, 1'700'000'001'285);
+
+    ruuvi::http_request req;
+    ruuvi::http_response resp;
+    req.query = "mac=cb%3Ab8%3A33%3A4c%3A88%3A4f&from=1700000001";
+    h.serve(req, resp);
+    EXPECT_EQ(resp.status, 200);
+    EXPECT_EQ(resp.content_type, "application/json");
+    EXPECT_EQ(resp.body.rfind("{\"mac\":\"CB:B8:33:4C:88:4F\",\"fields\":[\"timestamp_ms\","
+                              "\"temperature\",",
+                              0),
+              0u);
+    EXPECT_NE(resp.body.find("\"samples\":[[1700000001285,21.505,null,100325,"),
+              std::string::npos);
+    EXPECT_EQ(resp.body.find("1700000000000"), std::string::npos);
+
+    resp      = {};
+    req.query = "mac=CB:B8:33:4C:88:40";
+    h.serve(req, resp);
+    EXPECT_EQ(resp.status, 404);
+    resp      = {};
+    req.query = "mac=CB:B8:33:4C:88:4F&from=yesterday";
+    h.serve(req, resp);
+    EXPECT_EQ(resp.status, 400);
+    for (auto from: {"1e300", "-1e300", "inf", "nan"}) {
+        resp      = {};
+        req.query = std::string("mac=CB:B8:33:4C:88:4F&from=") + from;
+        h.serve(req, resp);
+        EXPECT_EQ(resp.status, 400) << from;
+    }
+    resp      = {};
+    req.query = "";
+    h.serve(req, resp);
+    EXPECT_EQ(resp.status, 400);
+}
+
+TEST(HistoryTest, ServesPages) {
+    ruuvi::history h;
+    drifting_tag tag;
+    std::vector<int64_t> added;
+    for (int i = 0; i < 25; ++i) {
+        auto const& r = tag.next();
+        h.add(r, tag.time_ms);
+        added.push_back(tag.time_ms);
+    }
+
+    ruuvi::http_request req;
+    ruuvi::http_response resp;
+    std::vector<int64_t> served;
+    std::string from = "0";
+    for (int page = 0; page < 3; ++page) {
+        resp      = {};
+        req.query = "mac=CB:B8:33:4C:88:4F&limit=10&from=" + from;
+        h.serve(req, resp);
+        ASSERT_EQ(resp.status, 200);
+        size_t count = 0;
+        for (auto at = resp.body.find("[17"); at != std::string::npos;
+             at      = resp.body.find("[17", at + 1)) {
+            served.push_back(std::stoll(resp.body.substr(at + 1, 13)));
+            ++count;
+        }
+        auto next = resp.body.find("\"next\":");
+        if (page < 2) {
+            EXPECT_EQ(count, 10u);
+            ASSERT_NE(next, std::string::npos);
+            from = resp.body.substr(next + 7, resp.body.find('}', next) - next - 7);
+        } else {
+            EXPECT_EQ(count, 5u);
+            EXPECT_EQ(next, std::string::npos);
+        }
+    }
+    EXPECT_EQ(served, added);
+
+    for (auto limit: {"0", "10001", "-1", "many"}) {
+        resp      = {};
+        req.query = std::string("mac=CB:B8:33:4C:88:4F&limit=") + limit;
+        h.serve(req, resp);
+        EXPECT_EQ(resp.status, 400) << limit;
+    }
+}
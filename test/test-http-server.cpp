@@ -0,0 +1,235 @@
+#include <chrono>
+#include <gtest/gtest.h>
+#include <ruuvi/gzip.hpp>
+#include <ruuvi/http_server.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+// Sends the request to the server on localhost and returns everything it answered
+std::string round_trip(uint16_t port, std::string const& request) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::runtime_error("socket failed");
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+    std::string response;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+        && write(fd, request.data(), request.size()) == ssize_t(request.size())) {
+        shutdown(fd, SHUT_WR);
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) response.append(buf, size_t(len));
+    }
+    close(fd);
+    return response;
+}
+
+std::string get(uint16_t port, std::string const& target, std::string const& method = "GET") {
+    return round_trip(port, method + " " + target
+                                + " HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n\r\n");
+}
+
+std::string body_of(std::string const& response) {
+    auto end = response.find("\r\n\r\n");
+    return end == std::string::npos ? "" : response.substr(end + 4);
+}
+
+class HttpServerTest: public ::testing::Test {
+protected:
+    ruuvi::http_server server{0};
+    std::thread runner;
+
+    void start() {
+        runner = std::thread([this] { server.start(); });
+    }
+    void TearDown() override {
+        server.stop();
+        if (runner.joinable()) runner.join();
+    }
+};
+
+}  // namespace
+
+TEST_F(HttpServerTest, ServesHandlers) {
+    ASSERT_NE(server.port(), 0);
+    server.handle("/metrics", [](ruuvi::http_request const& req, ruuvi::http_response& r) {
+        r.content_type = "text/plain; version=0.0.4";
+        r.headers.emplace_back("X-Query", req.query);
+        r.body = "encoding " + std::string(req.header("accept-encoding")) + "\n";
+    });
+    server.handle("/fail", [](ruuvi::http_request const&, ruuvi::http_response& r) {
+        r.body = "partial";
+        throw std::runtime_error("failed");
+    });
+    start();
+
+    auto r = get(server.port(), "/metrics?a=1");
+    EXPECT_EQ(r.rfind("HTTP/1.1 200 OK\r\n", 0), 0u) << r;
+    EXPECT_NE(r.find("Content-Type: text/plain; version=0.0.4\r\n"), std::string::npos);
+    EXPECT_NE(r.find("Content-Length: 14\r\n"), std::string::npos);
+    EXPECT_NE(r.find("X-Query: a=1\r\n"), std::string::npos);
+    EXPECT_EQ(body_of(r), "encoding gzip\n");
+
+    // A second request reuses the buffers of the first
+    EXPECT_EQ(body_of(get(server.port(), "/metrics")), "encoding gzip\n");
+
+    r = get(server.port(), "/metrics", "HEAD");
+    EXPECT_NE(r.find("Content-Length: 14\r\n"), std::string::npos);
+    EXPECT_EQ(body_of(r), "");
+
+    EXPECT_EQ(get(server.port(), "/other").rfind("HTTP/1.1 404 ", 0), 0u);
+    r = get(server.port(), "/other", "HEAD");
+    EXPECT_EQ(r.rfind("HTTP/1.1 404 ", 0), 0u);
+    EXPECT_NE(r.find("Content-Length: 10\r\n"), std::string::npos);
+    EXPECT_EQ(body_of(r), "");
+    EXPECT_EQ(get(server.port(), "/metrics", "POST").rfind("HTTP/1.1 405 ", 0), 0u);
+    r = get(server.port(), "/fail");
+    EXPECT_EQ(r.rfind("HTTP/1.1 500 ", 0), 0u);
+    EXPECT_EQ(r.find("partial"), std::string::npos);
+    EXPECT_EQ(round_trip(server.port(), "nonsense\r\n\r\n").rfind("HTTP/1.1 400 ", 0), 0u);
+    // Exactly the limit, more would be left unread and reset the connection
+    EXPECT_EQ(round_trip(server.port(), std::string(16 * 1024, 'a')).rfind("HTTP/1.1 431 ", 0), 0u);
+
+    // A client that hangs up early doesn't stop the server
+    EXPECT_EQ(round_trip(server.port(), "GET /met"), "");
+    EXPECT_EQ(body_of(get(server.port(), "/metrics")), "encoding gzip\n");
+}
+
+TEST_F(HttpServerTest, LimitsTheTimeToSendARequest) {
+    server.handle("/metrics", [](ruuvi::http_request const&, ruuvi::http_response& r) {
+        r.body = "ok\n";
+    });
+    start();
+
+    // Each byte comes well within the timeout, the whole request doesn't
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(server.port());
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    auto const start = std::chrono::steady_clock::now();
+    std::string const request = "GET /metrics HTTP/1.1\r\nX-Padding: aaaaaaaaaaaaaaaaaaaa\r\n\r\n";
+    size_t sent = 0;
+    for (; sent < request.size(); ++sent) {
+        if (send(fd, request.data() + sent, 1, MSG_NOSIGNAL) != 1) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+    close(fd);
+    EXPECT_LT(sent, request.size());
+    EXPECT_LT(elapsed, std::chrono::seconds(7));
+
+    EXPECT_EQ(body_of(get(server.port(), "/metrics")), "ok\n");
+}
+
+TEST_F(HttpServerTest, ServesAroundStuckClients) {
+    server.handle("/metrics", [](ruuvi::http_request const&, ruuvi::http_response& r) {
+        r.body = "ok\n";
+    });
+    server.handle("/big", [](ruuvi::http_request const&, ruuvi::http_response& r) {
+        r.body.assign(64 << 20, 'x');
+    });
+    start();
+    auto open_connection = [this] {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port        = htons(server.port());
+        EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+        return fd;
+    };
+
+    // One client sends nothing, another never reads its long response
+    int idle   = open_connection();
+    int reader = open_connection();
+    std::string const request = "GET /big HTTP/1.1\r\n\r\n";
+    ASSERT_EQ(write(reader, request.data(), request.size()), ssize_t(request.size()));
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    auto const start = std::chrono::steady_clock::now();
+    EXPECT_EQ(body_of(get(server.port(), "/metrics")), "ok\n");
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+
+    // Stopping cuts both short
+    server.stop();
+    runner.join();
+    close(idle);
+    close(reader);
+}
+
+TEST_F(HttpServerTest, StopsBeforeStart) {
+    server.stop();
+    start();
+    runner.join();
+}
+
+TEST(HttpRequestTest, DecodesParameters) {
+    ruuvi::http_request r;
+    r.query = "mac=CB%3ab8%3A33:4C:88:4F&from=-3600&flag&from=1&name=a+b%2";
+    EXPECT_EQ(r.parameter("mac"), "CB:b8:33:4C:88:4F");
+    EXPECT_EQ(r.parameter("from"), "-3600");
+    EXPECT_EQ(r.parameter("flag"), "");
+    EXPECT_EQ(r.parameter("name"), "a b%2");
+    EXPECT_EQ(r.parameter("to"), "");
+}
+
+TEST(HttpRequestTest, RanksAcceptedValues) {
+    // As sent by Prometheus 2
+    auto accept = "application/openmetrics-text;version=1.0.0,application/openmetrics-text;"
+                  "version=0.0.1;q=0.75,text/plain;version=0.0.4;q=0.5,*/*;q=0.1";
+    EXPECT_EQ(ruuvi::accept_quality(accept, "application/openmetrics-text"), 1);
+    EXPECT_EQ(ruuvi::accept_quality(accept, "text/plain"), 0.5);
+    EXPECT_EQ(ruuvi::accept_quality(accept, "application/json"), 0.1);
+    EXPECT_EQ(ruuvi::accept_quality("text/*;q=0.3, */*", "text/plain"), 0.3);
+    EXPECT_EQ(ruuvi::accept_quality("", "text/plain"), 0);
+
+    EXPECT_EQ(ruuvi::accept_quality("gzip, deflate, br", "gzip"), 1);
+    EXPECT_EQ(ruuvi::accept_quality("GZIP ; q=0.5", "gzip"), 0.5);
+    EXPECT_EQ(ruuvi::accept_quality("deflate, gzip;q=0", "gzip"), 0);
+    EXPECT_EQ(ruuvi::accept_quality("identity, *;q=0.2", "gzip"), 0.2);
+    EXPECT_EQ(ruuvi::accept_quality("x-gzip", "gzip"), 0);
+}
+
+TEST(GzipTest, RoundTrips) {
+    std::string text;
+    for (int i = 0; i < 1000; ++i)
+        text.append("ruuvi_temperature_celsius{mac=\"CB:B8:33:4C:88:4F\"} ")
+            .append(std::to_string(i))
+            .append("\n");
+
+    ruuvi::gzip_compressor gzip;
+    std::string compressed;
+    for (auto const& in: {text, std::string(), text.substr(0, 100), text}) {
+        gzip.compress(in, compressed);
+        ASSERT_GE(compressed.size(), 18u);  // Header and trailer
+        EXPECT_EQ(uint8_t(compressed[0]), 0x1f);
+        EXPECT_EQ(uint8_t(compressed[1]), 0x8b);
+
+        std::string out(in.size() + 1, '\0');
+        z_stream s{};
+        ASSERT_EQ(inflateInit2(&s, 15 + 16), Z_OK);
+        s.next_in   = reinterpret_cast<Bytef*>(compressed.data());
+        s.avail_in  = uInt(compressed.size());
+        s.next_out  = reinterpret_cast<Bytef*>(out.data());
+        s.avail_out = uInt(out.size());
+        EXPECT_EQ(inflate(&s, Z_FINISH), Z_STREAM_END);
+        out.resize(s.total_out);
+        inflateEnd(&s);
+        EXPECT_EQ(out, in);
+    }
+    gzip.compress(text, compressed);
+    EXPECT_LT(compressed.size(), text.size() / 10);
+}
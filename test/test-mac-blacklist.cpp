@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include <ble/mac_blacklist.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+ble::mac_address mac(uint8_t last) {
+    return {0xCB, 0xB8, 0x33, 0x4C, 0x88, last};
+}
+
+}  // namespace
+
+TEST(MacBlacklistTest, FindsAddedAddresses) {
+    ble::mac_blacklist b;
+    EXPECT_FALSE(b.contains(mac(1)));
+    EXPECT_TRUE(b.insert(mac(1)));
+    EXPECT_FALSE(b.insert(mac(1)));
+    EXPECT_TRUE(b.insert(mac(2)));
+    EXPECT_TRUE(b.contains(mac(1)));
+    EXPECT_TRUE(b.contains(mac(2)));
+    EXPECT_FALSE(b.contains(mac(3)));
+    EXPECT_EQ(b.size(), 2u);
+    EXPECT_EQ(b.formatted(), (std::vector<std::string>{"CB:B8:33:4C:88:01", "CB:B8:33:4C:88:02"}));
+}
+
+TEST(MacBlacklistTest, ForgetsTheOldestWhenFull) {
+    ble::mac_blacklist b(3);
+    for (uint8_t i = 0; i < 5; ++i) b.insert(mac(i));
+    EXPECT_EQ(b.size(), 3u);
+    EXPECT_FALSE(b.contains(mac(0)));
+    EXPECT_FALSE(b.contains(mac(1)));
+    for (uint8_t i = 2; i < 5; ++i) EXPECT_TRUE(b.contains(mac(i)));
+
+    // A device still sending is blacklisted again
+    EXPECT_TRUE(b.insert(mac(0)));
+    EXPECT_TRUE(b.contains(mac(0)));
+    EXPECT_FALSE(b.contains(mac(2)));
+
+    EXPECT_THROW(ble::mac_blacklist(0), std::invalid_argument);
+}
@@ -0,0 +1,74 @@
+#include <gtest/gtest.h>
+#include <prometheus/metric_family.h>
+#include <ruuvi/openmetrics.hpp>
+#include <limits>
+#include <string>
+#include <vector>
+
+using prometheus::MetricFamily;
+using prometheus::MetricType;
+
+TEST(OpenMetricsTest, SerializesFamilies) {
+    std::vector<MetricFamily> families(4);
+    families[0].name = "ruuvi_tag_evictions_total";
+    families[0].help = "Number of tags\nremoved";
+    families[0].type = MetricType::Counter;
+    auto& evicted    = families[0].metric.emplace_back();
+
+    evicted.label         = {{"reason", "say \"hi\"\\"}};
+    evicted.counter.value = 3;
+
+    families[1].name = "ruuvi_temperature_celsius";
+    families[1].help = "Temperature";
+    families[1].type = MetricType::Gauge;
+    auto& t          = families[1].metric.emplace_back();
+    t.label          = {{"mac", "CB:B8:33:4C:88:4F"}};
+    t.gauge.value    = 21.5;
+    t.timestamp_ms   = 1'700'000'000'042;
+    families[1].metric.emplace_back().gauge.value = std::numeric_limits<double>::quiet_NaN();
+
+    families[2].name = "ruuvi_push_seconds";
+    families[2].type = MetricType::Histogram;
+    auto& h          = families[2].metric.emplace_back().histogram;
+    h.sample_count   = 2;
+    h.sample_sum     = 0.75;
+    h.bucket.resize(2);
+    h.bucket[0].upper_bound      = 0.5;
+    h.bucket[0].cumulative_count = 1;
+    h.bucket[1].upper_bound      = std::numeric_limits<double>::infinity();
+    h.bucket[1].cumulative_count = 2;
+
+    // Counters without the suffix get it on their samples
+    families[3].name = "ruuvi_restarts";
+    families[3].type = MetricType::Counter;
+    families[3].metric.emplace_back().counter.value = 1;
+
+    std::string out = "kept\n";
+    ruuvi::serialize_openmetrics(families, out);
+    EXPECT_EQ(out, "kept\n"
+                   "# TYPE ruuvi_tag_evictions counter\n"
+                   "# HELP ruuvi_tag_evictions Number of tags\\nremoved\n"
+                   "ruuvi_tag_evictions_total{reason=\"say \\\"hi\\\"\\\\\"} 3\n"
+                   "# TYPE ruuvi_temperature_celsius gauge\n"
+                   "# HELP ruuvi_temperature_celsius Temperature\n"
+                   "ruuvi_temperature_celsius{mac=\"CB:B8:33:4C:88:4F\"} 21.5 1700000000.042\n"
+                   "ruuvi_temperature_celsius NaN\n"
+                   "# TYPE ruuvi_push_seconds histogram\n"
+                   "ruuvi_push_seconds_bucket{le=\"0.5\"} 1\n"
+                   "ruuvi_push_seconds_bucket{le=\"+Inf\"} 2\n"
+                   "ruuvi_push_seconds_sum 0.75\n"
+                   "ruuvi_push_seconds_count 2\n"
+                   "# TYPE ruuvi_restarts counter\n"
+                   "ruuvi_restarts_total 1\n");
+}
+
+TEST(OpenMetricsTest, FollowsTheAcceptHeader) {
+    EXPECT_TRUE(ruuvi::prefers_openmetrics(
+        "application/openmetrics-text;version=1.0.0,application/openmetrics-text;version=0.0.1;"
+        "q=0.75,text/plain;version=0.0.4;q=0.5,*/*;q=0.1"));
+    EXPECT_TRUE(ruuvi::prefers_openmetrics("application/openmetrics-text"));
+    EXPECT_FALSE(ruuvi::prefers_openmetrics("text/plain;version=0.0.4;q=1,*/*;q=0.1"));
+    EXPECT_FALSE(ruuvi::prefers_openmetrics("*/*"));
+    EXPECT_FALSE(ruuvi::prefers_openmetrics(""));
+    EXPECT_FALSE(ruuvi::prefers_openmetrics("application/openmetrics-text;q=0.2,text/plain"));
+}
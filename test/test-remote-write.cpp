@@ -0,0 +1,404 @@
+#include "ruuvi_vectors.hpp"
+#include "temp_dir.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <prometheus/metric_family.h>
+#include <random>
+#include <ruuvi/remote_write.hpp>
+#include <ruuvi/snappy.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+struct series {
+    std::map<std::string, std::string> labels;
+    double value    = 0;
+    int64_t time_ms = 0;
+};
+
+uint64_t read_varint(std::string_view& in) {
+    uint64_t v = 0;
+    for (unsigned shift = 0; !in.empty(); shift += 7) {
+        auto b = uint8_t(in.front());
+        in.remove_prefix(1);
+        v |= uint64_t(b & 0x7fu) << shift;
+        if ((b & 0x80u) == 0) return v;
+    }
+    throw std::runtime_error("Truncated varint");
+}
+
+std::string_view read_bytes(std::string_view& in) {
+    auto size = read_varint(in);
+    if (size > in.size()) throw std::runtime_error("Truncated field");
+    auto r = in.substr(0, size);
+    in.remove_prefix(size);
+    return r;
+}
+
+// Only the fields remote write uses, in the wire types it uses them with
+std::vector<series> decode_write_request(std::string_view in) {
+    std::vector<series> r;
+    while (!in.empty()) {
+        EXPECT_EQ(read_varint(in), 1u << 3u | 2u);
+        auto ts = read_bytes(in);
+        auto& s = r.emplace_back();
+        while (!ts.empty()) {
+            auto key   = read_varint(ts);
+            auto field = read_bytes(ts);
+            if (key == (1u << 3u | 2u)) {
+                std::string name, value;
+                while (!field.empty()) {
+                    auto k = read_varint(field);
+                    (k == (1u << 3u | 2u) ? name : value) = std::string(read_bytes(field));
+                }
+                s.labels[name] = value;
+            } else {
+                EXPECT_EQ(key, 2u << 3u | 2u);
+                EXPECT_EQ(read_varint(field), 1u << 3u | 1u);
+                std::memcpy(&s.value, field.data(), sizeof(s.value));
+                field.remove_prefix(8);
+                EXPECT_EQ(read_varint(field), 2u << 3u);
+                s.time_ms = int64_t(read_varint(field));
+            }
+        }
+    }
+    return r;
+}
+
+prometheus::MetricFamily gauge(std::string name, double value, int64_t timestamp_ms = 0) {
+    prometheus::MetricFamily f;
+    f.name  = std::move(name);
+    f.help  = "Test gauge";
+    f.type  = prometheus::MetricType::Gauge;
+    auto& m = f.metric.emplace_back();
+    m.label.push_back({"mac", "CB:B8:33:4C:00:01"});
+    m.label.push_back({"axis", "x"});
+    m.gauge.value  = value;
+    m.timestamp_ms = timestamp_ms;
+    return f;
+}
+
+class static_source: public prometheus::Collectable {
+public:
+    std::vector<prometheus::MetricFamily> Collect() const override {
+        return {gauge("ruuvi_temperature_celsius", 21.5)};
+    }
+};
+
+class failing_source: public prometheus::Collectable {
+public:
+    std::vector<prometheus::MetricFamily> Collect() const override {
+        throw std::runtime_error("Unreadable source");
+    }
+};
+
+// Answers each remote write request with the next status, 204 once they run out
+class stand_in_receiver {
+public:
+    explicit stand_in_receiver(std::deque<int> s): statuses(std::move(s)) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len        = sizeof(addr);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), len) < 0 || listen(fd, 4) < 0
+            || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+            throw std::runtime_error("Failed to listen");
+        port   = ntohs(addr.sin_port);
+        runner = std::thread([this] { serve(); });
+    }
+    ~stand_in_receiver() {
+        shutdown(fd, SHUT_RDWR);
+        runner.join();
+        close(fd);
+    }
+
+    std::string url() const {
+        return "http://127.0.0.1:" + std::to_string(port) + "/api/v1/write";
+    }
+
+    // Uncompressed bodies of the requests answered with success
+    std::vector<std::string> received() {
+        std::lock_guard g(mtx);
+        return bodies;
+    }
+    std::vector<std::string> heads() {
+        std::lock_guard g(mtx);
+        return requests;
+    }
+
+private:
+    int fd;
+    uint16_t port;
+    std::thread runner;
+    std::mutex mtx;
+    std::deque<int> statuses;
+    std::vector<std::string> bodies;
+    std::vector<std::string> requests;
+
+    void serve() {
+        int c;
+        while ((c = accept(fd, nullptr, nullptr)) >= 0) {
+            std::string data;
+            char buf[4096];
+            ssize_t len;
+            size_t end = std::string::npos, size = 0;
+            while ((len = read(c, buf, sizeof(buf))) > 0) {
+                data.append(buf, size_t(len));
+                if (end == std::string::npos) {
+                    end = data.find("\r\n\r\n");
+                    if (end == std::string::npos) continue;
+                    auto at = data.find("Content-Length: ");
+                    size    = at < end ? std::stoul(data.substr(at + 16)) : 0;
+                }
+                if (data.size() >= end + 4 + size) break;
+            }
+            if (end == std::string::npos) {
+                close(c);
+                continue;
+            }
+            std::lock_guard g(mtx);
+            int status = 204;
+            if (!statuses.empty()) {
+                status = statuses.front();
+                statuses.pop_front();
+            }
+            requests.push_back(data.substr(0, end));
+            std::string body;
+            if (status == 204
+                && ruuvi::snappy_uncompress(std::string_view(data).substr(end + 4), body))
+                bodies.push_back(body);
+            auto response = "HTTP/1.1 " + std::to_string(status) + " X\r\n\r\n";
+            if (write(c, response.data(), response.size()) < 0) ADD_FAILURE() << "write failed";
+            close(c);
+        }
+    }
+};
+
+double counter_of(std::vector<prometheus::MetricFamily> const& families, std::string const& name,
+                  std::string const& label = "") {
+    for (auto const& f: families) {
+        if (f.name != name) continue;
+        for (auto const& m: f.metric)
+            if (label.empty() || m.label.at(0).value == label)
+                return f.type == prometheus::MetricType::Gauge ? m.gauge.value : m.counter.value;
+    }
+    return std::nan("");
+}
+
+}  // namespace
+
+TEST(SnappyTest, RoundTrips) {
+    std::mt19937 rng(5);
+    std::string noise(100'000, '\0');
+    for (auto& c: noise) c = char(rng());
+    std::string text;
+    while (text.size() < 200'000)
+        text += "ruuvi_temperature_celsius{mac=\"CB:B8:33:4C:00:" + std::to_string(text.size() % 97)
+              + "\"} 21.5\n";
+
+    std::string compressed, out;
+    for (auto const& in: {std::string(), std::string("a"), std::string(70, 'b'), noise, text}) {
+        ruuvi::snappy_compress(in, compressed);
+        ASSERT_TRUE(ruuvi::snappy_uncompress(compressed, out));
+        EXPECT_EQ(out, in);
+    }
+    EXPECT_LT(compressed.size(), text.size() / 4);
+    EXPECT_FALSE(ruuvi::snappy_uncompress(compressed.substr(0, compressed.size() / 2), out));
+    EXPECT_FALSE(ruuvi::snappy_uncompress("\x05\x0d\x01", out));  // Copies before any data
+
+    // "Wikipedia" twice, as the reference implementation compresses it
+    ruuvi::snappy_compress("WikipediaWikipedia", compressed);
+    EXPECT_EQ(compressed, "\x12\x20Wikipedia\x15\x09");
+}
+
+TEST(RemoteWriteTest, EncodesFamilies) {
+    prometheus::MetricFamily h;
+    h.name = "ruuvi_remote_write_batch_samples";
+    h.type = prometheus::MetricType::Histogram;
+    auto& m = h.metric.emplace_back();
+    m.histogram.sample_count = 3;
+    m.histogram.sample_sum   = 12;
+    m.histogram.bucket       = {{2, 5}, {3, std::numeric_limits<double>::infinity()}};
+
+    std::string out;
+    ruuvi::encode_write_request({gauge("ruuvi_acceleration_gs", -0.5, 1234), h}, 99, out,
+                                {{"site", "cabin"}, {"mac", "ignored"}});
+    auto s = decode_write_request(out);
+    ASSERT_EQ(s.size(), 5u);
+    EXPECT_EQ(s[0].labels, (std::map<std::string, std::string>{
+                               {"__name__", "ruuvi_acceleration_gs"},
+                               {"axis", "x"},
+                               {"mac", "CB:B8:33:4C:00:01"},
+                               {"site", "cabin"}}));
+    EXPECT_EQ(s[0].value, -0.5);
+    EXPECT_EQ(s[0].time_ms, 1234);
+    EXPECT_EQ(s[1].labels["__name__"], "ruuvi_remote_write_batch_samples_bucket");
+    EXPECT_EQ(s[1].labels["le"], "5");
+    EXPECT_EQ(s[1].value, 2);
+    EXPECT_EQ(s[1].time_ms, 99);
+    EXPECT_EQ(s[2].labels["le"], "+Inf");
+    EXPECT_EQ(s[3].labels["__name__"], "ruuvi_remote_write_batch_samples_sum");
+    EXPECT_EQ(s[3].value, 12);
+    EXPECT_EQ(s[4].value, 3);
+
+    // Sorted by name, as remote write requires
+    std::string_view rest(out);
+    read_varint(rest);
+    auto ts = read_bytes(rest);
+    read_varint(ts);
+    auto first = read_bytes(ts);
+    read_varint(first);
+    EXPECT_EQ(read_bytes(first), "__name__");
+
+    ruuvi::remote_write_options https;
+    https.url = "https://example.com/write";
+    EXPECT_THROW(ruuvi::remote_writer(https, {}), std::invalid_argument);
+    ruuvi::remote_write_options busy;
+    busy.url      = "http://example.com/write";
+    busy.interval = std::chrono::milliseconds(0);
+    EXPECT_THROW(ruuvi::remote_writer(busy, {}), std::invalid_argument);
+}
+
+TEST(RemoteWriteTest, RetriesWithBackoff) {
+    using namespace std::chrono_literals;
+    stand_in_receiver receiver({503, 429});
+    ruuvi::remote_write_options opts;
+    opts.url         = receiver.url();
+    opts.interval    = 50ms;
+    opts.min_backoff = 10ms;
+    ruuvi::remote_writer writer(opts, {std::make_shared<static_source>()});
+    std::thread runner([&writer] { writer.start(); });
+
+    for (int i = 0; i < 500 && receiver.received().size() < 2; ++i)
+        std::this_thread::sleep_for(10ms);
+    writer.stop();
+    runner.join();
+
+    auto bodies = receiver.received();
+    ASSERT_GE(bodies.size(), 2u);
+    auto first = decode_write_request(bodies[0]);
+    ASSERT_FALSE(first.empty());
+    EXPECT_EQ(first[0].labels["__name__"], "ruuvi_temperature_celsius");
+    EXPECT_EQ(first[0].value, 21.5);
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    EXPECT_NEAR(double(first[0].time_ms),
+                double(std::chrono::duration_cast<std::chrono::milliseconds>(now).count()), 10'000);
+
+    auto head = receiver.heads().at(0);
+    EXPECT_EQ(head.rfind("POST /api/v1/write HTTP/1.1\r\n", 0), 0u);
+    auto authority = receiver.url().substr(7, receiver.url().find('/', 7) - 7);
+    EXPECT_NE(head.find("\r\nHost: " + authority + "\r\n"), std::string::npos);
+    EXPECT_NE(head.find("Content-Encoding: snappy\r\n"), std::string::npos);
+    EXPECT_NE(head.find("X-Prometheus-Remote-Write-Version: 0.1.0\r\n"), std::string::npos);
+
+    auto families = writer.Collect();
+    EXPECT_EQ(counter_of(families, "ruuvi_remote_write_requests_total", "failure"), 2);
+    EXPECT_GE(counter_of(families, "ruuvi_remote_write_requests_total", "success"), 2);
+    EXPECT_GT(counter_of(families, "ruuvi_remote_write_samples_total"), 0);
+    EXPECT_EQ(counter_of(families, "ruuvi_remote_write_dropped_samples_total", "overflow"), 0);
+}
+
+TEST(RemoteWriteTest, SkipsFailingSources) {
+    using namespace std::chrono_literals;
+    stand_in_receiver receiver({});
+    ruuvi::remote_write_options opts;
+    opts.url      = receiver.url();
+    opts.interval = 20ms;
+    ruuvi::remote_writer writer(
+        opts, {std::make_shared<failing_source>(), std::make_shared<static_source>()}
+    );
+    std::thread runner([&writer] { writer.start(); });
+
+    for (int i = 0; i < 500 && receiver.received().size() < 2; ++i)
+        std::this_thread::sleep_for(10ms);
+    writer.stop();
+    runner.join();
+
+    auto bodies = receiver.received();
+    ASSERT_GE(bodies.size(), 2u);
+    auto first = decode_write_request(bodies[0]);
+    ASSERT_FALSE(first.empty());
+    EXPECT_EQ(first[0].labels["__name__"], "ruuvi_temperature_celsius");
+}
+
+TEST(RemoteWriteTest, BoundsTheBuffer) {
+    using namespace std::chrono_literals;
+    uint16_t port;
+    {
+        // Nothing listens once it is gone
+        stand_in_receiver gone({});
+        port = uint16_t(std::stoi(gone.url().substr(gone.url().rfind(':') + 1)));
+    }
+    ruuvi::remote_write_options opts;
+    opts.url          = "http://127.0.0.1:" + std::to_string(port) + "/";
+    opts.interval     = 10ms;
+    opts.min_backoff  = 5ms;
+    opts.max_backoff  = 20ms;
+    opts.max_buffered = 10;
+    ruuvi::remote_writer writer(opts, {std::make_shared<static_source>()});
+    std::thread runner([&writer] { writer.start(); });
+    std::this_thread::sleep_for(100ms);
+    writer.stop();
+    runner.join();
+
+    auto families = writer.Collect();
+    EXPECT_GT(counter_of(families, "ruuvi_remote_write_dropped_samples_total", "overflow"), 0);
+    EXPECT_LE(counter_of(families, "ruuvi_remote_write_buffered_samples"), 10);
+    EXPECT_GT(counter_of(families, "ruuvi_remote_write_requests_total", "failure"), 1);
+    EXPECT_EQ(counter_of(families, "ruuvi_remote_write_requests_total", "success"), 0);
+}
+
+TEST(RemoteWriteTest, ReplaysTheSpool) {
+    using namespace std::chrono_literals;
+    tests::temp_dir dir;
+    ruuvi::spool_options spool_opts;
+    spool_opts.directory = dir.path;
+    auto spool           = std::make_shared<ruuvi::spool>(spool_opts);
+    ble::AdvPacket p;
+    ble::parse_mac(vectors::mac, p.mac);
+    auto data = vectors::to_raw_data(vectors::format_5);
+    p.set_manufacturer_data(data.data(), data.size());
+    for (int64_t t = 1000; t < 1005; ++t) spool->append(p, t);
+
+    {
+        stand_in_receiver receiver({503});
+        ruuvi::remote_write_options opts;
+        opts.url         = receiver.url();
+        opts.interval    = 50ms;
+        opts.min_backoff = 10ms;
+        ruuvi::remote_writer writer(opts, {std::make_shared<static_source>()}, spool);
+        std::thread runner([&writer] { writer.start(); });
+        for (int i = 0; i < 500 && spool->pending() > 0; ++i) std::this_thread::sleep_for(10ms);
+        writer.stop();
+        runner.join();
+        EXPECT_EQ(spool->pending(), 0u);
+
+        // In order with the time they were received, instead of the collected temperature
+        std::vector<series> temperatures;
+        for (auto const& body: receiver.received())
+            for (auto const& s: decode_write_request(body))
+                if (s.labels.at("__name__") == "ruuvi_temperature_celsius")
+                    temperatures.push_back(s);
+        EXPECT_EQ(temperatures.size(), 5u);
+        for (size_t i = 0; i < temperatures.size(); ++i) {
+            EXPECT_EQ(temperatures[i].time_ms, int64_t(1000 + i));
+            EXPECT_NEAR(temperatures[i].value, 24.3, 1e-3);
+            EXPECT_EQ(temperatures[i].labels["mac"], vectors::mac);
+        }
+    }
+    spool.reset();
+}
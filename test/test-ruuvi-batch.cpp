@@ -0,0 +1,108 @@
+#include <cstring>
+#include <gtest/gtest.h>
+#include <random>
+#include <ruuvi/ruuvi.hpp>
+
+namespace {
+
+constexpr size_t payload_size = 24;
+
+// Random payloads, with every field set to its invalid sentinel now and then
+std::vector<uint8_t> make_payloads(size_t count, size_t stride) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> pick(0, 7);
+
+    std::vector<uint8_t> r(count * stride);
+    for (size_t i = 0; i < count; ++i) {
+        auto p = r.data() + i * stride;
+        for (size_t j = 0; j < payload_size; ++j) p[j] = byte(rng);
+        p[0] = pick(rng) == 0 ? byte(rng) : 0x05;
+
+        auto set16 = [p](size_t at, uint16_t v) {
+            p[at]     = v >> 8u;
+            p[at + 1] = v & 0xFFu;
+        };
+        if (pick(rng) == 0) set16(1, 0x8000);
+        if (pick(rng) == 0) set16(3, pick(rng) < 4 ? 0xFFFF : 40'000 + pick(rng));
+        if (pick(rng) == 0) set16(5, 0xFFFF);
+        if (pick(rng) == 0) set16(7, 0x8000);
+        if (pick(rng) == 0) set16(9, 0x8000);
+        if (pick(rng) == 0) set16(11, 0x8000);
+        if (pick(rng) == 0) p[13] = 0xFF, p[14] |= 0xE0;
+        if (pick(rng) == 0) p[14] |= 0x1F;
+    }
+    return r;
+}
+
+template<class T> bool same_bits(T a, T b) {
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+void expect_matches_scalar(uint8_t const* payloads, size_t count, size_t stride,
+                           ruuvi::simd_level level) {
+    ruuvi::format_5_batch batch;
+    ruuvi::decode_format_5_batch(payloads, count, stride, batch, level);
+    ASSERT_EQ(batch.size(), count);
+
+    ruuvi::format_5_reading r;
+    for (size_t i = 0; i < count; ++i) {
+        ruuvi::decode_format_5(payloads + i * stride, payload_size, r);
+        SCOPED_TRACE("row " + std::to_string(i));
+        EXPECT_TRUE(same_bits(batch.temperature[i], r.temperature));
+        EXPECT_TRUE(same_bits(batch.humidity[i], r.humidity));
+        EXPECT_TRUE(same_bits(batch.pressure[i], r.pressure));
+        EXPECT_TRUE(same_bits(batch.acceleration_x[i], r.acceleration[0]));
+        EXPECT_TRUE(same_bits(batch.acceleration_y[i], r.acceleration[1]));
+        EXPECT_TRUE(same_bits(batch.acceleration_z[i], r.acceleration[2]));
+        EXPECT_TRUE(same_bits(batch.battery_voltage[i], r.battery_voltage));
+        EXPECT_EQ(batch.measurement_sequence[i], r.measurement_sequence);
+        EXPECT_EQ(batch.tx_power[i], r.tx_power);
+        EXPECT_EQ(batch.movement_counter[i], r.movement_counter);
+        EXPECT_EQ(batch.errors[i], r.errors);
+    }
+}
+
+const ruuvi::simd_level all_levels[] = {ruuvi::simd_level::scalar, ruuvi::simd_level::ssse3,
+                                        ruuvi::simd_level::avx2, ruuvi::simd_level::neon};
+
+}  // namespace
+
+TEST(RuuviBatchTest, MatchesScalarDecoder) {
+    // Not a multiple of the block size, so the scalar tail runs too
+    const size_t count = 1003;
+    auto payloads      = make_payloads(count, payload_size);
+
+    for (auto level: all_levels) {
+        if (!ruuvi::simd_supported(level)) continue;
+        SCOPED_TRACE("level " + std::to_string(int(level)));
+        expect_matches_scalar(payloads.data(), count, payload_size, level);
+    }
+}
+
+TEST(RuuviBatchTest, DecodesStridedPackets) {
+    const size_t count = 77;
+    auto payloads      = make_payloads(count, payload_size);
+
+    std::vector<ble::AdvPacket> packets(count);
+    for (size_t i = 0; i < count; ++i)
+        packets[i].set_manufacturer_data(payloads.data() + i * payload_size, payload_size);
+
+    for (auto level: all_levels) {
+        if (!ruuvi::simd_supported(level)) continue;
+        SCOPED_TRACE("level " + std::to_string(int(level)));
+        expect_matches_scalar(packets[0].manufacturer_data(), count, sizeof(ble::AdvPacket),
+                              level);
+    }
+}
+
+TEST(RuuviBatchTest, UnsupportedLevelFallsBack) {
+    auto payloads = make_payloads(16, payload_size);
+    ruuvi::format_5_batch batch;
+    for (auto level: all_levels) {
+        ruuvi::decode_format_5_batch(payloads.data(), 16, payload_size, batch, level);
+        EXPECT_EQ(batch.size(), 16u);
+    }
+    ruuvi::decode_format_5_batch(payloads.data(), 0, payload_size, batch);
+    EXPECT_EQ(batch.size(), 0u);
+}
@@ -0,0 +1,482 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <gtest/gtest.h>
+#include <map>
+#include <prometheus/metric_family.h>
+#include <ruuvi/ruuvi_prometheus_exposer.hpp>
+#include <ruuvi/seqlock.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "ruuvi_vectors.hpp"
+
+namespace {
+
+ble::mac_address tag_mac(size_t i) {
+    return {0xCB, 0xB8, 0x33, 0x4C, uint8_t(i >> 8u), uint8_t(i)};
+}
+
+// Every value is derived from k, so a torn snapshot has mismatching values
+ruuvi::format_5_reading make_reading(ble::mac_address const& mac, uint16_t k) {
+    ruuvi::format_5_reading r;
+    r.mac                  = mac;
+    r.temperature          = k;
+    r.humidity             = k;
+    r.pressure             = k;
+    r.acceleration         = {float(k), float(k), float(k)};
+    r.battery_voltage      = k;
+    r.measurement_sequence = k;
+    r.signal_strength      = int16_t(k);
+    return r;
+}
+
+prometheus::MetricFamily const* find_family(std::vector<prometheus::MetricFamily> const& families,
+                                            std::string const& name) {
+    for (auto const& f: families)
+        if (f.name == name) return &f;
+    return nullptr;
+}
+
+// Value of the metric of the tag, or NaN if there is none
+double value_of(std::vector<prometheus::MetricFamily> const& families, std::string const& name,
+                std::string const& mac, std::string const& axis = "") {
+    auto f = find_family(families, name);
+    if (f == nullptr) return std::nan("");
+    for (auto const& m: f->metric) {
+        bool match = true;
+        for (auto const& l: m.label) {
+            if (l.name == "mac") match = match && l.value == mac;
+            if (l.name == "axis") match = match && l.value == axis;
+        }
+        if (match)
+            return f->type == prometheus::MetricType::Counter ? m.counter.value : m.gauge.value;
+    }
+    return std::nan("");
+}
+
+// Samples of the text format by name and labels, checks that every family has a single header
+std::map<std::string, double> parse_samples(std::string const& text) {
+    std::map<std::string, double> samples;
+    std::map<std::string, int> headers;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.rfind("# TYPE ", 0) == 0) ++headers[line];
+        if (line.empty() || line[0] == '#') continue;
+        auto sp = line.rfind(' ');
+        samples[line.substr(0, sp)] = std::stod(line.substr(sp + 1));
+    }
+    for (auto const& [h, n]: headers) EXPECT_EQ(n, 1) << h;
+    return samples;
+}
+
+std::map<std::string, double> collect_samples(ruuvi::RuuviExposer const& exposer) {
+    std::map<std::string, double> samples;
+    for (auto const& f: exposer.Collect()) {
+        for (auto const& m: f.metric) {
+            std::string key = f.name;
+            for (auto const& l: m.label) {
+                key += key.back() == '"' ? "," : "{";
+                key += l.name + "=\"" + l.value + "\"";
+            }
+            if (!m.label.empty()) key += "}";
+            samples[key] =
+                f.type == prometheus::MetricType::Counter ? m.counter.value : m.gauge.value;
+        }
+    }
+    return samples;
+}
+
+void expect_render_matches_collect(ruuvi::RuuviExposer const& exposer) {
+    std::string text;
+    exposer.render(text);
+    auto rendered  = parse_samples(text);
+    auto collected = collect_samples(exposer);
+    ASSERT_EQ(rendered.size(), collected.size());
+    for (auto const& [key, value]: collected) {
+        SCOPED_TRACE(key);
+        ASSERT_EQ(rendered.count(key), 1u);
+        if (std::isnan(value))
+            EXPECT_TRUE(std::isnan(rendered[key]));
+        else
+            EXPECT_DOUBLE_EQ(rendered[key], value);
+    }
+}
+
+}  // namespace
+
+TEST(SeqlockTest, StoresWholeValues) {
+    struct big {
+        uint64_t words[9];
+    };
+    ruuvi::seqlock<big> lock;
+    EXPECT_EQ(lock.load().words[8], 0u);
+
+    std::atomic_bool done = false;
+    std::thread writer([&] {
+        big v;
+        for (uint64_t k = 1; k <= 200'000; ++k) {
+            for (auto& w: v.words) w = k;
+            lock.store(v);
+        }
+        done = true;
+    });
+
+    uint64_t last = 0;
+    while (!done) {
+        auto v = lock.load();
+        for (auto w: v.words) ASSERT_EQ(w, v.words[0]);
+        ASSERT_GE(v.words[0], last);
+        last = v.words[0];
+    }
+    writer.join();
+    EXPECT_EQ(lock.load().words[0], 200'000u);
+}
+
+TEST(RuuviExposerTest, ExportsReadings) {
+    ruuvi::RuuviExposer exposer;
+    ble::mac_address mac;
+    ble::parse_mac(vectors::mac, mac);
+
+    ruuvi::format_5_reading r;
+    auto payload = vectors::to_raw_data(vectors::format_5);
+    ruuvi::decode_format_5(payload.data(), payload.size(), r);
+    r.mac             = mac;
+    r.signal_strength = -70;
+    exposer.update(r);
+    exposer.update(r);
+
+    auto families = exposer.Collect();
+    EXPECT_FLOAT_EQ(value_of(families, "ruuvi_temperature_celsius", vectors::mac), 24.3);
+    EXPECT_FLOAT_EQ(value_of(families, "ruuvi_acceleration_gs", vectors::mac, "z"), 1.036);
+    EXPECT_EQ(value_of(families, "ruuvi_rssi_dbm", vectors::mac), -70);
+    EXPECT_EQ(value_of(families, "ruuvi_received_measurements_total", vectors::mac), 2);
+    EXPECT_EQ(value_of(families, "ruuvi_errors_total", vectors::mac), 0);
+    EXPECT_EQ(find_family(families, "ruuvi_acceleration_gs")->metric.size(), 3u);
+
+    // Repeated adverts only move the signal strength, unknown tags are ignored
+    exposer.update_signal(mac, -50);
+    exposer.update_signal(tag_mac(7), -50);
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_rssi_dbm", vectors::mac), -50);
+    EXPECT_FLOAT_EQ(value_of(families, "ruuvi_temperature_celsius", vectors::mac), 24.3);
+    EXPECT_EQ(find_family(families, "ruuvi_rssi_dbm")->metric.size(), 1u);
+
+    // Readings whose MAC doesn't match the sender are exported without one
+    r.errors |= ruuvi::mac_mismatch;
+    exposer.update(r);
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_errors_total", ""), 1);
+    EXPECT_EQ(find_family(families, "ruuvi_rssi_dbm")->metric.size(), 2u);
+}
+
+TEST(RuuviExposerTest, CollectSeesConsistentReadings) {
+    constexpr size_t tags    = 100;
+    constexpr uint16_t count = 2000;
+    ruuvi::RuuviExposer exposer;
+
+    std::atomic_bool done = false;
+    std::thread writer([&] {
+        for (uint16_t k = 1; k <= count; ++k)
+            for (size_t i = 0; i < tags; ++i) exposer.update(make_reading(tag_mac(i), k));
+        done = true;
+    });
+
+    size_t scrapes = 0;
+    while (!done || scrapes == 0) {
+        auto families    = exposer.Collect();
+        auto temperature = find_family(families, "ruuvi_temperature_celsius");
+        ASSERT_NE(temperature, nullptr);
+        for (auto const& m: temperature->metric) {
+            auto mac = m.label.back().value;
+            auto k   = m.gauge.value;
+            ASSERT_EQ(value_of(families, "ruuvi_relative_humidity_ratio", mac), k);
+            ASSERT_EQ(value_of(families, "ruuvi_acceleration_gs", mac, "y"), k);
+            ASSERT_EQ(value_of(families, "ruuvi_measurement_count", mac), k);
+            ASSERT_EQ(value_of(families, "ruuvi_rssi_dbm", mac), k);
+        }
+        ++scrapes;
+    }
+    writer.join();
+
+    auto families = exposer.Collect();
+    EXPECT_EQ(find_family(families, "ruuvi_temperature_celsius")->metric.size(), tags);
+    EXPECT_EQ(value_of(families, "ruuvi_measurement_count", ble::format_mac(tag_mac(42))), count);
+    EXPECT_EQ(value_of(families, "ruuvi_received_measurements_total",
+                       ble::format_mac(tag_mac(42))),
+              count);
+}
+
+TEST(RuuviExposerTest, DecodeOnCollectMatchesDecodeOnUpdate) {
+    ruuvi::RuuviExposer eager(ruuvi::decode_mode::on_update);
+    ruuvi::RuuviExposer lazy(ruuvi::decode_mode::on_collect);
+    auto update = [&](ble::AdvPacket const& p) {
+        eager.update(p);
+        lazy.update(p);
+    };
+    auto same = [](double a, double b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+
+    ble::AdvPacket p;
+    ble::parse_mac(vectors::mac, p.mac);
+    p.manufacturer_id = vectors::ruuvi_id;
+    p.signal_strength = -60;
+    auto valid        = vectors::to_raw_data(vectors::format_5);
+    auto invalid      = vectors::to_raw_data(vectors::format_5_invalid);
+
+    EXPECT_EQ(find_family(lazy.Collect(), "ruuvi_temperature_celsius")->metric.size(), 0u);
+    p.set_manufacturer_data(invalid.data(), invalid.size());
+    update(p);  // Also a MAC mismatch
+    p.set_manufacturer_data(valid.data(), valid.size());
+    update(p);
+    p.signal_strength = -65;
+    update(p);
+    eager.update_signal(p.mac, -70);
+    lazy.update_signal(p.mac, -70);
+
+    auto e = eager.Collect();
+    auto l = lazy.Collect();
+    ASSERT_EQ(e.size(), l.size());
+    for (size_t i = 0; i < e.size(); ++i) {
+        SCOPED_TRACE(e[i].name);
+        ASSERT_EQ(e[i].metric.size(), l[i].metric.size());
+        for (size_t j = 0; j < e[i].metric.size(); ++j) {
+            auto const& labels = e[i].metric[j].label;
+            ASSERT_EQ(labels.size(), l[i].metric[j].label.size());
+            for (size_t k = 0; k < labels.size(); ++k)
+                EXPECT_EQ(labels[k].value, l[i].metric[j].label[k].value);
+            // Updated at slightly different times
+            if (e[i].name == "ruuvi_last_seen_timestamp_seconds") continue;
+            if (e[i].name == "ruuvi_errors_total") continue;
+            EXPECT_TRUE(same(e[i].metric[j].gauge.value, l[i].metric[j].gauge.value));
+            EXPECT_EQ(e[i].metric[j].counter.value, l[i].metric[j].counter.value);
+        }
+    }
+    EXPECT_EQ(value_of(l, "ruuvi_rssi_dbm", vectors::mac), -70);
+    EXPECT_EQ(value_of(l, "ruuvi_received_measurements_total", vectors::mac), 2);
+
+    // Only decoded adverts are checked for errors, and each of them once
+    p.set_manufacturer_data(invalid.data(), invalid.size());
+    std::copy(p.mac.begin(), p.mac.end(), p.data.begin() + 18);
+    update(p);
+    update(p);
+    lazy.Collect();
+    l = lazy.Collect();
+    EXPECT_EQ(value_of(eager.Collect(), "ruuvi_errors_total", vectors::mac), 2);
+    EXPECT_EQ(value_of(l, "ruuvi_errors_total", vectors::mac), 1);
+    EXPECT_EQ(value_of(l, "ruuvi_received_measurements_total", vectors::mac), 4);
+    EXPECT_TRUE(std::isnan(value_of(l, "ruuvi_temperature_celsius", vectors::mac)));
+}
+
+TEST(RuuviExposerTest, RenderMatchesCollect) {
+    for (auto mode: {ruuvi::decode_mode::on_update, ruuvi::decode_mode::on_collect}) {
+        ruuvi::RuuviExposer exposer(mode);
+        std::string text;
+        exposer.render(text);
+        EXPECT_EQ(text.find("mac="), std::string::npos);
+
+        ble::AdvPacket p;
+        p.manufacturer_id = vectors::ruuvi_id;
+        p.signal_strength = -60;
+        auto valid        = vectors::to_raw_data(vectors::format_5);
+        auto invalid      = vectors::to_raw_data(vectors::format_5_invalid);
+        for (size_t i = 0; i < 5; ++i) {
+            p.mac = tag_mac(i);
+            std::copy(p.mac.begin(), p.mac.end(), valid.begin() + 18);
+            p.set_manufacturer_data(valid.data(), valid.size());
+            exposer.update(p);
+        }
+        expect_render_matches_collect(exposer);
+
+        // Only the changed tags are rendered again, the others keep their text
+        p.mac = tag_mac(3);
+        p.set_manufacturer_data(invalid.data(), invalid.size());
+        exposer.update(p);
+        exposer.update_signal(tag_mac(1), -42);
+        expect_render_matches_collect(exposer);
+        text.clear();
+        exposer.render(text);
+        auto samples = parse_samples(text);
+        EXPECT_EQ(samples["ruuvi_rssi_dbm{mac=\"" + ble::format_mac(tag_mac(1)) + "\"}"], -42);
+        EXPECT_EQ(samples["ruuvi_errors_total{mac=\"\"}"], 1);
+        EXPECT_EQ(samples["ruuvi_received_measurements_total{mac=\"\"}"], 1);
+        EXPECT_TRUE(std::isnan(samples["ruuvi_temperature_celsius{mac=\"\"}"]));
+        EXPECT_NE(text.find("# TYPE ruuvi_acceleration_gs gauge\n"), std::string::npos);
+        EXPECT_NE(text.find("ruuvi_acceleration_gs{axis=\"z\",mac=\""), std::string::npos);
+    }
+}
+
+TEST(RuuviExposerTest, ExpiresTags) {
+    using namespace std::chrono_literals;
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode::on_update, {10s, 3});
+    auto mac_of    = [](size_t i) { return ble::format_mac(tag_mac(i)); };
+    auto evictions = [](std::vector<prometheus::MetricFamily> const& families,
+                        std::string const& reason) {
+        for (auto const& m: find_family(families, "ruuvi_tag_evictions_total")->metric)
+            if (m.label.at(0).value == reason) return m.counter.value;
+        return std::nan("");
+    };
+
+    for (size_t i = 0; i < 3; ++i) exposer.update(make_reading(tag_mac(i), 1));
+    // Tag 0 is seen again, which leaves tag 1 as the least recently seen
+    exposer.update_signal(tag_mac(0), -40);
+    exposer.update(make_reading(tag_mac(3), 1));
+    auto families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_tags", ""), 3);
+    EXPECT_EQ(evictions(families, "capacity"), 1);
+    EXPECT_EQ(find_family(families, "ruuvi_rssi_dbm")->metric.size(), 3u);
+    EXPECT_TRUE(std::isnan(value_of(families, "ruuvi_rssi_dbm", mac_of(1))));
+    EXPECT_EQ(value_of(families, "ruuvi_rssi_dbm", mac_of(0)), -40);
+
+    // A returning tag starts over in a reused slot
+    exposer.update(make_reading(tag_mac(1), 7));
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_received_measurements_total", mac_of(1)), 1);
+    EXPECT_EQ(value_of(families, "ruuvi_measurement_count", mac_of(1)), 7);
+    EXPECT_TRUE(std::isnan(value_of(families, "ruuvi_rssi_dbm", mac_of(2))));
+    expect_render_matches_collect(exposer);
+
+    // Updates read a clock that may lag by a scheduler tick
+    auto t = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(30ms);
+    exposer.update(make_reading(tag_mac(1), 8));
+    exposer.expire(t);
+    EXPECT_EQ(value_of(exposer.Collect(), "ruuvi_tags", ""), 3);
+    exposer.expire(t + 10s + 1ms);
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_tags", ""), 1);
+    EXPECT_EQ(evictions(families, "expired"), 2);
+    EXPECT_EQ(evictions(families, "capacity"), 2);
+    EXPECT_EQ(find_family(families, "ruuvi_rssi_dbm")->metric.size(), 1u);
+    EXPECT_EQ(value_of(families, "ruuvi_measurement_count", mac_of(1)), 8);
+    expect_render_matches_collect(exposer);
+}
+
+TEST(RuuviExposerTest, ScrapesSeeConsistentTagsWhileEvicting) {
+    constexpr size_t tags = 40;
+    // Few slots for many tags, so they are reused while scrapes read them
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode::on_update, {{}, 8});
+
+    std::atomic_bool done = false;
+    std::thread writer([&] {
+        for (size_t k = 0; k < 20'000; ++k)
+            exposer.update(make_reading(tag_mac(k % tags), uint16_t(k % tags)));
+        done = true;
+    });
+
+    // Every value of a tag is its number, values of another tag in the slot show up as mismatches
+    auto check = [](std::map<std::string, double> const& samples) {
+        for (size_t i = 0; i < tags; ++i) {
+            auto mac  = "{mac=\"" + ble::format_mac(tag_mac(i)) + "\"}";
+            auto temp = samples.find("ruuvi_temperature_celsius" + mac);
+            if (temp == samples.end()) continue;
+            ASSERT_EQ(temp->second, double(i));
+            ASSERT_EQ(samples.at("ruuvi_measurement_count" + mac), double(i));
+            ASSERT_EQ(samples.at("ruuvi_received_measurements_total" + mac), 1);
+        }
+        // Slots read early in a scrape may have been given to other tags before it ends, so
+        // only the gauge is bounded
+        ASSERT_LE(samples.at("ruuvi_tags"), 8);
+    };
+    std::string text;
+    while (!done) {
+        check(collect_samples(exposer));
+        text.clear();
+        exposer.render(text);
+        check(parse_samples(text));
+    }
+    writer.join();
+    expect_render_matches_collect(exposer);
+}
+
+TEST(RuuviExposerTest, ExportsReceiveTimes) {
+    using namespace std::chrono;
+    auto wall_ms = [] {
+        return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    };
+    auto const mac = ble::format_mac(tag_mac(1));
+    ruuvi::RuuviExposer plain;
+    ruuvi::RuuviExposer timed(ruuvi::decode_mode::on_update, {}, ruuvi::sample_time::receive);
+
+    auto before = wall_ms();
+    plain.update(make_reading(tag_mac(1), 1));
+    timed.update(make_reading(tag_mac(1), 1));
+    std::this_thread::sleep_for(30ms);
+    timed.update_signal(tag_mac(1), -50);
+    auto after = wall_ms();
+
+    // The last advert is exported either way, the samples are only stamped when asked to. The
+    // clock read by updates may lag by a scheduler tick.
+    auto families = plain.Collect();
+    auto seen     = value_of(families, "ruuvi_last_seen_timestamp_seconds", mac) * 1000;
+    EXPECT_GE(seen, before - 10);
+    EXPECT_LE(seen, after + 1);
+    EXPECT_EQ(find_family(families, "ruuvi_temperature_celsius")->metric.at(0).timestamp_ms, 0);
+
+    families     = timed.Collect();
+    auto measured = find_family(families, "ruuvi_temperature_celsius")->metric.at(0).timestamp_ms;
+    auto signal   = find_family(families, "ruuvi_rssi_dbm")->metric.at(0).timestamp_ms;
+    EXPECT_GE(measured, before - 10);
+    EXPECT_LE(signal, after + 1);
+    EXPECT_GE(signal - measured, 15);
+    seen = value_of(families, "ruuvi_last_seen_timestamp_seconds", mac) * 1000;
+    EXPECT_NEAR(seen, double(signal), 1);
+    EXPECT_EQ(find_family(families, "ruuvi_last_seen_timestamp_seconds")->metric.at(0).timestamp_ms,
+              0);
+    EXPECT_EQ(find_family(families, "ruuvi_errors_total")->metric.at(0).timestamp_ms, 0);
+
+    std::string text;
+    timed.render(text);
+    auto sample = "ruuvi_temperature_celsius{mac=\"" + mac + "\"} 1 ";
+    auto at     = text.find(sample);
+    ASSERT_NE(at, std::string::npos);
+    EXPECT_NEAR(double(std::stoll(text.substr(at + sample.size()))), double(measured), 1);
+    EXPECT_NE(text.find("ruuvi_errors_total{mac=\"" + mac + "\"} 0\n"), std::string::npos);
+}
+
+TEST(RuuviExposerTest, AggregatesWindows) {
+    using namespace std::chrono_literals;
+    using std::chrono::steady_clock;
+    EXPECT_THROW(ruuvi::RuuviExposer(ruuvi::decode_mode::on_collect, {}, ruuvi::sample_time::scrape,
+                                     {10s}),
+                 std::invalid_argument);
+
+    ruuvi::RuuviExposer exposer(ruuvi::decode_mode::on_update, {}, ruuvi::sample_time::scrape,
+                                {1h, true});
+    auto const mac1 = ble::format_mac(tag_mac(1));
+    auto const mac2 = ble::format_mac(tag_mac(2));
+    for (uint16_t k: {1, 5, 3}) exposer.update(make_reading(tag_mac(1), k));
+    auto r     = make_reading(tag_mac(2), 2);
+    r.humidity = std::nanf("");  // Not measured
+    exposer.update(r);
+
+    // Nothing is exported until a window closes
+    auto families = exposer.Collect();
+    EXPECT_TRUE(find_family(families, "ruuvi_temperature_celsius_window_max")->metric.empty());
+    expect_render_matches_collect(exposer);
+
+    exposer.expire(steady_clock::now() + 1h);
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_min", mac1), 1);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_max", mac1), 5);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_sum", mac1), 9);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_count", mac1), 3);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_last", mac1), 3);
+    EXPECT_EQ(value_of(families, "ruuvi_acceleration_gs_window_max", mac1, "z"), 5);
+    EXPECT_EQ(value_of(families, "ruuvi_pressure_pascals_window_count", mac2), 1);
+    EXPECT_EQ(value_of(families, "ruuvi_relative_humidity_ratio_window_count", mac2), 0);
+    EXPECT_TRUE(std::isnan(value_of(families, "ruuvi_relative_humidity_ratio_window_min", mac2)));
+    EXPECT_EQ(find_family(families, "ruuvi_rssi_dbm_window_min"), nullptr);
+    expect_render_matches_collect(exposer);
+
+    // Tags not heard from in a window export it as empty
+    exposer.update(make_reading(tag_mac(1), 9));
+    exposer.expire(steady_clock::now() + 2h);
+    families = exposer.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_min", mac1), 9);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_count", mac1), 1);
+    EXPECT_EQ(value_of(families, "ruuvi_temperature_celsius_window_count", mac2), 0);
+    EXPECT_TRUE(std::isnan(value_of(families, "ruuvi_temperature_celsius_window_max", mac2)));
+    expect_render_matches_collect(exposer);
+}
@@ -1,53 +1,46 @@
 
 #include <cmath>
+#include <cstring>
 #include <gtest/gtest.h>
+#include <ruuvi/formats.hpp>
 #include <ruuvi/ruuvi.hpp>
 
-std::vector<uint8_t> to_raw_data(std::string const& s) {
-    assert(s.size() % 2 == 0);
-    std::vector<uint8_t> r;
-    for (size_t i = 0; i < s.size(); i += 2) {
-        auto ch = s.substr(i, 2);
-        r.push_back(std::stoi(ch, nullptr, 16));
-    }
-    return r;
-}
+#include "ruuvi_vectors.hpp"
+
+using vectors::to_raw_data;
 
 ble::BlePacket default_packet() {
     ble::BlePacket r;
-    r.mac             = "CB:B8:33:4C:88:4F";
-    r.manufacturer_id = 0x0499;
+    r.mac             = vectors::mac;
+    r.manufacturer_id = vectors::ruuvi_id;
     r.device_name     = "";
     r.signal_strength = 40;
     return r;
 }
 
 ble::BlePacket default_packet5() {
-    auto r = default_packet();
-    r.manufacturer_data =
-        to_raw_data("0512FC5394C37C0004FFFC040CAC364200CDCBB8334C884F");
+    auto r              = default_packet();
+    r.manufacturer_data = to_raw_data(vectors::format_5);
     return r;
 }
 ble::BlePacket max_packet5() {
-    auto r = default_packet();
-    r.manufacturer_data =
-        to_raw_data("057FFF9C40FFFE7FFF7FFF7FFFFFDEFEFFFECBB8334C884F");
+    auto r              = default_packet();
+    r.manufacturer_data = to_raw_data(vectors::format_5_max);
     return r;
 }
 ble::BlePacket invalid_packet5() {
-    auto r = default_packet();
-    r.manufacturer_data =
-        to_raw_data("058000FFFFFFFF800080008000FFFFFFFFFFFFFFFFFFFFFF");
+    auto r              = default_packet();
+    r.manufacturer_data = to_raw_data(vectors::format_5_invalid);
     return r;
 }
 ble::BlePacket default_packet3() {
     auto r              = default_packet();
-    r.manufacturer_data = to_raw_data("03291A1ECE1EFC18F94202CA0B53");
+    r.manufacturer_data = to_raw_data(vectors::format_3);
     return r;
 }
 ble::BlePacket broken_data() {
     auto r              = default_packet();
-    r.manufacturer_data = to_raw_data("09291A1ECE1EFC18F94202CA0B53");
+    r.manufacturer_data = to_raw_data(vectors::unknown_format);
     return r;
 }
 
@@ -150,3 +143,168 @@ TEST(RuuviDecodeTest, DecodeTotalAcceleration) {
                std::hypot(data.acceleration[0], data.acceleration[1],
                           data.acceleration[2]));
 }
+
+TEST(RuuviDecodeTest, DecodeReadingMatchesConvert) {
+    for (auto const& p : {default_packet5(), max_packet5(), invalid_packet5()}) {
+        auto data = ruuvi::convert_data_format_5(p);
+        ruuvi::format_5_reading reading;
+        EXPECT_EQ(ruuvi::decode_format_5(ble::to_adv_packet(p), reading), !data.contains_errors);
+
+        auto same = [](float a, float b) { return a == b || (std::isnan(a) && std::isnan(b)); };
+        EXPECT_TRUE(same(reading.temperature, data.temperature));
+        EXPECT_TRUE(same(reading.humidity, data.humidity));
+        EXPECT_TRUE(same(reading.acceleration[0], data.acceleration[0]));
+        EXPECT_TRUE(same(reading.acceleration[1], data.acceleration[1]));
+        EXPECT_TRUE(same(reading.acceleration[2], data.acceleration[2]));
+        EXPECT_TRUE(same(reading.battery_voltage, data.battery_voltage));
+        EXPECT_EQ(reading.pressure, data.pressure);
+        EXPECT_EQ(reading.measurement_sequence, data.measurement_sequence);
+        EXPECT_EQ(reading.tx_power, data.tx_power);
+        EXPECT_EQ(reading.movement_counter, data.movement_counter);
+        EXPECT_EQ(reading.signal_strength, data.signal_strength);
+        EXPECT_EQ(ruuvi::describe_errors(reading), data.error_msg);
+    }
+}
+
+TEST(RuuviDecodeTest, DecodeReadingErrorBits) {
+    ruuvi::format_5_reading reading;
+    EXPECT_FALSE(ruuvi::decode_format_5(ble::to_adv_packet(invalid_packet5()), reading));
+    EXPECT_EQ(reading.errors,
+              ruuvi::invalid_temperature | ruuvi::invalid_humidity | ruuvi::invalid_pressure
+                  | ruuvi::invalid_acceleration_x | ruuvi::invalid_acceleration_y
+                  | ruuvi::invalid_acceleration_z | ruuvi::invalid_battery_voltage
+                  | ruuvi::invalid_tx_power | ruuvi::mac_mismatch);
+    EXPECT_FALSE(ruuvi::describe_errors(reading).empty());
+
+    auto p = ble::to_adv_packet(default_packet5());
+    p.data_size = 10;
+    EXPECT_FALSE(ruuvi::decode_format_5(p, reading));
+    EXPECT_EQ(reading.errors, ruuvi::invalid_size);
+
+    EXPECT_TRUE(ruuvi::decode_format_5(ble::to_adv_packet(default_packet5()), reading));
+    EXPECT_TRUE(ruuvi::describe_errors(reading).empty());
+}
+
+ble::BlePacket default_packet6() {
+    auto r              = default_packet();
+    r.manufacturer_data = to_raw_data(vectors::format_6);
+    return r;
+}
+ble::BlePacket default_packet_e1() {
+    auto r              = default_packet();
+    r.manufacturer_data = to_raw_data(vectors::format_e1);
+    return r;
+}
+
+TEST(RuuviFormatsTest, Format5ReadingMatchesTable) {
+    using ruuvi::field;
+    auto same = [](float a, float b) { return std::memcmp(&a, &b, sizeof(float)) == 0; };
+
+    for (auto const& p : {default_packet5(), max_packet5(), invalid_packet5()}) {
+        auto adv = ble::to_adv_packet(p);
+        ruuvi::format_5_reading r;
+        ruuvi::decode_format_5(adv, r);
+        ruuvi::measurement m;
+        ASSERT_EQ(ruuvi::decode(adv, m), 5);
+
+        EXPECT_TRUE(same(m[field::temperature], r.temperature));
+        EXPECT_TRUE(same(m[field::humidity], r.humidity));
+        EXPECT_TRUE(same(m[field::acceleration_x], r.acceleration[0]));
+        EXPECT_TRUE(same(m[field::acceleration_y], r.acceleration[1]));
+        EXPECT_TRUE(same(m[field::acceleration_z], r.acceleration[2]));
+        EXPECT_TRUE(same(m[field::battery_voltage], r.battery_voltage));
+        EXPECT_EQ(m.valid(field::pressure), r.valid(ruuvi::invalid_pressure));
+        if (m.valid(field::pressure)) { EXPECT_EQ(m[field::pressure], r.pressure); }
+        EXPECT_EQ(m.valid(field::tx_power), r.valid(ruuvi::invalid_tx_power));
+        if (m.valid(field::tx_power)) { EXPECT_EQ(m[field::tx_power], r.tx_power); }
+        EXPECT_EQ(m[field::movement_counter], r.movement_counter);
+        EXPECT_EQ(m[field::measurement_sequence], r.measurement_sequence);
+        EXPECT_EQ(m.mac_mismatch, !r.valid(ruuvi::mac_mismatch));
+        EXPECT_FALSE(m.has(field::co2));
+    }
+}
+
+TEST(RuuviFormatsTest, Format3ConversionMatchesTable) {
+    using ruuvi::field;
+    auto data = ruuvi::convert_data_format_3(default_packet3());
+    ruuvi::measurement m;
+    ASSERT_EQ(ruuvi::decode(ble::to_adv_packet(default_packet3()), m), 3);
+
+    EXPECT_FLOAT_EQ(m[field::humidity], data.humidity);
+    EXPECT_FLOAT_EQ(m[field::temperature], data.temperature);
+    EXPECT_FLOAT_EQ(m[field::pressure], data.pressure);
+    EXPECT_FLOAT_EQ(m[field::acceleration_x], data.acceleration[0]);
+    EXPECT_FLOAT_EQ(m[field::acceleration_y], data.acceleration[1]);
+    EXPECT_FLOAT_EQ(m[field::acceleration_z], data.acceleration[2]);
+    EXPECT_FLOAT_EQ(m[field::battery_voltage], data.battery_voltage);
+    EXPECT_EQ(m.invalid, 0u);
+}
+
+TEST(RuuviFormatsTest, ChecksLength) {
+    auto p = default_packet3();
+    p.manufacturer_data.resize(13);
+    ruuvi::measurement m;
+    EXPECT_EQ(ruuvi::decode(ble::to_adv_packet(p), m), ruuvi::payload_too_short);
+    EXPECT_TRUE(ruuvi::convert_data_format_3(p).contains_errors);
+    EXPECT_THROW(ruuvi::convert_data_format_3(p, true), std::runtime_error);
+
+    for (auto full : {default_packet5(), default_packet6(), default_packet_e1()}) {
+        full.manufacturer_data.pop_back();
+        EXPECT_EQ(ruuvi::decode(ble::to_adv_packet(full), m), ruuvi::payload_too_short);
+    }
+}
+
+TEST(RuuviFormatsTest, DecodesFormat6) {
+    using ruuvi::field;
+    ruuvi::measurement m;
+    ASSERT_EQ(ruuvi::decode(ble::to_adv_packet(default_packet6()), m), 6);
+
+    EXPECT_FLOAT_EQ(m[field::temperature], 29.5f);
+    EXPECT_FLOAT_EQ(m[field::humidity], 55.3f);
+    EXPECT_FLOAT_EQ(m[field::pressure], 101102);
+    EXPECT_FLOAT_EQ(m[field::pm2_5], 11.2f);
+    EXPECT_FLOAT_EQ(m[field::co2], 201);
+    EXPECT_FLOAT_EQ(m[field::voc_index], 10);
+    EXPECT_FLOAT_EQ(m[field::nox_index], 2);
+    EXPECT_NEAR(m[field::luminosity], 13026.67f, 0.5f);
+    EXPECT_FLOAT_EQ(m[field::measurement_sequence], 205);
+    EXPECT_FALSE(m.has(field::pm1_0));
+    EXPECT_FALSE(m.mac_mismatch);
+    EXPECT_EQ(m.invalid, 0u);
+}
+
+TEST(RuuviFormatsTest, DecodesFormatE1) {
+    using ruuvi::field;
+    ruuvi::measurement m;
+    ASSERT_EQ(ruuvi::decode(ble::to_adv_packet(default_packet_e1()), m), 0xE1);
+
+    EXPECT_FLOAT_EQ(m[field::temperature], 29.5f);
+    EXPECT_FLOAT_EQ(m[field::humidity], 55.3f);
+    EXPECT_FLOAT_EQ(m[field::pressure], 101102);
+    EXPECT_FLOAT_EQ(m[field::pm1_0], 10.1f);
+    EXPECT_FLOAT_EQ(m[field::pm2_5], 11.2f);
+    EXPECT_FLOAT_EQ(m[field::pm4_0], 121.3f);
+    EXPECT_FLOAT_EQ(m[field::pm10_0], 455.4f);
+    EXPECT_FLOAT_EQ(m[field::co2], 201);
+    EXPECT_FLOAT_EQ(m[field::voc_index], 20);
+    EXPECT_FLOAT_EQ(m[field::nox_index], 4);
+    EXPECT_FLOAT_EQ(m[field::luminosity], 13027.f);
+    EXPECT_FLOAT_EQ(m[field::measurement_sequence], 14601710);
+    EXPECT_FALSE(m.mac_mismatch);
+    EXPECT_EQ(m.invalid, 0u);
+}
+
+TEST(RuuviFormatsTest, Dispatch) {
+    ruuvi::measurement m;
+    EXPECT_EQ(ruuvi::decode(ble::to_adv_packet(broken_data()), m), ruuvi::unknown_format);
+
+    auto other            = default_packet6();
+    other.manufacturer_id = 0x0500;
+    EXPECT_EQ(ruuvi::decode(ble::to_adv_packet(other), m), ruuvi::not_ruuvitag);
+    EXPECT_EQ(ruuvi::decode(nullptr, 0, m), ruuvi::unknown_format);
+
+    EXPECT_EQ(ruuvi::identify_format(default_packet6()), 6);
+    EXPECT_EQ(ruuvi::identify_format(default_packet_e1()), 0xE1);
+    EXPECT_TRUE(ruuvi::is_decodable(0xE1));
+    EXPECT_FALSE(ruuvi::is_decodable(4));
+}
@@ -0,0 +1,166 @@
+#include "ruuvi_vectors.hpp"
+#include "temp_dir.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <prometheus/metric_family.h>
+#include <ruuvi/spool.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+
+using tests::temp_dir;
+
+ble::AdvPacket advert(std::string const& hex = vectors::format_5) {
+    ble::AdvPacket p;
+    ble::parse_mac(vectors::mac, p.mac);
+    p.manufacturer_id = vectors::ruuvi_id;
+    p.signal_strength = -70;
+    auto data         = vectors::to_raw_data(hex);
+    p.set_manufacturer_data(data.data(), data.size());
+    return p;
+}
+
+double value_of(std::vector<prometheus::MetricFamily> const& families, std::string const& name,
+                std::string const& label = "") {
+    for (auto const& f: families) {
+        if (f.name != name) continue;
+        for (auto const& m: f.metric)
+            if (label.empty() || m.label.at(0).value == label)
+                return f.type == prometheus::MetricType::Gauge ? m.gauge.value : m.counter.value;
+    }
+    return std::nan("");
+}
+
+}  // namespace
+
+TEST(SpoolTest, ReadsBackInOrder) {
+    temp_dir dir;
+    ruuvi::spool_options opts;
+    opts.directory = dir.path;
+    ruuvi::spool s(opts);
+
+    auto p = advert();
+    EXPECT_FALSE(s.append(advert(vectors::format_3), 1));
+    for (int64_t t = 1; t <= 10; ++t) EXPECT_TRUE(s.append(p, t));
+    EXPECT_EQ(s.pending(), 10u);
+
+    std::vector<ruuvi::spooled_reading> out;
+    s.read(out, 4);
+    ASSERT_EQ(out.size(), 4u);
+    EXPECT_EQ(out[0].timestamp_ms, 1);
+    EXPECT_EQ(out[3].timestamp_ms, 4);
+    EXPECT_EQ(out[0].mac, p.mac);
+    EXPECT_EQ(out[0].signal_strength, -70);
+    EXPECT_TRUE(std::equal(out[0].payload.begin(), out[0].payload.end(), p.data.begin()));
+
+    // Read again until acknowledged
+    s.read(out, 4);
+    EXPECT_EQ(out.at(0).timestamp_ms, 1);
+    s.acknowledge(4);
+    EXPECT_EQ(s.pending(), 6u);
+    s.read(out, 100);
+    ASSERT_EQ(out.size(), 6u);
+    EXPECT_EQ(out[0].timestamp_ms, 5);
+    EXPECT_EQ(out[5].timestamp_ms, 10);
+    s.acknowledge(6);
+    EXPECT_EQ(s.pending(), 0u);
+    s.read(out, 100);
+    EXPECT_TRUE(out.empty());
+
+    auto families = s.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_spool_readings_total"), 10);
+    EXPECT_EQ(value_of(families, "ruuvi_spool_pending_readings"), 0);
+}
+
+TEST(SpoolTest, RotatesAndBoundsTheSize) {
+    temp_dir dir;
+    ruuvi::spool_options opts;
+    opts.directory    = dir.path;
+    opts.segment_size = 10 * 44;  // Ten readings
+    opts.max_size     = 3 * opts.segment_size;
+    ruuvi::spool s(opts);
+
+    auto p = advert();
+    for (int64_t t = 0; t < 25; ++t) s.append(p, t);
+    std::vector<ruuvi::spooled_reading> out;
+    s.read(out, 12);
+    ASSERT_EQ(out.size(), 12u);
+    for (size_t i = 0; i < out.size(); ++i) EXPECT_EQ(out[i].timestamp_ms, int64_t(i));
+    s.acknowledge(12);
+    EXPECT_EQ(dir.segments(), 2u);  // The first one is gone once sent
+
+    // The oldest unsent readings make room
+    for (int64_t t = 25; t < 45; ++t) s.append(p, t);
+    EXPECT_EQ(dir.segments(), 3u);
+    EXPECT_EQ(s.pending(), 25u);
+    s.read(out, 100);
+    ASSERT_EQ(out.size(), 25u);
+    EXPECT_EQ(out.front().timestamp_ms, 20);
+    EXPECT_EQ(out.back().timestamp_ms, 44);
+
+    auto families = s.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_spool_dropped_readings_total", "capacity"), 8);
+    EXPECT_EQ(value_of(families, "ruuvi_spool_segments"), 3);
+}
+
+TEST(SpoolTest, AcknowledgesAcrossDroppedSegments) {
+    temp_dir dir;
+    ruuvi::spool_options opts;
+    opts.directory    = dir.path;
+    opts.segment_size = 10 * 44;
+    opts.max_size     = 3 * opts.segment_size;
+    ruuvi::spool s(opts);
+
+    auto p = advert();
+    for (int64_t t = 0; t < 20; ++t) s.append(p, t);
+    std::vector<ruuvi::spooled_reading> out;
+    s.read(out, 5);
+    ASSERT_EQ(out.size(), 5u);
+
+    // Starting the fourth segment drops the one being sent
+    for (int64_t t = 20; t < 31; ++t) s.append(p, t);
+    s.acknowledge(5);
+    EXPECT_EQ(s.pending(), 21u);
+    s.read(out, 100);
+    ASSERT_EQ(out.size(), 21u);
+    EXPECT_EQ(out.front().timestamp_ms, 10);
+    EXPECT_EQ(out.back().timestamp_ms, 30);
+
+    // Only the readings that were never read are lost
+    auto families = s.Collect();
+    EXPECT_EQ(value_of(families, "ruuvi_spool_dropped_readings_total", "capacity"), 5);
+}
+
+TEST(SpoolTest, ContinuesAfterRestart) {
+    temp_dir dir;
+    ruuvi::spool_options opts;
+    opts.directory       = dir.path;
+    opts.segment_size    = 10 * 44;
+    opts.commit_interval = {};
+    auto p               = advert();
+    {
+        ruuvi::spool s(opts);
+        for (int64_t t = 0; t < 15; ++t) s.append(p, t);
+        s.commit();
+        s.acknowledge(12);
+    }
+    {
+        ruuvi::spool s(opts);
+        EXPECT_EQ(s.pending(), 3u);
+        for (int64_t t = 15; t < 20; ++t) s.append(p, t);
+        std::vector<ruuvi::spooled_reading> out;
+        s.read(out, 100);
+        ASSERT_EQ(out.size(), 8u);
+        EXPECT_EQ(out.front().timestamp_ms, 12);
+        EXPECT_EQ(out.back().timestamp_ms, 19);
+        // The position within a segment is only saved when closing
+        s.acknowledge(1);
+    }
+    {
+        ruuvi::spool s(opts);
+        EXPECT_EQ(s.pending(), 7u);
+    }
+}
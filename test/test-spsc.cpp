@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+#include <ble/spsc_queue.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+TEST(SpscQueueTest, KeepsOrder) {
+    ble::spsc_queue<int> q(5);
+    EXPECT_EQ(q.capacity(), 8u);
+    for (int i = 0; i < 8; ++i) EXPECT_TRUE(q.push(i));
+    EXPECT_EQ(q.size(), 8u);
+
+    int v = -1;
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_TRUE(q.pop(v));
+        EXPECT_EQ(v, i);
+    }
+    EXPECT_FALSE(q.pop(v));
+    EXPECT_TRUE(q.empty());
+    EXPECT_EQ(q.dropped(), 0u);
+
+    EXPECT_THROW(ble::spsc_queue<int>(0), std::invalid_argument);
+    EXPECT_THROW(ble::spsc_queue<int>(ble::spsc_queue<int>::max_capacity + 1),
+                 std::invalid_argument);
+    EXPECT_THROW(ble::spsc_queue<int>(SIZE_MAX), std::invalid_argument);
+}
+
+TEST(SpscQueueTest, DropNewest) {
+    ble::spsc_queue<int> q(4, ble::overflow_policy::drop_newest);
+    for (int i = 0; i < 6; ++i) q.push(i);
+    EXPECT_EQ(q.dropped(), 2u);
+
+    int v = -1;
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(q.pop(v));
+        EXPECT_EQ(v, i);
+    }
+    EXPECT_FALSE(q.pop(v));
+}
+
+TEST(SpscQueueTest, DropOldest) {
+    ble::spsc_queue<int> q(4, ble::overflow_policy::drop_oldest);
+    for (int i = 0; i < 6; ++i) q.push(i);
+    EXPECT_EQ(q.dropped(), 2u);
+
+    int v = -1;
+    for (int i = 2; i < 6; ++i) {
+        ASSERT_TRUE(q.pop(v));
+        EXPECT_EQ(v, i);
+    }
+    EXPECT_FALSE(q.pop(v));
+}
+
+TEST(SpscQueueTest, ConcurrentDropOldest) {
+    constexpr int count = 200'000;
+    ble::spsc_queue<int> q(16, ble::overflow_policy::drop_oldest);
+
+    std::atomic_bool done = false;
+    std::thread producer([&q, &done] {
+        for (int i = 0; i < count; ++i) q.push(i);
+        done = true;
+    });
+
+    // Elements arrive in order, and each one is either received or counted as dropped. Checked
+    // once the producer is joined, a failed assertion must not leave it running.
+    std::vector<int> received;
+    int v;
+    while (true) {
+        bool finished = done;
+        if (!q.pop(v)) {
+            if (finished) break;
+            continue;
+        }
+        received.push_back(v);
+    }
+    producer.join();
+    EXPECT_EQ(std::adjacent_find(received.begin(), received.end(), std::greater_equal<>()),
+              received.end());
+    EXPECT_EQ(uint64_t(received.size()) + q.dropped(), uint64_t(count));
+}
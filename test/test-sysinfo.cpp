@@ -0,0 +1,398 @@
+#include "diskstat.hpp"
+#include "procfs.hpp"
+#include "snapshot_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <prometheus/metric_family.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <sysinfo/cache_exposer.hpp>
+#include <sysinfo/diskstat_exposer.hpp>
+#include <sysinfo/system_info_exposer.hpp>
+#include <sysinfo/system_sampler.hpp>
+
+#include <unistd.h>
+
+namespace {
+
+constexpr char const* meminfo_text = "MemTotal:        3884324 kB\n"
+                                     "MemFree:         2195476 kB\n"
+                                     "MemAvailable:    3206780 kB\n"
+                                     "Buffers:           77104 kB\n"
+                                     "Cached:          1003340 kB\n"
+                                     "SwapCached:            0 kB\n"
+                                     "Active:           621864 kB\n"
+                                     "Inactive:         848580 kB\n"
+                                     "Active(anon):       2508 kB\n"
+                                     "Unevictable:          16 kB\n"
+                                     "SwapTotal:        102396 kB\n"
+                                     "SwapFree:         102396 kB\n"
+                                     "Dirty:               148 kB\n"
+                                     "Writeback:             0 kB\n"
+                                     "HugePages_Total:       0\n";
+
+constexpr char const* stat_text = "cpu  2476195 6364 478796 86625432 59066 0 27457 0 0 0\n"
+                                  "cpu0 547514 1242 93522 23025002 17978 0 5922 0 0 0\n"
+                                  "intr 412938475 0 0 0\n"
+                                  "ctxt 781139302\n";
+
+constexpr char const* netstat_text =
+    "TcpExt: SyncookiesSent SyncookiesRecv\n"
+    "TcpExt: 0 0\n"
+    "IpExt: InNoRoutes InTruncatedPkts InMcastPkts OutMcastPkts InBcastPkts OutBcastPkts "
+    "InOctets OutOctets InMcastOctets OutMcastOctets InBcastOctets\n"
+    "IpExt: 0 0 1844 321 90417 0 2988104736 1093771620 231904 48217 18904366\n";
+
+// Lines of kernels 4.17, 4.19 and 5.5, and a partition of a 2.6 kernel
+constexpr char const* diskstats_text =
+    "   8       0 sda 1 2 3 4 5 6 7 8 9 10 11\n"
+    " 179       0 mmcblk0 41315 4590 578410 13771 35649 17824 677331 71298 0 38482 85069 "
+    "1188 0 285192 356\n"
+    " 259       0 nvme0n1 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17\n"
+    "   8       1 sda1 10 20 30 40\n";
+
+std::string fixture(std::string const& machine) {
+    return std::string(SYSINFO_FIXTURES) + "/" + machine;
+}
+
+prometheus::MetricFamily const* find(std::vector<prometheus::MetricFamily> const& families,
+                                     std::string const& name) {
+    auto it = std::find_if(families.begin(), families.end(),
+                           [&name](auto const& f) { return f.name == name; });
+    return it == families.end() ? nullptr : &*it;
+}
+
+}  // namespace
+
+TEST(ProcfsTest, ParsesMeminfo) {
+    sys_info::meminfo_values values{};
+    auto found = sys_info::parse_meminfo(meminfo_text, values);
+    EXPECT_EQ(found, (1u << sys_info::meminfo_key_count) - 1);
+    EXPECT_EQ(values[0], 3884324000u);
+    EXPECT_EQ(values[2], 3206780000u);
+    EXPECT_EQ(values[7], 848580000u);
+    EXPECT_EQ(values[10], 148000u);
+
+    // Missing and malformed lines are left out of the mask
+    values = {};
+    found = sys_info::parse_meminfo("MemFree: 12 kB\nMemTotal: x kB\nDirty: 3 GB\nCached: 7\n",
+                                    values);
+    EXPECT_EQ(found, (1u << 1) | (1u << 4));
+    EXPECT_EQ(values[1], 12000u);
+    EXPECT_EQ(values[4], 7u);
+}
+
+TEST(ProcfsTest, ParsesStat) {
+    sys_info::cpu_times cpu;
+    ASSERT_TRUE(sys_info::parse_stat(stat_text, cpu));
+    EXPECT_EQ(cpu.ticks[sys_info::cpu_times::user], 2476195u);
+    EXPECT_EQ(cpu.ticks[sys_info::cpu_times::idle], 86625432u);
+    EXPECT_EQ(cpu.ticks[sys_info::cpu_times::softirq], 27457u);
+
+    // Kernels before 2.6.33 have no guest_nice
+    ASSERT_TRUE(sys_info::parse_stat("cpu 1 2 3 4 5 6 7 8 9\n", cpu));
+    EXPECT_EQ(cpu.ticks[sys_info::cpu_times::guest], 9u);
+    EXPECT_EQ(cpu.ticks[sys_info::cpu_times::guest_nice], 0u);
+    EXPECT_FALSE(sys_info::parse_stat("cpu 1 2 3\n", cpu));
+    EXPECT_FALSE(sys_info::parse_stat("cpu0 1 2 3 4\n", cpu));
+    EXPECT_FALSE(sys_info::parse_stat("", cpu));
+}
+
+TEST(ProcfsTest, ParsesNetstat) {
+    sys_info::netstat_values v{};
+    ASSERT_TRUE(sys_info::parse_netstat(netstat_text, v));
+    EXPECT_EQ(v.in_octets, 2988104736ul);
+    EXPECT_EQ(v.out_octets, 1093771620ul);
+    EXPECT_EQ(v.in_mcast_octets, 231904ul);
+    EXPECT_EQ(v.out_mcast_octets, 48217ul);
+
+    EXPECT_FALSE(sys_info::parse_netstat("IpExt: InOctets OutOctets\nIpExt: 1 2\n", v));
+    EXPECT_FALSE(sys_info::parse_netstat("TcpExt: InOctets\nTcpExt: 1\n", v));
+}
+
+TEST(ProcfsTest, ParsesDiskstats) {
+    std::vector<sys_info::Diskstat> disks;
+    sys_info::parse_diskstats(diskstats_text, disks);
+    ASSERT_EQ(disks.size(), 3u);
+    EXPECT_EQ(disks[0].devname, "sda");
+    EXPECT_EQ(disks[0].WeightedIOTime, 11u);
+    EXPECT_EQ(disks[0].DiscardCompleted, 0u);
+    EXPECT_EQ(disks[1].major, 179);
+    EXPECT_EQ(disks[1].WriteSectors, 677331u);
+    EXPECT_EQ(disks[1].DiscardTime, 356u);
+    EXPECT_EQ(disks[1].FlushComplete, 0u);
+    EXPECT_EQ(disks[2].DiscardSectors, 14u);
+    EXPECT_EQ(disks[2].FlushTime, 17u);
+
+    // Replaces the previous contents
+    sys_info::parse_diskstats("   8       0 sdb 1 2 3 4 5 6 7 8 9 10 11\n", disks);
+    ASSERT_EQ(disks.size(), 1u);
+    EXPECT_EQ(disks[0].devname, "sdb");
+
+    long temp;
+    ASSERT_TRUE(sys_info::parse_integer("48686\n", temp));
+    EXPECT_EQ(temp, 48686);
+    EXPECT_FALSE(sys_info::parse_integer("", temp));
+}
+
+TEST(ProcfsTest, ParsesFixtures) {
+    struct machine {
+        char const* name;
+        size_t disks;
+        size_t cores;
+    };
+    for (auto m: {machine{"rpi3", 27, 4}, machine{"rpi4", 27, 4}, machine{"rpizero", 27, 1},
+                  machine{"x86-server", 81, 64}}) {
+        SCOPED_TRACE(m.name);
+        auto const proc = fixture(m.name) + "/proc/";
+        std::string_view text;
+
+        sys_info::proc_file meminfo(proc + "meminfo");
+        sys_info::meminfo_values values{};
+        ASSERT_TRUE(meminfo.read(text));
+        EXPECT_EQ(sys_info::parse_meminfo(text, values), (1u << sys_info::meminfo_key_count) - 1);
+
+        sys_info::proc_file stat(proc + "stat");
+        sys_info::cpu_times cpu;
+        std::vector<sys_info::core_times> cores;
+        ASSERT_TRUE(stat.read(text));
+        EXPECT_TRUE(sys_info::parse_stat(text, cpu));
+        EXPECT_TRUE(sys_info::parse_stat(text, cpu, cores));
+        EXPECT_EQ(cores.size(), m.cores);
+
+        sys_info::proc_file netstat(proc + "net/netstat");
+        sys_info::netstat_values octets{};
+        ASSERT_TRUE(netstat.read(text));
+        EXPECT_TRUE(sys_info::parse_netstat(text, octets));
+
+        sys_info::proc_file diskstats(proc + "diskstats");
+        std::vector<sys_info::Diskstat> disks;
+        ASSERT_TRUE(diskstats.read(text));
+        sys_info::parse_diskstats(text, disks);
+        EXPECT_EQ(disks.size(), m.disks);
+    }
+}
+
+TEST(ProcfsTest, ReadsUnderTheRoot) {
+    auto const root = fixture("rpi4");
+    auto sysinfo    = sys_info::SystemInfoCollector::create(root);
+    auto families   = sysinfo->Collect();
+    auto const* f   = find(families, "sysinfo_memory_size_bytes");
+    ASSERT_NE(f, nullptr);
+    EXPECT_EQ(f->metric.at(0).gauge.value, 3884324000.0);
+    f = find(families, "sysinfo_sensor_temperature_celsius");
+    ASSERT_NE(f, nullptr);
+    ASSERT_EQ(f->metric.size(), 1u);
+    EXPECT_DOUBLE_EQ(f->metric[0].gauge.value, 48.686);
+    EXPECT_EQ(f->metric[0].label.at(0).value, "cpu-thermal");
+
+    sys_info::DiskstatExposer diskstat(root);
+    families = diskstat.Collect();
+    f        = find(families, "sysinfo_disk_write_bytes_total");
+    ASSERT_NE(f, nullptr);
+    ASSERT_EQ(f->metric.size(), 27u);
+    EXPECT_EQ(f->metric.back().label.at(0).value, "mmcblk0p2");
+}
+
+TEST(ProcfsTest, ExportsEachCoreAndMode) {
+    auto sysinfo        = sys_info::SystemInfoCollector::create(fixture("x86-server"));
+    auto const families = sysinfo->Collect();
+    auto const* f       = find(families, "sysinfo_cpu_seconds_total");
+    ASSERT_NE(f, nullptr);
+    EXPECT_EQ(f->type, prometheus::MetricType::Counter);
+    ASSERT_EQ(f->metric.size(), 64u * sys_info::cpu_times::state_count);
+
+    auto const& user = f->metric.front();
+    ASSERT_EQ(user.label.size(), 2u);
+    EXPECT_EQ(user.label[0].name, "cpu");
+    EXPECT_EQ(user.label[0].value, "0");
+    EXPECT_EQ(user.label[1].name, "mode");
+    EXPECT_EQ(user.label[1].value, "user");
+    EXPECT_DOUBLE_EQ(user.counter.value, 4294292.0 / double(sysconf(_SC_CLK_TCK)));
+
+    auto const& last = f->metric.back();
+    EXPECT_EQ(last.label[0].value, "63");
+    EXPECT_EQ(last.label[1].value, "guest_nice");
+    EXPECT_DOUBLE_EQ(last.counter.value, 1153.0 / double(sysconf(_SC_CLK_TCK)));
+}
+
+TEST(ProcfsTest, RereadsTheFile) {
+    char name[] = "/tmp/ruuvi-procfs-XXXXXX";
+    int fd      = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    std::string big(10'000, 'x');
+    ASSERT_EQ(write(fd, "first", 5), 5);
+
+    sys_info::proc_file file(name);
+    std::string_view contents;
+    ASSERT_TRUE(file.read(contents));
+    EXPECT_EQ(contents, "first");
+
+    // Grows past the initial buffer
+    ASSERT_EQ(pwrite(fd, big.data(), big.size(), 0), ssize_t(big.size()));
+    ASSERT_TRUE(file.read(contents));
+    EXPECT_EQ(contents, big);
+    close(fd);
+    unlink(name);
+
+    sys_info::proc_file missing("/proc/does-not-exist");
+    EXPECT_FALSE(missing.read(contents));
+
+    // The real thing, generated by the kernel on each read
+    sys_info::proc_file meminfo("/proc/meminfo");
+    sys_info::meminfo_values values{};
+    ASSERT_TRUE(meminfo.read(contents));
+    EXPECT_NE(sys_info::parse_meminfo(contents, values) & 1u, 0u);
+    ASSERT_TRUE(meminfo.read(contents));
+    EXPECT_NE(sys_info::parse_meminfo(contents, values) & 1u, 0u);
+}
+
+TEST(SnapshotCacheTest, CoalescesRefreshes) {
+    sys_info::snapshot_cache<int> cache(std::chrono::hours(1));
+    std::atomic_int refreshes = 0;
+    auto slow_refresh         = [&refreshes](auto const& previous) {
+        EXPECT_EQ(previous, nullptr);
+        ++refreshes;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        return std::make_shared<int const>(42);
+    };
+
+    std::vector<std::thread> scrapes;
+    std::vector<std::shared_ptr<int const>> got(8);
+    for (auto& g: got)
+        scrapes.emplace_back([&cache, &g, &slow_refresh] { g = cache.get(slow_refresh); });
+    for (auto& t: scrapes) t.join();
+
+    EXPECT_EQ(refreshes, 1);
+    for (auto const& g: got) EXPECT_EQ(g, got[0]);
+    EXPECT_EQ(*got[0], 42);
+    EXPECT_EQ(cache.statistics().refreshes, 1u);
+    EXPECT_EQ(cache.statistics().hits, 7u);
+    EXPECT_GE(cache.statistics().refresh_ns, 50'000'000u);
+
+    // Fresh enough
+    EXPECT_EQ(cache.get(slow_refresh), got[0]);
+    EXPECT_EQ(refreshes, 1);
+}
+
+TEST(SnapshotCacheTest, RefreshesStaleSnapshots) {
+    sys_info::snapshot_cache<int> cache(std::chrono::steady_clock::duration::zero());
+    int n        = 0;
+    auto refresh = [&n](auto const& previous) {
+        return std::make_shared<int const>(previous ? *previous + 1 : n++);
+    };
+    EXPECT_EQ(*cache.get(refresh), 0);
+    EXPECT_EQ(*cache.get(refresh), 1);
+    EXPECT_EQ(*cache.get(refresh), 2);
+
+    // A failed refresh keeps the previous snapshot
+    auto fail = [](auto const&) -> std::shared_ptr<int const> {
+        throw std::runtime_error("Can't read");
+    };
+    EXPECT_THROW(cache.get(fail), std::runtime_error);
+    EXPECT_EQ(*cache.get(refresh), 3);
+    EXPECT_EQ(cache.statistics().refreshes, 5u);
+    EXPECT_EQ(cache.statistics().hits, 0u);
+}
+
+TEST(SnapshotCacheTest, ReadsEachSourceAtItsInterval) {
+    namespace fs = std::filesystem;
+    char name[]  = "/tmp/ruuvi-sysinfo-XXXXXX";
+    ASSERT_NE(mkdtemp(name), nullptr);
+    fs::path const root(name);
+    fs::copy(fixture("rpi4"), root, fs::copy_options::recursive);
+    auto set = [&root](char const* file, std::string const& contents) {
+        std::ofstream(root / file) << contents;
+    };
+
+    sys_info::refresh_intervals intervals;
+    intervals.meminfo = std::chrono::hours(1);
+    auto sysinfo      = sys_info::SystemInfoCollector::create(root.string(), intervals);
+    auto diskstat     = std::make_shared<sys_info::DiskstatExposer>(root.string(),
+                                                                std::chrono::hours(1));
+    sys_info::CacheExposer caches(sysinfo, diskstat);
+    auto value = [](std::vector<prometheus::MetricFamily> const& families, char const* name) {
+        auto const* f = find(families, name);
+        return f && !f->metric.empty() ? f->metric.back().gauge.value : -1.0;
+    };
+    auto families = sysinfo->Collect();
+    EXPECT_EQ(value(families, "sysinfo_memory_free_bytes"), 2195476000.0);
+    EXPECT_DOUBLE_EQ(value(families, "sysinfo_sensor_temperature_celsius"), 48.686);
+    EXPECT_EQ(value(diskstat->Collect(), "sysinfo_disk_io_in_progress"), 0.0);
+
+    set("proc/meminfo", "MemFree: 1 kB\n");
+    set("sys/class/thermal/thermal_zone0/temp", "51000\n");
+    set("proc/diskstats", " 179 2 mmcblk0p2 1 2 3 4 5 6 7 8 9 10 11\n");
+    families = sysinfo->Collect();
+    EXPECT_EQ(value(families, "sysinfo_memory_free_bytes"), 2195476000.0);
+    EXPECT_DOUBLE_EQ(value(families, "sysinfo_sensor_temperature_celsius"), 51.0);
+    EXPECT_EQ(find(families, "sysinfo_cache_refreshes_total"), nullptr);
+    EXPECT_EQ(value(diskstat->Collect(), "sysinfo_disk_io_in_progress"), 0.0);
+
+    // One family per counter, with a series for each cache
+    families = caches.Collect();
+    EXPECT_EQ(families.size(), 3u);
+    auto const* refreshes = find(families, "sysinfo_cache_refreshes_total");
+    ASSERT_NE(refreshes, nullptr);
+    ASSERT_EQ(refreshes->metric.size(), 2u);
+    EXPECT_EQ(refreshes->metric[0].label.at(0).value, "sysinfo");
+    EXPECT_EQ(refreshes->metric[0].counter.value, 2);
+    EXPECT_EQ(refreshes->metric[1].label.at(0).value, "diskstat");
+    EXPECT_EQ(refreshes->metric[1].counter.value, 1);
+    auto const* hits = find(families, "sysinfo_cache_hits_total");
+    ASSERT_NE(hits, nullptr);
+    ASSERT_EQ(hits->metric.size(), 2u);
+    EXPECT_EQ(hits->metric[1].counter.value, 1);
+
+    fs::remove_all(root);
+}
+
+TEST(SystemSamplerTest, RejectsInvalidOptions) {
+    sys_info::sampler_options opts;
+    opts.rate = 0;
+    EXPECT_THROW(sys_info::SystemSampler{opts}, std::invalid_argument);
+    opts.rate = 1000;
+    EXPECT_THROW(sys_info::SystemSampler{opts}, std::invalid_argument);
+    opts.rate   = 10;
+    opts.window = std::chrono::milliseconds(50);
+    EXPECT_THROW(sys_info::SystemSampler{opts}, std::invalid_argument);
+}
+
+TEST(SystemSamplerTest, SamplesTheLiveSystem) {
+    sys_info::sampler_options opts;
+    opts.rate   = 100;
+    opts.window = std::chrono::seconds(1);
+    sys_info::SystemSampler sampler(opts);
+    std::thread thread(&sys_info::SystemSampler::start, &sampler);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    auto const families = sampler.Collect();
+    sampler.stop();
+    thread.join();
+
+    auto const* samples = find(families, "sysinfo_sampler_samples_total");
+    ASSERT_NE(samples, nullptr);
+    EXPECT_GT(samples->metric.at(0).counter.value, 0);
+    EXPECT_EQ(find(families, "sysinfo_sampler_errors_total")->metric.at(0).counter.value, 0);
+    EXPECT_GT(find(families, "sysinfo_sampler_cpu_seconds_total")->metric.at(0).counter.value, 0);
+
+    for (auto name: {"sysinfo_sampled_cpu_busy_ratio", "sysinfo_sampled_memory_used_ratio"}) {
+        auto const* f = find(families, name);
+        ASSERT_NE(f, nullptr) << name;
+        auto const& summary = f->metric.at(0).summary;
+        EXPECT_GT(summary.sample_count, 0u) << name;
+        ASSERT_EQ(summary.quantile.size(), 3u) << name;
+        double previous = 0;
+        for (auto const& q: summary.quantile) {
+            EXPECT_GE(q.value, previous) << name << " " << q.quantile;
+            EXPECT_LE(q.value, 1) << name << " " << q.quantile;
+            previous = q.value;
+        }
+    }
+}